@@ -0,0 +1,247 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+
+#include "box_factory.h"
+#include "box_batch.h"
+
+#define BATCH_BUFFER_SIZE (1 << 16)
+
+/* Longest possible result line: "<side> <height>\n" */
+#define BATCH_MAX_RESULT_LENGTH (32)
+
+typedef struct batch_reader_s {
+    FILE *file;
+    size_t position;
+    size_t length;
+    unsigned int line;
+    char buffer[BATCH_BUFFER_SIZE];
+} batch_reader_t;
+
+typedef struct batch_writer_s {
+    FILE *file;
+    size_t length;
+    char buffer[BATCH_BUFFER_SIZE];
+} batch_writer_t;
+
+/* The state of a run, whose buffers are allocated along with it */
+typedef struct batch_state_s {
+    batch_reader_t reader;
+    batch_writer_t writer;
+} batch_state_t;
+
+/* batch_run - the implementation of box_batch_run, on its allocated reader and writer. */
+static bool batch_run(box_factory_t *factory, batch_reader_t *reader, batch_writer_t *writer);
+
+/* reader_peek - returns the next character in the input without consuming it, or EOF. */
+static int reader_peek(batch_reader_t *reader);
+
+/* reader_next_token - skips whitespace and returns the first character of the next token, without
+   consuming it, or EOF if the input has ended. */
+static int reader_next_token(batch_reader_t *reader);
+
+/* reader_at_whitespace - returns true if the next character in the input is whitespace, or if the
+   input has ended (without consuming it). */
+static bool reader_at_whitespace(batch_reader_t *reader);
+
+/* reader_read_unsigned - reads an unsigned decimal number. Returns false if there's none, or if it
+   doesn't fit in an unsigned int. */
+static bool reader_read_unsigned(batch_reader_t *reader, unsigned int *value);
+
+/* writer_flush - writes the buffered output to the file. Returns false on a write error. */
+static bool writer_flush(batch_writer_t *writer);
+
+/* writer_write_unsigned, writer_write_char - buffered output of a number/character.
+   The caller must make sure that there's enough room in the buffer.
+ */
+static void writer_write_unsigned(batch_writer_t *writer, unsigned int value);
+static void writer_write_char(batch_writer_t *writer, char c);
+
+bool box_batch_run(box_factory_t *factory, FILE *input, FILE *output)
+{
+    batch_state_t *state = NULL;
+    bool result = false;
+
+    /* The buffers are quite large, so they are not allocated on the stack, and each run has its own
+       so that runs may go on at once */
+    state = malloc(sizeof(batch_state_t));
+    if (NULL == state) {
+        fprintf(stderr, "Fatal error: failed allocating the buffers (out of memory)\n");
+        return false;
+    }
+
+    state->reader.file = input;
+    state->reader.position = 0;
+    state->reader.length = 0;
+    state->reader.line = 1;
+    state->writer.file = output;
+    state->writer.length = 0;
+
+    result = batch_run(factory, &(state->reader), &(state->writer));
+    free(state);
+
+    return result;
+}
+
+static bool batch_run(box_factory_t *factory, batch_reader_t *reader, batch_writer_t *writer)
+{
+    unsigned int side = 0;
+    unsigned int height = 0;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    int command = 0;
+
+    while (EOF != (command = reader_next_token(reader))) {
+        reader->position++;
+
+        /* The command is a single letter, so it must be followed by whitespace */
+        if (!reader_at_whitespace(reader)) {
+            fprintf(stderr, "Error: line %u: expected whitespace after the command\n", reader->line);
+            writer_flush(writer);
+            return false;
+        }
+
+        if (!reader_read_unsigned(reader, &side) || !reader_read_unsigned(reader, &height)) {
+            fprintf(stderr, "Error: line %u: expected side and height\n", reader->line);
+            writer_flush(writer);
+            return false;
+        }
+
+        if (BATCH_BUFFER_SIZE - writer->length < BATCH_MAX_RESULT_LENGTH) {
+            if (!writer_flush(writer)) {
+                return false;
+            }
+        }
+
+        switch (command) {
+        case 'i':
+            if (!box_factory_insert(factory, side, height)) {
+                fprintf(stderr, "Fatal error: line %u: Insertion failed (out of memory)\n", reader->line);
+                writer_flush(writer);
+                return false;
+            }
+            break;
+        case 'r':
+            writer_write_char(writer, box_factory_remove(factory, side, height) ? '1' : '0');
+            writer_write_char(writer, '\n');
+            break;
+        case 'g':
+            if (box_factory_get_box(factory, side, height, &found_side_square, &found_height)) {
+                writer_write_unsigned(writer, (unsigned int) sqrt((double) found_side_square));
+                writer_write_char(writer, ' ');
+                writer_write_unsigned(writer, found_height);
+            } else {
+                writer_write_char(writer, '-');
+            }
+            writer_write_char(writer, '\n');
+            break;
+        case 'c':
+            writer_write_char(writer, box_factory_check_box(factory, side, height) ? '1' : '0');
+            writer_write_char(writer, '\n');
+            break;
+        default:
+            fprintf(stderr, "Error: line %u: unknown command '%c'\n", reader->line, command);
+            writer_flush(writer);
+            return false;
+        }
+    }
+
+    if (ferror(reader->file)) {
+        fprintf(stderr, "Error: failed reading the commands\n");
+        writer_flush(writer);
+        return false;
+    }
+
+    return writer_flush(writer);
+}
+
+static int reader_peek(batch_reader_t *reader)
+{
+    if (reader->position == reader->length) {
+        reader->length = fread(reader->buffer, 1, BATCH_BUFFER_SIZE, reader->file);
+        reader->position = 0;
+
+        if (reader->length == 0) {
+            return EOF;
+        }
+    }
+
+    return (unsigned char) reader->buffer[reader->position];
+}
+
+static int reader_next_token(batch_reader_t *reader)
+{
+    int c = 0;
+
+    while (EOF != (c = reader_peek(reader))) {
+        if (c == '\n') {
+            reader->line++;
+        } else if ((c != ' ') && (c != '\t') && (c != '\r')) {
+            return c;
+        }
+        reader->position++;
+    }
+
+    return EOF;
+}
+
+static bool reader_at_whitespace(batch_reader_t *reader)
+{
+    int c = reader_peek(reader);
+
+    return (c == EOF) || (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static bool reader_read_unsigned(batch_reader_t *reader, unsigned int *value)
+{
+    int c = reader_next_token(reader);
+
+    if ((c < '0') || (c > '9')) {
+        return false;
+    }
+
+    *value = 0;
+    while (((c = reader_peek(reader)) >= '0') && (c <= '9')) {
+        /* A number that wraps around would silently become another valid box */
+        if (*value > (UINT_MAX - (c - '0')) / 10) {
+            return false;
+        }
+        *value = *value * 10 + (c - '0');
+        reader->position++;
+    }
+
+    return true;
+}
+
+static bool writer_flush(batch_writer_t *writer)
+{
+    if ((writer->length > 0) && (fwrite(writer->buffer, 1, writer->length, writer->file) != writer->length)) {
+        fprintf(stderr, "Error: failed writing the results\n");
+        return false;
+    }
+
+    writer->length = 0;
+    return (0 == fflush(writer->file));
+}
+
+static void writer_write_unsigned(batch_writer_t *writer, unsigned int value)
+{
+    char digits[10];
+    unsigned int count = 0;
+
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+
+    while (count > 0) {
+        writer->buffer[writer->length++] = digits[--count];
+    }
+}
+
+static void writer_write_char(batch_writer_t *writer, char c)
+{
+    writer->buffer[writer->length++] = c;
+}
@@ -0,0 +1,25 @@
+/*
+  box_batch.h - Non-interactive batch mode of the box factory.
+  Reads a stream of commands, separated by any whitespace, each of the form "<op> <side> <height>":
+    i - insert a box. Prints nothing.
+    r - remove a box. Prints 1 if the box was removed, 0 if it was not found.
+    g - get the smallest fitting box. Prints "<side> <height>" of the box, or "-" if none was found.
+    c - check if a fitting box exists. Prints 1 or 0.
+  Both input and output are buffered, and nothing but the results is written.
+ */
+
+#ifndef __BOX_BATCH_H__
+#define __BOX_BATCH_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "box_factory.h"
+
+/* box_batch_run - run all of the commands in input on the factory, writing the results to output.
+   Returns false on a malformed command or a fatal error (which is reported to stderr), true otherwise.
+   Each run allocates its own buffers, so runs on different factories may go on at once.
+ */
+bool box_batch_run(box_factory_t *factory, FILE *input, FILE *output);
+
+#endif /* __BOX_BATCH_H__ */
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "box_factory.h"
+#include "box_batch.h"
+
+#define RANDOM_COMMANDS (50000)
+#define COORDINATE_RANGE (60)
+
+/* The longest output of a command: "<side> <height>\n" */
+#define MAX_RESULT_LENGTH (32)
+
+#define RUN_THREADS (4)
+
+/* The context of a thread that runs the commands on its own factory */
+typedef struct run_context_s {
+    const char *commands;
+    char *output;
+    size_t output_size;
+} run_context_t;
+
+/* run_commands - run the command stream on the factory, and returns box_batch_run's result. The
+   output is copied to output (of output_size bytes, NUL terminated).
+ */
+static bool run_commands(box_factory_t *factory, const char *commands, char *output, size_t output_size)
+{
+    FILE *input = tmpfile();
+    FILE *results = tmpfile();
+    size_t length = 0;
+    bool result = false;
+
+    assert(input && results);
+    assert(fwrite(commands, 1, strlen(commands), input) == strlen(commands));
+    rewind(input);
+
+    result = box_batch_run(factory, input, results);
+
+    rewind(results);
+    length = fread(output, 1, output_size - 1, results);
+    assert(feof(results));
+    output[length] = '\0';
+
+    fclose(input);
+    fclose(results);
+
+    return result;
+}
+
+/* verify_commands - run the command stream on a new factory, which must give result and output */
+static void verify_commands(const char *commands, bool result, const char *output)
+{
+    box_factory_t *factory = box_factory_create();
+    char actual[256];
+
+    assert(factory);
+    assert(run_commands(factory, commands, actual, sizeof(actual)) == result);
+    assert(0 == strcmp(actual, output));
+    box_factory_destroy(factory);
+}
+
+static void* run_on_new_factory(void *context)
+{
+    run_context_t *run_context = context;
+    box_factory_t *factory = box_factory_create();
+
+    assert(factory);
+    assert(run_commands(factory, run_context->commands, run_context->output, run_context->output_size));
+    box_factory_destroy(factory);
+
+    return NULL;
+}
+
+int main(void)
+{
+    box_factory_t *factory = NULL;
+    box_factory_t *expected_factory = NULL;
+    char *commands = NULL;
+    char *expected = NULL;
+    char *output = NULL;
+    size_t commands_length = 0;
+    size_t expected_length = 0;
+    run_context_t contexts[RUN_THREADS];
+    pthread_t threads[RUN_THREADS];
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    unsigned int i = 0;
+
+    srand(18);
+
+    printf("Running each command...\n");
+    verify_commands("", true, "");
+    verify_commands("i 3 4\nc 3 4\nc 3 5\ng 2 2\ng 4 1\n", true, "1\n0\n3 4\n-\n");
+    verify_commands("i 3 4\ni 2 9\ng 1 1\nr 3 4\nr 3 4\ng 1 1\n", true, "2 9\n1\n0\n2 9\n");
+
+    printf("Running commands separated by any whitespace...\n");
+    verify_commands("  i 3\t4 i\n2 10\r\n\n g 1   1", true, "3 4\n");
+
+    printf("Running malformed commands...\n");
+    verify_commands("c 1 1\nx 1 1\nc 1 1\n", false, "0\n");
+    verify_commands("i 3 4\nc 3\n", false, "");
+    verify_commands("i 3 -4\n", false, "");
+    verify_commands("c 1 1\ni 3\n", false, "0\n");
+    verify_commands("i5 6\n", false, "");
+    verify_commands("c 1 1\ng1 1\nc 1 1\n", false, "0\n");
+    verify_commands("c 1 1\ncc 1 1\n", false, "0\n");
+
+    printf("Running dimensions at and beyond the range of unsigned int...\n");
+    verify_commands("i 2 4294967295\ng 2 4294967295\n", true, "2 4294967295\n");
+    verify_commands("i 2 4294967296\n", false, "");
+    verify_commands("c 1 1\ni 2 4294967297\nc 1 1\n", false, "0\n");
+    verify_commands("i 99999999999999999999 1\n", false, "");
+
+    printf("Running %d random commands against the factory itself...\n", RANDOM_COMMANDS);
+    factory = box_factory_create();
+    expected_factory = box_factory_create();
+    commands = malloc(RANDOM_COMMANDS * MAX_RESULT_LENGTH);
+    expected = malloc(RANDOM_COMMANDS * MAX_RESULT_LENGTH);
+    output = malloc(RANDOM_COMMANDS * MAX_RESULT_LENGTH);
+    assert(factory && expected_factory && commands && expected && output);
+
+    /* The output is well beyond the batch's buffers, so it is flushed along the way */
+    for (i = 0; i < RANDOM_COMMANDS; i++) {
+        side = rand() % COORDINATE_RANGE + 1;
+        height = rand() % COORDINATE_RANGE + 1;
+
+        switch (rand() % 4) {
+        case 0:
+            commands_length += sprintf(commands + commands_length, "i %u %u\n", side, height);
+            assert(box_factory_insert(expected_factory, side, height));
+            break;
+        case 1:
+            commands_length += sprintf(commands + commands_length, "r %u %u\n", side, height);
+            expected_length += sprintf(expected + expected_length, "%d\n", box_factory_remove(expected_factory, side, height));
+            break;
+        case 2:
+            commands_length += sprintf(commands + commands_length, "g %u %u\n", side, height);
+            if (box_factory_get_box(expected_factory, side, height, &found_side_square, &found_height)) {
+                expected_length += sprintf(expected + expected_length, "%u %u\n", (unsigned int) sqrt((double) found_side_square), found_height);
+            } else {
+                expected_length += sprintf(expected + expected_length, "-\n");
+            }
+            break;
+        default:
+            commands_length += sprintf(commands + commands_length, "c %u %u\n", side, height);
+            expected_length += sprintf(expected + expected_length, "%d\n", box_factory_check_box(expected_factory, side, height));
+            break;
+        }
+    }
+
+    assert(run_commands(factory, commands, output, RANDOM_COMMANDS * MAX_RESULT_LENGTH));
+    assert(0 == strcmp(output, expected));
+
+    /* Each run has its own buffers, so runs on several threads at once don't mix */
+    printf("Running the random commands on %d threads at once...\n", RUN_THREADS);
+    for (i = 0; i < RUN_THREADS; i++) {
+        contexts[i].commands = commands;
+        contexts[i].output = malloc(RANDOM_COMMANDS * MAX_RESULT_LENGTH);
+        contexts[i].output_size = RANDOM_COMMANDS * MAX_RESULT_LENGTH;
+        assert(contexts[i].output);
+        assert(0 == pthread_create(&threads[i], NULL, run_on_new_factory, &contexts[i]));
+    }
+    for (i = 0; i < RUN_THREADS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+        assert(0 == strcmp(contexts[i].output, expected));
+        free(contexts[i].output);
+    }
+
+    free(commands);
+    free(expected);
+    free(output);
+    box_factory_destroy(factory);
+    box_factory_destroy(expected_factory);
+
+    return 0;
+}
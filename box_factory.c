@@ -1,607 +1,2463 @@
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
-
-#include "rb_tree.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pool.h"
+#include "bp_tree.h"
+#include "box_flat.h"
+#include "box_subtree.h"
+#include "op_stats.h"
+#include "persistent_tree.h"
+#include "rb_tree_gen.h"
+#include "range_tree.h"
+#include "parallel_sort.h"
 #include "box_factory.h"
 
+/* A box packed into a single value that sorts by the main value and then by the sub value */
+#define BOX_KEY(main_val, sub_val) (((unsigned long long) (main_val) << 32) | (sub_val))
+#define BOX_KEY_MAIN(key) ((unsigned int) ((key) >> 32))
+#define BOX_KEY_SUB(key) ((unsigned int) ((key) & 0xffffffff))
+
+/* The file format of box_factory_save: the header, followed by the runs of the tree by side (whose
+   x is side^2 and y is height), and then the runs of the tree by height (whose x is height and y is
+   side^2). Both are sorted by x and then by y, and there are run_count of each. The values are in
+   the byte order of the saving machine, so a file of the other byte order fails the magic check.
+ */
+#define BOX_FACTORY_FILE_MAGIC ("BOXFACT")
+#define BOX_FACTORY_FILE_VERSION (1)
+#define BOX_FACTORY_FILE_TEMPORARY_SUFFIX (".tmp")
+
+typedef struct box_factory_file_header_s {
+    char magic[8];
+    unsigned int version;
+    unsigned int run_size;            /* sizeof(range_tree_point_t) */
+    unsigned long long run_count;     /* Number of distinct boxes (and runs of each tree) */
+} box_factory_file_header_t;
+
+/* The volume index is a flat array (box_flat) up to BOX_FACTORY_FLAT_MAX distinct boxes, where a
+   scan beats the range tree's pointer chasing, and the range tree beyond it. It only goes back to
+   a flat array once the range tree is down to BOX_FACTORY_FLAT_MIN distinct boxes, so a factory
+   that hovers around the limit doesn't keep moving its boxes back and forth. */
+#define BOX_FACTORY_FLAT_MAX (1024)
+#define BOX_FACTORY_FLAT_MIN (BOX_FACTORY_FLAT_MAX / 4)
+
+/* A function that is called for each run of boxes by box_factory_for_each_run, which returns false
+   to stop */
+typedef bool (* box_factory_run_callback_t)(const range_tree_point_t *run, void *context);
+
+/* The context of box_factory_copy_run, which collects the heights of a side until the side is done */
+typedef struct box_factory_copy_context_s {
+    persistent_tree_node_t *heights; /* The payloads of the current side's heights */
+    size_t height_count;
+    unsigned int side_square;        /* The current side */
+    persistent_tree_node_t *sides;   /* The payloads of the sides that are done, each of which holds a
+                                        reference to its tree of heights as the child */
+    size_t side_count;
+} box_factory_copy_context_t;
+
+/* The context of box_factory_write_run */
+typedef struct box_factory_write_context_s {
+    FILE *file;
+    unsigned long long count;
+} box_factory_write_context_t;
+
+/* The query of a fit objective's scan, see BOX_FIT_OBJECTIVE */
+typedef struct box_fit_query_s {
+    unsigned int side_square;
+    unsigned int height;
+} box_fit_query_t;
+
+/* The position of a box in a main tree (BOX_FACTORY_RB_TREE): the main node of its main value, and
+   a cursor on its sub value in the node's subtree */
+typedef struct box_tree_position_s {
+    box_main_tree_node_t *main_node;
+    box_subtree_cursor_t sub_key;
+} box_tree_position_t;
+
+/* The best fits so far of a scan, a max-heap of size boxes out of k (the worst on top) */
+typedef struct box_fit_heap_s {
+    box_factory_fit_t *fits;
+    size_t size;
+    size_t k;
+} box_fit_heap_t;
+
+/* Batch queries are taken by each thread BOX_FACTORY_QUERY_CHUNK at a time, and a batch is only
+   split between threads if each gets at least BOX_FACTORY_QUERY_MIN_PER_THREAD queries */
+#define BOX_FACTORY_QUERY_CHUNK (64)
+#define BOX_FACTORY_QUERY_MIN_PER_THREAD (1024)
+
+/* The workers' ranges are locked by different threads, so each one gets its own cache lines */
+#define BOX_FACTORY_QUERY_ALIGNMENT (64)
+
+typedef struct box_factory_query_batch_s box_factory_query_batch_t;
+
+/* A thread of a batch query, and the range of queries [next, end) that it has yet to answer */
+typedef struct box_factory_query_worker_s {
+    pthread_mutex_t lock;      /* Guards next and end, which other workers steal from */
+    size_t next;
+    size_t end;
+    pthread_t thread;
+    bool started;
+    box_factory_query_batch_t *batch;
+} __attribute__((aligned(BOX_FACTORY_QUERY_ALIGNMENT))) box_factory_query_worker_t;
+
+struct box_factory_query_batch_s {
+    box_factory_t *factory;
+    const box_factory_box_t *queries;
+    box_factory_get_result_t *get_results;  /* For box_factory_get_box_batch, NULL otherwise */
+    bool *check_results;                    /* For box_factory_check_box_batch, NULL otherwise */
+    box_factory_query_worker_t *workers;
+    unsigned int worker_count;
+};
+
+/* box_factory_do_insert, box_factory_do_remove, box_factory_do_insert_batch,
+   box_factory_do_remove_batch, box_factory_do_get_box, box_factory_do_check_box,
+   box_factory_do_get_boxes_k, box_factory_do_take_box - the operations,
+   which their public functions wrap with their statistics. The batches that go box by box call these
+   directly, so that their boxes aren't also recorded as operations of their own.
+ */
+static bool box_factory_do_insert(box_factory_t *factory, unsigned int side, unsigned int height);
+static bool box_factory_do_remove(box_factory_t *factory, unsigned int side, unsigned int height);
+static bool box_factory_do_insert_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count);
+static size_t box_factory_do_remove_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count);
+static bool box_factory_do_get_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+static bool box_factory_do_check_box(box_factory_t *factory, unsigned int side, unsigned int height);
+static size_t box_factory_do_get_boxes_k(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_objective_t objective, box_factory_fit_t *fits, size_t k);
+static bool box_factory_do_take_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+
 /* box_factory_insert_tree_by_side, box_factory_insert_tree_by_height - insertion functions for the
-   two main trees.
+   two main trees. exists is set if the box was already in the tree.
  */
-static bool box_factory_insert_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height);
-static bool box_factory_insert_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height);
+static bool box_factory_insert_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height, bool *exists);
+static bool box_factory_insert_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height, bool *exists);
 
 /* box_factory_remove_tree_by_side, box_factory_remove_tree_by_height - removal functions for the
-   two main trees.
+   two main trees. deleted is set if that was the last instance of the box in the tree.
+ */
+static bool box_factory_remove_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height, bool *deleted);
+static bool box_factory_remove_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height, bool *deleted);
+
+/* box_factory_insert_to_tree, box_factory_remove_from_tree - the implementation of the insertion and
+   removal functions, which is the same for both main trees, but with the values swapped.
+ */
+static bool box_factory_insert_to_tree(box_factory_t *factory, box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *exists);
+static bool box_factory_remove_from_tree(box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *deleted);
+
+/* box_factory_locate - find the box (main_val, sub_val) in a main tree, with a single descent of the
+   main tree and a single search of the subtree. Returns false if it doesn't exist.
+ */
+static bool box_factory_locate(box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val, box_tree_position_t *position);
+
+/* box_factory_remove_at - remove an instance of the box at position from its main tree, in place:
+   the sub value is removed through the cursor, and the main node is deleted (or its augmentation
+   updated) where it is, without searching for either again. deleted is set if that was the last
+   instance of the box. The position is invalidated.
+ */
+static void box_factory_remove_at(box_main_tree_t *tree, box_tree_position_t *position, bool *deleted);
+
+/* box_factory_insert_to_bp_tree, box_factory_remove_from_bp_tree - the same for the B+tree backend.
+   The count of each main key is the number of its subtree's instances, so it reaches zero along
+   with its subtree.
+ */
+static bool box_factory_insert_to_bp_tree(box_factory_t *factory, bp_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *exists);
+static bool box_factory_remove_from_bp_tree(bp_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *deleted);
+
+/* bp_subtree_max - the max key of a non-empty B+tree subtree. */
+static unsigned int bp_subtree_max(bp_tree_t *subtree);
+
+/* box_factory_build_tree - build an empty main tree out of count runs of boxes, which must be sorted
+   by the main value (x) and then by the sub value (y), without duplicates.
+   Returns false on an allocation failure, in which case the factory may only be destroyed.
+ */
+static bool box_factory_build_tree(box_factory_t *factory, box_main_tree_t *tree, const range_tree_point_t *runs, size_t count);
+
+/* box_factory_keys_to_runs - convert unique sorted box keys with their counts into runs. */
+static void box_factory_keys_to_runs(unsigned long long *keys, unsigned int *counts, size_t count, range_tree_point_t *runs);
+
+/* box_factory_for_each_run - call callback for each run of boxes of the tree by side (or by height, if
+   by_height is set), in order, where x is the main value and y is the sub value.
+   Returns false if callback stopped it.
+ */
+static bool box_factory_for_each_run(box_factory_t *factory, bool by_height, box_factory_run_callback_t callback, void *context);
+
+/* box_factory_write_run - a box_factory_run_callback_t that writes the run to a file and counts it,
+   of a box_factory_write_context_t. Returns false on a write error.
+ */
+static bool box_factory_write_run(const range_tree_point_t *run, void *context);
+
+/* box_factory_sync_directory - fsync the directory that holds path, so that a rename to path
+   survives a crash. Returns false on an I/O error (or an allocation error).
+ */
+static bool box_factory_sync_directory(const char *path);
+
+/* box_factory_flat_insert_run - a box_factory_run_callback_t that inserts the distinct box of a run
+   of the tree by side to a box_flat_t. Returns false on an allocation error.
+ */
+static bool box_factory_flat_insert_run(const range_tree_point_t *run, void *flat);
+
+/* box_factory_index_build - fill the empty volume index with the distinct boxes of count runs of the
+   tree by side, sorted like box_factory_build_tree. Returns false on an allocation failure.
+ */
+static bool box_factory_index_build(box_factory_t *factory, const range_tree_point_t *runs, size_t count);
+
+/* box_factory_index_insert, box_factory_index_remove - insert/remove the distinct box
+   (side_square, height) to/from the volume index, in whichever form it is. An insertion moves the
+   index to the range tree once the flat array is full.
+   Return false on an allocation error (insert) or if the box doesn't exist (remove), in which case
+   the index is left unchanged.
+ */
+static bool box_factory_index_insert(box_factory_t *factory, unsigned int side_square, unsigned int height);
+static bool box_factory_index_remove(box_factory_t *factory, unsigned int side_square, unsigned int height);
+
+/* box_factory_index_shrink - move the volume index back to a flat array if the range tree is down to
+   BOX_FACTORY_FLAT_MIN distinct boxes. The array is filled from the tree by side, so it must only be
+   called once the index and the main trees hold the same boxes. On an allocation error, the range
+   tree is simply kept.
+ */
+static void box_factory_index_shrink(box_factory_t *factory);
+
+/* box_factory_compare_runs - qsort's comparison of runs, by x and then by y. */
+static int box_factory_compare_runs(const void *a, const void *b);
+
+/* box_factory_query_batch - the implementation of both batch queries. */
+static void box_factory_query_batch(box_factory_query_batch_t *batch, size_t count, unsigned int threads);
+
+/* box_factory_answer_queries - answer the queries [low, high) of batch. */
+static void box_factory_answer_queries(box_factory_query_batch_t *batch, size_t low, size_t high);
+
+/* box_factory_query_worker - the thread function of a box_factory_query_worker_t, which answers the
+   queries of its own range, and then steals from the others until there's nothing left.
+ */
+static void* box_factory_query_worker(void *worker);
+
+/* box_factory_steal_queries - move the back half of the range of another worker that still has
+   queries to worker's range. Returns false if no other worker has any.
+ */
+static bool box_factory_steal_queries(box_factory_query_worker_t *worker);
+
+/* box_factory_check_runs - returns true if count runs are sorted without duplicates, and hold no
+   empty run.
+ */
+static bool box_factory_check_runs(const range_tree_point_t *runs, unsigned long long count);
+
+/* box_factory_same_boxes - returns true if the runs by side and the runs by height (count of each)
+   describe the same boxes with the same counts. The runs by height are transposed and sorted like
+   the runs by side in O(n log n), and then compared to them. Returns false on an allocation error.
+ */
+static bool box_factory_same_boxes(const range_tree_point_t *side_runs, const range_tree_point_t *height_runs, unsigned long long count);
+
+/* box_factory_sort_boxes - pack the boxes into box keys of the tree by side (or by height, if
+   by_height is set), then sort and deduplicate them into keys, with the count of each in counts.
+   Returns the number of unique keys, or 0 on an allocation failure.
+ */
+static size_t box_factory_sort_boxes(const box_factory_box_t *boxes, size_t count, bool by_height, unsigned long long *keys, unsigned int *counts, unsigned int threads);
+
+/* box_factory_insert_keys_to_tree - insert unique sorted box keys to a main tree, with the count of
+   each. A group of keys with the same main value costs a single search of the main tree. If is_new
+   isn't NULL, it is set for each key that wasn't in the tree.
+   Returns false on an allocation failure, in which case the tree is left unchanged.
+ */
+static bool box_factory_insert_keys_to_tree(box_factory_t *factory, box_main_tree_t *tree, unsigned long long *keys, unsigned int *counts, size_t count, bool *is_new);
+
+/* box_factory_insert_group - box_factory_insert_keys_to_tree of keys that share their main value. */
+static bool box_factory_insert_group(box_factory_t *factory, box_main_tree_t *tree, unsigned long long *keys, unsigned int *counts, size_t count, bool *is_new);
+
+/* box_factory_remove_keys_from_tree - remove up to the given count of each of the unique sorted box
+   keys from a main tree. counts is updated to the number of boxes that were actually removed, and
+   if deleted isn't NULL, it is set for each key whose last box was removed.
+   Returns the total number of removed boxes.
+ */
+static size_t box_factory_remove_keys_from_tree(box_main_tree_t *tree, unsigned long long *keys, unsigned int *counts, size_t count, bool *deleted);
+
+/* box_subtree_remove_counts - remove up to the given count of each of the sorted sub values in keys
+   from a subtree, and update counts to the number that was actually removed (and deleted, like
+   box_factory_remove_keys_from_tree).
+ */
+static void box_subtree_remove_counts(box_subtree_t *subtree, unsigned long long *keys, unsigned int *counts, size_t count, bool *deleted);
+
+/* box_snapshot_update - a new version of the persistent tree by_side (which is left unchanged),
+   where the count of the box (side_square, height) is changed by delta, in result.
+   Returns false on an allocation failure.
+ */
+static bool box_snapshot_update(persistent_tree_node_t *by_side, unsigned int side_square, unsigned int height, int delta, persistent_tree_node_t **result);
+
+/* box_snapshot_create - create a snapshot of the version by_side, which takes over the reference to
+   it. Returns NULL on an allocation failure, in which case by_side is released.
+ */
+static box_snapshot_t* box_snapshot_create(persistent_tree_node_t *by_side);
+
+/* box_factory_next_snapshot - the next version of the factory's snapshot, where the count of the box
+   (side_square, height) is changed by delta. Returns NULL on an allocation failure.
+ */
+static box_snapshot_t* box_factory_next_snapshot(box_factory_t *factory, unsigned int side_square, unsigned int height, int delta);
+
+/* box_factory_publish - make snapshot the factory's current version, releasing the previous one. */
+static void box_factory_publish(box_factory_t *factory, box_snapshot_t *snapshot);
+
+/* box_factory_copy_boxes - copy all of the factory's boxes into a new persistent tree by side. The
+   runs of the tree by side are already sorted, so each side's tree of heights, and then the tree of
+   the sides, are built with persistent_tree_build in O(n).
+   Returns false on an allocation failure.
+ */
+static bool box_factory_copy_boxes(box_factory_t *factory, persistent_tree_node_t **by_side);
+
+/* box_factory_copy_run - a box_factory_run_callback_t that adds a run of the tree by side to a
+   box_factory_copy_context_t, first building the previous side's key if the run has a new side.
+   Returns false on an allocation error.
+ */
+static bool box_factory_copy_run(const range_tree_point_t *run, void *context);
+
+/* box_factory_copy_side - build the tree of the collected heights of the current side, and add the
+   side's key over it. Returns false on an allocation error.
  */
-static bool box_factory_remove_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height);
-static bool box_factory_remove_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height);
+static bool box_factory_copy_side(box_factory_copy_context_t *copy);
 
-/* create_box_key - key creation function for the trees. The key would be the same, but the comparison
-   function would be different. Returns NULL on an allocation failure.
+/* box_snapshot_search - the implementation of box_snapshot_get_box, as an in-order scan of the branch
+   of node from side_square up, where found_side_square & found_height hold the best box so far (if
+   found is set). Returns true once no box in the rest of the scan can be better.
  */
-static box_key_t* create_box_key(unsigned int subval);
+static bool box_snapshot_search(persistent_tree_node_t *node, unsigned int side_square, unsigned int height, bool *found, unsigned int *found_side_square, unsigned int *found_height);
 
-/* create_main_tree_node - creates a node in a main tree - tree_by_side or tree_by_height.
-   Returns NULL on an allocation failure.
+/* box_fit_worse_volume, box_fit_worse_height, box_fit_worse_side, box_fit_worse_waste - the orders
+   of the objectives (see box_factory_objective_t), which return true if the box a is a worse fit
+   for query than the box b. Each is a strict total order of the boxes.
  */
-static box_main_tree_node_t* create_main_tree_node(unsigned int main_val, rb_tree_key_cmp_t key_cmp);
+static inline bool box_fit_worse_volume(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query);
+static inline bool box_fit_worse_height(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query);
+static inline bool box_fit_worse_side(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query);
+static inline bool box_fit_worse_waste(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query);
 
-/* free_main_tree_node - frees an allocated main tree node, assuming that its subtree is empty */
-static void free_main_tree_node(box_main_tree_node_t *node);
+/* box_fit_excess - the excess of a box that fits query over it, relative to the query, in the
+   dimension where it is larger, as the fraction numerator / denominator.
+ */
+static inline void box_fit_excess(unsigned int side_square, unsigned int height, const box_fit_query_t *query, unsigned long long *numerator, unsigned long long *denominator);
 
-/* compare_nodes_by_side, compare_nodes_by_height - node comparison functions for the main trees
-   of the box factory */
-static int compare_nodes(void *a, void *b);
+/* box_factory_tree_shape - the implementation of box_factory_shape for a single main tree. */
+static void box_factory_tree_shape(box_main_tree_t *tree, box_factory_tree_shape_t *shape);
 
-/* compare_keys_side, compare_keys_height - key comparison functions for the subtrees of each node
-   in the main trees.
+/* box_factory_create_trees - creates the empty trees of the factory in its pool.
+   Returns false on an allocation failure.
  */
-static int compare_keys(void *a, void *b);
+static bool box_factory_create_trees(box_factory_t *factory);
 
-/* The following are convenience functions internally used:
-      get_sub_tree - returns the subtree of a given main tree node.
-      get_sub_tree_max - returns the max value in the sub tree of a main tree node.
-      get_main_tree_node_val - returns the key value of a main tree node.
-      get_sub_tree_node_val - returns the key value of a sub tree node.
+/* augment_branch_max - augmentation function for the main trees, maintains branch_max of each
+   main tree node.
  */
-static rb_tree_t * get_sub_tree(rb_tree_node_t *main_tree_node);
-static unsigned int get_sub_tree_max(rb_tree_node_t *main_tree_node);
-static unsigned int get_main_tree_node_val(rb_tree_node_t *main_tree_node);
-static unsigned int get_sub_tree_node_val(rb_tree_node_t *sub_tree_node);
+static inline void augment_branch_max(box_main_tree_t *tree, box_main_tree_node_t *node);
 
-/* The following are check_box and get_box implementations that can be called on either of the
-   two main trees, and are general. The real get_box and check_box would call directly to these
-   functions with the main tree that is smaller.
+/* box_factory_check_by_input - check_box implementation that can be called on either of the two
+   main trees, and is general. The real check_box would call it directly with the main tree that
+   is smaller.
+ */
+static bool box_factory_check_by_input(box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val);
+
+RB_TREE_FUNCTIONS(box_main_tree, unsigned int, augment_branch_max)
+
+/* BOX_FIT_OBJECTIVE - define the k best fits scan of an objective, specialized at compile time, so
+   that its order is inlined instead of called through a pointer:
+     box_fit_scan_name(factory, query, fits, k) - fill fits with the (up to) k best boxes that fit
+       query by the order worse (see box_fit_worse_volume), from the best one, and return their
+       number.
+   The scan is an in-order scan of a main tree (the tree by height if by_height is set, otherwise the
+   tree by side) from the query's main value up, which skips the branches without a large enough sub
+   value. The candidates are kept in a bounded max-heap (the worst on top) in fits itself.
+   worse must be monotone - a box is never worse than a box that is at least as large in both
+   dimensions - so that a main value with the query's sub value bounds all of the boxes of the rest of
+   the scan (which stops once that bound doesn't make it into the heap), and a subtree is scanned
+   only until its next box doesn't make it.
  */
-static bool box_factory_check_by_input(rb_tree_t *tree, unsigned int main_val, unsigned int sub_val);
-static bool box_factory_get_by_input(rb_tree_t *tree,
-                                     unsigned int main_val,
-                                     unsigned int sub_val,
-                                     unsigned int *found_main_val,
-                                     unsigned int *found_sub_val);
+#define BOX_FIT_OBJECTIVE(name, worse, by_height)                                               \
+                                                                                                \
+static inline bool box_fit_accepts_##name(const box_fit_heap_t *heap, unsigned int main_val, unsigned int sub_val, const box_fit_query_t *query) \
+{                                                                                               \
+    unsigned int side_square = (by_height) ? sub_val : main_val;                                \
+    unsigned int height = (by_height) ? main_val : sub_val;                                     \
+                                                                                                \
+    return (heap->size < heap->k) || worse(heap->fits[0].side_square, heap->fits[0].height, side_square, height, query); \
+}                                                                                               \
+                                                                                                \
+static void box_fit_sift_down_##name(box_factory_fit_t *fits, size_t size, size_t index, const box_fit_query_t *query) \
+{                                                                                               \
+    box_factory_fit_t fit = fits[index];                                                        \
+    size_t child = 0;                                                                           \
+                                                                                                \
+    while ((child = 2 * index + 1) < size) {                                                    \
+        if ((child + 1 < size) && worse(fits[child + 1].side_square, fits[child + 1].height, fits[child].side_square, fits[child].height, query)) { \
+            child++;                                                                            \
+        }                                                                                       \
+        if (!worse(fits[child].side_square, fits[child].height, fit.side_square, fit.height, query)) { \
+            break;                                                                              \
+        }                                                                                       \
+        fits[index] = fits[child];                                                              \
+        index = child;                                                                          \
+    }                                                                                           \
+    fits[index] = fit;                                                                          \
+}                                                                                               \
+                                                                                                \
+static void box_fit_add_##name(box_fit_heap_t *heap, unsigned int main_val, unsigned int sub_val, unsigned int count, const box_fit_query_t *query) \
+{                                                                                               \
+    box_factory_fit_t fit = {.side_square = (by_height) ? sub_val : main_val, .height = (by_height) ? main_val : sub_val, .count = count}; \
+    size_t parent = 0;                                                                          \
+    size_t index = 0;                                                                           \
+                                                                                                \
+    if (heap->size == heap->k) {                                                                \
+        /* The new box replaces the worst one at the top */                                     \
+        heap->fits[0] = fit;                                                                    \
+        box_fit_sift_down_##name(heap->fits, heap->k, 0, query);                                \
+        return;                                                                                 \
+    }                                                                                           \
+                                                                                                \
+    /* Sift the new box up from the bottom, over the better boxes */                            \
+    index = heap->size++;                                                                       \
+    while (index > 0) {                                                                         \
+        parent = (index - 1) / 2;                                                               \
+        if (!worse(fit.side_square, fit.height, heap->fits[parent].side_square, heap->fits[parent].height, query)) { \
+            break;                                                                              \
+        }                                                                                       \
+        heap->fits[index] = heap->fits[parent];                                                 \
+        index = parent;                                                                         \
+    }                                                                                           \
+    heap->fits[index] = fit;                                                                    \
+}                                                                                               \
+                                                                                                \
+static bool box_fit_branch_##name(box_main_tree_t *tree, box_main_tree_node_t *node, const box_fit_query_t *query, box_fit_heap_t *heap) \
+{                                                                                               \
+    unsigned int main_query = (by_height) ? query->height : query->side_square;                 \
+    unsigned int sub_query = (by_height) ? query->side_square : query->height;                  \
+    box_subtree_cursor_t sub_key;                                                               \
+    bool sub_found = false;                                                                     \
+                                                                                                \
+    /* Branches without a large enough sub value are skipped altogether */                      \
+    if (box_main_tree_is_nil(tree, node) || (node->branch_max < sub_query)) {                   \
+        return false;                                                                           \
+    }                                                                                           \
+                                                                                                \
+    if (node->key < main_query) {                                                               \
+        return box_fit_branch_##name(tree, node->right, query, heap);                           \
+    }                                                                                           \
+                                                                                                \
+    if (box_fit_branch_##name(tree, node->left, query, heap)) {                                 \
+        return true;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    /* The bound of all of the boxes of this node and of the rest of the scan */                \
+    if (!box_fit_accepts_##name(heap, node->key, sub_query, query)) {                           \
+        return true;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    for (sub_found = box_subtree_search_smallest(&(node->subtree), sub_query, &sub_key);        \
+         sub_found && box_fit_accepts_##name(heap, node->key, box_subtree_cursor_key(&sub_key), query); \
+         sub_found = box_subtree_cursor_next(&sub_key)) {                                       \
+        box_fit_add_##name(heap, node->key, box_subtree_cursor_key(&sub_key), box_subtree_cursor_count(&sub_key), query); \
+    }                                                                                           \
+                                                                                                \
+    return box_fit_branch_##name(tree, node->right, query, heap);                               \
+}                                                                                               \
+                                                                                                \
+static void box_fit_bp_tree_##name(bp_tree_t *tree, const box_fit_query_t *query, box_fit_heap_t *heap) \
+{                                                                                               \
+    unsigned int main_query = (by_height) ? query->height : query->side_square;                 \
+    unsigned int sub_query = (by_height) ? query->side_square : query->height;                  \
+    bp_tree_cursor_t main_key;                                                                  \
+    bp_tree_cursor_t sub_key;                                                                   \
+    bool found = false;                                                                         \
+    bool sub_found = false;                                                                     \
+                                                                                                \
+    for (found = bp_tree_search_smallest(tree, main_query, &main_key);                          \
+         found && box_fit_accepts_##name(heap, bp_tree_cursor_key(&main_key), sub_query, query); \
+         found = bp_tree_cursor_next(&main_key)) {                                              \
+        /* The aux of each main key is its subtree's max */                                     \
+        if (bp_tree_cursor_aux(&main_key) < sub_query) {                                        \
+            continue;                                                                           \
+        }                                                                                       \
+                                                                                                \
+        for (sub_found = bp_tree_search_smallest(bp_tree_cursor_value(&main_key), sub_query, &sub_key); \
+             sub_found && box_fit_accepts_##name(heap, bp_tree_cursor_key(&main_key), bp_tree_cursor_key(&sub_key), query); \
+             sub_found = bp_tree_cursor_next(&sub_key)) {                                       \
+            box_fit_add_##name(heap, bp_tree_cursor_key(&main_key), bp_tree_cursor_key(&sub_key), bp_tree_cursor_count(&sub_key), query); \
+        }                                                                                       \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+static size_t box_fit_scan_##name(box_factory_t *factory, const box_fit_query_t *query, box_factory_fit_t *fits, size_t k) \
+{                                                                                               \
+    box_fit_heap_t heap = {.fits = fits, .size = 0, .k = k};                                    \
+    box_main_tree_t *tree = (by_height) ? factory->tree_by_height : factory->tree_by_side;      \
+    box_factory_fit_t worst;                                                                    \
+    size_t size = 0;                                                                            \
+                                                                                                \
+    if (k > 0) {                                                                                \
+        if (factory->backend == BOX_FACTORY_BP_TREE) {                                          \
+            box_fit_bp_tree_##name((by_height) ? factory->bp_tree_by_height : factory->bp_tree_by_side, query, &heap); \
+        } else {                                                                                \
+            box_fit_branch_##name(tree, tree->head, query, &heap);                              \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    /* Sort the heap by moving its worst box to its end, which shrinks by one */                \
+    for (size = heap.size; size > 1; size--) {                                                  \
+        worst = fits[0];                                                                        \
+        fits[0] = fits[size - 1];                                                               \
+        fits[size - 1] = worst;                                                                 \
+        box_fit_sift_down_##name(fits, size - 1, 0, query);                                     \
+    }                                                                                           \
+                                                                                                \
+    return heap.size;                                                                           \
+}
 
+BOX_FIT_OBJECTIVE(volume, box_fit_worse_volume, false)
+BOX_FIT_OBJECTIVE(height, box_fit_worse_height, true)
+BOX_FIT_OBJECTIVE(side, box_fit_worse_side, false)
+BOX_FIT_OBJECTIVE(waste, box_fit_worse_waste, false)
 
 box_factory_t* box_factory_create()
+{
+    return box_factory_create_with_backend(BOX_FACTORY_RB_TREE);
+}
+
+box_factory_t* box_factory_create_with_backend(box_factory_backend_t backend)
 {
     box_factory_t *factory = NULL;
-    rb_tree_t *rb_tree = NULL;
 
     factory = calloc(sizeof(box_factory_t), 1);
     if (NULL == factory) {
         return NULL;
     }
+    factory->backend = backend;
+
+    if (0 != pthread_mutex_init(&(factory->snapshot_lock), NULL)) {
+        free(factory);
+        return NULL;
+    }
 
-    rb_tree = rb_tree_create((rb_tree_key_cmp_t) compare_nodes);
-    if (NULL == rb_tree) {
+    factory->pool = pool_create();
+    if (NULL == factory->pool) {
+        pthread_mutex_destroy(&(factory->snapshot_lock));
         free(factory);
         return NULL;
     }
-    factory->tree_by_side = rb_tree;
 
-    rb_tree = rb_tree_create((rb_tree_key_cmp_t) compare_nodes);
-    if (NULL == rb_tree) {
-        free(factory->tree_by_side);
+    if (false == box_factory_create_trees(factory)) {
+        if (NULL != factory->flat_index) {
+            box_flat_destroy(factory->flat_index);
+        }
+        pool_destroy(factory->pool);
+        pthread_mutex_destroy(&(factory->snapshot_lock));
         free(factory);
         return NULL;
     }
-    factory->tree_by_height = rb_tree;
 
     return factory;
 }
 
-bool box_factory_insert(box_factory_t *factory, unsigned int side, unsigned int height)
+box_factory_t* box_factory_build_from_array(const box_factory_box_t *boxes, size_t count, unsigned int threads)
 {
-    if (false == box_factory_insert_tree_by_side(factory, side, height)) {
-        return false;
+    box_factory_t *factory = NULL;
+    unsigned long long *keys = NULL;
+    unsigned int *counts = NULL;
+    range_tree_point_t *runs = NULL;
+    size_t unique = 0;
+    bool result = false;
+
+    factory = box_factory_create();
+    if ((NULL == factory) || (count == 0)) {
+        return factory;
     }
 
-    if (false == box_factory_insert_tree_by_height(factory, side, height)) {
-        assert(box_factory_remove_tree_by_side(factory, side, height));
-        return false;
+    keys = malloc(count * sizeof(unsigned long long));
+    counts = malloc(count * sizeof(unsigned int));
+    runs = malloc(count * sizeof(range_tree_point_t));
+    if ((NULL == keys) || (NULL == counts) || (NULL == runs)) {
+        goto cleanup;
     }
 
-    return true;
+    /* By side - the runs of (side^2, height) are also the points of the volume index */
+    unique = box_factory_sort_boxes(boxes, count, false, keys, counts, threads);
+    if (unique == 0) {
+        goto cleanup;
+    }
+    box_factory_keys_to_runs(keys, counts, unique, runs);
+    if (!box_factory_build_tree(factory, factory->tree_by_side, runs, unique) ||
+        !box_factory_index_build(factory, runs, unique)) {
+        goto cleanup;
+    }
+
+    /* By height */
+    unique = box_factory_sort_boxes(boxes, count, true, keys, counts, threads);
+    if (unique == 0) {
+        goto cleanup;
+    }
+    box_factory_keys_to_runs(keys, counts, unique, runs);
+    if (false == box_factory_build_tree(factory, factory->tree_by_height, runs, unique)) {
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    free(keys);
+    free(counts);
+    free(runs);
+
+    if (!result) {
+        /* Whatever was built is in the factory's pool */
+        box_factory_destroy(factory);
+        return NULL;
+    }
+
+    return factory;
 }
 
-bool box_factory_remove(box_factory_t *factory, unsigned int side, unsigned int height)
+bool box_factory_save(box_factory_t *factory, const char *path)
 {
-    if (false == box_factory_remove_tree_by_side(factory, side, height)) {
+    box_factory_file_header_t header;
+    box_factory_write_context_t context = {NULL, 0};
+    char *temporary_path = NULL;
+    FILE *file = NULL;
+    bool result = false;
+
+    /* The file is written aside and then renamed over path, so a crash never leaves a partial file */
+    temporary_path = malloc(strlen(path) + sizeof(BOX_FACTORY_FILE_TEMPORARY_SUFFIX));
+    if (NULL == temporary_path) {
         return false;
     }
+    strcpy(temporary_path, path);
+    strcat(temporary_path, BOX_FACTORY_FILE_TEMPORARY_SUFFIX);
 
-    /* If we were able to remove from the tree by side, we must be able to remove
-       from the tree by height, because the key exists.
-     */
-    assert(box_factory_remove_tree_by_height(factory, side, height));
+    file = fopen(temporary_path, "wb");
+    if (NULL == file) {
+        free(temporary_path);
+        return false;
+    }
 
-    return true;
-}
+    /* The header is written again once the runs are counted */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BOX_FACTORY_FILE_MAGIC, sizeof(header.magic));
+    header.version = BOX_FACTORY_FILE_VERSION;
+    header.run_size = sizeof(range_tree_point_t);
 
+    context.file = file;
+    if ((1 != fwrite(&header, sizeof(header), 1, file)) ||
+        !box_factory_for_each_run(factory, false, box_factory_write_run, &context)) {
+        goto cleanup;
+    }
 
-bool box_factory_get_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
-{
-    if (factory->tree_by_height->count == 0) {
-        return false;
+    header.run_count = context.count;
+    context.count = 0;
+    if (!box_factory_for_each_run(factory, true, box_factory_write_run, &context) ||
+        (context.count != header.run_count) ||
+        (0 != fseek(file, 0, SEEK_SET)) ||
+        (1 != fwrite(&header, sizeof(header), 1, file)) ||
+        (0 != fflush(file)) ||
+        (0 != fsync(fileno(file)))) {
+        goto cleanup;
     }
 
-    if (factory->tree_by_height->count > factory->tree_by_side->count){
-        return box_factory_get_by_input(factory->tree_by_side, side * side, height, found_side_square, found_height);
+    result = true;
+
+cleanup:
+    if ((0 != fclose(file)) || !result || (0 != rename(temporary_path, path))) {
+        remove(temporary_path);
+        result = false;
+    } else {
+        /* The rename itself is only durable once the directory is */
+        result = box_factory_sync_directory(path);
     }
-    return box_factory_get_by_input(factory->tree_by_height, height, side * side, found_height, found_side_square);
+    free(temporary_path);
+
+    return result;
 }
 
-static bool box_factory_get_by_input(rb_tree_t *tree,
-                                     unsigned int main_val,
-                                     unsigned int sub_val,
-                                     unsigned int *found_main_val,
-                                     unsigned int *found_sub_val)
+box_factory_t* box_factory_open(const char *path)
 {
-    rb_tree_node_t *node = NULL;
-    rb_tree_node_t *sub_node = NULL;
-    rb_tree_node_t *min_node = NULL;
-    rb_tree_node_t *min_sub_node = NULL;
-    box_main_tree_node_t target_node = {.val = main_val, .subtree = NULL};
-    box_key_t target_subnode = {.val = sub_val};
-    unsigned int min_volume = 0;
-    unsigned int volume = 0;
+    box_factory_file_header_t *header = NULL;
+    const range_tree_point_t *side_runs = NULL;
+    const range_tree_point_t *height_runs = NULL;
+    box_factory_t *factory = NULL;
+    struct stat status;
+    void *map = MAP_FAILED;
+    int fd = -1;
+    bool result = false;
+
+    fd = open(path, O_RDONLY);
+    if ((-1 == fd) || (0 != fstat(fd, &status)) || ((size_t) status.st_size < sizeof(box_factory_file_header_t))) {
+        goto cleanup;
+    }
+
+    map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map) {
+        goto cleanup;
+    }
+    /* The runs are read once, in order */
+    madvise(map, status.st_size, MADV_SEQUENTIAL);
+
+    header = map;
+    if ((0 != memcmp(header->magic, BOX_FACTORY_FILE_MAGIC, sizeof(header->magic))) ||
+        (header->version != BOX_FACTORY_FILE_VERSION) ||
+        (header->run_size != sizeof(range_tree_point_t)) ||
+        (header->run_count > (status.st_size - sizeof(box_factory_file_header_t)) / (2 * sizeof(range_tree_point_t))) ||
+        ((size_t) status.st_size != sizeof(box_factory_file_header_t) + 2 * header->run_count * sizeof(range_tree_point_t))) {
+        goto cleanup;
+    }
 
-    node = rb_tree_search_smallest(tree, &target_node);
+    /* The runs are validated before anything is built out of them, as the builds trust their order,
+       and the two trees must hold the same boxes */
+    side_runs = (const range_tree_point_t *) (header + 1);
+    height_runs = side_runs + header->run_count;
+    if (!box_factory_check_runs(side_runs, header->run_count) ||
+        !box_factory_check_runs(height_runs, header->run_count) ||
+        !box_factory_same_boxes(side_runs, height_runs, header->run_count)) {
+        goto cleanup;
+    }
 
-    while (node && (get_sub_tree_max(node) < sub_val)) {
-        node = rb_tree_successor(tree, node);
+    /* The trees are built straight out of the mapped runs, without sorting or rebalancing */
+    factory = box_factory_create();
+    if ((NULL == factory) || (header->run_count == 0)) {
+        result = (NULL != factory);
+        goto cleanup;
     }
 
-    if (NULL == node) {
-        return NULL;
+    result = box_factory_build_tree(factory, factory->tree_by_side, side_runs, header->run_count) &&
+             box_factory_index_build(factory, side_runs, header->run_count) &&
+             box_factory_build_tree(factory, factory->tree_by_height, height_runs, header->run_count);
+
+cleanup:
+    if (MAP_FAILED != map) {
+        munmap(map, status.st_size);
+    }
+    if (-1 != fd) {
+        close(fd);
+    }
+
+    if (!result && (NULL != factory)) {
+        box_factory_destroy(factory);
+        factory = NULL;
     }
 
-    sub_node = rb_tree_search_smallest(get_sub_tree(node), &target_subnode);
+    return factory;
+}
+
+static size_t box_factory_sort_boxes(const box_factory_box_t *boxes, size_t count, bool by_height, unsigned long long *keys, unsigned int *counts, unsigned int threads)
+{
+    size_t i = 0;
 
-    /* sub_node must exist in this flow. */
-    assert(sub_node);
+    for (i = 0; i < count; i++) {
+        if (by_height) {
+            keys[i] = BOX_KEY(boxes[i].height, boxes[i].side * boxes[i].side);
+        } else {
+            keys[i] = BOX_KEY(boxes[i].side * boxes[i].side, boxes[i].height);
+        }
+    }
 
-    min_volume = get_main_tree_node_val(node) * get_sub_tree_node_val(sub_node);
-    min_node = node;
-    min_sub_node = sub_node;
+    return parallel_sort_unique(keys, count, counts, threads);
+}
 
-    while (node && (min_volume / get_main_tree_node_val(node) >= sub_val)) {
-        node = rb_tree_successor(tree, node);
+static bool box_factory_build_tree(box_factory_t *factory, box_main_tree_t *tree, const range_tree_point_t *runs, size_t count)
+{
+    box_main_tree_node_t **main_nodes = NULL;
+    unsigned int *sub_values = NULL;
+    unsigned int *sub_counts = NULL;
+    box_main_tree_node_t *main_node = NULL;
+    size_t main_count = 0;
+    size_t sub_count = 0;
+    size_t i = 0;
+    bool result = false;
+
+    main_nodes = malloc(count * sizeof(box_main_tree_node_t *));
+    sub_values = malloc(count * sizeof(unsigned int));
+    sub_counts = malloc(count * sizeof(unsigned int));
+    if ((NULL == main_nodes) || (NULL == sub_values) || (NULL == sub_counts)) {
+        goto cleanup;
+    }
 
-        if ((NULL == node) || (get_sub_tree_max(node) < sub_val)) {
-            continue;
+    /* A main node per group of runs with the same main value, whose subtree is built out of the
+       group. The subtrees are complete before the main tree is built, for the augmentation. */
+    for (i = 0; i < count; i++) {
+        if ((i == 0) || (runs[i].x != runs[i - 1].x)) {
+            main_node = box_main_tree_create_node(tree, runs[i].x);
+            if (NULL == main_node) {
+                goto cleanup;
+            }
+            box_subtree_init(&(main_node->subtree));
+            main_nodes[main_count++] = main_node;
+            sub_count = 0;
         }
 
-        sub_node = rb_tree_search_smallest(get_sub_tree(node), &target_subnode);
+        sub_values[sub_count] = runs[i].y;
+        sub_counts[sub_count++] = runs[i].count;
 
-        volume = get_main_tree_node_val(node) * get_sub_tree_node_val(sub_node);
-        if (min_volume > volume) {
-            min_volume = volume;
-            min_node = node;
-            min_sub_node = sub_node;
+        if (((i + 1 == count) || (runs[i + 1].x != runs[i].x)) &&
+            (false == box_subtree_build(&(main_node->subtree), factory->pool, sub_values, sub_counts, sub_count))) {
+            goto cleanup;
         }
     }
 
-    *found_main_val = get_main_tree_node_val(min_node);
-    *found_sub_val = get_sub_tree_node_val(min_sub_node);
+    box_main_tree_build(tree, main_nodes, main_count);
+    result = true;
 
-    return true;
+cleanup:
+    free(main_nodes);
+    free(sub_values);
+    free(sub_counts);
+    return result;
 }
 
-
-bool box_factory_check_box(box_factory_t *factory, unsigned int side, unsigned int height)
+static void box_factory_keys_to_runs(unsigned long long *keys, unsigned int *counts, size_t count, range_tree_point_t *runs)
 {
-    if (factory->tree_by_height->count > factory->tree_by_side->count){
-        return box_factory_check_by_input(factory->tree_by_side, side * side, height);
+    size_t i = 0;
+
+    for (i = 0; i < count; i++) {
+        runs[i].x = BOX_KEY_MAIN(keys[i]);
+        runs[i].y = BOX_KEY_SUB(keys[i]);
+        runs[i].count = counts[i];
     }
-    return box_factory_check_by_input(factory->tree_by_height, height, side * side);
 }
 
-static bool box_factory_check_by_input(rb_tree_t *tree, unsigned int main_val, unsigned int sub_val)
+static bool box_factory_for_each_run(box_factory_t *factory, bool by_height, box_factory_run_callback_t callback, void *context)
 {
-    rb_tree_node_t *main_node = NULL;
-    box_main_tree_node_t *main_key = NULL;
-    box_main_tree_node_t target_node;
-    box_key_t target_subnode;
-
-    target_node.val = main_val;
-    target_subnode.val = sub_val;
-    main_node = rb_tree_search_smallest(tree, &target_node);
-
-    if (NULL == main_node){
-        return false;
+    box_main_tree_t *tree = by_height ? factory->tree_by_height : factory->tree_by_side;
+    bp_tree_t *bp_tree = by_height ? factory->bp_tree_by_height : factory->bp_tree_by_side;
+    box_main_tree_node_t *main_node = NULL;
+    box_subtree_cursor_t sub_cursor;
+    bp_tree_cursor_t main_key;
+    bp_tree_cursor_t sub_key;
+    range_tree_point_t run;
+    bool found = false;
+    bool sub_found = false;
+
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        for (found = bp_tree_first(bp_tree, &main_key); found; found = bp_tree_cursor_next(&main_key)) {
+            for (sub_found = bp_tree_first(bp_tree_cursor_value(&main_key), &sub_key); sub_found; sub_found = bp_tree_cursor_next(&sub_key)) {
+                run.x = bp_tree_cursor_key(&main_key);
+                run.y = bp_tree_cursor_key(&sub_key);
+                run.count = bp_tree_cursor_count(&sub_key);
+                if (false == callback(&run, context)) {
+                    return false;
+                }
+            }
+        }
+        return true;
     }
 
-    main_key = (box_main_tree_node_t*)main_node->key;
-    while ((NULL != main_node) && (-1 == main_key->subtree->key_cmp(main_key->subtree->max->key, &target_subnode))){
-        main_node = rb_tree_successor(tree, main_node);
-        if (NULL != main_node){
-            main_key = (box_main_tree_node_t*)(main_node->key);
+    for (main_node = box_main_tree_search_smallest(tree, 0); NULL != main_node; main_node = box_main_tree_successor(tree, main_node)) {
+        for (sub_found = box_subtree_search_smallest(&(main_node->subtree), 0, &sub_cursor); sub_found; sub_found = box_subtree_cursor_next(&sub_cursor)) {
+            run.x = main_node->key;
+            run.y = box_subtree_cursor_key(&sub_cursor);
+            run.count = box_subtree_cursor_count(&sub_cursor);
+            if (false == callback(&run, context)) {
+                return false;
+            }
         }
     }
 
-    if (NULL == main_node){
+    return true;
+}
+
+static bool box_factory_write_run(const range_tree_point_t *run, void *context)
+{
+    box_factory_write_context_t *write_context = context;
+
+    if (1 != fwrite(run, sizeof(range_tree_point_t), 1, write_context->file)) {
         return false;
     }
+    write_context->count++;
 
     return true;
 }
 
-static bool box_factory_insert_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height)
+static bool box_factory_sync_directory(const char *path)
 {
-    box_main_tree_node_t *new_node = NULL;
-    box_main_tree_node_t *side_tree_node = NULL;
-    box_key_t *new_key = NULL;
-    bool exists_in_side_tree = false;
-    bool exists_in_subtree = false;
+    char *directory = NULL;
+    int fd = -1;
+    bool result = false;
 
-    /* When trying to insert a new node to this tree, one of the following will cases occur:
-         1. There's no box of the same size, meaning the side would not be found in the tree by side.
-         2. There's a box with the same side, but not with the same height.
-         3. There's a box with the same side and with the same height.
-     */
-    new_node = create_main_tree_node(side * side, compare_keys);
-    if (NULL == new_node) {
+    directory = strdup(path);
+    if (NULL == directory) {
         return false;
     }
 
-    new_key = create_box_key(height);
-    if (NULL == new_key) {
-        return false;
+    fd = open(dirname(directory), O_RDONLY | O_DIRECTORY);
+    result = (-1 != fd) && (0 == fsync(fd));
+    if (-1 != fd) {
+        close(fd);
     }
+    free(directory);
 
-    /* First, search in the main tree (tree by side) */
-    side_tree_node = rb_tree_search(factory->tree_by_side, new_node);
+    return result;
+}
 
-    /* Case 1 - there's no box of the same size */
-    if (NULL == side_tree_node) {
-        /* Insert to the tree by side - this must be a new key in the tree. */
-        if (false == rb_tree_insert(factory->tree_by_side, new_node, &exists_in_side_tree)) {
-            free(new_node);
-            free(new_key);
-            return false;
-        }
-        assert(exists_in_side_tree == false);
+static bool box_factory_flat_insert_run(const range_tree_point_t *run, void *flat)
+{
+    return box_flat_insert(flat, run->x, run->y, 1);
+}
 
-        /* Insert to the subtree - this must be a new key in the tree. */
-        if (false == rb_tree_insert(new_node->subtree, new_key, &exists_in_subtree)) {
-            rb_tree_remove(factory->tree_by_side, new_node, (void **) &side_tree_node);
-            assert(side_tree_node == new_node);
-            free_main_tree_node(new_node);
-            free(new_key);
-            return false;
+static bool box_factory_index_build(box_factory_t *factory, const range_tree_point_t *runs, size_t count)
+{
+    range_tree_point_t *points = NULL;
+    size_t i = 0;
+
+    if (count <= BOX_FACTORY_FLAT_MAX) {
+        for (i = 0; i < count; i++) {
+            if (false == box_flat_insert(factory->flat_index, runs[i].x, runs[i].y, 1)) {
+                return false;
+            }
         }
-        assert(exists_in_subtree == false);
         return true;
     }
 
-    /* There's a node with the same side */
-    free_main_tree_node(new_node);
-
-    /* Now rb_tree_insert should take care of cases 2 & 3. */
-    if (false == rb_tree_insert(side_tree_node->subtree, new_key, &exists_in_subtree)) {
-        free(new_key);
+    /* The runs may be read-only (box_factory_open maps them), so the distinct boxes are copied */
+    points = malloc(count * sizeof(range_tree_point_t));
+    if (NULL == points) {
         return false;
     }
+    for (i = 0; i < count; i++) {
+        points[i].x = runs[i].x;
+        points[i].y = runs[i].y;
+        points[i].count = 1;
+    }
 
-    /* This is case 3, in which we can free the new key that we've created */
-    if (exists_in_subtree) {
-        free(new_key);
+    if (false == range_tree_build(factory->index_by_volume, points, count)) {
+        free(points);
+        return false;
     }
+    free(points);
+    box_flat_destroy(factory->flat_index);
+    factory->flat_index = NULL;
 
     return true;
 }
 
-static bool box_factory_insert_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height)
+static bool box_factory_index_insert(box_factory_t *factory, unsigned int side_square, unsigned int height)
 {
-    box_main_tree_node_t *new_node = NULL;
-    box_main_tree_node_t *height_tree_node = NULL;
-    box_key_t *new_key = NULL;
-    bool exists_in_height_tree = false;
-    bool exists_in_subtree = false;
+    box_flat_t *flat = factory->flat_index;
+    range_tree_point_t *runs = NULL;
+    size_t i = 0;
+    bool removed = false;
 
-    /* When trying to insert a new node to this tree, one of the following will cases occur:
-         1. There's no box of the same size, meaning the height would not be found in the tree by height.
-         2. There's a box with the same height, but not with the same side.
-         3. There's a box with the same height and with the same side.
-     */
-    new_node = create_main_tree_node(height, compare_keys);
-    if (NULL == new_node) {
-        return false;
+    if (NULL == flat) {
+        return range_tree_insert(factory->index_by_volume, side_square, height);
     }
 
-    /* First, search in the main tree (tree by height) */
-    height_tree_node = rb_tree_search(factory->tree_by_height, new_node);
+    if (flat->size < BOX_FACTORY_FLAT_MAX) {
+        return box_flat_insert(flat, side_square, height, 1);
+    }
 
-    new_key = create_box_key(side * side);
-    if (NULL == new_key) {
+    /* The array is full, so it's moved to the (empty) range tree, which is built out of its boxes in
+       sorted order, before the box is inserted there */
+    runs = malloc(flat->size * sizeof(range_tree_point_t));
+    if (NULL == runs) {
         return false;
     }
-
-    /* Case 1 - there's no box of the same size */
-    if (NULL == height_tree_node) {
-        /* Insert to the tree by side - this must be a new key in the tree. */
-        if (false == rb_tree_insert(factory->tree_by_height, new_node, &exists_in_height_tree)) {
-            free(new_node);
-            free(new_key);
-            return false;
-        }
-        assert(exists_in_height_tree == false);
-
-        /* Insert to the subtree - this must be a new key in the tree. */
-        if (false == rb_tree_insert(new_node->subtree, new_key, &exists_in_subtree)) {
-            rb_tree_remove(factory->tree_by_height, new_node, (void **) &height_tree_node);
-            assert(height_tree_node == new_node);
-            free_main_tree_node(new_node);
-            free(new_key);
-            return false;
-        }
-        assert(exists_in_subtree == false);
-        return true;
+    for (i = 0; i < flat->size; i++) {
+        runs[i].x = flat->side_squares[i];
+        runs[i].y = flat->heights[i];
+        runs[i].count = flat->counts[i];
     }
+    qsort(runs, flat->size, sizeof(range_tree_point_t), box_factory_compare_runs);
 
-    /* There's a node with the same height */
-    free_main_tree_node(new_node);
-
-    /* Now rb_tree_insert should take care of cases 2 & 3. */
-    if (false == rb_tree_insert(height_tree_node->subtree, new_key, &exists_in_subtree)) {
-        free(new_key);
+    if (!range_tree_build(factory->index_by_volume, runs, flat->size)) {
+        free(runs);
         return false;
     }
-
-    /* This is case 3, in which we can free the new key that we've created */
-    if (exists_in_subtree) {
-        free(new_key);
+    free(runs);
+
+    if (false == range_tree_insert(factory->index_by_volume, side_square, height)) {
+        /* The boxes are in both now, so the tree is simply emptied again */
+        for (i = 0; i < flat->size; i++) {
+            removed = range_tree_remove(factory->index_by_volume, flat->side_squares[i], flat->heights[i]);
+            assert(removed);
+            (void) removed;
+        }
+        return false;
     }
 
+    box_flat_destroy(flat);
+    factory->flat_index = NULL;
+
     return true;
 }
 
-
-static bool box_factory_remove_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height)
+static bool box_factory_index_remove(box_factory_t *factory, unsigned int side_square, unsigned int height)
 {
-    box_main_tree_node_t *new_node = NULL;
-    box_main_tree_node_t *side_tree_node = NULL;
-    box_main_tree_node_t *deleted_side_tree_node = NULL;
-    box_key_t *new_key = NULL;
-    box_key_t *subtree_key = NULL;
-
-    /* When trying to remove a node from this tree, the following cases may occur:
-        1. There's no box with that size, which either means:
-            1.1. There's no box with the same side.
-            1.2. There's a box with the same side but not with the same height.
-        2. There's a box with the same size. If there's only one, we should remove the node from the tree.
-     */
-    new_node = create_main_tree_node(side * side, compare_keys);
-    if (NULL == new_node) {
-        return false;
+    if (NULL != factory->flat_index) {
+        return box_flat_remove(factory->flat_index, side_square, height, 1);
     }
 
-    /* First, search in the main tree (tree by side) */
-    side_tree_node = rb_tree_search(factory->tree_by_side, new_node);
+    return range_tree_remove(factory->index_by_volume, side_square, height);
+}
 
-    if (NULL == side_tree_node) {
-        /* Case 1.1 */
-        free_main_tree_node(new_node);
-        return false;
-    }
-    free_main_tree_node(new_node);
+static void box_factory_index_shrink(box_factory_t *factory)
+{
+    box_flat_t *flat = NULL;
+    range_tree_t *empty = NULL;
 
-    new_key = create_box_key(height);
-    if (NULL == new_key) {
-        return false;
+    if ((NULL != factory->flat_index) || (range_tree_count(factory->index_by_volume) > BOX_FACTORY_FLAT_MIN)) {
+        return;
     }
 
-    subtree_key = rb_tree_search(side_tree_node->subtree, new_key);
-    if (NULL == subtree_key) {
-        /* Case 1.2 */
-        free(new_key);
-        return false;
+    flat = box_flat_create();
+    if (NULL == flat) {
+        return;
     }
 
-    /* Case 2 */
-    /* Remove the node from the subtree */
-    assert(rb_tree_remove(side_tree_node->subtree, new_key, (void **) &subtree_key));
-    if (subtree_key) {
-        /* There's no more of the same side and height in the tree, free the key */
-        free(subtree_key);
+    empty = range_tree_create(factory->pool);
+    if ((NULL == empty) || !box_factory_for_each_run(factory, false, box_factory_flat_insert_run, flat)) {
+        if (NULL != empty) {
+            range_tree_destroy(empty);
+        }
+        box_flat_destroy(flat);
+        return;
     }
 
-    /* The subtree has been emptied, so the node should be completely removed */
-    if (side_tree_node->subtree->count == 0) {
-        assert(rb_tree_remove(factory->tree_by_side, side_tree_node, (void **) &deleted_side_tree_node));
-        /* This must be the same node. */
-        assert(deleted_side_tree_node == side_tree_node);
-        free_main_tree_node(deleted_side_tree_node);
-    }
-    free(new_key);
-    return true;
+    range_tree_destroy(factory->index_by_volume);
+    factory->index_by_volume = empty;
+    factory->flat_index = flat;
 }
 
-static bool box_factory_remove_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height)
+static int box_factory_compare_runs(const void *a, const void *b)
 {
-    box_main_tree_node_t *new_node = NULL;
-    box_main_tree_node_t *height_tree_node = NULL;
-    box_main_tree_node_t *deleted_height_tree_node = NULL;
-    box_key_t *new_key = NULL;
-    box_key_t *subtree_key = NULL;
+    const range_tree_point_t *run_a = a;
+    const range_tree_point_t *run_b = b;
 
-    /* When trying to remove a node from this tree, the following cases may occur:
-        1. There's no box with that size, which either means:
-            1.1. There's no box with the same height.
-            1.2. There's a box with the same height but not with the same side.
-        2. There's a box with the same size. If there's only one, we should remove the node from the tree.
-     */
-    new_node = create_main_tree_node(height, compare_keys);
-    if (NULL == new_node) {
-        return false;
+    if (run_a->x != run_b->x) {
+        return (run_a->x > run_b->x) - (run_a->x < run_b->x);
     }
 
-    /* First, search in the main tree (tree by side) */
-    height_tree_node = rb_tree_search(factory->tree_by_height, new_node);
+    return (run_a->y > run_b->y) - (run_a->y < run_b->y);
+}
 
-    if (NULL == height_tree_node) {
-        /* Case 1.1 */
-        free_main_tree_node(new_node);
-        return false;
+static bool box_factory_check_runs(const range_tree_point_t *runs, unsigned long long count)
+{
+    unsigned long long i = 0;
+
+    for (i = 0; i < count; i++) {
+        if ((runs[i].count == 0) ||
+            ((i > 0) && ((runs[i].x < runs[i - 1].x) || ((runs[i].x == runs[i - 1].x) && (runs[i].y <= runs[i - 1].y))))) {
+            return false;
+        }
     }
-    free_main_tree_node(new_node);
 
-    new_key = create_box_key(side * side);
-    if (NULL == new_key) {
-        return false;
+    return true;
+}
+
+static bool box_factory_same_boxes(const range_tree_point_t *side_runs, const range_tree_point_t *height_runs, unsigned long long count)
+{
+    range_tree_point_t *transposed = NULL;
+    unsigned long long i = 0;
+    bool same = true;
+
+    if (count == 0) {
+        return true;
     }
 
-    subtree_key = rb_tree_search(height_tree_node->subtree, new_key);
-    if (NULL == subtree_key) {
-        /* Case 1.2 */
-        free(new_key);
+    transposed = malloc(count * sizeof(range_tree_point_t));
+    if (NULL == transposed) {
         return false;
     }
+    for (i = 0; i < count; i++) {
+        transposed[i].x = height_runs[i].y;
+        transposed[i].y = height_runs[i].x;
+        transposed[i].count = height_runs[i].count;
+    }
+    qsort(transposed, count, sizeof(range_tree_point_t), box_factory_compare_runs);
 
-    /* Case 2 */
-    /* Remove the node from the subtree */
-    assert(rb_tree_remove(height_tree_node->subtree, new_key, (void **) &subtree_key));
-    if (subtree_key) {
-        /* There's no more of the same height and side in the tree, free the key */
-        free(subtree_key);
+    for (i = 0; same && (i < count); i++) {
+        same = (transposed[i].x == side_runs[i].x) && (transposed[i].y == side_runs[i].y) && (transposed[i].count == side_runs[i].count);
     }
+    free(transposed);
+
+    return same;
+}
 
-    /* The subtree has been emptied, so the node should be completely removed */
-    if (height_tree_node->subtree->count == 0) {
-        assert(rb_tree_remove(factory->tree_by_height, height_tree_node, (void **) &deleted_height_tree_node));
-        /* This must be the same node. */
-        assert(deleted_height_tree_node == height_tree_node);
-        free_main_tree_node(deleted_height_tree_node);
+void box_factory_destroy(box_factory_t *factory)
+{
+    unsigned int op = 0;
+
+    /* All of the trees, nodes and keys are in the pool. The snapshots are not, and those that are
+       still referenced by readers outlive the factory. */
+    box_snapshot_release(factory->snapshot);
+    pthread_mutex_destroy(&(factory->snapshot_lock));
+    if (NULL != factory->flat_index) {
+        box_flat_destroy(factory->flat_index);
     }
-    free(new_key);
-    return true;
+    pool_destroy(factory->pool);
+    for (op = 0; op < BOX_FACTORY_OPS; op++) {
+        op_stats_free(&(factory->stats[op]));
+    }
+    free(factory);
 }
 
-static box_key_t* create_box_key(unsigned int subval)
+bool box_factory_reset(box_factory_t *factory)
 {
-    box_key_t *key = calloc(sizeof(box_key_t), 1);
-    if (NULL == key) {
-        return NULL;
+    box_snapshot_t *empty = NULL;
+
+    if (NULL != factory->snapshot) {
+        empty = box_snapshot_create(NULL);
+        if (NULL == empty) {
+            return false;
+        }
+        box_factory_publish(factory, empty);
     }
 
-    key->val = subval;
+    if (NULL != factory->flat_index) {
+        box_flat_destroy(factory->flat_index);
+        factory->flat_index = NULL;
+    }
+    pool_reset(factory->pool);
 
-    return key;
+    return box_factory_create_trees(factory);
 }
 
-static box_main_tree_node_t* create_main_tree_node(unsigned int main_val, rb_tree_key_cmp_t key_cmp)
+static bool box_factory_create_trees(box_factory_t *factory)
 {
-    box_main_tree_node_t *node = calloc(sizeof(box_main_tree_node_t), 1);
-    rb_tree_t *subtree = NULL;
-
-    if (NULL == node) {
-        return NULL;
+    /* The flat array isn't in the pool, so it's always destroyed by box_factory_destroy */
+    factory->index_by_volume = range_tree_create(factory->pool);
+    factory->flat_index = box_flat_create();
+    if (NULL == factory->flat_index) {
+        return false;
     }
 
-    node->val = main_val;
-
-    subtree = rb_tree_create((rb_tree_key_cmp_t) compare_keys);
-    if (NULL == subtree) {
-        free(node);
-        return NULL;
+    /* On a failure, whatever was allocated is released along with the pool */
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        factory->bp_tree_by_side = bp_tree_create(factory->pool);
+        factory->bp_tree_by_height = bp_tree_create(factory->pool);
+        return (NULL != factory->bp_tree_by_side) && (NULL != factory->bp_tree_by_height) && (NULL != factory->index_by_volume);
     }
-    node->subtree = subtree;
 
-    return node;
+    factory->tree_by_side = box_main_tree_create(factory->pool);
+    factory->tree_by_height = box_main_tree_create(factory->pool);
+    return (NULL != factory->tree_by_side) && (NULL != factory->tree_by_height) && (NULL != factory->index_by_volume);
 }
 
-static void free_main_tree_node(box_main_tree_node_t *node)
+bool box_factory_insert(box_factory_t *factory, unsigned int side, unsigned int height)
 {
-    /* XXX: We assume that the subtree is empty */
-    free(node->subtree);
-    free(node);
+    op_stats_token_t token;
+    bool result = false;
+
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_INSERT]), &token);
+    result = box_factory_do_insert(factory, side, height);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_INSERT]), &token);
+
+    return result;
 }
 
-static int compare_nodes(void *a, void *b)
+bool box_factory_remove(box_factory_t *factory, unsigned int side, unsigned int height)
 {
-    /* Compare nodes of the tree_by_side */
-    box_main_tree_node_t *node_a = a;
-    box_main_tree_node_t *node_b = b;
+    op_stats_token_t token;
+    bool result = false;
 
-    if (node_a->val < node_b->val) {
-        return -1;
-    }
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_REMOVE]), &token);
+    result = box_factory_do_remove(factory, side, height);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_REMOVE]), &token);
 
-    if (node_a->val > node_b->val) {
-        return 1;
-    }
+    return result;
+}
+
+bool box_factory_take_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    op_stats_token_t token;
+    bool result = false;
+
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_TAKE_BOX]), &token);
+    result = box_factory_do_take_box(factory, side, height, found_side_square, found_height);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_TAKE_BOX]), &token);
 
-    /* The sides of the two nodes are equal */
-    return 0;
+    return result;
 }
 
-static int compare_keys(void *a, void *b)
+bool box_factory_insert_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count)
 {
-    /* Compare nodes of the subtree of a node in tree_by_height */
-    box_key_t *key_a = a;
-    box_key_t *key_b = b;
+    op_stats_token_t token;
+    bool result = false;
 
-    if (key_a->val < key_b->val) {
-        return -1;
-    }
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_INSERT_BATCH]), &token);
+    result = box_factory_do_insert_batch(factory, boxes, count);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_INSERT_BATCH]), &token);
 
-    if (key_a->val > key_b->val) {
-        return 1;
-    }
+    return result;
+}
+
+size_t box_factory_remove_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count)
+{
+    op_stats_token_t token;
+    size_t removed = 0;
+
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_REMOVE_BATCH]), &token);
+    removed = box_factory_do_remove_batch(factory, boxes, count);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_REMOVE_BATCH]), &token);
 
-    /* The sides of the two keys are equal */
-    return 0;
+    return removed;
 }
 
-static rb_tree_t * get_sub_tree(rb_tree_node_t *main_tree_node)
+bool box_factory_get_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
 {
-    box_main_tree_node_t *main_tree_key = NULL;
+    op_stats_token_t token;
+    bool result = false;
+
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_GET_BOX]), &token);
+    result = box_factory_do_get_box(factory, side, height, found_side_square, found_height);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_GET_BOX]), &token);
 
-    assert(main_tree_node);
+    return result;
+}
 
-    main_tree_key = (box_main_tree_node_t *) main_tree_node->key;
+size_t box_factory_get_boxes_k(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_fit_t *fits, size_t k)
+{
+    op_stats_token_t token;
+    size_t result = 0;
 
-    assert(main_tree_key);
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_GET_BOXES_K]), &token);
+    result = box_factory_do_get_boxes_k(factory, side, height, BOX_FACTORY_FIT_VOLUME, fits, k);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_GET_BOXES_K]), &token);
 
-    return main_tree_key->subtree;
+    return result;
 }
 
-static unsigned int get_sub_tree_max(rb_tree_node_t *main_tree_node)
+size_t box_factory_get_boxes_k_by(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_objective_t objective, box_factory_fit_t *fits, size_t k)
 {
-    box_main_tree_node_t *main_tree_key = NULL;
-    rb_tree_node_t *max_node = NULL;
-    box_key_t *max_key = NULL;
-    rb_tree_t *tree = NULL;
+    op_stats_token_t token;
+    size_t result = 0;
 
-    main_tree_key = (box_main_tree_node_t *) main_tree_node->key;
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_GET_BOXES_K]), &token);
+    result = box_factory_do_get_boxes_k(factory, side, height, objective, fits, k);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_GET_BOXES_K]), &token);
 
-    assert(main_tree_key);
+    return result;
+}
 
-    tree = main_tree_key->subtree;
-    max_node = tree->max;
+bool box_factory_get_box_by(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_objective_t objective, unsigned int *found_side_square, unsigned int *found_height)
+{
+    op_stats_token_t token;
+    box_factory_fit_t fit;
+    bool result = false;
+
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_GET_BOX]), &token);
+    if (objective == BOX_FACTORY_FIT_VOLUME) {
+        /* The index answers the default objective within its bound */
+        result = box_factory_do_get_box(factory, side, height, found_side_square, found_height);
+    } else if (box_factory_do_get_boxes_k(factory, side, height, objective, &fit, 1) > 0) {
+        *found_side_square = fit.side_square;
+        *found_height = fit.height;
+        result = true;
+    }
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_GET_BOX]), &token);
 
-    /* We assume that there are nodes in the tree */
-    assert(max_node);
-    assert(max_node != &(tree->nil));
+    return result;
+}
 
-    max_key = (box_key_t *) max_node->key;
+bool box_factory_check_box(box_factory_t *factory, unsigned int side, unsigned int height)
+{
+    op_stats_token_t token;
+    bool result = false;
 
-    assert(max_key);
+    op_stats_begin(&(factory->stats[BOX_FACTORY_OP_CHECK_BOX]), &token);
+    result = box_factory_do_check_box(factory, side, height);
+    op_stats_end(&(factory->stats[BOX_FACTORY_OP_CHECK_BOX]), &token);
 
-    return max_key->val;
+    return result;
 }
 
-static unsigned int get_main_tree_node_val(rb_tree_node_t *main_tree_node)
+bool box_factory_stats(box_factory_t *factory, box_factory_stats_t *stats, bool reset)
 {
-    box_main_tree_node_t *main_tree_key = (box_main_tree_node_t *) main_tree_node->key;
+    unsigned int op = 0;
 
-    return main_tree_key->val;
+    if (!OP_STATS_ENABLED) {
+        return false;
+    }
+
+    for (op = 0; op < BOX_FACTORY_OPS; op++) {
+        op_stats_read(&(factory->stats[op]), (NULL == stats) ? NULL : &(stats->ops[op]), reset);
+    }
+
+    return true;
 }
 
-static unsigned int get_sub_tree_node_val(rb_tree_node_t *sub_tree_node)
+bool box_factory_shape(box_factory_t *factory, box_factory_shape_t *shape)
 {
-    box_key_t *sub_tree_key = (box_key_t *) sub_tree_node->key;
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        return false;
+    }
+
+    box_factory_tree_shape(factory->tree_by_side, &(shape->by_side));
+    box_factory_tree_shape(factory->tree_by_height, &(shape->by_height));
+    shape->pool_bytes = factory->pool->allocated;
+
+    return true;
+}
+
+static void box_factory_tree_shape(box_main_tree_t *tree, box_factory_tree_shape_t *shape)
+{
+    box_main_tree_node_t *main_node = NULL;
+    rb_tree_shape_t subtree_shape;
+
+    memset(shape, 0, sizeof(*shape));
+    box_main_tree_shape(tree, &(shape->main));
+
+    for (main_node = box_main_tree_search_smallest(tree, 0); NULL != main_node; main_node = box_main_tree_successor(tree, main_node)) {
+        shape->subtree_values += main_node->subtree.size;
+        /* A main node is deleted along with its last box, so its subtree is never empty */
+        shape->subtree_sizes[31 - __builtin_clz(main_node->subtree.size)]++;
+
+        if (!main_node->subtree.is_tree) {
+            continue;
+        }
+        box_subtree_shape(&(main_node->subtree), &subtree_shape);
+        shape->subtree_trees++;
+        shape->subtree_nodes += subtree_shape.nodes;
+        shape->subtree_node_bytes += subtree_shape.node_bytes + subtree_shape.header_bytes;
+        if (subtree_shape.height > shape->subtree_max_height) {
+            shape->subtree_max_height = subtree_shape.height;
+        }
+    }
+
+    shape->subtree_header_bytes = shape->main.nodes * sizeof(box_subtree_t);
+    shape->key_bytes = (shape->main.nodes + shape->subtree_values) * 2 * sizeof(unsigned int);
+}
+
+static bool box_factory_do_insert(box_factory_t *factory, unsigned int side, unsigned int height)
+{
+    box_snapshot_t *next = NULL;
+    bool exists = false;
+    bool exists_by_height = false;
+    bool deleted = false;
+    bool removed = false;
+
+    /* The next version is made first, so that it's simply dropped if anything else fails */
+    if (NULL != factory->snapshot) {
+        next = box_factory_next_snapshot(factory, side * side, height, 1);
+        if (NULL == next) {
+            return false;
+        }
+    }
+
+    if (false == box_factory_insert_tree_by_side(factory, side, height, &exists)) {
+        box_snapshot_release(next);
+        return false;
+    }
+
+    if (false == box_factory_insert_tree_by_height(factory, side, height, &exists_by_height)) {
+        removed = box_factory_remove_tree_by_side(factory, side, height, &deleted);
+        assert(removed);
+        (void) removed;
+        box_snapshot_release(next);
+        return false;
+    }
+
+    /* The volume index holds each distinct box once, so another instance of an existing box
+       doesn't change it */
+    if (!exists) {
+        if (false == box_factory_index_insert(factory, side * side, height)) {
+            removed = box_factory_remove_tree_by_side(factory, side, height, &deleted);
+            assert(removed);
+            removed = box_factory_remove_tree_by_height(factory, side, height, &deleted);
+            assert(removed);
+            (void) removed;
+            box_snapshot_release(next);
+            return false;
+        }
+        box_factory_index_shrink(factory);
+    }
+
+    if (NULL != next) {
+        box_factory_publish(factory, next);
+    }
+
+    return true;
+}
+
+static bool box_factory_do_remove(box_factory_t *factory, unsigned int side, unsigned int height)
+{
+    persistent_tree_node_t *main_key = NULL;
+    box_snapshot_t *next = NULL;
+    bool deleted = false;
+    bool deleted_by_height = false;
+    bool removed = false;
+
+    if (NULL != factory->snapshot) {
+        /* The current version has the same boxes as the trees, and tells if the box exists before
+           a version without it is made */
+        main_key = persistent_tree_search(factory->snapshot->by_side, side * side);
+        if ((NULL == main_key) || (NULL == persistent_tree_search(main_key->child, height))) {
+            return false;
+        }
+
+        next = box_factory_next_snapshot(factory, side * side, height, -1);
+        if (NULL == next) {
+            return false;
+        }
+    }
+
+    if (false == box_factory_remove_tree_by_side(factory, side, height, &deleted)) {
+        box_snapshot_release(next);
+        return false;
+    }
+
+    /* Both trees hold the same boxes, so we must be able to remove it from the tree by height too,
+       and from the index once its last instance is removed.
+     */
+    removed = box_factory_remove_tree_by_height(factory, side, height, &deleted_by_height);
+    assert(removed && (deleted_by_height == deleted));
+    if (deleted) {
+        removed = box_factory_index_remove(factory, side * side, height);
+        assert(removed);
+        (void) removed;
+        box_factory_index_shrink(factory);
+    }
+
+    if (NULL != next) {
+        box_factory_publish(factory, next);
+    }
+
+    return true;
+}
+
+static bool box_factory_do_take_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    box_tree_position_t side_position;
+    box_tree_position_t height_position;
+    unsigned int side_square = 0;
+    unsigned int box_height = 0;
+    box_snapshot_t *next = NULL;
+    bool deleted = false;
+    bool deleted_by_height = false;
+    bool removed = false;
+
+    /* The index answers without visiting the main trees, so each of them is descended only once
+       below, to the box's position, which its removal then uses in place */
+    if (false == box_factory_do_get_box(factory, side, height, &side_square, &box_height)) {
+        return false;
+    }
+    *found_side_square = side_square;
+    *found_height = box_height;
+
+    /* Unlike box_factory_remove, the box is known to exist in all of the trees and in the current
+       version, so nothing is searched before it is removed */
+    if (NULL != factory->snapshot) {
+        next = box_factory_next_snapshot(factory, side_square, box_height, -1);
+        if (NULL == next) {
+            return false;
+        }
+    }
+
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        /* The count of a B+tree's main key is only changed by a descent of bp_tree_remove */
+        removed = box_factory_remove_from_bp_tree(factory->bp_tree_by_side, side_square, box_height, &deleted);
+        assert(removed);
+        removed = box_factory_remove_from_bp_tree(factory->bp_tree_by_height, box_height, side_square, &deleted_by_height);
+        assert(removed && (deleted_by_height == deleted));
+    } else {
+        removed = box_factory_locate(factory->tree_by_side, side_square, box_height, &side_position) &&
+                  box_factory_locate(factory->tree_by_height, box_height, side_square, &height_position);
+        assert(removed);
+        box_factory_remove_at(factory->tree_by_side, &side_position, &deleted);
+        box_factory_remove_at(factory->tree_by_height, &height_position, &deleted_by_height);
+        assert(deleted_by_height == deleted);
+    }
+    if (deleted) {
+        removed = box_factory_index_remove(factory, side_square, box_height);
+        assert(removed);
+        box_factory_index_shrink(factory);
+    }
+    (void) removed;
+    (void) deleted_by_height;
+
+    if (NULL != next) {
+        box_factory_publish(factory, next);
+    }
+
+    return true;
+}
+
+static bool box_factory_do_insert_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count)
+{
+    unsigned long long *side_keys = NULL;
+    unsigned long long *height_keys = NULL;
+    unsigned int *side_counts = NULL;
+    unsigned int *height_counts = NULL;
+    bool *is_new = NULL;
+    size_t side_unique = 0;
+    size_t height_unique = 0;
+    size_t i = 0;
+    bool removed = false;
+    bool result = false;
+
+    if ((factory->backend == BOX_FACTORY_BP_TREE) || (NULL != factory->snapshot)) {
+        /* The B+trees count a single box per insertion, and every box makes a version of the
+           snapshots, so the batch is inserted box by box */
+        for (i = 0; i < count; i++) {
+            if (false == box_factory_do_insert(factory, boxes[i].side, boxes[i].height)) {
+                while (i-- > 0) {
+                    removed = box_factory_do_remove(factory, boxes[i].side, boxes[i].height);
+                    assert(removed);
+                    (void) removed;
+                }
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    side_keys = malloc(count * sizeof(unsigned long long));
+    height_keys = malloc(count * sizeof(unsigned long long));
+    side_counts = malloc(count * sizeof(unsigned int));
+    height_counts = malloc(count * sizeof(unsigned int));
+    is_new = malloc(count * sizeof(bool));
+    if ((NULL == side_keys) || (NULL == height_keys) || (NULL == side_counts) || (NULL == height_counts) || (NULL == is_new)) {
+        goto cleanup;
+    }
+
+    /* Both orders are sorted up front, so that nothing is left to fail once the trees change but
+       the insertions themselves */
+    side_unique = box_factory_sort_boxes(boxes, count, false, side_keys, side_counts, 0);
+    height_unique = box_factory_sort_boxes(boxes, count, true, height_keys, height_counts, 0);
+    if ((side_unique == 0) || (height_unique == 0)) {
+        goto cleanup;
+    }
+
+    if (false == box_factory_insert_keys_to_tree(factory, factory->tree_by_side, side_keys, side_counts, side_unique, is_new)) {
+        goto cleanup;
+    }
+
+    /* Only the new boxes go to the volume index, whose points are the keys by side */
+    for (i = 0; i < side_unique; i++) {
+        if (is_new[i] && (false == box_factory_index_insert(factory, BOX_KEY_MAIN(side_keys[i]), BOX_KEY_SUB(side_keys[i])))) {
+            break;
+        }
+    }
+
+    if ((i < side_unique) ||
+        (false == box_factory_insert_keys_to_tree(factory, factory->tree_by_height, height_keys, height_counts, height_unique, NULL))) {
+        while (i-- > 0) {
+            if (is_new[i]) {
+                removed = box_factory_index_remove(factory, BOX_KEY_MAIN(side_keys[i]), BOX_KEY_SUB(side_keys[i]));
+                assert(removed);
+                (void) removed;
+            }
+        }
+        box_factory_remove_keys_from_tree(factory->tree_by_side, side_keys, side_counts, side_unique, NULL);
+        goto cleanup;
+    }
+    box_factory_index_shrink(factory);
+
+    result = true;
+
+cleanup:
+    free(side_keys);
+    free(height_keys);
+    free(side_counts);
+    free(height_counts);
+    free(is_new);
+    return result;
+}
+
+static size_t box_factory_do_remove_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count)
+{
+    unsigned long long *side_keys = NULL;
+    unsigned long long *height_keys = NULL;
+    unsigned int *side_counts = NULL;
+    unsigned int *height_counts = NULL;
+    bool *deleted = NULL;
+    size_t side_unique = 0;
+    size_t height_unique = 0;
+    size_t removed = 0;
+    size_t height_removed = 0;
+    size_t i = 0;
+    bool index_removed = false;
+
+    if ((factory->backend == BOX_FACTORY_RB_TREE) && (NULL == factory->snapshot) && (count > 0)) {
+        side_keys = malloc(count * sizeof(unsigned long long));
+        height_keys = malloc(count * sizeof(unsigned long long));
+        side_counts = malloc(count * sizeof(unsigned int));
+        height_counts = malloc(count * sizeof(unsigned int));
+        deleted = malloc(count * sizeof(bool));
+        if ((NULL != side_keys) && (NULL != height_keys) && (NULL != side_counts) && (NULL != height_counts) && (NULL != deleted)) {
+            side_unique = box_factory_sort_boxes(boxes, count, false, side_keys, side_counts, 0);
+            height_unique = box_factory_sort_boxes(boxes, count, true, height_keys, height_counts, 0);
+        }
+    }
+
+    if ((side_unique == 0) || (height_unique == 0)) {
+        /* Removals don't allocate, so the batch can always be removed box by box */
+        for (i = 0; i < count; i++) {
+            if (box_factory_do_remove(factory, boxes[i].side, boxes[i].height)) {
+                removed++;
+            }
+        }
+        goto cleanup;
+    }
+
+    /* Both trees hold the same boxes with the same counts, so the same number of each is removed
+       from them, and the boxes whose last instance is removed are removed from the volume index */
+    removed = box_factory_remove_keys_from_tree(factory->tree_by_side, side_keys, side_counts, side_unique, deleted);
+    height_removed = box_factory_remove_keys_from_tree(factory->tree_by_height, height_keys, height_counts, height_unique, NULL);
+    assert(height_removed == removed);
+    (void) height_removed;
+
+    for (i = 0; i < side_unique; i++) {
+        if (deleted[i]) {
+            index_removed = box_factory_index_remove(factory, BOX_KEY_MAIN(side_keys[i]), BOX_KEY_SUB(side_keys[i]));
+            assert(index_removed);
+            (void) index_removed;
+        }
+    }
+    box_factory_index_shrink(factory);
+
+cleanup:
+    free(side_keys);
+    free(height_keys);
+    free(side_counts);
+    free(height_counts);
+    free(deleted);
+    return removed;
+}
+
+static bool box_factory_do_get_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    if (NULL != factory->flat_index) {
+        return box_flat_search_min(factory->flat_index, side * side, height, found_side_square, found_height);
+    }
+
+    return range_tree_search_min(factory->index_by_volume, side * side, height, found_side_square, found_height);
+}
+
+static size_t box_factory_do_get_boxes_k(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_objective_t objective, box_factory_fit_t *fits, size_t k)
+{
+    box_fit_query_t query = {.side_square = side * side, .height = height};
+
+    switch (objective) {
+    case BOX_FACTORY_FIT_HEIGHT:
+        return box_fit_scan_height(factory, &query, fits, k);
+    case BOX_FACTORY_FIT_SIDE:
+        return box_fit_scan_side(factory, &query, fits, k);
+    case BOX_FACTORY_FIT_WASTE:
+        return box_fit_scan_waste(factory, &query, fits, k);
+    default:
+        return box_fit_scan_volume(factory, &query, fits, k);
+    }
+}
+
+static inline bool box_fit_worse_volume(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query)
+{
+    unsigned long long a_volume = (unsigned long long) a_side_square * a_height;
+    unsigned long long b_volume = (unsigned long long) b_side_square * b_height;
+
+    (void) query;
+    return (a_volume > b_volume) || ((a_volume == b_volume) && (a_side_square > b_side_square));
+}
+
+static inline bool box_fit_worse_height(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query)
+{
+    (void) query;
+    return (a_height > b_height) || ((a_height == b_height) && (a_side_square > b_side_square));
+}
+
+static inline bool box_fit_worse_side(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query)
+{
+    (void) query;
+    return (a_side_square > b_side_square) || ((a_side_square == b_side_square) && (a_height > b_height));
+}
+
+static inline bool box_fit_worse_waste(unsigned int a_side_square, unsigned int a_height, unsigned int b_side_square, unsigned int b_height, const box_fit_query_t *query)
+{
+    unsigned long long a_numerator = 0;
+    unsigned long long a_denominator = 0;
+    unsigned long long b_numerator = 0;
+    unsigned long long b_denominator = 0;
+
+    box_fit_excess(a_side_square, a_height, query, &a_numerator, &a_denominator);
+    box_fit_excess(b_side_square, b_height, query, &b_numerator, &b_denominator);
+
+    /* Both fractions are of 32 bit values, so their cross products can't overflow */
+    if (a_numerator * b_denominator != b_numerator * a_denominator) {
+        return a_numerator * b_denominator > b_numerator * a_denominator;
+    }
+    return box_fit_worse_volume(a_side_square, a_height, b_side_square, b_height, query);
+}
+
+static inline void box_fit_excess(unsigned int side_square, unsigned int height, const box_fit_query_t *query, unsigned long long *numerator, unsigned long long *denominator)
+{
+    /* An empty dimension of the query is taken as 1, so any excess over it counts in full */
+    unsigned long long side_numerator = side_square - query->side_square;
+    unsigned long long side_denominator = (query->side_square > 0) ? query->side_square : 1;
+    unsigned long long height_numerator = height - query->height;
+    unsigned long long height_denominator = (query->height > 0) ? query->height : 1;
+
+    if (side_numerator * height_denominator >= height_numerator * side_denominator) {
+        *numerator = side_numerator;
+        *denominator = side_denominator;
+    } else {
+        *numerator = height_numerator;
+        *denominator = height_denominator;
+    }
+}
+
+static bool box_factory_do_check_box(box_factory_t *factory, unsigned int side, unsigned int height)
+{
+    if (NULL != factory->flat_index) {
+        return box_flat_has_dominating(factory->flat_index, side * side, height);
+    }
+
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        /* The B+trees keep the max subtree value of every branch, just like branch_max */
+        if (factory->bp_tree_by_height->count > factory->bp_tree_by_side->count) {
+            return bp_tree_has_dominating(factory->bp_tree_by_side, side * side, height);
+        }
+        return bp_tree_has_dominating(factory->bp_tree_by_height, height, side * side);
+    }
+
+    if (factory->tree_by_height->count > factory->tree_by_side->count){
+        return box_factory_check_by_input(factory->tree_by_side, side * side, height);
+    }
+    return box_factory_check_by_input(factory->tree_by_height, height, side * side);
+}
+
+void box_factory_get_box_batch(box_factory_t *factory, const box_factory_box_t *queries, size_t count, box_factory_get_result_t *results, unsigned int threads)
+{
+    box_factory_query_batch_t batch = {.factory = factory, .queries = queries, .get_results = results};
+
+    box_factory_query_batch(&batch, count, threads);
+}
+
+void box_factory_check_box_batch(box_factory_t *factory, const box_factory_box_t *queries, size_t count, bool *results, unsigned int threads)
+{
+    box_factory_query_batch_t batch = {.factory = factory, .queries = queries, .check_results = results};
+
+    box_factory_query_batch(&batch, count, threads);
+}
+
+bool box_factory_enable_snapshots(box_factory_t *factory)
+{
+    persistent_tree_node_t *by_side = NULL;
+    box_snapshot_t *snapshot = NULL;
+
+    if (NULL != factory->snapshot) {
+        return true;
+    }
+
+    if (false == box_factory_copy_boxes(factory, &by_side)) {
+        return false;
+    }
+
+    snapshot = box_snapshot_create(by_side);
+    if (NULL == snapshot) {
+        return false;
+    }
+
+    box_factory_publish(factory, snapshot);
+    return true;
+}
+
+box_snapshot_t* box_factory_snapshot(box_factory_t *factory)
+{
+    box_snapshot_t *snapshot = NULL;
+
+    /* The lock makes sure that the writer doesn't release the version between reading the pointer
+       and taking the reference */
+    pthread_mutex_lock(&(factory->snapshot_lock));
+    snapshot = factory->snapshot;
+    if (NULL != snapshot) {
+        __atomic_add_fetch(&(snapshot->refs), 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&(factory->snapshot_lock));
+
+    return snapshot;
+}
+
+void box_snapshot_release(box_snapshot_t *snapshot)
+{
+    if ((NULL != snapshot) && (0 == __atomic_sub_fetch(&(snapshot->refs), 1, __ATOMIC_ACQ_REL))) {
+        persistent_tree_release(snapshot->by_side);
+        free(snapshot);
+    }
+}
+
+bool box_snapshot_get_box(box_snapshot_t *snapshot, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    bool found = false;
+
+    box_snapshot_search(snapshot->by_side, side * side, height, &found, found_side_square, found_height);
+    return found;
+}
+
+bool box_snapshot_check_box(box_snapshot_t *snapshot, unsigned int side, unsigned int height)
+{
+    return persistent_tree_has_dominating(snapshot->by_side, side * side, height);
+}
+
+static bool box_factory_check_by_input(box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val)
+{
+    box_main_tree_node_t *node = tree->head;
+
+    /* A single descent: whenever a node's value is large enough, the node itself and its entire
+       right branch are candidates, and the augmented branch_max tells whether one of them fits.
+       Otherwise, only the left branch might still contain a fitting box.
+     */
+    while (!box_main_tree_is_nil(tree, node)) {
+        if (node->key < main_val) {
+            node = node->right;
+            continue;
+        }
+
+        if (box_subtree_max(&(node->subtree)) >= sub_val) {
+            return true;
+        }
+
+        if (!box_main_tree_is_nil(tree, node->right) && (node->right->branch_max >= sub_val)) {
+            return true;
+        }
+
+        node = node->left;
+    }
+
+    return false;
+}
+
+static bool box_factory_insert_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height, bool *exists)
+{
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        return box_factory_insert_to_bp_tree(factory, factory->bp_tree_by_side, side * side, height, exists);
+    }
+    return box_factory_insert_to_tree(factory, factory->tree_by_side, side * side, height, exists);
+}
+
+static bool box_factory_insert_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height, bool *exists)
+{
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        return box_factory_insert_to_bp_tree(factory, factory->bp_tree_by_height, height, side * side, exists);
+    }
+    return box_factory_insert_to_tree(factory, factory->tree_by_height, height, side * side, exists);
+}
+
+static bool box_factory_remove_tree_by_side(box_factory_t *factory, unsigned int side, unsigned int height, bool *deleted)
+{
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        return box_factory_remove_from_bp_tree(factory->bp_tree_by_side, side * side, height, deleted);
+    }
+    return box_factory_remove_from_tree(factory->tree_by_side, side * side, height, deleted);
+}
+
+static bool box_factory_remove_tree_by_height(box_factory_t *factory, unsigned int side, unsigned int height, bool *deleted)
+{
+    if (factory->backend == BOX_FACTORY_BP_TREE) {
+        return box_factory_remove_from_bp_tree(factory->bp_tree_by_height, height, side * side, deleted);
+    }
+    return box_factory_remove_from_tree(factory->tree_by_height, height, side * side, deleted);
+}
+
+static bool box_factory_insert_to_tree(box_factory_t *factory, box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *exists)
+{
+    box_main_tree_node_t *main_node = NULL;
+    bool inserted = false;
+
+    /* When trying to insert a new box to a main tree, one of the following will cases occur:
+         1. There's no box with the same main value (side or height), so it is not found in the tree.
+         2. There's a box with the same main value, but not with the same sub value.
+         3. There's a box with the same main value and with the same sub value.
+       The searches are by value, so nothing is allocated unless a node is actually added.
+     */
+    main_node = box_main_tree_search(tree, main_val);
+
+    /* Case 1 - there's no box with the same main value */
+    if (NULL == main_node) {
+        main_node = box_main_tree_create_node(tree, main_val);
+        if (NULL == main_node) {
+            return false;
+        }
+        box_subtree_init(&(main_node->subtree));
+
+        /* Insert to the subtree - this must be a new value, which goes inline. */
+        OP_STATS_COUNT(subtree_searches);
+        inserted = box_subtree_insert(&(main_node->subtree), factory->pool, sub_val, 1, exists);
+        assert(inserted);
+        assert(*exists == false);
+        (void) inserted;
+
+        /* The subtree is complete before the node is inserted to the main tree, so that the
+           augmentation computes its branch max right away. */
+        box_main_tree_insert_node(tree, main_node);
+        return true;
+    }
+
+    /* Now box_subtree_insert should take care of cases 2 & 3. */
+    OP_STATS_COUNT(subtree_searches);
+    if (false == box_subtree_insert(&(main_node->subtree), factory->pool, sub_val, 1, exists)) {
+        return false;
+    }
+
+    /* In case 2, the subtree max might have changed */
+    if (!*exists) {
+        box_main_tree_augment_update(tree, main_node);
+    }
+
+    return true;
+}
+
+static bool box_factory_remove_from_tree(box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *deleted)
+{
+    box_tree_position_t position;
+
+    *deleted = false;
+
+    /* When trying to remove a box from a main tree, the following cases may occur:
+        1. There's no box with that size, which either means:
+            1.1. There's no box with the same main value.
+            1.2. There's a box with the same main value but not with the same sub value.
+        2. There's a box with the same size. If there's only one, we should remove the node from the tree.
+     */
+    if (false == box_factory_locate(tree, main_val, sub_val, &position)) {
+        /* Case 1 */
+        return false;
+    }
+
+    /* Case 2 */
+    box_factory_remove_at(tree, &position, deleted);
+
+    return true;
+}
+
+static bool box_factory_locate(box_main_tree_t *tree, unsigned int main_val, unsigned int sub_val, box_tree_position_t *position)
+{
+    position->main_node = box_main_tree_search(tree, main_val);
+    if (NULL == position->main_node) {
+        return false;
+    }
+
+    OP_STATS_COUNT(subtree_searches);
+    return box_subtree_search_smallest(&(position->main_node->subtree), sub_val, &(position->sub_key)) &&
+           (box_subtree_cursor_key(&(position->sub_key)) == sub_val);
+}
+
+static void box_factory_remove_at(box_main_tree_t *tree, box_tree_position_t *position, bool *deleted)
+{
+    box_main_tree_node_t *main_node = position->main_node;
+
+    box_subtree_cursor_remove(&(position->sub_key), 1, deleted);
+    if (!*deleted) {
+        /* There are more boxes of the same size, nothing else has changed */
+        return;
+    }
+
+    if (main_node->subtree.size == 0) {
+        /* The subtree has been emptied (and holds no memory), so the node should be completely
+           removed */
+        box_main_tree_delete_node(tree, main_node);
+    } else {
+        /* The subtree max might have changed */
+        box_main_tree_augment_update(tree, main_node);
+    }
+}
+
+static bool box_factory_insert_keys_to_tree(box_factory_t *factory, box_main_tree_t *tree, unsigned long long *keys, unsigned int *counts, size_t count, bool *is_new)
+{
+    size_t group = 0;
+    size_t end = 0;
+
+    for (group = 0; group < count; group = end) {
+        for (end = group + 1; (end < count) && (BOX_KEY_MAIN(keys[end]) == BOX_KEY_MAIN(keys[group])); end++);
+
+        if (false == box_factory_insert_group(factory, tree, keys + group, counts + group, end - group, (NULL == is_new) ? NULL : is_new + group)) {
+            /* The failed group has undone itself, the ones before it are undone here */
+            box_factory_remove_keys_from_tree(tree, keys, counts, group, NULL);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool box_factory_insert_group(box_factory_t *factory, box_main_tree_t *tree, unsigned long long *keys, unsigned int *counts, size_t count, bool *is_new)
+{
+    box_main_tree_node_t *main_node = NULL;
+    unsigned int old_max = 0;
+    bool exists_in_subtree = false;
+    bool is_new_node = false;
+    size_t i = 0;
+
+    /* The same cases as in box_factory_insert_to_tree, once for the entire group */
+    main_node = box_main_tree_search(tree, BOX_KEY_MAIN(keys[0]));
+    if (NULL == main_node) {
+        main_node = box_main_tree_create_node(tree, BOX_KEY_MAIN(keys[0]));
+        if (NULL == main_node) {
+            return false;
+        }
+        box_subtree_init(&(main_node->subtree));
+        is_new_node = true;
+    } else {
+        old_max = box_subtree_max(&(main_node->subtree));
+    }
+
+    for (i = 0; i < count; i++) {
+        OP_STATS_COUNT(subtree_searches);
+        if (false == box_subtree_insert(&(main_node->subtree), factory->pool, BOX_KEY_SUB(keys[i]), counts[i], &exists_in_subtree)) {
+            /* The subtree of a new node is emptied, so it holds no memory */
+            box_subtree_remove_counts(&(main_node->subtree), keys, counts, i, NULL);
+            if (is_new_node) {
+                pool_free(factory->pool, main_node, sizeof(box_main_tree_node_t));
+            }
+            return false;
+        }
+        if (NULL != is_new) {
+            is_new[i] = !exists_in_subtree;
+        }
+    }
+
+    if (is_new_node) {
+        box_main_tree_insert_node(tree, main_node);
+    } else if (box_subtree_max(&(main_node->subtree)) != old_max) {
+        box_main_tree_augment_update(tree, main_node);
+    }
+
+    return true;
+}
+
+static size_t box_factory_remove_keys_from_tree(box_main_tree_t *tree, unsigned long long *keys, unsigned int *counts, size_t count, bool *deleted)
+{
+    box_main_tree_node_t *main_node = NULL;
+    unsigned int old_max = 0;
+    size_t removed = 0;
+    size_t group = 0;
+    size_t end = 0;
+    size_t i = 0;
+
+    for (group = 0; group < count; group = end) {
+        for (end = group + 1; (end < count) && (BOX_KEY_MAIN(keys[end]) == BOX_KEY_MAIN(keys[group])); end++);
+
+        main_node = box_main_tree_search(tree, BOX_KEY_MAIN(keys[group]));
+        if (NULL == main_node) {
+            for (i = group; i < end; i++) {
+                counts[i] = 0;
+                if (NULL != deleted) {
+                    deleted[i] = false;
+                }
+            }
+            continue;
+        }
+
+        old_max = box_subtree_max(&(main_node->subtree));
+        box_subtree_remove_counts(&(main_node->subtree), keys + group, counts + group, end - group, (NULL == deleted) ? NULL : deleted + group);
+        for (i = group; i < end; i++) {
+            removed += counts[i];
+        }
+
+        if (main_node->subtree.size == 0) {
+            box_main_tree_delete_node(tree, main_node);
+        } else if (box_subtree_max(&(main_node->subtree)) != old_max) {
+            box_main_tree_augment_update(tree, main_node);
+        }
+    }
+
+    return removed;
+}
+
+static void box_subtree_remove_counts(box_subtree_t *subtree, unsigned long long *keys, unsigned int *counts, size_t count, bool *deleted)
+{
+    bool deleted_value = false;
+    size_t i = 0;
+
+    for (i = 0; i < count; i++) {
+        OP_STATS_COUNT(subtree_searches);
+        counts[i] = box_subtree_remove(subtree, BOX_KEY_SUB(keys[i]), counts[i], &deleted_value);
+        if (NULL != deleted) {
+            deleted[i] = deleted_value;
+        }
+    }
+}
+
+static bool box_factory_insert_to_bp_tree(box_factory_t *factory, bp_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *exists)
+{
+    bp_tree_cursor_t main_key;
+    bp_tree_t *subtree = NULL;
+    bool main_exists = false;
+    bool deleted = false;
+    bool updated = false;
+
+    /* A single descent counts the box in its main key, and raises the branch maxima of the
+       subtree values on the way to it. A new main key gets an empty subtree.
+     */
+    if (false == bp_tree_insert(tree, main_val, sub_val, &main_exists, &main_key)) {
+        return false;
+    }
+
+    if (main_exists) {
+        subtree = bp_tree_cursor_value(&main_key);
+    } else {
+        subtree = bp_tree_create(tree->pool);
+        if (NULL == subtree) {
+            updated = bp_tree_remove(tree, main_val, &deleted);
+            assert(updated);
+            (void) updated;
+            return false;
+        }
+        bp_tree_cursor_set_value(&main_key, subtree);
+    }
+
+    OP_STATS_COUNT(subtree_searches);
+    if (false == bp_tree_insert(subtree, sub_val, 0, exists, NULL)) {
+        /* Uncount the box, and restore the aux that was raised for it */
+        updated = bp_tree_remove(tree, main_val, &deleted);
+        assert(updated);
+        if (deleted) {
+            bp_tree_destroy(subtree);
+        } else {
+            updated = bp_tree_set_aux(tree, main_val, bp_subtree_max(subtree));
+            assert(updated);
+        }
+        (void) updated;
+        return false;
+    }
+
+    return true;
+}
+
+static bool box_factory_remove_from_bp_tree(bp_tree_t *tree, unsigned int main_val, unsigned int sub_val, bool *deleted)
+{
+    bp_tree_cursor_t main_key;
+    bp_tree_t *subtree = NULL;
+    unsigned int old_max = 0;
+    bool main_deleted = false;
+    bool updated = false;
+
+    *deleted = false;
+
+    if (false == bp_tree_search(tree, main_val, &main_key)) {
+        return false;
+    }
+    subtree = bp_tree_cursor_value(&main_key);
+    old_max = bp_tree_cursor_aux(&main_key);
+
+    OP_STATS_COUNT(subtree_searches);
+    if (false == bp_tree_remove(subtree, sub_val, deleted)) {
+        return false;
+    }
+
+    /* The main key exists, and counts this box */
+    updated = bp_tree_remove(tree, main_val, &main_deleted);
+    assert(updated);
+    if (main_deleted) {
+        /* That was the last box of the main value, so its subtree is empty */
+        bp_tree_destroy(subtree);
+    } else if (*deleted && (sub_val == old_max)) {
+        /* The subtree max has decreased */
+        updated = bp_tree_set_aux(tree, main_val, bp_subtree_max(subtree));
+        assert(updated);
+    }
+    (void) updated;
+
+    return true;
+}
+
+static unsigned int bp_subtree_max(bp_tree_t *subtree)
+{
+    bp_tree_cursor_t max;
+
+    bp_tree_last(subtree, &max);
+    return bp_tree_cursor_key(&max);
+}
+
+static bool box_snapshot_update(persistent_tree_node_t *by_side, unsigned int side_square, unsigned int height, int delta, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *main_key = persistent_tree_search(by_side, side_square);
+    persistent_tree_node_t *heights = (NULL == main_key) ? NULL : main_key->child;
+    persistent_tree_node_t *sub_key = persistent_tree_search(heights, height);
+    persistent_tree_node_t *max = NULL;
+    bool success = false;
+
+    /* Both the height's key in the subtree and the side's key (which counts all of its boxes) are
+       updated, and the side's key gets the new version of the subtree */
+    if (false == persistent_tree_set(heights, height, ((NULL == sub_key) ? 0 : sub_key->count) + delta, 0, NULL, &heights)) {
+        return false;
+    }
+
+    max = persistent_tree_find_max(heights);
+    success = persistent_tree_set(by_side, side_square, ((NULL == main_key) ? 0 : main_key->count) + delta,
+                                  (NULL == max) ? 0 : max->key, heights, result);
+
+    /* The new version of by_side holds its own reference to the subtree */
+    persistent_tree_release(heights);
+    return success;
+}
+
+static box_snapshot_t* box_snapshot_create(persistent_tree_node_t *by_side)
+{
+    box_snapshot_t *snapshot = malloc(sizeof(box_snapshot_t));
+
+    if (NULL == snapshot) {
+        persistent_tree_release(by_side);
+        return NULL;
+    }
+
+    snapshot->refs = 1;
+    snapshot->by_side = by_side;
+    return snapshot;
+}
+
+static box_snapshot_t* box_factory_next_snapshot(box_factory_t *factory, unsigned int side_square, unsigned int height, int delta)
+{
+    persistent_tree_node_t *by_side = NULL;
+
+    if (false == box_snapshot_update(factory->snapshot->by_side, side_square, height, delta, &by_side)) {
+        return NULL;
+    }
+
+    return box_snapshot_create(by_side);
+}
+
+static void box_factory_publish(box_factory_t *factory, box_snapshot_t *snapshot)
+{
+    box_snapshot_t *previous = NULL;
+
+    pthread_mutex_lock(&(factory->snapshot_lock));
+    previous = factory->snapshot;
+    factory->snapshot = snapshot;
+    pthread_mutex_unlock(&(factory->snapshot_lock));
+
+    /* Readers that still use the previous version hold their own references to it */
+    box_snapshot_release(previous);
+}
+
+static bool box_factory_copy_boxes(box_factory_t *factory, persistent_tree_node_t **by_side)
+{
+    size_t distinct = (NULL != factory->flat_index) ? factory->flat_index->size : range_tree_count(factory->index_by_volume);
+    box_factory_copy_context_t context = {NULL, 0, 0, NULL, 0};
+    bool success = false;
+    size_t i = 0;
+
+    *by_side = NULL;
+    if (0 == distinct) {
+        return true;
+    }
+
+    /* A side has at most all of the distinct boxes' heights, and there are at most as many sides */
+    context.heights = malloc(distinct * sizeof(persistent_tree_node_t));
+    context.sides = malloc(distinct * sizeof(persistent_tree_node_t));
+    success = (NULL != context.heights) && (NULL != context.sides) &&
+              box_factory_for_each_run(factory, false, box_factory_copy_run, &context) &&
+              ((0 == context.height_count) || box_factory_copy_side(&context)) &&
+              persistent_tree_build(context.sides, context.side_count, by_side);
+
+    /* by_side holds its own references to the trees of heights */
+    for (i = 0; i < context.side_count; i++) {
+        persistent_tree_release(context.sides[i].child);
+    }
+    free(context.heights);
+    free(context.sides);
+    return success;
+}
+
+static bool box_factory_copy_run(const range_tree_point_t *run, void *context)
+{
+    box_factory_copy_context_t *copy = context;
+    persistent_tree_node_t *height = NULL;
+
+    if ((copy->height_count > 0) && (run->x != copy->side_square) && !box_factory_copy_side(copy)) {
+        return false;
+    }
+
+    copy->side_square = run->x;
+    height = &(copy->heights[copy->height_count++]);
+    height->key = run->y;
+    height->count = run->count;
+    height->aux = 0;
+    height->child = NULL;
+    return true;
+}
+
+static bool box_factory_copy_side(box_factory_copy_context_t *copy)
+{
+    persistent_tree_node_t *side = &(copy->sides[copy->side_count]);
+    size_t i = 0;
+
+    /* Like box_snapshot_update, the side's key counts all of its boxes, and its aux is its max height */
+    side->key = copy->side_square;
+    side->count = 0;
+    for (i = 0; i < copy->height_count; i++) {
+        side->count += copy->heights[i].count;
+    }
+    side->aux = copy->heights[copy->height_count - 1].key;
+    if (false == persistent_tree_build(copy->heights, copy->height_count, &(side->child))) {
+        return false;
+    }
+
+    copy->side_count++;
+    copy->height_count = 0;
+    return true;
+}
+
+static bool box_snapshot_search(persistent_tree_node_t *node, unsigned int side_square, unsigned int height, bool *found, unsigned int *found_side_square, unsigned int *found_height)
+{
+    persistent_tree_node_t *sub_key = NULL;
+
+    /* Branches without a tall enough box are skipped altogether */
+    if ((NULL == node) || (node->branch_max < height)) {
+        return false;
+    }
+
+    if (node->key < side_square) {
+        return box_snapshot_search(node->right, side_square, height, found, found_side_square, found_height);
+    }
+
+    if (box_snapshot_search(node->left, side_square, height, found, found_side_square, found_height)) {
+        return true;
+    }
+
+    /* The rest of the sides are larger, so once the side alone makes a volume that isn't smaller
+       than the best one, none of them can be better (on a tie, the smaller side wins) */
+    if (*found && ((unsigned long long) node->key * height >= (unsigned long long) *found_side_square * *found_height)) {
+        return true;
+    }
+
+    sub_key = persistent_tree_search_smallest(node->child, height);
+    if ((NULL != sub_key) &&
+        (!*found || ((unsigned long long) node->key * sub_key->key < (unsigned long long) *found_side_square * *found_height))) {
+        *found_side_square = node->key;
+        *found_height = sub_key->key;
+        *found = true;
+    }
+
+    return box_snapshot_search(node->right, side_square, height, found, found_side_square, found_height);
+}
+
+static inline void augment_branch_max(box_main_tree_t *tree, box_main_tree_node_t *node)
+{
+    /* Nodes are in the main tree only while their subtree is not empty */
+    node->branch_max = box_subtree_max(&(node->subtree));
+
+    if (!box_main_tree_is_nil(tree, node->left) && (node->left->branch_max > node->branch_max)) {
+        node->branch_max = node->left->branch_max;
+    }
+
+    if (!box_main_tree_is_nil(tree, node->right) && (node->right->branch_max > node->branch_max)) {
+        node->branch_max = node->right->branch_max;
+    }
+}
+
+static void box_factory_query_batch(box_factory_query_batch_t *batch, size_t count, unsigned int threads)
+{
+    box_factory_query_worker_t *workers = NULL;
+    void *memory = NULL;
+    unsigned int i = 0;
+
+    if (threads == 0) {
+        threads = parallel_sort_threads();
+    }
+    if (threads > count / BOX_FACTORY_QUERY_MIN_PER_THREAD) {
+        threads = count / BOX_FACTORY_QUERY_MIN_PER_THREAD;
+    }
+    if ((threads <= 1) ||
+        (0 != posix_memalign(&memory, BOX_FACTORY_QUERY_ALIGNMENT, threads * sizeof(box_factory_query_worker_t)))) {
+        box_factory_answer_queries(batch, 0, count);
+        return;
+    }
+
+    workers = memory;
+    memset(workers, 0, threads * sizeof(box_factory_query_worker_t));
+    batch->workers = workers;
+    batch->worker_count = threads;
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&(workers[i].lock), NULL);
+        workers[i].next = count * i / threads;
+        workers[i].end = count * (i + 1) / threads;
+        workers[i].batch = batch;
+    }
+
+    /* The ranges are all set before any worker starts, as a worker may steal from any other. The
+       last worker is the calling thread, and a worker whose thread failed to start is stolen from. */
+    for (i = 0; i + 1 < threads; i++) {
+        workers[i].started = (0 == pthread_create(&(workers[i].thread), NULL, box_factory_query_worker, &workers[i]));
+    }
+    box_factory_query_worker(&workers[threads - 1]);
+
+    for (i = 0; i + 1 < threads; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&(workers[i].lock));
+    }
+    free(workers);
+}
+
+static void box_factory_answer_queries(box_factory_query_batch_t *batch, size_t low, size_t high)
+{
+    box_factory_get_result_t *result = NULL;
+    size_t i = 0;
+
+    for (i = low; i < high; i++) {
+        if (NULL != batch->get_results) {
+            result = &(batch->get_results[i]);
+            result->found = box_factory_get_box(batch->factory, batch->queries[i].side, batch->queries[i].height, &(result->side_square), &(result->height));
+        } else {
+            batch->check_results[i] = box_factory_check_box(batch->factory, batch->queries[i].side, batch->queries[i].height);
+        }
+    }
+}
+
+static void* box_factory_query_worker(void *worker)
+{
+    box_factory_query_worker_t *self = worker;
+    size_t low = 0;
+    size_t high = 0;
+
+    do {
+        while (true) {
+            pthread_mutex_lock(&(self->lock));
+            low = self->next;
+            high = (self->end - low > BOX_FACTORY_QUERY_CHUNK) ? low + BOX_FACTORY_QUERY_CHUNK : self->end;
+            self->next = high;
+            pthread_mutex_unlock(&(self->lock));
+
+            if (low == high) {
+                break;
+            }
+            box_factory_answer_queries(self->batch, low, high);
+        }
+    } while (box_factory_steal_queries(self));
+
+    return NULL;
+}
+
+static bool box_factory_steal_queries(box_factory_query_worker_t *worker)
+{
+    box_factory_query_batch_t *batch = worker->batch;
+    box_factory_query_worker_t *victim = NULL;
+    size_t middle = 0;
+    size_t end = 0;
+    unsigned int index = worker - batch->workers;
+    unsigned int i = 0;
+
+    /* The victims are tried from the next worker on, so thieves spread over different victims */
+    for (i = 1; i < batch->worker_count; i++) {
+        victim = &(batch->workers[(index + i) % batch->worker_count]);
+
+        pthread_mutex_lock(&(victim->lock));
+        end = victim->end;
+        middle = victim->next + (end - victim->next) / 2;
+        victim->end = middle;
+        pthread_mutex_unlock(&(victim->lock));
+
+        if (middle < end) {
+            /* Only the worker itself takes from the front of its range, which is empty now */
+            pthread_mutex_lock(&(worker->lock));
+            worker->next = middle;
+            worker->end = end;
+            pthread_mutex_unlock(&(worker->lock));
+            return true;
+        }
+    }
 
-    return sub_tree_key->val;
+    return false;
 }
@@ -4,24 +4,106 @@
  */
 
 #include <stdbool.h>
+#include <pthread.h>
 
-#include "rb_tree.h"
+#include "pool.h"
+#include "bp_tree.h"
+#include "box_flat.h"
+#include "box_subtree.h"
+#include "op_stats.h"
+#include "persistent_tree.h"
+#include "rb_tree_gen.h"
+#include "range_tree.h"
 
 #ifndef __BOX_FACTORY_H__
 #define __BOX_FACTORY_H__
 
-typedef struct box_key_s {
-    unsigned int val;
-} box_key_t;
+/* Main tree - a node per side^2 (tree_by_side) or height (tree_by_height), with a subtree of the
+   boxes' other dimension (see box_subtree.h). The subtree is embedded in the node, and its first
+   few values are inline, so a new main value costs a single allocation. */
+RB_TREE_TYPES(box_main_tree, unsigned int,
+              box_subtree_t subtree;
+              unsigned int branch_max; /* The max subtree value of all the main tree nodes under
+                                          this one (including itself). Maintained by the main
+                                          tree's augmentation. */
+)
 
-typedef struct box_main_tree_node_s {
-    unsigned int val;
-    rb_tree_t *subtree;
-} box_main_tree_node_t;
+/* The data structure of the main trees and subtrees, chosen when the factory is created */
+typedef enum box_factory_backend_e {
+    BOX_FACTORY_RB_TREE = 0,   /* Red-black trees (the default) */
+    BOX_FACTORY_BP_TREE,       /* B+trees - cache friendlier for large inventories */
+} box_factory_backend_t;
+
+/* The operations that box_factory_stats tells apart */
+typedef enum box_factory_op_e {
+    BOX_FACTORY_OP_INSERT = 0,
+    BOX_FACTORY_OP_REMOVE,
+    BOX_FACTORY_OP_INSERT_BATCH,
+    BOX_FACTORY_OP_REMOVE_BATCH,
+    BOX_FACTORY_OP_GET_BOX,      /* Including each query of box_factory_get_box_batch */
+    BOX_FACTORY_OP_CHECK_BOX,    /* Including each query of box_factory_check_box_batch */
+    BOX_FACTORY_OP_GET_BOXES_K,
+    BOX_FACTORY_OP_TAKE_BOX,
+    BOX_FACTORY_OPS,
+} box_factory_op_t;
+
+/* The statistics of a factory's operations, by box_factory_op_t */
+typedef struct box_factory_stats_s {
+    op_stats_t ops[BOX_FACTORY_OPS];
+} box_factory_stats_t;
+
+/* The size classes of box_factory_tree_shape_t's subtree_sizes, one per power of 2 */
+#define BOX_FACTORY_SHAPE_SIZE_CLASSES (32)
+
+/* The shape and memory footprint of a main tree and its subtrees, see box_factory_shape */
+typedef struct box_factory_tree_shape_s {
+    rb_tree_shape_t main;            /* The main tree, whose nodes embed the subtrees */
+    size_t subtree_values;           /* All of the subtrees' values, one per distinct box */
+    size_t subtree_trees;            /* The subtrees that were promoted to trees */
+    size_t subtree_nodes;            /* All of the promoted subtrees' nodes */
+    unsigned int subtree_max_height; /* The tallest promoted subtree, 0 if there's none */
+    size_t subtree_sizes[BOX_FACTORY_SHAPE_SIZE_CLASSES]; /* The number of subtrees of 2^i to
+                                                             2^(i+1) - 1 values, by i */
+    size_t subtree_node_bytes;       /* The promoted subtrees' nodes and tree headers */
+    size_t subtree_header_bytes;     /* The embedded subtrees (part of main.node_bytes) */
+    size_t key_bytes;                /* The payload - the key and count of every main tree node and
+                                        subtree value (part of the bytes above) */
+} box_factory_tree_shape_t;
+
+/* The shape and memory footprint of a factory, see box_factory_shape */
+typedef struct box_factory_shape_s {
+    box_factory_tree_shape_t by_side;
+    box_factory_tree_shape_t by_height;
+    size_t pool_bytes;               /* All of the memory that is allocated from the factory's pool:
+                                        the trees above and the range tree index */
+} box_factory_shape_t;
+
+/* An immutable version of the boxes of a factory, see box_factory_snapshot */
+typedef struct box_snapshot_s {
+    unsigned int refs;               /* The factory's reference (while this is its current version)
+                                        and the readers', updated atomically */
+    persistent_tree_node_t *by_side; /* A key per side^2 that counts its boxes, whose aux is its
+                                        max height, and whose child is a tree of its heights */
+} box_snapshot_t;
 
 typedef struct box_factory_s {
-    rb_tree_t *tree_by_side;   /* Tree by the key side */
-    rb_tree_t *tree_by_height; /* Tree by the key height */
+    pool_t *pool;              /* All of the factory's trees, nodes and keys are allocated from it */
+    box_factory_backend_t backend;
+    box_main_tree_t *tree_by_side;   /* Tree by the key side (BOX_FACTORY_RB_TREE) */
+    box_main_tree_t *tree_by_height; /* Tree by the key height (BOX_FACTORY_RB_TREE). Both trees
+                                        count the instances of each box in its subtree value, so
+                                        either one answers a query with the counts. */
+    bp_tree_t *bp_tree_by_side;      /* The same trees for BOX_FACTORY_BP_TREE. The aux of each key */
+    bp_tree_t *bp_tree_by_height;    /* is its subtree's max, and its value is the subtree. */
+    range_tree_t *index_by_volume; /* 2D index of (side^2, height), answers GetBox. Holds each
+                                      distinct box once, unlike the trees. */
+    box_flat_t *flat_index;        /* The same index as a flat array while the factory has only a few
+                                      distinct boxes (index_by_volume is empty then), NULL otherwise */
+    box_snapshot_t *snapshot;        /* The current version, NULL unless snapshots are enabled */
+    pthread_mutex_t snapshot_lock;   /* Guards replacing the current version against readers that
+                                        take a reference to it */
+    op_stats_record_t stats[BOX_FACTORY_OPS]; /* By box_factory_op_t, each of which allocates its
+                                                 statistics on its first call */
 } box_factory_t;
 
 /* box_factory_create - create an empty box factory.
@@ -30,6 +112,53 @@ typedef struct box_factory_s {
  */
 box_factory_t* box_factory_create();
 
+/* box_factory_create_with_backend - create an empty box factory, whose main trees and subtrees are
+   of the given backend. box_factory_create uses BOX_FACTORY_RB_TREE.
+   If an allocation error occurs, NULL is returned.
+ */
+box_factory_t* box_factory_create_with_backend(box_factory_backend_t backend);
+
+/* A box, for box_factory_build_from_array */
+typedef struct box_factory_box_s {
+    unsigned int side;
+    unsigned int height;
+} box_factory_box_t;
+
+/* box_factory_build_from_array - create a box factory (of BOX_FACTORY_RB_TREE) out of count boxes in
+   any order, e.g. a dump of the inventory. The boxes are sorted and deduplicated by up to threads
+   threads (0 for the number of CPUs), and then all of the trees are built perfectly balanced in
+   linear time, which is much faster than an insertion per box.
+   If an allocation error occurs, NULL is returned.
+ */
+box_factory_t* box_factory_build_from_array(const box_factory_box_t *boxes, size_t count, unsigned int threads);
+
+/* box_factory_save - save the factory's boxes to the file at path, in a pointer-free format of
+   sorted runs of (main value, sub value, count) per main tree, from which box_factory_open builds
+   the trees in linear time. The file is written aside and renamed over path once it is complete,
+   and both the file and its directory are synced, so path holds either the old or the new boxes
+   after a crash. Returns false on an I/O error (or an allocation error), in which case path is
+   left unchanged, unless only the sync of the directory failed.
+ */
+bool box_factory_save(box_factory_t *factory, const char *path);
+
+/* box_factory_open - create a box factory (of BOX_FACTORY_RB_TREE) out of a file that was saved by
+   box_factory_save. The file is mapped to memory, and the trees are built straight out of its runs,
+   without sorting or rebalancing, so the time it takes is mostly the time it takes to read the file.
+   The runs of both trees are checked to hold the same boxes, which sorts a copy of one of them.
+   Returns NULL if the file can't be read or is not a valid box factory file, or on an allocation
+   error.
+ */
+box_factory_t* box_factory_open(const char *path);
+
+/* box_factory_destroy - free the factory and all of its boxes, by releasing its pool at once. */
+void box_factory_destroy(box_factory_t *factory);
+
+/* box_factory_reset - remove all of the boxes from the factory, by releasing its pool at once.
+   The pool's memory is kept for the boxes that would be inserted next.
+   Returns false on an allocation failure, in which case the factory may only be destroyed.
+ */
+bool box_factory_reset(box_factory_t *factory);
+
 /* box_factory_insert - the exercise's BoxInsert.
    Returns false on errors (which can only happen due to an allocation error), otherwise true
  */
@@ -40,9 +169,64 @@ bool box_factory_insert(box_factory_t *factory, unsigned int side, unsigned int
  */
 bool box_factory_remove(box_factory_t *factory, unsigned int side, unsigned int height);
 
+/* box_factory_insert_batch - insert count boxes at once. The batch is sorted and grouped by side and
+   by height, so each main tree is searched once per distinct main value, and each subtree once per
+   distinct box, instead of once per box.
+   Returns false on an allocation error, in which case none of the boxes are inserted.
+ */
+bool box_factory_insert_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count);
+
+/* box_factory_remove_batch - remove count boxes at once, grouped like box_factory_insert_batch.
+   Boxes that don't exist (or have less instances than the batch holds) are skipped, just like
+   box_factory_remove would return false for them.
+   Returns the number of boxes that were removed.
+ */
+size_t box_factory_remove_batch(box_factory_t *factory, const box_factory_box_t *boxes, size_t count);
+
+/* box_factory_take_box - GetBox and BoxRemove of the box that it finds, in a single call.
+   found_side_square and found_height are set like box_factory_get_box, and one instance of that box
+   is removed. The box is known to exist, so it is removed from each main tree in a single descent,
+   without box_factory_remove's checks.
+   Returns false if no box fits (or, when snapshots are enabled, on an allocation error, in which
+   case the box is kept), otherwise true.
+ */
+bool box_factory_take_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+
+/* box_factory_enable_snapshots - start keeping an immutable version of the boxes, which is updated
+   by path copying on every insertion and removal (at the cost of O(log n) allocations each), so that
+   box_factory_snapshot takes O(1). The current boxes are copied in O(n).
+   Once enabled, a single writer thread may keep calling the factory's functions, while any number
+   of other threads take snapshots and query them. box_factory_remove may then also fail on an
+   allocation error (returning false and keeping the box), and the batch functions go box by box.
+   Returns false on an allocation error, in which case snapshots stay disabled.
+ */
+bool box_factory_enable_snapshots(box_factory_t *factory);
+
+/* box_factory_snapshot - take a reference to the current version of the boxes, which never changes,
+   and stays valid (even after the factory is destroyed) until it is released. Takes O(1), and may be
+   called by any thread. Returns NULL if snapshots are not enabled.
+ */
+box_snapshot_t* box_factory_snapshot(box_factory_t *factory);
+
+/* box_snapshot_release - release a reference to a snapshot, freeing whatever only it still uses. */
+void box_snapshot_release(box_snapshot_t *snapshot);
+
+/* box_snapshot_get_box, box_snapshot_check_box - GetBox and CheckBox on a snapshot, without locks.
+   GetBox scans the sides from the query's up, skipping the branches without a tall enough box and
+   stopping once the side alone rules out a smaller volume, so it is O(log^2 n) for most inventories,
+   but not bounded like box_factory_get_box's range tree (e.g. when all boxes have the same volume).
+ */
+bool box_snapshot_get_box(box_snapshot_t *snapshot, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+bool box_snapshot_check_box(box_snapshot_t *snapshot, unsigned int side, unsigned int height);
+
 /* box_factory_get_box - the exercise's GetBox.
    Returns true/false is a box is found/not found. In addition, found_side_square and found_height would
-   contain the side^2 and height of the matching smallest box.
+   contain the side^2 and height of the matching smallest box (by volume, and then by side).
+   Answered by the volume index: a scan of the flat array up to 1024 distinct boxes, and the range
+   tree in O(log^2 n) beyond it, regardless of the inventory's shape. Every way of making a factory
+   (insertions, batches, box_factory_build_from_array and box_factory_open) keeps the index, whose
+   price is O(log^2 n) insertions and removals of distinct boxes beyond the flat array, with
+   amortized scapegoat rebuilds.
  */
 bool box_factory_get_box(box_factory_t *factory, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
 
@@ -51,4 +235,83 @@ bool box_factory_get_box(box_factory_t *factory, unsigned int side, unsigned int
  */
 bool box_factory_check_box(box_factory_t *factory, unsigned int side, unsigned int height);
 
+/* A result of box_factory_get_boxes_k - a box with its number of instances */
+typedef struct box_factory_fit_s {
+    unsigned int side_square;
+    unsigned int height;
+    unsigned int count;
+} box_factory_fit_t;
+
+/* The objectives of box_factory_get_box_by, which choose the best box among the boxes that fit */
+typedef enum box_factory_objective_e {
+    BOX_FACTORY_FIT_VOLUME = 0, /* The least side^2 * height, and then the smallest side (GetBox) */
+    BOX_FACTORY_FIT_HEIGHT,     /* The lowest height, and then the smallest side */
+    BOX_FACTORY_FIT_SIDE,       /* The smallest side, and then the lowest height */
+    BOX_FACTORY_FIT_WASTE,      /* The least waste relative to the request: the least excess over
+                                   the query's side^2 or height (whichever is larger) as a fraction
+                                   of it, and then the least volume and side */
+    BOX_FACTORY_OBJECTIVES,
+} box_factory_objective_t;
+
+/* box_factory_get_boxes_k - GetBox of the k best boxes: fills fits with the (up to) k smallest boxes
+   that fit (side, height), by volume and then by side like box_factory_get_box, in that order.
+   The boxes are collected in a single in-order scan of the tree by side from side^2 up, which skips
+   the branches without a tall enough box, into a bounded heap in fits itself (so nothing is
+   allocated). The scan stops once a side^2 * height can't beat the k-th box, so it takes
+   O(log n + k log k) for most inventories, but not bounded like box_factory_get_box's range tree.
+   Returns the number of boxes in fits, 0 if none fits.
+ */
+size_t box_factory_get_boxes_k(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_fit_t *fits, size_t k);
+
+/* box_factory_get_box_by, box_factory_get_boxes_k_by - box_factory_get_box and
+   box_factory_get_boxes_k by any objective. Each objective has its own scan, specialized at compile
+   time, with its own bound: by volume and by waste like box_factory_get_boxes_k, by side until the
+   k-th box's side, and by height in the tree by height, up to the k-th box's height.
+   box_factory_get_box_by of BOX_FACTORY_FIT_VOLUME is box_factory_get_box itself.
+ */
+bool box_factory_get_box_by(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_objective_t objective, unsigned int *found_side_square, unsigned int *found_height);
+size_t box_factory_get_boxes_k_by(box_factory_t *factory, unsigned int side, unsigned int height, box_factory_objective_t objective, box_factory_fit_t *fits, size_t k);
+
+/* box_factory_get_box, box_factory_check_box and box_factory_get_boxes_k (and their _by versions
+   and the batches below) never modify the factory, so any number of threads may query it at once, for as long as no thread
+   modifies it. */
+
+/* A result of box_factory_get_box_batch */
+typedef struct box_factory_get_result_s {
+    bool found;
+    unsigned int side_square;
+    unsigned int height;
+} box_factory_get_result_t;
+
+/* box_factory_get_box_batch, box_factory_check_box_batch - answer count queries (whose side and
+   height are the query's dimensions) with box_factory_get_box or box_factory_check_box, spread over
+   up to threads threads (0 for the number of CPUs), where results[i] is the answer of queries[i].
+   The queries are split evenly between the threads, and a thread that runs out of queries steals
+   half of the rest of another's, so slow queries don't hold back the batch.
+   The factory must not be modified during the call. If a thread can't be created (or the threads'
+   state can't be allocated), its queries are answered by the calling thread.
+ */
+void box_factory_get_box_batch(box_factory_t *factory, const box_factory_box_t *queries, size_t count, box_factory_get_result_t *results, unsigned int threads);
+void box_factory_check_box_batch(box_factory_t *factory, const box_factory_box_t *queries, size_t count, bool *results, unsigned int threads);
+
+/* box_factory_stats - copy the statistics of the factory's operations to stats (unless it's NULL),
+   and zero them if reset is set. For each operation type, these are its number of calls, and of a sample of the calls
+   (see op_stats.h): the events of the data structures during them (see op_stats_counters_t), and a
+   histogram of their latencies (see op_stats_percentile). The statistics are kept since the factory
+   was created or last reset by this function (box_factory_reset doesn't reset them).
+   Recording costs an atomic add per call, and two clock reads and a few more atomic adds per sample.
+   The statistics of an operation type (about 15KB) are only allocated by its first call.
+   When the factory is built with NO_OP_STATS it costs nothing, and false is returned.
+   May be called by any thread while the factory is in use, see op_stats_read.
+ */
+bool box_factory_stats(box_factory_t *factory, box_factory_stats_t *stats, bool reset);
+
+/* box_factory_shape - measure the shape and memory footprint of the factory's main trees and
+   subtrees into shape: their heights and node counts, how the boxes spread over the subtrees, and
+   how many of their bytes are nodes, embedded subtrees and the keys themselves.
+   Walks all of the trees, in O(n). Like a query, it doesn't modify the factory.
+   Returns false for the BOX_FACTORY_BP_TREE backend, whose trees have no such shape.
+ */
+bool box_factory_shape(box_factory_t *factory, box_factory_shape_t *shape);
+
 #endif /* __BOX_FACTORY_H__ */
@@ -0,0 +1,818 @@
+/*
+  box_factory_bench.c - Benchmark of the box factory operations.
+  Preloads a factory with boxes of the selected workload, and then runs a random mix of
+  insert/remove/get/check operations, reporting the throughput and the latency percentiles of
+  each operation type.
+
+  Usage: box_factory_bench [-w workload] [-b backend] [-l] [-t threads] [-S shards] [-L log] [-g group] [-q threads] [-i] [-m] [-n boxes] [-o operations] [-r range] [-s seed]
+  Backends: rb (red-black trees, the default), bp (B+trees).
+  -l preloads the boxes with box_factory_build_from_array (rb only), instead of an insert per box.
+  -t runs the preload and the operations on a sharded factory (box_shards) split among threads,
+     each with its own boxes and random stream, and also reports the wall clock throughput.
+     -S sets the number of shards (16 by default).
+  -L logs the insertions and removals (of the preload too) to a new write-ahead log (box_wal) at
+     the given path, and then also reports the time it takes to replay it into an empty factory.
+     -g sets the number of records per group commit (256 by default).
+  -q also answers a batch of queries of the size of operations with box_factory_get_box_batch and
+     box_factory_check_box_batch on the given number of threads (0 for the number of CPUs), and
+     reports their throughput.
+  -i also reports the factory's own statistics of the operations (box_factory_stats) after the
+     preload: the calls, the average data structure events per sampled call, and the latency
+     percentiles of the samples.
+  -m also reports the shape and memory footprint of the factory's trees (box_factory_shape, rb
+     only) after the operations: the heights, the spread of the subtree sizes, and the bytes per box.
+  Workloads:
+    uniform   - sides and heights are uniform in [1, range].
+    zipf      - sides and heights are Zipf distributed in [1, range], so a few sizes are hot.
+    distinct  - every box has a distinct side, heights are uniform.
+    staircase - all boxes have about the same volume (height ~ range^2 / side^2), and queries are
+                small, so every box is a candidate - the worst case of a scan bounded by volume.
+    tall-tail - distinct sides with short heights, and only the largest sides are tall. Queries
+                ask for tall boxes, so scanning by side has to pass over all of the short ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "box_factory.h"
+#include "box_shards.h"
+#include "box_wal.h"
+
+typedef enum bench_op_e {
+    BENCH_OP_INSERT = 0,
+    BENCH_OP_REMOVE,
+    BENCH_OP_GET,
+    BENCH_OP_CHECK,
+    BENCH_OP_COUNT,
+} bench_op_t;
+
+static const char *bench_op_names[BENCH_OP_COUNT] = {"insert", "remove", "get", "check"};
+
+typedef enum bench_workload_e {
+    WORKLOAD_UNIFORM = 0,
+    WORKLOAD_ZIPF,
+    WORKLOAD_DISTINCT,
+    WORKLOAD_STAIRCASE,
+    WORKLOAD_TALL_TAIL,
+    WORKLOAD_COUNT,
+} bench_workload_t;
+
+static const char *workload_names[WORKLOAD_COUNT] = {"uniform", "zipf", "distinct", "staircase", "tall-tail"};
+
+/* By box_factory_backend_t */
+static const char *backend_names[] = {"rb", "bp"};
+#define BACKEND_COUNT (sizeof(backend_names) / sizeof(backend_names[0]))
+
+typedef struct bench_box_s {
+    unsigned int side;
+    unsigned int height;
+} bench_box_t;
+
+typedef struct bench_s {
+    bench_workload_t workload;
+    unsigned int seed;          /* The state of rand_r, so that every thread has its own */
+    box_shards_t *shards;       /* The factory of -t, which the operations go to instead */
+    box_wal_t *wal;             /* The log of -L, which the insertions and removals go through */
+    unsigned int range;
+    unsigned int next_distinct; /* The next side of the distinct workloads */
+    double *zipf_cdf;           /* Cumulative distribution of the zipf workload, by value - 1 */
+    bench_box_t *boxes;         /* The boxes currently in the factory */
+    unsigned int box_count;
+    unsigned long long *latencies[BENCH_OP_COUNT];
+    unsigned int latency_count[BENCH_OP_COUNT];
+    unsigned long long total_time[BENCH_OP_COUNT];
+} bench_t;
+
+#define ZIPF_EXPONENT (1.0)
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned int random_below(bench_t *bench, unsigned int limit)
+{
+    /* rand_r() may be only 15 bits wide, so combine two calls */
+    return (unsigned int) ((((unsigned long long) rand_r(&bench->seed) << 15) ^ rand_r(&bench->seed)) % limit);
+}
+
+static bool zipf_init(bench_t *bench)
+{
+    double sum = 0;
+    unsigned int i = 0;
+
+    bench->zipf_cdf = calloc(sizeof(double), bench->range);
+    if (NULL == bench->zipf_cdf) {
+        return false;
+    }
+
+    for (i = 0; i < bench->range; i++) {
+        sum += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+        bench->zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < bench->range; i++) {
+        bench->zipf_cdf[i] /= sum;
+    }
+
+    return true;
+}
+
+static unsigned int zipf_value(bench_t *bench)
+{
+    double target = (double) rand_r(&bench->seed) / RAND_MAX;
+    unsigned int low = 0;
+    unsigned int high = bench->range - 1;
+    unsigned int middle = 0;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (bench->zipf_cdf[middle] < target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low + 1;
+}
+
+/* next_box - generate a box to insert by the workload */
+static bench_box_t next_box(bench_t *bench)
+{
+    bench_box_t box = {0, 0};
+    double volume = (double) bench->range * bench->range;
+
+    switch (bench->workload) {
+    case WORKLOAD_UNIFORM:
+        box.side = random_below(bench, bench->range) + 1;
+        box.height = random_below(bench, bench->range) + 1;
+        break;
+    case WORKLOAD_ZIPF:
+        box.side = zipf_value(bench);
+        box.height = zipf_value(bench);
+        break;
+    case WORKLOAD_DISTINCT:
+        box.side = ++bench->next_distinct;
+        box.height = random_below(bench, bench->range) + 1;
+        break;
+    case WORKLOAD_STAIRCASE:
+        box.side = (++bench->next_distinct % bench->range) + 1;
+        box.height = (unsigned int) (volume / ((double) box.side * box.side)) + 1;
+        break;
+    case WORKLOAD_TALL_TAIL:
+        box.side = ++bench->next_distinct;
+        box.height = (box.side % 1024 == 0) ? bench->range : random_below(bench, 16) + 1;
+        break;
+    default:
+        break;
+    }
+
+    return box;
+}
+
+/* next_query - generate a box to search for by the workload */
+static bench_box_t next_query(bench_t *bench)
+{
+    bench_box_t box = {0, 0};
+
+    switch (bench->workload) {
+    case WORKLOAD_STAIRCASE:
+        box.side = 1;
+        box.height = 1;
+        break;
+    case WORKLOAD_TALL_TAIL:
+        box.side = random_below(bench, 16) + 1;
+        box.height = bench->range - random_below(bench, 16);
+        break;
+    default:
+        box = next_box(bench);
+        if (bench->workload == WORKLOAD_DISTINCT) {
+            box.side = random_below(bench, bench->next_distinct) + 1;
+        }
+        break;
+    }
+
+    return box;
+}
+
+static void record(bench_t *bench, bench_op_t op, unsigned long long start)
+{
+    unsigned long long latency = now_ns() - start;
+
+    bench->latencies[op][bench->latency_count[op]++] = latency;
+    bench->total_time[op] += latency;
+}
+
+static bool run_op(bench_t *bench, box_factory_t *factory, bench_op_t op)
+{
+    bench_box_t box = {0, 0};
+    unsigned int index = 0;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned long long start = 0;
+
+    switch (op) {
+    case BENCH_OP_INSERT:
+        box = next_box(bench);
+        start = now_ns();
+        if (!((NULL != bench->shards) ? box_shards_insert(bench->shards, box.side, box.height) :
+              (NULL != bench->wal) ? box_wal_insert(bench->wal, factory, box.side, box.height) :
+                                     box_factory_insert(factory, box.side, box.height))) {
+            return false;
+        }
+        record(bench, op, start);
+        bench->boxes[bench->box_count++] = box;
+        break;
+    case BENCH_OP_REMOVE:
+        if (bench->box_count == 0) {
+            break;
+        }
+        index = random_below(bench, bench->box_count);
+        box = bench->boxes[index];
+        bench->boxes[index] = bench->boxes[--bench->box_count];
+        start = now_ns();
+        if (NULL != bench->shards) {
+            box_shards_remove(bench->shards, box.side, box.height);
+        } else if (NULL != bench->wal) {
+            if (!box_wal_remove(bench->wal, factory, box.side, box.height) && bench->wal->failed) {
+                return false;
+            }
+        } else {
+            box_factory_remove(factory, box.side, box.height);
+        }
+        record(bench, op, start);
+        break;
+    case BENCH_OP_GET:
+        box = next_query(bench);
+        start = now_ns();
+        if (NULL != bench->shards) {
+            box_shards_get_box(bench->shards, box.side, box.height, &found_side_square, &found_height);
+        } else {
+            box_factory_get_box(factory, box.side, box.height, &found_side_square, &found_height);
+        }
+        record(bench, op, start);
+        break;
+    case BENCH_OP_CHECK:
+        box = next_query(bench);
+        start = now_ns();
+        if (NULL != bench->shards) {
+            box_shards_check_box(bench->shards, box.side, box.height);
+        } else {
+            box_factory_check_box(factory, box.side, box.height);
+        }
+        record(bench, op, start);
+        break;
+    default:
+        break;
+    }
+
+    return true;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    unsigned long long latency_a = *(const unsigned long long *) a;
+    unsigned long long latency_b = *(const unsigned long long *) b;
+
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+static unsigned long long percentile(unsigned long long *sorted, unsigned int count, double fraction)
+{
+    unsigned int index = (unsigned int) (fraction * count);
+
+    if (index >= count) {
+        index = count - 1;
+    }
+
+    return sorted[index];
+}
+
+static void report(bench_t *bench)
+{
+    unsigned int op = 0;
+    unsigned int count = 0;
+    unsigned long long *latencies = NULL;
+
+    printf("%-8s %10s %14s %10s %10s %10s\n", "op", "count", "ops/sec", "p50 ns", "p99 ns", "p999 ns");
+    for (op = 0; op < BENCH_OP_COUNT; op++) {
+        count = bench->latency_count[op];
+        latencies = bench->latencies[op];
+        if (count == 0) {
+            continue;
+        }
+
+        qsort(latencies, count, sizeof(unsigned long long), compare_latencies);
+        printf("%-8s %10u %14.0f %10llu %10llu %10llu\n",
+               bench_op_names[op],
+               count,
+               count / ((double) bench->total_time[op] / 1e9),
+               percentile(latencies, count, 0.5),
+               percentile(latencies, count, 0.99),
+               percentile(latencies, count, 0.999));
+    }
+}
+
+/* report_tree_shape - the report of -m for a single main tree. */
+static void report_tree_shape(const char *name, const box_factory_tree_shape_t *shape)
+{
+    size_t bytes = shape->main.node_bytes + shape->main.header_bytes + shape->subtree_node_bytes;
+    unsigned int i = 0;
+
+    printf("%-9s main nodes %zu, height %u, black height %u; subtree values %zu, promoted %zu with %zu nodes, max height %u\n",
+           name, shape->main.nodes, shape->main.height, shape->main.black_height, shape->subtree_values,
+           shape->subtree_trees, shape->subtree_nodes, shape->subtree_max_height);
+    printf("%-9s bytes %zu (%.1f per box): main nodes %zu (subtrees %zu), subtree trees %zu, keys %zu\n",
+           "", bytes, (shape->subtree_values > 0) ? (double) bytes / shape->subtree_values : 0.0, shape->main.node_bytes,
+           shape->subtree_header_bytes, shape->subtree_node_bytes, shape->key_bytes);
+    printf("%-9s subtrees by values:", "");
+    for (i = 0; i < BOX_FACTORY_SHAPE_SIZE_CLASSES; i++) {
+        if (shape->subtree_sizes[i] > 0) {
+            printf(" %u-%u: %zu", 1U << i, (2U << i) - 1, shape->subtree_sizes[i]);
+        }
+    }
+    printf("\n");
+}
+
+/* report_shape - the report of -m. */
+static void report_shape(box_factory_t *factory)
+{
+    box_factory_shape_t shape;
+
+    if (!box_factory_shape(factory, &shape)) {
+        printf("No shape (of the bp backend)\n");
+        return;
+    }
+
+    report_tree_shape("by side", &(shape.by_side));
+    report_tree_shape("by height", &(shape.by_height));
+    printf("Pool: %zu bytes\n", shape.pool_bytes);
+}
+
+/* report_stats - the report of -i. */
+static void report_stats(box_factory_t *factory)
+{
+    static const char *names[BOX_FACTORY_OPS] = {"insert", "remove", "insert_b", "remove_b", "get", "check", "get_k", "take"};
+    box_factory_stats_t *stats = NULL;
+    op_stats_t *op = NULL;
+    unsigned int i = 0;
+
+    stats = malloc(sizeof(box_factory_stats_t));
+    if ((NULL == stats) || !box_factory_stats(factory, stats, false)) {
+        printf("No statistics (built with NO_OP_STATS)\n");
+        free(stats);
+        return;
+    }
+
+    printf("%-8s %10s %8s %8s %8s %8s %8s %8s %10s %10s %10s\n", "op", "calls", "samples", "compare",
+           "succ", "subtree", "rotate", "alloc", "p50 ns", "p99 ns", "max ns");
+    for (i = 0; i < BOX_FACTORY_OPS; i++) {
+        op = &(stats->ops[i]);
+        if (op->samples == 0) {
+            continue;
+        }
+
+        printf("%-8s %10llu %8llu %8.1f %8.1f %8.1f %8.2f %8.2f %10llu %10llu %10llu\n",
+               names[i],
+               op->calls,
+               op->samples,
+               (double) op->counters.comparisons / op->samples,
+               (double) op->counters.successor_steps / op->samples,
+               (double) op->counters.subtree_searches / op->samples,
+               (double) op->counters.rotations / op->samples,
+               (double) op->counters.allocations / op->samples,
+               op_stats_percentile(op, 50),
+               op_stats_percentile(op, 99),
+               op->latency_max);
+    }
+
+    free(stats);
+}
+
+/* The state of a thread of -t */
+typedef struct bench_thread_s {
+    bench_t bench;
+    pthread_t thread;
+    unsigned int boxes;        /* Boxes to preload */
+    unsigned int operations;
+    bool failed;
+} bench_thread_t;
+
+static void* preload_thread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    bench_t *bench = &(thread->bench);
+    unsigned int i = 0;
+
+    for (i = 0; i < thread->boxes; i++) {
+        bench->boxes[i] = next_box(bench);
+        if (!box_shards_insert(bench->shards, bench->boxes[i].side, bench->boxes[i].height)) {
+            thread->failed = true;
+            return NULL;
+        }
+    }
+    bench->box_count = thread->boxes;
+
+    return NULL;
+}
+
+static void* operations_thread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    unsigned int i = 0;
+
+    for (i = 0; i < thread->operations; i++) {
+        if (!run_op(&(thread->bench), NULL, random_below(&(thread->bench), BENCH_OP_COUNT))) {
+            thread->failed = true;
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* run_threads - run both phases of the benchmark with the given threads, each running its share of
+   the boxes and operations on the shards. The latencies of all of the threads are merged into bench.
+   Returns false on an allocation failure.
+ */
+static bool run_threads(bench_t *bench, bench_thread_t *threads, unsigned int count, void *(*phase)(void *))
+{
+    unsigned int i = 0;
+    unsigned int op = 0;
+    bool result = true;
+
+    for (i = 0; i < count; i++) {
+        if (0 != pthread_create(&(threads[i].thread), NULL, phase, &threads[i])) {
+            /* Run it on this thread instead */
+            phase(&threads[i]);
+            threads[i].thread = pthread_self();
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!pthread_equal(threads[i].thread, pthread_self())) {
+            pthread_join(threads[i].thread, NULL);
+        }
+        result = result && !threads[i].failed;
+    }
+
+    /* Collect the latencies of the phase */
+    for (i = 0; i < count; i++) {
+        for (op = 0; op < BENCH_OP_COUNT; op++) {
+            memcpy(bench->latencies[op] + bench->latency_count[op], threads[i].bench.latencies[op],
+                   threads[i].bench.latency_count[op] * sizeof(unsigned long long));
+            bench->latency_count[op] += threads[i].bench.latency_count[op];
+            bench->total_time[op] += threads[i].bench.total_time[op];
+            threads[i].bench.latency_count[op] = 0;
+            threads[i].bench.total_time[op] = 0;
+        }
+    }
+
+    return result;
+}
+
+/* bench_batch_queries - the -q mode, on the factory after the operations. Returns false on an
+   allocation failure.
+ */
+static bool bench_batch_queries(bench_t *bench, box_factory_t *factory, unsigned int count, unsigned int threads)
+{
+    box_factory_box_t *queries = NULL;
+    box_factory_get_result_t *get_results = NULL;
+    bool *check_results = NULL;
+    bench_box_t query = {0, 0};
+    unsigned long long start = 0;
+    unsigned int i = 0;
+    bool result = false;
+
+    queries = calloc(sizeof(box_factory_box_t), count);
+    get_results = calloc(sizeof(box_factory_get_result_t), count);
+    check_results = calloc(sizeof(bool), count);
+    if ((NULL == queries) || (NULL == get_results) || (NULL == check_results)) {
+        goto cleanup;
+    }
+
+    for (i = 0; i < count; i++) {
+        query = next_query(bench);
+        queries[i].side = query.side;
+        queries[i].height = query.height;
+    }
+
+    start = now_ns();
+    box_factory_get_box_batch(factory, queries, count, get_results, threads);
+    printf("Batch get: %.0f queries/sec\n", count / ((now_ns() - start) / 1e9));
+
+    start = now_ns();
+    box_factory_check_box_batch(factory, queries, count, check_results, threads);
+    printf("Batch check: %.0f queries/sec\n", count / ((now_ns() - start) / 1e9));
+
+    result = true;
+
+cleanup:
+    free(queries);
+    free(get_results);
+    free(check_results);
+
+    return result;
+}
+
+/* bench_threads - the -t mode, on shards that were preloaded. Returns false on an allocation failure. */
+static bool bench_threads(bench_t *bench, unsigned int count, unsigned int boxes, unsigned int operations)
+{
+    bench_thread_t *threads = NULL;
+    unsigned long long start = 0;
+    unsigned int i = 0;
+    unsigned int op = 0;
+    bool result = false;
+
+    threads = calloc(sizeof(bench_thread_t), count);
+    if (NULL == threads) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        threads[i].bench = *bench;
+        threads[i].bench.seed = bench->seed + i;
+        threads[i].boxes = boxes / count + ((i < boxes % count) ? 1 : 0);
+        threads[i].operations = operations / count + ((i < operations % count) ? 1 : 0);
+        threads[i].bench.boxes = calloc(sizeof(bench_box_t), threads[i].boxes + threads[i].operations);
+        if (NULL == threads[i].bench.boxes) {
+            goto cleanup;
+        }
+        for (op = 0; op < BENCH_OP_COUNT; op++) {
+            threads[i].bench.latencies[op] = calloc(sizeof(unsigned long long), threads[i].operations);
+            if (NULL == threads[i].bench.latencies[op]) {
+                goto cleanup;
+            }
+        }
+    }
+
+    start = now_ns();
+    if (!run_threads(bench, threads, count, preload_thread)) {
+        goto cleanup;
+    }
+    printf("Preload: %.3f sec\n", (now_ns() - start) / 1e9);
+
+    start = now_ns();
+    if (!run_threads(bench, threads, count, operations_thread)) {
+        goto cleanup;
+    }
+    printf("Throughput: %.0f ops/sec on %u threads\n", operations / ((now_ns() - start) / 1e9), count);
+
+    result = true;
+
+cleanup:
+    for (i = 0; i < count; i++) {
+        free(threads[i].bench.boxes);
+        for (op = 0; op < BENCH_OP_COUNT; op++) {
+            free(threads[i].bench.latencies[op]);
+        }
+    }
+    free(threads);
+
+    return result;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-w uniform|zipf|distinct|staircase|tall-tail] [-b rb|bp] [-l] [-t threads] [-S shards] [-L log] [-g group] [-q threads] [-i] [-m] [-n boxes] [-o operations] [-r range] [-s seed]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_t bench;
+    box_factory_t *factory = NULL;
+    box_factory_box_t *dump = NULL;
+    box_factory_backend_t backend = BOX_FACTORY_RB_TREE;
+    unsigned int boxes = 100000;
+    unsigned int operations = 1000000;
+    unsigned int seed = 1;
+    unsigned int threads = 0;
+    unsigned int shards = 16;
+    unsigned int side_range = 0;
+    unsigned int group_size = 256;
+    unsigned int query_threads = 0;
+    bool batch_queries = false;
+    bool factory_stats = false;
+    bool factory_shape = false;
+    const char *log_path = NULL;
+    unsigned int i = 0;
+    unsigned long long start = 0;
+    bool bulk_load = false;
+    bool out_of_memory = false;
+    int option = 0;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.range = 10000;
+
+    while (-1 != (option = getopt(argc, argv, "w:b:lt:S:L:g:q:imn:o:r:s:"))) {
+        switch (option) {
+        case 'w':
+            for (i = 0; i < WORKLOAD_COUNT; i++) {
+                if (0 == strcmp(optarg, workload_names[i])) {
+                    break;
+                }
+            }
+            if (i == WORKLOAD_COUNT) {
+                usage(argv[0]);
+                return -1;
+            }
+            bench.workload = i;
+            break;
+        case 'b':
+            for (i = 0; i < BACKEND_COUNT; i++) {
+                if (0 == strcmp(optarg, backend_names[i])) {
+                    break;
+                }
+            }
+            if (i == BACKEND_COUNT) {
+                usage(argv[0]);
+                return -1;
+            }
+            backend = i;
+            break;
+        case 'l':
+            bulk_load = true;
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'g':
+            group_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            batch_queries = true;
+            query_threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            factory_stats = true;
+            break;
+        case 'm':
+            factory_shape = true;
+            break;
+        case 'n':
+            boxes = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            operations = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            bench.range = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if ((bench.range == 0) || (bulk_load && ((backend != BOX_FACTORY_RB_TREE) || (threads > 0))) || (shards == 0) ||
+        ((NULL != log_path) && (bulk_load || (threads > 0))) || ((batch_queries || factory_stats || factory_shape) && (threads > 0))) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    bench.seed = seed;
+    if (threads > 0) {
+        /* The sides of the distinct workloads grow with the boxes of each thread */
+        side_range = bench.range;
+        if ((bench.workload == WORKLOAD_DISTINCT) || (bench.workload == WORKLOAD_TALL_TAIL)) {
+            side_range = (boxes + operations) / threads + 1;
+        }
+        bench.shards = box_shards_create(backend, shards, side_range);
+        out_of_memory = (NULL == bench.shards);
+    } else {
+        factory = box_factory_create_with_backend(backend);
+        out_of_memory = (NULL == factory);
+        if (!out_of_memory && (NULL != log_path)) {
+            /* A new log, rather than a replay of the previous run's */
+            unlink(log_path);
+            bench.wal = box_wal_open(log_path, factory, group_size, 0);
+            if (NULL == bench.wal) {
+                fprintf(stderr, "Fatal error: can't create the log %s\n", log_path);
+                return -1;
+            }
+        }
+    }
+    bench.boxes = calloc(sizeof(bench_box_t), boxes + operations);
+    for (i = 0; i < BENCH_OP_COUNT; i++) {
+        bench.latencies[i] = calloc(sizeof(unsigned long long), operations);
+        if (NULL == bench.latencies[i]) {
+            out_of_memory = true;
+        }
+    }
+    if (out_of_memory || (NULL == bench.boxes) ||
+        ((bench.workload == WORKLOAD_ZIPF) && !zipf_init(&bench))) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        return -1;
+    }
+
+    printf("Workload %s: %u boxes, %u operations, range %u, seed %u, backend %s\n",
+           workload_names[bench.workload], boxes, operations, bench.range, seed, backend_names[backend]);
+
+    if (threads > 0) {
+        printf("Threads %u, shards %u\n", threads, shards);
+        if (!bench_threads(&bench, threads, boxes, operations)) {
+            fprintf(stderr, "Fatal error: out of memory\n");
+            return -1;
+        }
+
+        report(&bench);
+
+        start = now_ns();
+        box_shards_destroy(bench.shards);
+        printf("Destroy: %.3f sec\n", (now_ns() - start) / 1e9);
+        return 0;
+    }
+
+    start = now_ns();
+    for (i = 0; i < boxes; i++) {
+        bench.boxes[i] = next_box(&bench);
+        if (!bulk_load && !((NULL != bench.wal) ? box_wal_insert(bench.wal, factory, bench.boxes[i].side, bench.boxes[i].height) :
+                                                  box_factory_insert(factory, bench.boxes[i].side, bench.boxes[i].height))) {
+            fprintf(stderr, "Fatal error: insertion failed (out of memory)\n");
+            return -1;
+        }
+    }
+    if (bulk_load) {
+        box_factory_destroy(factory);
+        dump = calloc(sizeof(box_factory_box_t), boxes);
+        for (i = 0; (NULL != dump) && (i < boxes); i++) {
+            dump[i].side = bench.boxes[i].side;
+            dump[i].height = bench.boxes[i].height;
+        }
+        factory = (NULL == dump) ? NULL : box_factory_build_from_array(dump, boxes, 0);
+        free(dump);
+        if (NULL == factory) {
+            fprintf(stderr, "Fatal error: bulk load failed (out of memory)\n");
+            return -1;
+        }
+    }
+    bench.box_count = boxes;
+    printf("Preload: %.3f sec\n", (now_ns() - start) / 1e9);
+
+    if (factory_stats) {
+        /* Only the operations are reported, without the preload */
+        box_factory_stats(factory, NULL, true);
+    }
+
+    for (i = 0; i < operations; i++) {
+        if (!run_op(&bench, factory, random_below(&bench, BENCH_OP_COUNT))) {
+            fprintf(stderr, "Fatal error: insertion failed (out of memory)\n");
+            return -1;
+        }
+    }
+
+    report(&bench);
+    if (factory_stats) {
+        report_stats(factory);
+    }
+    if (factory_shape) {
+        report_shape(factory);
+    }
+
+    if (batch_queries && !bench_batch_queries(&bench, factory, operations, query_threads)) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        return -1;
+    }
+
+    start = now_ns();
+    box_factory_destroy(factory);
+    printf("Destroy: %.3f sec\n", (now_ns() - start) / 1e9);
+
+    if (NULL != bench.wal) {
+        if (false == box_wal_close(bench.wal)) {
+            fprintf(stderr, "Fatal error: writing the log failed\n");
+            return -1;
+        }
+
+        start = now_ns();
+        factory = box_factory_create_with_backend(backend);
+        bench.wal = (NULL == factory) ? NULL : box_wal_open(log_path, factory, group_size, 0);
+        if (NULL == bench.wal) {
+            fprintf(stderr, "Fatal error: replaying the log failed\n");
+            return -1;
+        }
+        printf("Replay: %.3f sec\n", (now_ns() - start) / 1e9);
+        box_wal_close(bench.wal);
+        box_factory_destroy(factory);
+    }
+
+    return 0;
+}
@@ -0,0 +1,965 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "box_factory.h"
+#include "box_flat.h"
+#include "range_tree.h"
+#include "parallel_sort.h"
+
+/* Beyond BOX_FACTORY_FLAT_MAX distinct boxes, so the volume index takes all of its forms */
+#define SIDE_RANGE (48)
+#define HEIGHT_RANGE (48)
+#define BOXES (4000)
+#define QUERY_STEP (5)
+
+/* BOX_FACTORY_FLAT_MIN, below which the volume index is always a flat array */
+#define FLAT_MIN (256)
+
+/* Enough boxes for box_factory_build_from_array to sort them on several threads */
+#define BUILD_BOXES (4 * PARALLEL_SORT_MIN_CHUNK + 1)
+
+/* The heights of side 3 in test_shape, enough to promote its subtree by side to a tree */
+#define SHAPE_HEIGHTS (10)
+
+/* The calls of each operation type in test_stats */
+#define STATS_CALLS (1000)
+
+/* Enough queries for a batch to be split between several threads */
+#define BATCH_QUERIES (20000)
+
+/* More than the number of distinct boxes, so the k best are all of the boxes that fit */
+#define MAX_FITS (SIDE_RANGE * HEIGHT_RANGE + 1)
+
+/* The order of a model of box_factory_get_boxes_k_by: whether box a is worse than box b for a
+   query of side_square and height
+ */
+typedef bool (*model_worse_t)(const box_factory_fit_t *a, const box_factory_fit_t *b, unsigned int side_square, unsigned int height);
+
+/* The expected contents of the factory, the number of instances of each box by side and height */
+static unsigned int model[SIDE_RANGE + 1][HEIGHT_RANGE + 1];
+
+/* model_clear - empty the model */
+static void model_clear(void)
+{
+    memset(model, 0, sizeof(model));
+}
+
+/* random_box - a random box within the ranges */
+static box_factory_box_t random_box(void)
+{
+    box_factory_box_t box = {.side = rand() % SIDE_RANGE + 1, .height = rand() % HEIGHT_RANGE + 1};
+
+    return box;
+}
+
+/* model_get_box - the expected result of box_factory_get_box */
+static bool model_get_box(unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    unsigned long long best = 0;
+    unsigned long long volume = 0;
+    unsigned int s = 0;
+    unsigned int h = 0;
+    bool found = false;
+
+    /* By side first, so the first box of the least volume is also the one of the smallest side */
+    for (s = side; s <= SIDE_RANGE; s++) {
+        for (h = height; h <= HEIGHT_RANGE; h++) {
+            if (model[s][h] == 0) {
+                continue;
+            }
+            volume = (unsigned long long) s * s * h;
+            if (!found || (volume < best)) {
+                best = volume;
+                *found_side_square = s * s;
+                *found_height = h;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+/* model_check_box - the expected result of box_factory_check_box */
+static bool model_check_box(unsigned int side, unsigned int height)
+{
+    unsigned int s = 0;
+    unsigned int h = 0;
+
+    for (s = side; s <= SIDE_RANGE; s++) {
+        for (h = height; h <= HEIGHT_RANGE; h++) {
+            if (model[s][h] > 0) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* verify_factory - every query of the factory must match the model, and the volume index must hold
+   every distinct box, however the factory was made
+ */
+static void verify_factory(box_factory_t *factory)
+{
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int expected_side_square = 0;
+    unsigned int expected_height = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    unsigned int distinct = 0;
+    bool found = false;
+
+    for (side = 1; side <= SIDE_RANGE; side++) {
+        for (height = 1; height <= HEIGHT_RANGE; height++) {
+            distinct += (model[side][height] > 0);
+        }
+    }
+    if (NULL != factory->flat_index) {
+        assert((factory->flat_index->size == distinct) && (range_tree_count(factory->index_by_volume) == 0));
+    } else {
+        assert((distinct > FLAT_MIN) && (range_tree_count(factory->index_by_volume) == distinct));
+    }
+
+    for (side = 0; side <= SIDE_RANGE + 1; side += QUERY_STEP) {
+        for (height = 0; height <= HEIGHT_RANGE + 1; height += QUERY_STEP) {
+            found = model_get_box(side, height, &expected_side_square, &expected_height);
+            assert(box_factory_get_box(factory, side, height, &found_side_square, &found_height) == found);
+            if (found) {
+                assert((found_side_square == expected_side_square) && (found_height == expected_height));
+            }
+            assert(box_factory_check_box(factory, side, height) == model_check_box(side, height));
+        }
+    }
+}
+
+/* fill_random - fill boxes with count random boxes, and count them in the model */
+static void fill_random(box_factory_box_t *boxes, size_t count)
+{
+    size_t i = 0;
+
+    for (i = 0; i < count; i++) {
+        boxes[i] = random_box();
+        model[boxes[i].side][boxes[i].height]++;
+    }
+}
+
+/* empty_factory - remove all of the boxes of the model from the factory, one by one */
+static void empty_factory(box_factory_t *factory)
+{
+    unsigned int side = 0;
+    unsigned int height = 0;
+
+    for (side = 1; side <= SIDE_RANGE; side++) {
+        for (height = 1; height <= HEIGHT_RANGE; height++) {
+            for (; model[side][height] > 0; model[side][height]--) {
+                assert(box_factory_remove(factory, side, height));
+            }
+            assert(!box_factory_remove(factory, side, height));
+        }
+    }
+    verify_factory(factory);
+}
+
+static void test_build_from_array(void)
+{
+    static box_factory_box_t boxes[BUILD_BOXES];
+    box_factory_t *factory = NULL;
+    size_t counts[] = {1, 50, BOXES, BUILD_BOXES, BUILD_BOXES};
+    unsigned int threads[] = {1, 3, 1, 3, 0};
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    printf("Building an empty factory...\n");
+    model_clear();
+    factory = box_factory_build_from_array(boxes, 0, 0);
+    assert(factory);
+    verify_factory(factory);
+    assert(box_factory_insert(factory, 3, 4));
+    model[3][4]++;
+    verify_factory(factory);
+    empty_factory(factory);
+    box_factory_destroy(factory);
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        printf("Building a factory of %zu boxes on %u threads...\n", counts[i], threads[i]);
+        model_clear();
+        fill_random(boxes, counts[i]);
+        factory = box_factory_build_from_array(boxes, counts[i], threads[i]);
+        assert(factory);
+        verify_factory(factory);
+
+        /* The built trees keep working like inserted ones, with or without the range tree */
+        fill_random(boxes, 100);
+        for (j = 0; j < 100; j++) {
+            assert(box_factory_insert(factory, boxes[j].side, boxes[j].height));
+        }
+        verify_factory(factory);
+        for (; model[boxes[0].side][boxes[0].height] > 0; model[boxes[0].side][boxes[0].height]--) {
+            assert(box_factory_remove(factory, boxes[0].side, boxes[0].height));
+        }
+        verify_factory(factory);
+        empty_factory(factory);
+        box_factory_destroy(factory);
+    }
+}
+
+/* model_remove_batch - remove the boxes of a batch from the model, and return the number of boxes
+   that box_factory_remove_batch is expected to remove
+ */
+static size_t model_remove_batch(const box_factory_box_t *boxes, size_t count)
+{
+    size_t removed = 0;
+    size_t i = 0;
+
+    for (i = 0; i < count; i++) {
+        if (model[boxes[i].side][boxes[i].height] > 0) {
+            model[boxes[i].side][boxes[i].height]--;
+            removed++;
+        }
+    }
+
+    return removed;
+}
+
+static void test_batches(box_factory_backend_t backend, bool snapshots)
+{
+    static box_factory_box_t boxes[BOXES];
+    box_factory_t *factory = NULL;
+    size_t sizes[] = {1, 7, 300, BOXES};
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    unsigned int round = 0;
+
+    printf("Inserting and removing batches (backend %d%s)...\n", backend, snapshots ? ", with snapshots" : "");
+    model_clear();
+    factory = box_factory_create_with_backend(backend);
+    assert(factory);
+    if (snapshots) {
+        assert(box_factory_enable_snapshots(factory));
+    }
+
+    /* Empty batches change nothing */
+    assert(box_factory_insert_batch(factory, boxes, 0));
+    assert(box_factory_remove_batch(factory, boxes, 0) == 0);
+    verify_factory(factory);
+
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            /* Random boxes have many duplicates in the batch, and some are already in the factory */
+            count = sizes[i];
+            fill_random(boxes, count);
+            assert(box_factory_insert_batch(factory, boxes, count));
+            verify_factory(factory);
+
+            /* Some of the boxes don't exist, and some have less instances than the batch holds */
+            count = sizes[(i + round) % (sizeof(sizes) / sizeof(sizes[0]))];
+            for (j = 0; j < count; j++) {
+                boxes[j] = random_box();
+            }
+            assert(box_factory_remove_batch(factory, boxes, count) == model_remove_batch(boxes, count));
+            verify_factory(factory);
+        }
+    }
+
+    empty_factory(factory);
+    box_factory_destroy(factory);
+}
+
+/* verify_batch_queries - box_factory_get_box_batch and box_factory_check_box_batch of random queries
+   on several threads must match the model
+ */
+static void verify_batch_queries(box_factory_t *factory)
+{
+    static box_factory_box_t queries[BATCH_QUERIES];
+    static box_factory_get_result_t get_results[BATCH_QUERIES];
+    static bool check_results[BATCH_QUERIES];
+    unsigned int threads[] = {1, 4, 0};
+    unsigned int expected_side_square = 0;
+    unsigned int expected_height = 0;
+    unsigned int i = 0;
+    size_t j = 0;
+
+    for (j = 0; j < BATCH_QUERIES; j++) {
+        queries[j].side = rand() % (SIDE_RANGE + 2);
+        queries[j].height = rand() % (HEIGHT_RANGE + 2);
+    }
+
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        /* An empty batch touches no result */
+        get_results[0].found = true;
+        check_results[0] = true;
+        box_factory_get_box_batch(factory, queries, 0, get_results, threads[i]);
+        box_factory_check_box_batch(factory, queries, 0, check_results, threads[i]);
+        assert(get_results[0].found && check_results[0]);
+
+        memset(get_results, 0, sizeof(get_results));
+        memset(check_results, 0, sizeof(check_results));
+        box_factory_get_box_batch(factory, queries, BATCH_QUERIES, get_results, threads[i]);
+        box_factory_check_box_batch(factory, queries, BATCH_QUERIES, check_results, threads[i]);
+
+        for (j = 0; j < BATCH_QUERIES; j++) {
+            assert(get_results[j].found == model_get_box(queries[j].side, queries[j].height, &expected_side_square, &expected_height));
+            if (get_results[j].found) {
+                assert((get_results[j].side_square == expected_side_square) && (get_results[j].height == expected_height));
+            }
+            assert(check_results[j] == model_check_box(queries[j].side, queries[j].height));
+        }
+    }
+}
+
+/* test_take_box - each take must remove the box that GetBox finds, and only it, until the factory is
+   emptied by takes alone
+ */
+static void test_take_box(box_factory_backend_t backend, bool snapshots)
+{
+    static box_factory_box_t boxes[BOXES];
+    box_factory_t *factory = NULL;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int expected_side_square = 0;
+    unsigned int expected_height = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    unsigned int i = 0;
+    bool found = false;
+
+    printf("Taking boxes (backend %d%s)...\n", backend, snapshots ? ", with snapshots" : "");
+    model_clear();
+    factory = box_factory_create_with_backend(backend);
+    assert(factory);
+    if (snapshots) {
+        assert(box_factory_enable_snapshots(factory));
+    }
+    assert(!box_factory_take_box(factory, 0, 0, &found_side_square, &found_height));
+
+    /* Both in the range tree and, once most boxes were taken, in the flat array */
+    fill_random(boxes, BOXES);
+    assert(box_factory_insert_batch(factory, boxes, BOXES));
+    for (i = 0; i < 4 * BOXES; i++) {
+        side = rand() % (SIDE_RANGE + 2);
+        height = rand() % (HEIGHT_RANGE + 2);
+        found = model_get_box(side, height, &expected_side_square, &expected_height);
+        assert(box_factory_take_box(factory, side, height, &found_side_square, &found_height) == found);
+        if (found) {
+            assert((found_side_square == expected_side_square) && (found_height == expected_height));
+            for (side = 1; side * side < found_side_square; side++);
+            model[side][found_height]--;
+        }
+        if (i % 500 == 0) {
+            verify_factory(factory);
+        }
+    }
+    verify_factory(factory);
+
+    while (model_get_box(0, 0, &expected_side_square, &expected_height)) {
+        assert(box_factory_take_box(factory, 0, 0, &found_side_square, &found_height));
+        assert((found_side_square == expected_side_square) && (found_height == expected_height));
+        for (side = 1; side * side < found_side_square; side++);
+        model[side][found_height]--;
+    }
+    assert(!box_factory_take_box(factory, 0, 0, &found_side_square, &found_height));
+    verify_factory(factory);
+
+    box_factory_destroy(factory);
+}
+
+/* verify_snapshot - the snapshot's queries must match the model */
+static void verify_snapshot(box_snapshot_t *snapshot)
+{
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int expected_side_square = 0;
+    unsigned int expected_height = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    bool found = false;
+
+    for (side = 0; side <= SIDE_RANGE + 1; side += QUERY_STEP) {
+        for (height = 0; height <= HEIGHT_RANGE + 1; height += QUERY_STEP) {
+            found = model_get_box(side, height, &expected_side_square, &expected_height);
+            assert(box_snapshot_get_box(snapshot, side, height, &found_side_square, &found_height) == found);
+            if (found) {
+                assert((found_side_square == expected_side_square) && (found_height == expected_height));
+            }
+            assert(box_snapshot_check_box(snapshot, side, height) == model_check_box(side, height));
+        }
+    }
+}
+
+/* test_snapshots - a snapshot must keep answering for the boxes that the factory had when it was
+   taken, however the factory changes afterwards
+ */
+static void test_snapshots(box_factory_backend_t backend)
+{
+    static box_factory_box_t boxes[BOXES];
+    static unsigned int model_before[SIDE_RANGE + 1][HEIGHT_RANGE + 1];
+    static unsigned int model_after[SIDE_RANGE + 1][HEIGHT_RANGE + 1];
+    box_factory_t *factory = NULL;
+    box_snapshot_t *before = NULL;
+    box_snapshot_t *after = NULL;
+    box_factory_box_t box;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int side = 0;
+    unsigned int i = 0;
+
+    printf("Querying snapshots (backend %d)...\n", backend);
+    model_clear();
+    factory = box_factory_create_with_backend(backend);
+    assert(factory);
+    assert(NULL == box_factory_snapshot(factory));
+
+    /* The boxes that are already in the factory are copied when snapshots are enabled */
+    fill_random(boxes, BOXES);
+    assert(box_factory_insert_batch(factory, boxes, BOXES));
+    assert(box_factory_enable_snapshots(factory));
+    before = box_factory_snapshot(factory);
+    assert(before);
+    verify_snapshot(before);
+    memcpy(model_before, model, sizeof(model));
+
+    /* Every kind of change, one box at a time and in batches */
+    for (i = 0; i < BOXES; i++) {
+        box = random_box();
+        switch (rand() % 3) {
+        case 0:
+            assert(box_factory_insert(factory, box.side, box.height));
+            model[box.side][box.height]++;
+            break;
+        case 1:
+            assert(box_factory_remove(factory, box.side, box.height) == (model[box.side][box.height] > 0));
+            model[box.side][box.height] -= (model[box.side][box.height] > 0);
+            break;
+        default:
+            if (box_factory_take_box(factory, box.side, box.height, &found_side_square, &found_height)) {
+                for (side = 1; side * side < found_side_square; side++);
+                model[side][found_height]--;
+            }
+            break;
+        }
+    }
+    assert(box_factory_remove_batch(factory, boxes, BOXES) == model_remove_batch(boxes, BOXES));
+    verify_factory(factory);
+
+    after = box_factory_snapshot(factory);
+    assert(after);
+    verify_snapshot(after);
+    memcpy(model_after, model, sizeof(model));
+    fill_random(boxes, BOXES / 4);
+    assert(box_factory_insert_batch(factory, boxes, BOXES / 4));
+    verify_factory(factory);
+
+    /* Both versions are as they were, even once the factory is gone */
+    empty_factory(factory);
+    box_factory_destroy(factory);
+    memcpy(model, model_before, sizeof(model));
+    verify_snapshot(before);
+    box_snapshot_release(before);
+    memcpy(model, model_after, sizeof(model));
+    verify_snapshot(after);
+    box_snapshot_release(after);
+}
+
+/* main_tree_height, subtree_height - the number of nodes on the longest path down from node */
+static unsigned int main_tree_height(box_main_tree_t *tree, box_main_tree_node_t *node)
+{
+    unsigned int left = 0;
+    unsigned int right = 0;
+
+    if (&(tree->nil) == node) {
+        return 0;
+    }
+    left = main_tree_height(tree, node->left);
+    right = main_tree_height(tree, node->right);
+    return 1 + ((left > right) ? left : right);
+}
+
+static unsigned int subtree_height(box_subtree_tree_t *tree, box_subtree_tree_node_t *node)
+{
+    unsigned int left = 0;
+    unsigned int right = 0;
+
+    if (&(tree->nil) == node) {
+        return 0;
+    }
+    left = subtree_height(tree, node->left);
+    right = subtree_height(tree, node->right);
+    return 1 + ((left > right) ? left : right);
+}
+
+/* test_shape - box_factory_shape of a known factory: side 1 has a single height, side 2 has 2 and
+   side 3 has SHAPE_HEIGHTS, so only side 3's subtree (by side) is promoted to a tree
+ */
+static void test_shape(void)
+{
+    box_factory_t *factory = NULL;
+    box_factory_shape_t shape;
+    box_main_tree_node_t *main_node = NULL;
+    unsigned int height = 0;
+
+    printf("Measuring shapes...\n");
+    factory = box_factory_create_with_backend(BOX_FACTORY_BP_TREE);
+    assert(factory);
+    assert(!box_factory_shape(factory, &shape));
+    box_factory_destroy(factory);
+
+    factory = box_factory_create();
+    assert(factory);
+    assert(box_factory_shape(factory, &shape));
+    assert((shape.by_side.main.nodes == 0) && (shape.by_side.main.height == 0) && (shape.by_side.subtree_values == 0));
+    assert((shape.by_height.main.nodes == 0) && (shape.by_height.main.height == 0) && (shape.by_height.subtree_values == 0));
+
+    /* Another instance of a box changes only its count */
+    assert(box_factory_insert(factory, 1, 1) && box_factory_insert(factory, 1, 1));
+    assert(box_factory_insert(factory, 2, 1) && box_factory_insert(factory, 2, 2));
+    for (height = 1; height <= SHAPE_HEIGHTS; height++) {
+        assert(box_factory_insert(factory, 3, height));
+    }
+    assert(box_factory_shape(factory, &shape));
+
+    assert((shape.by_side.main.nodes == 3) && (shape.by_side.main.height == 2));
+    assert(shape.by_side.subtree_values == 1 + 2 + SHAPE_HEIGHTS);
+    assert((shape.by_side.subtree_trees == 1) && (shape.by_side.subtree_nodes == SHAPE_HEIGHTS));
+    main_node = factory->tree_by_side->max;
+    assert((main_node->key == 9) && main_node->subtree.is_tree);
+    assert(shape.by_side.subtree_max_height == subtree_height(main_node->subtree.tree, main_node->subtree.tree->head));
+    assert((shape.by_side.subtree_sizes[0] == 1) && (shape.by_side.subtree_sizes[1] == 1) && (shape.by_side.subtree_sizes[3] == 1));
+    assert(shape.by_side.key_bytes == (3 + 1 + 2 + SHAPE_HEIGHTS) * 2 * sizeof(unsigned int));
+    assert(shape.by_side.subtree_header_bytes == 3 * sizeof(box_subtree_t));
+
+    /* By height, heights 1 and 2 have 3 and 2 sides, and the rest have side 3 alone, all inline */
+    assert(shape.by_height.main.nodes == SHAPE_HEIGHTS);
+    assert(shape.by_height.main.height == main_tree_height(factory->tree_by_height, factory->tree_by_height->head));
+    assert(shape.by_height.subtree_values == 1 + 2 + SHAPE_HEIGHTS);
+    assert((shape.by_height.subtree_trees == 0) && (shape.by_height.subtree_nodes == 0) && (shape.by_height.subtree_max_height == 0));
+    assert((shape.by_height.subtree_sizes[0] == SHAPE_HEIGHTS - 2) && (shape.by_height.subtree_sizes[1] == 2));
+    assert(shape.by_height.subtree_node_bytes == 0);
+    assert(shape.pool_bytes >= shape.by_side.main.node_bytes + shape.by_side.subtree_node_bytes + shape.by_height.main.node_bytes);
+
+    /* Side 3's subtree is demoted back inline once it is down to BOX_SUBTREE_DEMOTE heights */
+    for (height = SHAPE_HEIGHTS; height > BOX_SUBTREE_DEMOTE; height--) {
+        assert(box_factory_remove(factory, 3, height));
+    }
+    assert(box_factory_shape(factory, &shape));
+    assert((shape.by_side.main.nodes == 3) && (shape.by_side.subtree_values == 1 + 2 + BOX_SUBTREE_DEMOTE));
+    assert((shape.by_side.subtree_trees == 0) && (shape.by_side.subtree_nodes == 0) && (shape.by_side.subtree_max_height == 0));
+    assert((shape.by_side.subtree_sizes[0] == 1) && (shape.by_side.subtree_sizes[1] == 2));
+    assert(shape.by_height.main.nodes == BOX_SUBTREE_DEMOTE);
+    assert(shape.by_height.main.height == main_tree_height(factory->tree_by_height, factory->tree_by_height->head));
+
+    box_factory_destroy(factory);
+}
+
+/* test_stats - box_factory_stats counts the calls of each operation type apart, samples them at the
+   interval, and only allocates the statistics of the types that were called
+ */
+static void test_stats(void)
+{
+    box_factory_stats_t *stats = NULL;
+    box_factory_t *factory = NULL;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int op = 0;
+    unsigned int i = 0;
+
+    printf("Counting operations...\n");
+    stats = malloc(sizeof(box_factory_stats_t));
+    factory = box_factory_create();
+    assert(stats && factory);
+    assert(box_factory_stats(factory, stats, false));
+    for (op = 0; op < BOX_FACTORY_OPS; op++) {
+        assert((NULL == factory->stats[op].stats) && (stats->ops[op].calls == 0) && (stats->ops[op].samples == 0));
+    }
+
+    /* Interleaved, so a countdown that the types shared would sample only one of them */
+    for (i = 0; i < STATS_CALLS; i++) {
+        assert(box_factory_insert(factory, i % SIDE_RANGE + 1, i % HEIGHT_RANGE + 1));
+        assert(box_factory_get_box(factory, 1, 1, &found_side_square, &found_height));
+    }
+    assert(box_factory_check_box(factory, 1, 1));
+    assert(box_factory_stats(factory, stats, false));
+    for (op = 0; op < BOX_FACTORY_OPS; op++) {
+        switch (op) {
+        case BOX_FACTORY_OP_INSERT:
+        case BOX_FACTORY_OP_GET_BOX:
+            assert((NULL != factory->stats[op].stats) && (stats->ops[op].calls == STATS_CALLS));
+            assert(stats->ops[op].samples == (STATS_CALLS + OP_STATS_SAMPLE_INTERVAL - 1) / OP_STATS_SAMPLE_INTERVAL);
+            assert(stats->ops[op].latency_max >= op_stats_percentile(&(stats->ops[op]), 50));
+            break;
+        case BOX_FACTORY_OP_CHECK_BOX:
+            assert((stats->ops[op].calls == 1) && (stats->ops[op].samples == 1));
+            break;
+        default:
+            assert((NULL == factory->stats[op].stats) && (stats->ops[op].calls == 0));
+            break;
+        }
+    }
+    assert(stats->ops[BOX_FACTORY_OP_INSERT].counters.allocations > 0);
+
+    /* A reset zeroes them all */
+    assert(box_factory_stats(factory, NULL, true));
+    assert(box_factory_stats(factory, stats, false));
+    for (op = 0; op < BOX_FACTORY_OPS; op++) {
+        assert((stats->ops[op].calls == 0) && (stats->ops[op].samples == 0) && (op_stats_percentile(&(stats->ops[op]), 50) == 0));
+    }
+
+    box_factory_destroy(factory);
+    free(stats);
+}
+
+static void test_batch_queries(void)
+{
+    static box_factory_box_t boxes[BOXES];
+    box_factory_t *factory = NULL;
+    size_t i = 0;
+
+    printf("Answering batches of queries...\n");
+    model_clear();
+    factory = box_factory_create();
+    assert(factory);
+    verify_batch_queries(factory);
+
+    /* In the flat array and in the range tree */
+    fill_random(boxes, 100);
+    for (i = 0; i < 100; i++) {
+        assert(box_factory_insert(factory, boxes[i].side, boxes[i].height));
+    }
+    verify_batch_queries(factory);
+
+    fill_random(boxes, BOXES);
+    assert(box_factory_insert_batch(factory, boxes, BOXES));
+    assert(NULL == factory->flat_index);
+    verify_batch_queries(factory);
+
+    assert(box_factory_remove_batch(factory, boxes, 1) == model_remove_batch(boxes, 1));
+    assert(NULL == factory->flat_index);
+    verify_batch_queries(factory);
+
+    empty_factory(factory);
+    box_factory_destroy(factory);
+}
+
+/* model_worse_volume - the order of box_factory_get_box: the least volume, and then the smallest side */
+static bool model_worse_volume(const box_factory_fit_t *a, const box_factory_fit_t *b, unsigned int side_square, unsigned int height)
+{
+    unsigned long long a_volume = (unsigned long long) a->side_square * a->height;
+    unsigned long long b_volume = (unsigned long long) b->side_square * b->height;
+
+    (void) side_square;
+    (void) height;
+    if (a_volume != b_volume) {
+        return a_volume > b_volume;
+    }
+    return a->side_square > b->side_square;
+}
+
+/* model_worse_height - the lowest height, and then the smallest side */
+static bool model_worse_height(const box_factory_fit_t *a, const box_factory_fit_t *b, unsigned int side_square, unsigned int height)
+{
+    (void) side_square;
+    (void) height;
+    if (a->height != b->height) {
+        return a->height > b->height;
+    }
+    return a->side_square > b->side_square;
+}
+
+/* model_worse_side - the smallest side, and then the lowest height */
+static bool model_worse_side(const box_factory_fit_t *a, const box_factory_fit_t *b, unsigned int side_square, unsigned int height)
+{
+    (void) side_square;
+    (void) height;
+    if (a->side_square != b->side_square) {
+        return a->side_square > b->side_square;
+    }
+    return a->height > b->height;
+}
+
+/* model_waste - whether the waste of box a, the larger excess of its side^2 and height over the
+   query's as a fraction of the query's (of 1 for an empty dimension), is more than box b's (1),
+   the same (0) or less (-1)
+ */
+static int model_waste(const box_factory_fit_t *a, const box_factory_fit_t *b, unsigned int side_square, unsigned int height)
+{
+    unsigned long long side_base = (side_square > 0) ? side_square : 1;
+    unsigned long long height_base = (height > 0) ? height : 1;
+    unsigned long long a_side = (a->side_square - side_square) * height_base;
+    unsigned long long a_height = (a->height - height) * side_base;
+    unsigned long long b_side = (b->side_square - side_square) * height_base;
+    unsigned long long b_height = (b->height - height) * side_base;
+    unsigned long long a_waste = (a_side > a_height) ? a_side : a_height;
+    unsigned long long b_waste = (b_side > b_height) ? b_side : b_height;
+
+    /* Both wastes are over the same side_base * height_base */
+    return (a_waste > b_waste) - (a_waste < b_waste);
+}
+
+/* model_worse_waste - the least waste, and then the least volume and side */
+static bool model_worse_waste(const box_factory_fit_t *a, const box_factory_fit_t *b, unsigned int side_square, unsigned int height)
+{
+    int waste = model_waste(a, b, side_square, height);
+
+    if (waste != 0) {
+        return waste > 0;
+    }
+    return model_worse_volume(a, b, side_square, height);
+}
+
+/* The models of the objectives, by box_factory_objective_t */
+static const model_worse_t model_objectives[BOX_FACTORY_OBJECTIVES] = {
+    model_worse_volume,
+    model_worse_height,
+    model_worse_side,
+    model_worse_waste,
+};
+
+/* model_get_boxes_k - the expected result of box_factory_get_boxes_k by the order worse: all of the
+   boxes that fit, in an insertion sort, cut at k
+ */
+static size_t model_get_boxes_k(unsigned int side, unsigned int height, model_worse_t worse, box_factory_fit_t *fits, size_t k)
+{
+    box_factory_fit_t fit;
+    size_t count = 0;
+    size_t i = 0;
+    unsigned int s = 0;
+    unsigned int h = 0;
+
+    for (s = side; s <= SIDE_RANGE; s++) {
+        for (h = height; h <= HEIGHT_RANGE; h++) {
+            if (model[s][h] == 0) {
+                continue;
+            }
+            fit.side_square = s * s;
+            fit.height = h;
+            fit.count = model[s][h];
+            for (i = count; (i > 0) && worse(&fits[i - 1], &fit, side * side, height); i--) {
+                fits[i] = fits[i - 1];
+            }
+            fits[i] = fit;
+            count++;
+        }
+    }
+
+    return (count < k) ? count : k;
+}
+
+/* verify_boxes_k - box_factory_get_box_by and box_factory_get_boxes_k_by (and
+   box_factory_get_boxes_k) of a grid of queries must match the model of every objective, for k of
+   none, one, a few, and more than the boxes that fit
+ */
+static void verify_boxes_k(box_factory_t *factory)
+{
+    static box_factory_fit_t fits[MAX_FITS];
+    static box_factory_fit_t expected[MAX_FITS];
+    static box_factory_fit_t volume_fits[MAX_FITS];
+    size_t ks[] = {0, 1, 3, 40, MAX_FITS};
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    int objective = 0;
+
+    for (side = 0; side <= SIDE_RANGE + 1; side += QUERY_STEP) {
+        for (height = 0; height <= HEIGHT_RANGE + 1; height += QUERY_STEP) {
+            for (objective = 0; objective < BOX_FACTORY_OBJECTIVES; objective++) {
+                count = model_get_boxes_k(side, height, model_objectives[objective], expected, 1);
+                assert(box_factory_get_box_by(factory, side, height, objective, &found_side_square, &found_height) == (count > 0));
+                if (count > 0) {
+                    assert((found_side_square == expected[0].side_square) && (found_height == expected[0].height));
+                }
+
+                for (i = 0; i < sizeof(ks) / sizeof(ks[0]); i++) {
+                    count = model_get_boxes_k(side, height, model_objectives[objective], expected, ks[i]);
+                    assert(box_factory_get_boxes_k_by(factory, side, height, objective, fits, ks[i]) == count);
+                    if (objective == BOX_FACTORY_FIT_VOLUME) {
+                        assert(box_factory_get_boxes_k(factory, side, height, volume_fits, ks[i]) == count);
+                        assert(0 == memcmp(fits, volume_fits, count * sizeof(fits[0])));
+                    }
+                    for (j = 0; j < count; j++) {
+                        assert(fits[j].side_square == expected[j].side_square);
+                        assert(fits[j].height == expected[j].height);
+                        assert(fits[j].count == expected[j].count);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void test_boxes_k(box_factory_backend_t backend)
+{
+    static box_factory_box_t boxes[BOXES];
+    box_factory_fit_t fits[4];
+    box_factory_t *factory = NULL;
+    size_t i = 0;
+
+    printf("Getting the k best boxes by each objective (backend %d)...\n", backend);
+    model_clear();
+    factory = box_factory_create_with_backend(backend);
+    assert(factory);
+    verify_boxes_k(factory);
+
+    /* Ties of volume go to the smallest side, and so do ties of waste (of 8 for both 2x9 and 3x4) */
+    assert(box_factory_insert(factory, 6, 1));
+    assert(box_factory_insert(factory, 2, 9));
+    assert(box_factory_insert(factory, 3, 4));
+    assert(box_factory_insert(factory, 3, 4));
+    assert(box_factory_get_boxes_k(factory, 1, 1, fits, 4) == 3);
+    assert((fits[0].side_square == 4) && (fits[0].height == 9) && (fits[0].count == 1));
+    assert((fits[1].side_square == 9) && (fits[1].height == 4) && (fits[1].count == 2));
+    assert((fits[2].side_square == 36) && (fits[2].height == 1) && (fits[2].count == 1));
+    assert(box_factory_get_boxes_k_by(factory, 1, 1, BOX_FACTORY_FIT_WASTE, fits, 4) == 3);
+    assert((fits[0].side_square == 4) && (fits[1].side_square == 9) && (fits[2].side_square == 36));
+    assert(box_factory_get_boxes_k_by(factory, 1, 1, BOX_FACTORY_FIT_HEIGHT, fits, 4) == 3);
+    assert((fits[0].height == 1) && (fits[1].height == 4) && (fits[2].height == 9));
+    assert(box_factory_get_boxes_k_by(factory, 1, 1, BOX_FACTORY_FIT_SIDE, fits, 4) == 3);
+    assert((fits[0].side_square == 4) && (fits[1].side_square == 9) && (fits[2].side_square == 36));
+    model[6][1] = 1;
+    model[2][9] = 1;
+    model[3][4] = 2;
+    verify_boxes_k(factory);
+
+    /* In the flat array and in the range tree */
+    fill_random(boxes, 100);
+    assert(box_factory_insert_batch(factory, boxes, 100));
+    verify_boxes_k(factory);
+
+    fill_random(boxes, BOXES);
+    assert(box_factory_insert_batch(factory, boxes, BOXES));
+    assert(NULL == factory->flat_index);
+    verify_boxes_k(factory);
+
+    for (i = 0; i < 100; i++) {
+        boxes[i] = random_box();
+    }
+    assert(box_factory_remove_batch(factory, boxes, 100) == model_remove_batch(boxes, 100));
+    verify_boxes_k(factory);
+
+    empty_factory(factory);
+    verify_boxes_k(factory);
+    box_factory_destroy(factory);
+}
+
+/* verify_save_open - the factory saved to path and opened again must match the model */
+static void verify_save_open(box_factory_t *factory, const char *path)
+{
+    box_factory_t *opened = NULL;
+
+    assert(box_factory_save(factory, path));
+    opened = box_factory_open(path);
+    assert(opened);
+    verify_factory(opened);
+    verify_boxes_k(opened);
+
+    /* The opened factory keeps working like any other */
+    assert(box_factory_insert(opened, 1, 1));
+    model[1][1]++;
+    verify_factory(opened);
+    model[1][1]--;
+    box_factory_destroy(opened);
+}
+
+static void test_save_open(box_factory_backend_t backend)
+{
+    static box_factory_box_t boxes[BOXES];
+    char directory[] = "/tmp/box_factory_test.XXXXXX";
+    char path[sizeof(directory) + 16];
+    char temporary_path[sizeof(path) + 16];
+    box_factory_t *factory = NULL;
+    box_factory_t *tampered = NULL;
+    range_tree_point_t runs[2];
+    FILE *file = NULL;
+    size_t sizes[] = {1, 100, BOXES};
+    size_t i = 0;
+
+    printf("Saving and opening factories (backend %d)...\n", backend);
+    assert(mkdtemp(directory));
+    sprintf(path, "%s/boxes", directory);
+    sprintf(temporary_path, "%s.tmp", path);
+    assert(NULL == box_factory_open(path));
+
+    model_clear();
+    factory = box_factory_create_with_backend(backend);
+    assert(factory);
+    verify_save_open(factory, path);
+
+    /* Each save replaces the last one, in the flat array and in the range tree */
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fill_random(boxes, sizes[i]);
+        assert(box_factory_insert_batch(factory, boxes, sizes[i]));
+        verify_save_open(factory, path);
+    }
+    assert(box_factory_remove_batch(factory, boxes, 100) == model_remove_batch(boxes, 100));
+    verify_save_open(factory, path);
+    assert(0 != access(temporary_path, F_OK));
+
+    /* Nor is a file whose runs by height hold as many boxes as its runs by side, but not the same
+       ones: (1, 2) twice and (2, 1) once, with the counts of the runs by height, (1, 4, 1) and
+       (2, 1, 2), swapped */
+    tampered = box_factory_create();
+    assert(tampered && box_factory_insert(tampered, 1, 2) && box_factory_insert(tampered, 1, 2) && box_factory_insert(tampered, 2, 1));
+    assert(box_factory_save(tampered, path));
+    box_factory_destroy(tampered);
+    tampered = box_factory_open(path);
+    assert(tampered);
+    box_factory_destroy(tampered);
+    file = fopen(path, "r+b");
+    assert(file && (0 == fseek(file, -(long) sizeof(runs), SEEK_END)) && (1 == fread(runs, sizeof(runs), 1, file)));
+    assert((runs[0].x == 1) && (runs[0].y == 4) && (runs[0].count == 1) && (runs[1].count == 2));
+    runs[0].count = 2;
+    runs[1].count = 1;
+    assert((0 == fseek(file, -(long) sizeof(runs), SEEK_END)) && (1 == fwrite(runs, sizeof(runs), 1, file)));
+    fclose(file);
+    assert(NULL == box_factory_open(path));
+
+    /* A truncated file is not a valid box factory file */
+    assert(0 == truncate(path, 100));
+    assert(NULL == box_factory_open(path));
+    file = fopen(path, "wb");
+    assert(file);
+    fclose(file);
+    assert(NULL == box_factory_open(path));
+
+    /* Nor can a save go to a missing directory, which leaves nothing behind */
+    assert(0 == unlink(path));
+    assert(0 == rmdir(directory));
+    assert(!box_factory_save(factory, path));
+    assert(0 != access(temporary_path, F_OK));
+
+    empty_factory(factory);
+    box_factory_destroy(factory);
+}
+
+int main(void)
+{
+    srand(18);
+
+    test_build_from_array();
+    test_batches(BOX_FACTORY_RB_TREE, false);
+    test_batches(BOX_FACTORY_BP_TREE, false);
+    test_batches(BOX_FACTORY_RB_TREE, true);
+    test_take_box(BOX_FACTORY_RB_TREE, false);
+    test_take_box(BOX_FACTORY_BP_TREE, false);
+    test_take_box(BOX_FACTORY_RB_TREE, true);
+    test_snapshots(BOX_FACTORY_RB_TREE);
+    test_snapshots(BOX_FACTORY_BP_TREE);
+    test_batch_queries();
+    test_boxes_k(BOX_FACTORY_RB_TREE);
+    test_boxes_k(BOX_FACTORY_BP_TREE);
+    test_save_open(BOX_FACTORY_RB_TREE);
+    test_save_open(BOX_FACTORY_BP_TREE);
+    test_shape();
+    test_stats();
+
+    return 0;
+}
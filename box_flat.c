@@ -0,0 +1,501 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BOX_FLAT_X86
+#endif
+
+#include "box_flat.h"
+
+/* The capacity of a new array, which is doubled whenever it's full */
+#define BOX_FLAT_INITIAL_CAPACITY (64)
+
+/* The index of "no box" */
+#define BOX_FLAT_NONE ((size_t) -1)
+
+/* A scan kernel of box_flat_search_min, which returns the index of the best box, or BOX_FLAT_NONE */
+typedef size_t (* box_flat_search_min_t)(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+
+/* A scan kernel of box_flat_has_dominating */
+typedef bool (* box_flat_has_dominating_t)(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+
+/* The kernels in use, which are chosen once by select_kernels (or box_flat_use_kernel) */
+static box_flat_search_min_t search_min_kernel = NULL;
+static box_flat_has_dominating_t has_dominating_kernel = NULL;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* select_kernels - choose the best kernels that the CPU supports, for pthread_once. */
+static void select_kernels(void);
+
+/* find - returns the index of the box (side_square, height), or BOX_FLAT_NONE if it doesn't exist. */
+static size_t find(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+
+/* grow - double the capacity of the array. Returns false on an allocation failure, in which case the
+   array is left unchanged.
+ */
+static bool grow(box_flat_t *flat);
+
+/* search_min_from - the scalar scan of the boxes from index on, where best is the index of the best
+   box before them (or BOX_FLAT_NONE). Returns the index of the best box. The vector kernels use it
+   for the boxes that don't fill a vector.
+ */
+static size_t search_min_from(const box_flat_t *flat, size_t index, unsigned int side_square, unsigned int height, size_t best);
+
+/* has_dominating_from - the scalar scan of box_flat_has_dominating, from index on. */
+static bool has_dominating_from(const box_flat_t *flat, size_t index, unsigned int side_square, unsigned int height);
+
+/* search_min_scalar, has_dominating_scalar - the scalar kernels. */
+static size_t search_min_scalar(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+static bool has_dominating_scalar(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+
+#ifdef BOX_FLAT_X86
+/* search_min_sse42, has_dominating_sse42, search_min_avx2, has_dominating_avx2 - the vector kernels,
+   which are compiled for their instruction sets regardless of the build's target, and are only
+   called if the CPU supports them.
+ */
+static size_t search_min_sse42(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+static bool has_dominating_sse42(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+static size_t search_min_avx2(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+static bool has_dominating_avx2(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+
+/* reduce_lanes - the best index among count lanes of best volumes (flipped) and indices. */
+static size_t reduce_lanes(const box_flat_t *flat, const long long *volumes, const long long *indices, unsigned int count);
+#endif
+
+box_flat_t* box_flat_create(void)
+{
+    box_flat_t *flat = calloc(sizeof(box_flat_t), 1);
+
+    if (NULL == flat) {
+        return NULL;
+    }
+
+    if (false == grow(flat)) {
+        free(flat);
+        return NULL;
+    }
+
+    return flat;
+}
+
+void box_flat_destroy(box_flat_t *flat)
+{
+    free(flat->side_squares);
+    free(flat->heights);
+    free(flat->volumes);
+    free(flat->counts);
+    free(flat);
+}
+
+bool box_flat_insert(box_flat_t *flat, unsigned int side_square, unsigned int height, unsigned int count)
+{
+    size_t index = find(flat, side_square, height);
+
+    if (BOX_FLAT_NONE != index) {
+        flat->counts[index] += count;
+        return true;
+    }
+
+    if ((flat->size == flat->capacity) && !grow(flat)) {
+        return false;
+    }
+
+    index = flat->size++;
+    flat->side_squares[index] = side_square;
+    flat->heights[index] = height;
+    flat->volumes[index] = (unsigned long long) side_square * height;
+    flat->counts[index] = count;
+
+    return true;
+}
+
+bool box_flat_remove(box_flat_t *flat, unsigned int side_square, unsigned int height, unsigned int count)
+{
+    size_t index = find(flat, side_square, height);
+    size_t last = flat->size - 1;
+
+    if ((BOX_FLAT_NONE == index) || (flat->counts[index] < count)) {
+        return false;
+    }
+
+    flat->counts[index] -= count;
+    if (flat->counts[index] > 0) {
+        return true;
+    }
+
+    /* The order doesn't matter, so the last box takes the removed box's place */
+    flat->side_squares[index] = flat->side_squares[last];
+    flat->heights[index] = flat->heights[last];
+    flat->volumes[index] = flat->volumes[last];
+    flat->counts[index] = flat->counts[last];
+    flat->size--;
+
+    return true;
+}
+
+bool box_flat_search_min(const box_flat_t *flat, unsigned int side_square, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    size_t best = BOX_FLAT_NONE;
+
+    pthread_once(&kernels_once, select_kernels);
+
+    best = search_min_kernel(flat, side_square, height);
+    if (BOX_FLAT_NONE == best) {
+        return false;
+    }
+
+    *found_side_square = flat->side_squares[best];
+    *found_height = flat->heights[best];
+
+    return true;
+}
+
+bool box_flat_has_dominating(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    pthread_once(&kernels_once, select_kernels);
+
+    return has_dominating_kernel(flat, side_square, height);
+}
+
+bool box_flat_use_kernel(box_flat_kernel_t kernel)
+{
+    pthread_once(&kernels_once, select_kernels);
+
+    switch (kernel) {
+    case BOX_FLAT_KERNEL_SCALAR:
+        search_min_kernel = search_min_scalar;
+        has_dominating_kernel = has_dominating_scalar;
+        return true;
+#ifdef BOX_FLAT_X86
+    case BOX_FLAT_KERNEL_SSE42:
+        if (!__builtin_cpu_supports("sse4.2")) {
+            return false;
+        }
+        search_min_kernel = search_min_sse42;
+        has_dominating_kernel = has_dominating_sse42;
+        return true;
+    case BOX_FLAT_KERNEL_AVX2:
+        if (!__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+        search_min_kernel = search_min_avx2;
+        has_dominating_kernel = has_dominating_avx2;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+static void select_kernels(void)
+{
+    search_min_kernel = search_min_scalar;
+    has_dominating_kernel = has_dominating_scalar;
+
+#ifdef BOX_FLAT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        search_min_kernel = search_min_avx2;
+        has_dominating_kernel = has_dominating_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        search_min_kernel = search_min_sse42;
+        has_dominating_kernel = has_dominating_sse42;
+    }
+#endif
+}
+
+static size_t find(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    size_t i = 0;
+
+    for (i = 0; i < flat->size; i++) {
+        if ((flat->side_squares[i] == side_square) && (flat->heights[i] == height)) {
+            return i;
+        }
+    }
+
+    return BOX_FLAT_NONE;
+}
+
+static bool grow(box_flat_t *flat)
+{
+    size_t capacity = (flat->capacity == 0) ? BOX_FLAT_INITIAL_CAPACITY : flat->capacity * 2;
+    unsigned int *side_squares = malloc(capacity * sizeof(unsigned int));
+    unsigned int *heights = malloc(capacity * sizeof(unsigned int));
+    unsigned long long *volumes = malloc(capacity * sizeof(unsigned long long));
+    unsigned int *counts = malloc(capacity * sizeof(unsigned int));
+
+    /* The arrays are replaced only once all of them are allocated, so a failure changes nothing */
+    if ((NULL == side_squares) || (NULL == heights) || (NULL == volumes) || (NULL == counts)) {
+        free(side_squares);
+        free(heights);
+        free(volumes);
+        free(counts);
+        return false;
+    }
+
+    if (flat->size > 0) {
+        memcpy(side_squares, flat->side_squares, flat->size * sizeof(unsigned int));
+        memcpy(heights, flat->heights, flat->size * sizeof(unsigned int));
+        memcpy(volumes, flat->volumes, flat->size * sizeof(unsigned long long));
+        memcpy(counts, flat->counts, flat->size * sizeof(unsigned int));
+    }
+    free(flat->side_squares);
+    free(flat->heights);
+    free(flat->volumes);
+    free(flat->counts);
+
+    flat->side_squares = side_squares;
+    flat->heights = heights;
+    flat->volumes = volumes;
+    flat->counts = counts;
+    flat->capacity = capacity;
+
+    return true;
+}
+
+static size_t search_min_from(const box_flat_t *flat, size_t index, unsigned int side_square, unsigned int height, size_t best)
+{
+    size_t i = 0;
+
+    for (i = index; i < flat->size; i++) {
+        if ((flat->side_squares[i] < side_square) || (flat->heights[i] < height)) {
+            continue;
+        }
+
+        if ((BOX_FLAT_NONE == best) ||
+            (flat->volumes[i] < flat->volumes[best]) ||
+            ((flat->volumes[i] == flat->volumes[best]) && (flat->side_squares[i] < flat->side_squares[best]))) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static bool has_dominating_from(const box_flat_t *flat, size_t index, unsigned int side_square, unsigned int height)
+{
+    size_t i = 0;
+
+    for (i = index; i < flat->size; i++) {
+        if ((flat->side_squares[i] >= side_square) && (flat->heights[i] >= height)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static size_t search_min_scalar(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    return search_min_from(flat, 0, side_square, height, BOX_FLAT_NONE);
+}
+
+static bool has_dominating_scalar(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    return has_dominating_from(flat, 0, side_square, height);
+}
+
+#ifdef BOX_FLAT_X86
+
+/* The vector kernels keep a running best (volume, side^2, index) per 64 bit lane, and reduce the
+   lanes at the end. x86 only compares signed 64 bit values, so the volumes are compared with their
+   top bit flipped (side squares fit in 63 bits as they are). A lane's best starts as the max
+   volume, which no box has, and an index of BOX_FLAT_NONE.
+ */
+#define BOX_FLAT_SIGN_BIT ((long long) 0x8000000000000000ULL)
+#define BOX_FLAT_MAX_SIGNED ((long long) 0x7fffffffffffffffULL)
+
+static size_t reduce_lanes(const box_flat_t *flat, const long long *volumes, const long long *indices, unsigned int count)
+{
+    size_t best = BOX_FLAT_NONE;
+    size_t index = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < count; i++) {
+        index = (size_t) indices[i];
+        if (BOX_FLAT_NONE == index) {
+            continue;
+        }
+
+        if ((BOX_FLAT_NONE == best) ||
+            (volumes[i] < (long long) (flat->volumes[best] ^ BOX_FLAT_SIGN_BIT)) ||
+            ((volumes[i] == (long long) (flat->volumes[best] ^ BOX_FLAT_SIGN_BIT)) && (flat->side_squares[index] < flat->side_squares[best]))) {
+            best = index;
+        }
+    }
+
+    return best;
+}
+
+/* update_sse42 - update the running best of 2 lanes with the boxes of the lanes, of which only those
+   in fit (a 64 bit mask per lane) count.
+ */
+__attribute__((target("sse4.2"), always_inline))
+static inline void update_sse42(__m128i *best_volume, __m128i *best_side_square, __m128i *best_index, __m128i volume, __m128i side_square, __m128i index, __m128i fit)
+{
+    __m128i better = _mm_or_si128(_mm_cmpgt_epi64(*best_volume, volume),
+                                  _mm_and_si128(_mm_cmpeq_epi64(*best_volume, volume), _mm_cmpgt_epi64(*best_side_square, side_square)));
+
+    better = _mm_and_si128(better, fit);
+    *best_volume = _mm_blendv_epi8(*best_volume, volume, better);
+    *best_side_square = _mm_blendv_epi8(*best_side_square, side_square, better);
+    *best_index = _mm_blendv_epi8(*best_index, index, better);
+}
+
+__attribute__((target("sse4.2")))
+static size_t search_min_sse42(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    const __m128i query_side_square = _mm_set1_epi32((int) side_square);
+    const __m128i query_height = _mm_set1_epi32((int) height);
+    const __m128i sign = _mm_set1_epi64x(BOX_FLAT_SIGN_BIT);
+    const __m128i step = _mm_set1_epi64x(4);
+    __m128i best_volume_low = _mm_set1_epi64x(BOX_FLAT_MAX_SIGNED);
+    __m128i best_volume_high = best_volume_low;
+    __m128i best_side_square_low = best_volume_low;
+    __m128i best_side_square_high = best_volume_low;
+    __m128i best_index_low = _mm_set1_epi64x(-1);
+    __m128i best_index_high = best_index_low;
+    __m128i index_low = _mm_set_epi64x(1, 0);
+    __m128i index_high = _mm_set_epi64x(3, 2);
+    __m128i side_squares, heights, fit;
+    long long volumes[4];
+    long long indices[4];
+    size_t i = 0;
+
+    for (i = 0; i + 4 <= flat->size; i += 4) {
+        side_squares = _mm_loadu_si128((const __m128i *) &(flat->side_squares[i]));
+        heights = _mm_loadu_si128((const __m128i *) &(flat->heights[i]));
+
+        /* An unsigned a >= b is max(a, b) == a */
+        fit = _mm_and_si128(_mm_cmpeq_epi32(_mm_max_epu32(side_squares, query_side_square), side_squares),
+                            _mm_cmpeq_epi32(_mm_max_epu32(heights, query_height), heights));
+        if (!_mm_testz_si128(fit, fit)) {
+            update_sse42(&best_volume_low, &best_side_square_low, &best_index_low,
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i *) &(flat->volumes[i])), sign),
+                         _mm_cvtepu32_epi64(side_squares), index_low, _mm_cvtepi32_epi64(fit));
+            update_sse42(&best_volume_high, &best_side_square_high, &best_index_high,
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i *) &(flat->volumes[i + 2])), sign),
+                         _mm_cvtepu32_epi64(_mm_srli_si128(side_squares, 8)), index_high, _mm_cvtepi32_epi64(_mm_srli_si128(fit, 8)));
+        }
+
+        index_low = _mm_add_epi64(index_low, step);
+        index_high = _mm_add_epi64(index_high, step);
+    }
+
+    _mm_storeu_si128((__m128i *) &volumes[0], best_volume_low);
+    _mm_storeu_si128((__m128i *) &volumes[2], best_volume_high);
+    _mm_storeu_si128((__m128i *) &indices[0], best_index_low);
+    _mm_storeu_si128((__m128i *) &indices[2], best_index_high);
+
+    return search_min_from(flat, i, side_square, height, reduce_lanes(flat, volumes, indices, 4));
+}
+
+__attribute__((target("sse4.2")))
+static bool has_dominating_sse42(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    const __m128i query_side_square = _mm_set1_epi32((int) side_square);
+    const __m128i query_height = _mm_set1_epi32((int) height);
+    __m128i side_squares, heights, fit;
+    size_t i = 0;
+
+    for (i = 0; i + 4 <= flat->size; i += 4) {
+        side_squares = _mm_loadu_si128((const __m128i *) &(flat->side_squares[i]));
+        heights = _mm_loadu_si128((const __m128i *) &(flat->heights[i]));
+        fit = _mm_and_si128(_mm_cmpeq_epi32(_mm_max_epu32(side_squares, query_side_square), side_squares),
+                            _mm_cmpeq_epi32(_mm_max_epu32(heights, query_height), heights));
+        if (!_mm_testz_si128(fit, fit)) {
+            return true;
+        }
+    }
+
+    return has_dominating_from(flat, i, side_square, height);
+}
+
+/* update_avx2 - update_sse42 for 4 lanes. */
+__attribute__((target("avx2"), always_inline))
+static inline void update_avx2(__m256i *best_volume, __m256i *best_side_square, __m256i *best_index, __m256i volume, __m256i side_square, __m256i index, __m256i fit)
+{
+    __m256i better = _mm256_or_si256(_mm256_cmpgt_epi64(*best_volume, volume),
+                                     _mm256_and_si256(_mm256_cmpeq_epi64(*best_volume, volume), _mm256_cmpgt_epi64(*best_side_square, side_square)));
+
+    better = _mm256_and_si256(better, fit);
+    *best_volume = _mm256_blendv_epi8(*best_volume, volume, better);
+    *best_side_square = _mm256_blendv_epi8(*best_side_square, side_square, better);
+    *best_index = _mm256_blendv_epi8(*best_index, index, better);
+}
+
+__attribute__((target("avx2")))
+static size_t search_min_avx2(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    const __m256i query_side_square = _mm256_set1_epi32((int) side_square);
+    const __m256i query_height = _mm256_set1_epi32((int) height);
+    const __m256i sign = _mm256_set1_epi64x(BOX_FLAT_SIGN_BIT);
+    const __m256i step = _mm256_set1_epi64x(8);
+    __m256i best_volume_low = _mm256_set1_epi64x(BOX_FLAT_MAX_SIGNED);
+    __m256i best_volume_high = best_volume_low;
+    __m256i best_side_square_low = best_volume_low;
+    __m256i best_side_square_high = best_volume_low;
+    __m256i best_index_low = _mm256_set1_epi64x(-1);
+    __m256i best_index_high = best_index_low;
+    __m256i index_low = _mm256_set_epi64x(3, 2, 1, 0);
+    __m256i index_high = _mm256_set_epi64x(7, 6, 5, 4);
+    __m256i side_squares, heights, fit;
+    long long volumes[8];
+    long long indices[8];
+    size_t i = 0;
+
+    for (i = 0; i + 8 <= flat->size; i += 8) {
+        side_squares = _mm256_loadu_si256((const __m256i *) &(flat->side_squares[i]));
+        heights = _mm256_loadu_si256((const __m256i *) &(flat->heights[i]));
+
+        fit = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(side_squares, query_side_square), side_squares),
+                               _mm256_cmpeq_epi32(_mm256_max_epu32(heights, query_height), heights));
+        if (!_mm256_testz_si256(fit, fit)) {
+            update_avx2(&best_volume_low, &best_side_square_low, &best_index_low,
+                        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &(flat->volumes[i])), sign),
+                        _mm256_cvtepu32_epi64(_mm256_castsi256_si128(side_squares)), index_low,
+                        _mm256_cvtepi32_epi64(_mm256_castsi256_si128(fit)));
+            update_avx2(&best_volume_high, &best_side_square_high, &best_index_high,
+                        _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &(flat->volumes[i + 4])), sign),
+                        _mm256_cvtepu32_epi64(_mm256_extracti128_si256(side_squares, 1)), index_high,
+                        _mm256_cvtepi32_epi64(_mm256_extracti128_si256(fit, 1)));
+        }
+
+        index_low = _mm256_add_epi64(index_low, step);
+        index_high = _mm256_add_epi64(index_high, step);
+    }
+
+    _mm256_storeu_si256((__m256i *) &volumes[0], best_volume_low);
+    _mm256_storeu_si256((__m256i *) &volumes[4], best_volume_high);
+    _mm256_storeu_si256((__m256i *) &indices[0], best_index_low);
+    _mm256_storeu_si256((__m256i *) &indices[4], best_index_high);
+
+    return search_min_from(flat, i, side_square, height, reduce_lanes(flat, volumes, indices, 8));
+}
+
+__attribute__((target("avx2")))
+static bool has_dominating_avx2(const box_flat_t *flat, unsigned int side_square, unsigned int height)
+{
+    const __m256i query_side_square = _mm256_set1_epi32((int) side_square);
+    const __m256i query_height = _mm256_set1_epi32((int) height);
+    __m256i side_squares, heights, fit;
+    size_t i = 0;
+
+    for (i = 0; i + 8 <= flat->size; i += 8) {
+        side_squares = _mm256_loadu_si256((const __m256i *) &(flat->side_squares[i]));
+        heights = _mm256_loadu_si256((const __m256i *) &(flat->heights[i]));
+        fit = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(side_squares, query_side_square), side_squares),
+                               _mm256_cmpeq_epi32(_mm256_max_epu32(heights, query_height), heights));
+        if (!_mm256_testz_si256(fit, fit)) {
+            return true;
+        }
+    }
+
+    return has_dominating_from(flat, i, side_square, height);
+}
+
+#endif /* BOX_FLAT_X86 */
@@ -0,0 +1,66 @@
+/*
+  box_flat.h - A flat array of (side^2, height) boxes, answering GetBox and CheckBox by a scan.
+  The boxes are kept as a structure of arrays (side^2, height, volume and count), in no particular
+  order, so a query is a single pass over contiguous memory without any pointer chasing, which is
+  done 8 (AVX2) or 4 (SSE4.2) boxes at a time. The kernel is chosen once by the CPU's features, with
+  a scalar fallback.
+  Insertions and removals scan for the box too, so the array is only meant for a few thousand
+  distinct boxes - box_factory uses it instead of its range tree while it's that small.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef __BOX_FLAT_H__
+#define __BOX_FLAT_H__
+
+typedef struct box_flat_s {
+    unsigned int *side_squares;
+    unsigned int *heights;
+    unsigned long long *volumes;    /* side^2 * height of each box */
+    unsigned int *counts;           /* Number of instances of each box */
+    size_t size;                    /* Number of distinct boxes */
+    size_t capacity;
+} box_flat_t;
+
+/* The scan kernels, see box_flat_use_kernel */
+typedef enum box_flat_kernel_e {
+    BOX_FLAT_KERNEL_SCALAR = 0,
+    BOX_FLAT_KERNEL_SSE42,
+    BOX_FLAT_KERNEL_AVX2,
+} box_flat_kernel_t;
+
+/* box_flat_create - create an empty array. If an allocation error occurs, NULL is returned. */
+box_flat_t* box_flat_create(void);
+
+/* box_flat_destroy - free the array. */
+void box_flat_destroy(box_flat_t *flat);
+
+/* box_flat_insert - insert count (at least 1) instances of the box (side_square, height).
+   Returns false if the array has to grow and the allocation fails (in which case the array is left
+   unchanged), true otherwise.
+ */
+bool box_flat_insert(box_flat_t *flat, unsigned int side_square, unsigned int height, unsigned int count);
+
+/* box_flat_remove - remove count (at least 1) instances of the box (side_square, height).
+   Returns false if the box has less than count instances, in which case nothing is removed.
+ */
+bool box_flat_remove(box_flat_t *flat, unsigned int side_square, unsigned int height, unsigned int count);
+
+/* box_flat_search_min - search for the box with the minimal volume among the boxes that dominate
+   (side_square, height). Ties are broken by the smaller side, like range_tree_search_min.
+   Returns true and fills found_side_square and found_height if such a box exists, false otherwise.
+ */
+bool box_flat_search_min(const box_flat_t *flat, unsigned int side_square, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+
+/* box_flat_has_dominating - returns true if a box dominates (side_square, height). */
+bool box_flat_has_dominating(const box_flat_t *flat, unsigned int side_square, unsigned int height);
+
+/* box_flat_use_kernel - use the given kernel for all of the arrays' scans from now on, instead of
+   the best one that the CPU supports (for tests and benchmarks). It must not be called while any
+   thread scans an array.
+   Returns false if the CPU doesn't support the kernel, in which case nothing changes.
+ */
+bool box_flat_use_kernel(box_flat_kernel_t kernel);
+
+#endif /* __BOX_FLAT_H__ */
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "box_flat.h"
+
+#define BOXES (1500)
+#define COORDINATE_RANGE (100)
+
+/* The boxes that are currently in the array, with their instance counts */
+static unsigned int box_side_square[BOXES];
+static unsigned int box_height[BOXES];
+static unsigned int box_count[BOXES];
+
+/* brute_force_min - the expected result of box_flat_search_min */
+static bool brute_force_min(unsigned int side_square, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    unsigned long long best = 0;
+    unsigned long long volume = 0;
+    bool found = false;
+    unsigned int i = 0;
+
+    for (i = 0; i < BOXES; i++) {
+        if ((box_count[i] == 0) || (box_side_square[i] < side_square) || (box_height[i] < height)) {
+            continue;
+        }
+
+        volume = (unsigned long long) box_side_square[i] * box_height[i];
+        if (!found || (volume < best) || ((volume == best) && (box_side_square[i] < *found_side_square))) {
+            best = volume;
+            *found_side_square = box_side_square[i];
+            *found_height = box_height[i];
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/* verify_kernel - the current kernel must answer like the brute force for a grid of queries */
+static void verify_kernel(box_flat_t *flat, unsigned int step)
+{
+    unsigned int side_square = 0;
+    unsigned int height = 0;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int expected_side_square = 0;
+    unsigned int expected_height = 0;
+    bool found = false;
+
+    for (side_square = 0; side_square <= COORDINATE_RANGE; side_square += step) {
+        for (height = 0; height <= COORDINATE_RANGE; height += step) {
+            found = box_flat_search_min(flat, side_square, height, &found_side_square, &found_height);
+            assert(found == brute_force_min(side_square, height, &expected_side_square, &expected_height));
+            assert(box_flat_has_dominating(flat, side_square, height) == found);
+            if (found) {
+                assert(found_side_square == expected_side_square);
+                assert(found_height == expected_height);
+            }
+        }
+    }
+
+    /* Beyond every box, where the vector kernels must not report their initial lanes */
+    assert(!box_flat_search_min(flat, UINT_MAX, UINT_MAX, &found_side_square, &found_height) ||
+           ((found_side_square == UINT_MAX) && (found_height == UINT_MAX)));
+}
+
+/* verify_queries - every kernel that the CPU supports must answer like the brute force */
+static void verify_queries(box_flat_t *flat, unsigned int step)
+{
+    unsigned int distinct = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < BOXES; i++) {
+        distinct += (box_count[i] > 0) ? 1 : 0;
+    }
+    assert(flat->size == distinct);
+
+    assert(box_flat_use_kernel(BOX_FLAT_KERNEL_SCALAR));
+    verify_kernel(flat, step);
+    if (box_flat_use_kernel(BOX_FLAT_KERNEL_SSE42)) {
+        verify_kernel(flat, step);
+    }
+    if (box_flat_use_kernel(BOX_FLAT_KERNEL_AVX2)) {
+        verify_kernel(flat, step);
+    }
+}
+
+int main(void)
+{
+    box_flat_t *flat = NULL;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    srand(18);
+    flat = box_flat_create();
+    assert(flat);
+
+    printf("Searching an empty array...\n");
+    verify_queries(flat, 1);
+
+    printf("Inserting %d boxes (with duplicates)...\n", BOXES);
+    for (i = 0; i < BOXES; i++) {
+        box_side_square[i] = rand() % COORDINATE_RANGE + 1;
+        box_height[i] = rand() % COORDINATE_RANGE + 1;
+        /* Keep a single instance count per distinct box */
+        for (j = 0; j < i; j++) {
+            if ((box_side_square[j] == box_side_square[i]) && (box_height[j] == box_height[i])) {
+                break;
+            }
+        }
+        assert(box_flat_insert(flat, box_side_square[i], box_height[i], 1));
+        box_count[j]++;
+        if (j != i) {
+            box_side_square[i] = 0;
+            box_height[i] = 0;
+        }
+        /* Every size up to a few vectors, for the kernels' tails */
+        if ((i < 40) || (i % 150 == 0)) {
+            verify_queries(flat, (i < 40) ? 3 : 7);
+        }
+    }
+    verify_queries(flat, 3);
+
+    printf("Inserting and removing several instances at once...\n");
+    for (i = 0; i < BOXES; i += 50) {
+        if (box_count[i] == 0) {
+            continue;
+        }
+        assert(box_flat_insert(flat, box_side_square[i], box_height[i], 3));
+        assert(!box_flat_remove(flat, box_side_square[i], box_height[i], box_count[i] + 4));
+        assert(box_flat_remove(flat, box_side_square[i], box_height[i], 3));
+    }
+    verify_queries(flat, 3);
+
+    printf("Searching boxes with volumes beyond 63 bits...\n");
+    assert(box_flat_insert(flat, UINT_MAX, UINT_MAX, 1));
+    assert(box_flat_insert(flat, UINT_MAX, UINT_MAX - 1, 1));
+    assert(box_flat_insert(flat, UINT_MAX - 1, UINT_MAX, 1));
+    assert(box_flat_use_kernel(BOX_FLAT_KERNEL_SCALAR));
+    assert(box_flat_search_min(flat, COORDINATE_RANGE + 1, 0, &found_side_square, &found_height));
+    assert((found_side_square == UINT_MAX - 1) && (found_height == UINT_MAX));
+    if (box_flat_use_kernel(BOX_FLAT_KERNEL_SSE42)) {
+        assert(box_flat_search_min(flat, COORDINATE_RANGE + 1, 0, &found_side_square, &found_height));
+        assert((found_side_square == UINT_MAX - 1) && (found_height == UINT_MAX));
+    }
+    if (box_flat_use_kernel(BOX_FLAT_KERNEL_AVX2)) {
+        assert(box_flat_search_min(flat, COORDINATE_RANGE + 1, 0, &found_side_square, &found_height));
+        assert((found_side_square == UINT_MAX - 1) && (found_height == UINT_MAX));
+    }
+    assert(box_flat_remove(flat, UINT_MAX, UINT_MAX, 1));
+    assert(box_flat_remove(flat, UINT_MAX, UINT_MAX - 1, 1));
+    assert(box_flat_remove(flat, UINT_MAX - 1, UINT_MAX, 1));
+
+    printf("Removing a non-existing box...\n");
+    assert(!box_flat_remove(flat, COORDINATE_RANGE + 1, 1, 1));
+
+    printf("Removing boxes, one instance at a time...\n");
+    for (i = 0; i < BOXES; i++) {
+        if (box_count[i] == 0) {
+            continue;
+        }
+        assert(box_flat_remove(flat, box_side_square[i], box_height[i], 1));
+        box_count[i]--;
+        if (i % 150 == 0) {
+            verify_queries(flat, 7);
+        }
+    }
+    verify_queries(flat, 3);
+
+    printf("Emptying array...\n");
+    for (i = 0; i < BOXES; i++) {
+        if (box_count[i] > 0) {
+            assert(box_flat_remove(flat, box_side_square[i], box_height[i], box_count[i]));
+            box_count[i] = 0;
+        }
+    }
+    assert(flat->size == 0);
+    verify_queries(flat, 1);
+
+    box_flat_destroy(flat);
+
+    return 0;
+}
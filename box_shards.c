@@ -0,0 +1,210 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "box_factory.h"
+#include "box_shards.h"
+
+/* shard_index - the index of the shard that holds the boxes of side. */
+static unsigned int shard_index(box_shards_t *shards, unsigned int side);
+
+/* is_better - returns true if the box (side_square, height) is a better GetBox result than the
+   box (best_side_square, best_height), by volume and then by side, like box_factory_get_box.
+ */
+static bool is_better(unsigned int side_square, unsigned int height, unsigned int best_side_square, unsigned int best_height);
+
+box_shards_t* box_shards_create(box_factory_backend_t backend, unsigned int count, unsigned int side_range)
+{
+    box_shards_t *shards = NULL;
+    void *memory = NULL;
+    unsigned int i = 0;
+
+    if (count == 0) {
+        return NULL;
+    }
+
+    shards = calloc(sizeof(box_shards_t), 1);
+    if (NULL == shards) {
+        return NULL;
+    }
+
+    if (0 != posix_memalign(&memory, BOX_SHARDS_ALIGNMENT, count * sizeof(box_shard_t))) {
+        free(shards);
+        return NULL;
+    }
+    memset(memory, 0, count * sizeof(box_shard_t));
+    shards->shards = memory;
+    shards->width = (side_range + count - 1) / count;
+    if (shards->width == 0) {
+        shards->width = 1;
+    }
+
+    /* count is only raised once a shard is completely initialized, for box_shards_destroy */
+    for (i = 0; i < count; i++) {
+        shards->shards[i].factory = box_factory_create_with_backend(backend);
+        if (NULL == shards->shards[i].factory) {
+            break;
+        }
+
+        if (0 != pthread_rwlock_init(&(shards->shards[i].lock), NULL)) {
+            box_factory_destroy(shards->shards[i].factory);
+            break;
+        }
+        shards->count++;
+    }
+
+    if (shards->count < count) {
+        box_shards_destroy(shards);
+        return NULL;
+    }
+
+    return shards;
+}
+
+void box_shards_destroy(box_shards_t *shards)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < shards->count; i++) {
+        pthread_rwlock_destroy(&(shards->shards[i].lock));
+        box_factory_destroy(shards->shards[i].factory);
+    }
+
+    free(shards->shards);
+    free(shards);
+}
+
+bool box_shards_insert(box_shards_t *shards, unsigned int side, unsigned int height)
+{
+    box_shard_t *shard = &(shards->shards[shard_index(shards, side)]);
+    bool result = false;
+
+    pthread_rwlock_wrlock(&(shard->lock));
+    result = box_factory_insert(shard->factory, side, height);
+    pthread_rwlock_unlock(&(shard->lock));
+
+    return result;
+}
+
+bool box_shards_remove(box_shards_t *shards, unsigned int side, unsigned int height)
+{
+    box_shard_t *shard = &(shards->shards[shard_index(shards, side)]);
+    bool result = false;
+
+    pthread_rwlock_wrlock(&(shard->lock));
+    result = box_factory_remove(shard->factory, side, height);
+    pthread_rwlock_unlock(&(shard->lock));
+
+    return result;
+}
+
+bool box_shards_get_box(box_shards_t *shards, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    box_shard_t *shard = NULL;
+    unsigned int shard_side_square = 0;
+    unsigned int shard_height = 0;
+    unsigned long long min_side = 0;
+    unsigned int i = 0;
+    bool found = false;
+    bool shard_found = false;
+
+    for (i = shard_index(shards, side); i < shards->count; i++) {
+        /* The boxes of the next shards are all larger in side than the ones found so far, so once
+           even their smallest possible volume isn't smaller, none of them can be better */
+        min_side = (unsigned long long) i * shards->width;
+        if (min_side < side) {
+            min_side = side;
+        }
+        if (found && (min_side * min_side * height >= (unsigned long long) *found_side_square * *found_height)) {
+            break;
+        }
+
+        shard = &(shards->shards[i]);
+        pthread_rwlock_rdlock(&(shard->lock));
+        shard_found = box_factory_get_box(shard->factory, side, height, &shard_side_square, &shard_height);
+        pthread_rwlock_unlock(&(shard->lock));
+
+        if (shard_found && (!found || is_better(shard_side_square, shard_height, *found_side_square, *found_height))) {
+            *found_side_square = shard_side_square;
+            *found_height = shard_height;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+bool box_shards_check_box(box_shards_t *shards, unsigned int side, unsigned int height)
+{
+    box_shard_t *shard = NULL;
+    unsigned int i = 0;
+    bool found = false;
+
+    for (i = shard_index(shards, side); (i < shards->count) && !found; i++) {
+        shard = &(shards->shards[i]);
+        pthread_rwlock_rdlock(&(shard->lock));
+        found = box_factory_check_box(shard->factory, side, height);
+        pthread_rwlock_unlock(&(shard->lock));
+    }
+
+    return found;
+}
+
+bool box_shards_take_box(box_shards_t *shards, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height)
+{
+    unsigned int shard_side_square = 0;
+    unsigned int shard_height = 0;
+    unsigned long long min_side = 0;
+    unsigned int first = shard_index(shards, side);
+    unsigned int best = 0;
+    unsigned int i = 0;
+    bool found = false;
+
+    /* The same scan as box_shards_get_box, under the write locks */
+    for (i = first; i < shards->count; i++) {
+        min_side = (unsigned long long) i * shards->width;
+        if (min_side < side) {
+            min_side = side;
+        }
+        if (found && (min_side * min_side * height >= (unsigned long long) *found_side_square * *found_height)) {
+            break;
+        }
+
+        pthread_rwlock_wrlock(&(shards->shards[i].lock));
+        if (box_factory_get_box(shards->shards[i].factory, side, height, &shard_side_square, &shard_height) &&
+            (!found || is_better(shard_side_square, shard_height, *found_side_square, *found_height))) {
+            *found_side_square = shard_side_square;
+            *found_height = shard_height;
+            best = i;
+            found = true;
+        }
+    }
+
+    /* The best box is still the best one of its shard, and taking it fails only on an allocation
+       error */
+    if (found) {
+        found = box_factory_take_box(shards->shards[best].factory, side, height, &shard_side_square, &shard_height);
+    }
+
+    while (i-- > first) {
+        pthread_rwlock_unlock(&(shards->shards[i].lock));
+    }
+
+    return found;
+}
+
+static unsigned int shard_index(box_shards_t *shards, unsigned int side)
+{
+    unsigned int index = side / shards->width;
+
+    return (index < shards->count) ? index : shards->count - 1;
+}
+
+static bool is_better(unsigned int side_square, unsigned int height, unsigned int best_side_square, unsigned int best_height)
+{
+    unsigned long long volume = (unsigned long long) side_square * height;
+    unsigned long long best_volume = (unsigned long long) best_side_square * best_height;
+
+    return (volume < best_volume) || ((volume == best_volume) && (side_square < best_side_square));
+}
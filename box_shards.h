@@ -0,0 +1,70 @@
+/*
+  box_shards.h - A thread-safe box factory, partitioned into shards by side.
+  Each shard is a complete box factory (with its own trees and pool) for a range of sides, guarded
+  by its own reader-writer lock. Insertions and removals lock only the shard of the box's side, so
+  writers of different shards never wait for each other, and readers of a shard share its lock.
+
+  A fitting box has a side at least as large as the query's, so GetBox and CheckBox visit only the
+  shards from the query's side and up. GetBox also stops at the first shard whose smallest possible
+  volume can't beat the best box found so far.
+
+  Every operation is atomic within its shards (and box_shards_take_box across them), but a query
+  that spans shards sees each of them at a different time, so it may or may not see boxes that are
+  inserted or removed concurrently.
+
+  What the shards provide is that the factory may be used from several threads at once, without
+  serializing them all through one lock. How throughput scales with the number of cores has only
+  been measured on a single CPU, where it can't show, so it should be measured (box_factory_bench -t)
+  on the target machine before relying on it.
+ */
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "box_factory.h"
+
+#ifndef __BOX_SHARDS_H__
+#define __BOX_SHARDS_H__
+
+/* Shards are written by different threads, so each one gets its own cache lines */
+#define BOX_SHARDS_ALIGNMENT (64)
+
+typedef struct box_shard_s {
+    pthread_rwlock_t lock;
+    box_factory_t *factory;
+} __attribute__((aligned(BOX_SHARDS_ALIGNMENT))) box_shard_t;
+
+typedef struct box_shards_s {
+    box_shard_t *shards;
+    unsigned int count;
+    unsigned int width;    /* Sides per shard. Shard i holds the sides in [i * width, (i + 1) * width),
+                              and the last shard also holds all of the larger sides. */
+} box_shards_t;
+
+/* box_shards_create - create count empty shards of the given backend, which split the sides in
+   [0, side_range) evenly. side_range should cover most of the expected sides, as all of the larger
+   ones share the last shard.
+   Returns NULL on an allocation error (or a lock initialization error).
+ */
+box_shards_t* box_shards_create(box_factory_backend_t backend, unsigned int count, unsigned int side_range);
+
+/* box_shards_destroy - free all of the shards and their boxes. No other thread may use them. */
+void box_shards_destroy(box_shards_t *shards);
+
+/* box_shards_insert, box_shards_remove, box_shards_get_box, box_shards_check_box - the thread-safe
+   versions of box_factory_insert, box_factory_remove, box_factory_get_box and box_factory_check_box,
+   with the same return values.
+ */
+bool box_shards_insert(box_shards_t *shards, unsigned int side, unsigned int height);
+bool box_shards_remove(box_shards_t *shards, unsigned int side, unsigned int height);
+bool box_shards_get_box(box_shards_t *shards, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+bool box_shards_check_box(box_shards_t *shards, unsigned int side, unsigned int height);
+
+/* box_shards_take_box - the thread-safe version of box_factory_take_box. Unlike GetBox, it holds the
+   write locks of all of the shards that it visits until the box is taken, so no other thread can
+   take the same box, or insert a better one meanwhile. The shards are locked in order, so takes
+   never deadlock.
+ */
+bool box_shards_take_box(box_shards_t *shards, unsigned int side, unsigned int height, unsigned int *found_side_square, unsigned int *found_height);
+
+#endif /* __BOX_SHARDS_H__ */
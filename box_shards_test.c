@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "box_factory.h"
+#include "box_shards.h"
+
+#define RANDOM_OPERATIONS (200000)
+
+/* The sides of the boxes go beyond the shards' side_range, so the last shard also holds larger sides */
+#define SIDE_RANGE (80)
+#define SHARDS_SIDE_RANGE (60)
+#define HEIGHT_RANGE (60)
+
+#define TAKE_THREADS (4)
+#define TAKE_BOXES (20000)
+
+/* The context of a taking thread, which takes boxes until none is left */
+typedef struct take_context_s {
+    box_shards_t *shards;
+    unsigned int (*taken)[HEIGHT_RANGE + 1];
+} take_context_t;
+
+/* compare_random - run the same random operations on shards and on a single box factory, which
+   must give the same results
+ */
+static void compare_random(box_factory_backend_t backend, unsigned int count)
+{
+    box_shards_t *shards = NULL;
+    box_factory_t *factory = NULL;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int expected_side_square = 0;
+    unsigned int expected_height = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    unsigned int i = 0;
+    bool found = false;
+
+    printf("Comparing %d random operations on %u shards to a factory (backend %d)...\n", RANDOM_OPERATIONS, count, backend);
+    shards = box_shards_create(backend, count, SHARDS_SIDE_RANGE);
+    factory = box_factory_create_with_backend(backend);
+    assert(shards && factory);
+
+    /* Queries of an empty factory */
+    assert(!box_shards_get_box(shards, 0, 0, &found_side_square, &found_height));
+    assert(!box_shards_check_box(shards, 0, 0));
+    assert(!box_shards_take_box(shards, 0, 0, &found_side_square, &found_height));
+    assert(!box_shards_remove(shards, 1, 1));
+
+    /* Boxes of side 0 all have a volume of 0, and which of them GetBox finds is up to the order of
+       the trees, so the boxes have a side of 1 and up (unlike the queries)
+     */
+    for (i = 0; i < RANDOM_OPERATIONS; i++) {
+        side = rand() % (SIDE_RANGE + 1);
+        height = rand() % (HEIGHT_RANGE + 1);
+
+        switch (rand() % 5) {
+        case 0:
+        case 1:
+            side += (side == 0);
+            assert(box_shards_insert(shards, side, height) == box_factory_insert(factory, side, height));
+            break;
+        case 2:
+            side += (side == 0);
+            assert(box_shards_remove(shards, side, height) == box_factory_remove(factory, side, height));
+            break;
+        case 3:
+            found = box_factory_get_box(factory, side, height, &expected_side_square, &expected_height);
+            assert(box_shards_get_box(shards, side, height, &found_side_square, &found_height) == found);
+            if (found) {
+                assert((found_side_square == expected_side_square) && (found_height == expected_height));
+            }
+            assert(box_shards_check_box(shards, side, height) == box_factory_check_box(factory, side, height));
+            break;
+        default:
+            found = box_factory_take_box(factory, side, height, &expected_side_square, &expected_height);
+            assert(box_shards_take_box(shards, side, height, &found_side_square, &found_height) == found);
+            if (found) {
+                assert((found_side_square == expected_side_square) && (found_height == expected_height));
+            }
+            break;
+        }
+    }
+
+    /* Whatever is left is the same on both */
+    while (box_factory_take_box(factory, 0, 0, &expected_side_square, &expected_height)) {
+        assert(box_shards_take_box(shards, 0, 0, &found_side_square, &found_height));
+        assert((found_side_square == expected_side_square) && (found_height == expected_height));
+    }
+    assert(!box_shards_take_box(shards, 0, 0, &found_side_square, &found_height));
+    assert(!box_shards_check_box(shards, 0, 0));
+
+    box_shards_destroy(shards);
+    box_factory_destroy(factory);
+}
+
+static void* take_all(void *context)
+{
+    take_context_t *take_context = context;
+    unsigned int side_square = 0;
+    unsigned int height = 0;
+
+    while (box_shards_take_box(take_context->shards, 0, 0, &side_square, &height)) {
+        assert((side_square <= SIDE_RANGE * SIDE_RANGE) && (height <= HEIGHT_RANGE));
+        take_context->taken[side_square][height]++;
+    }
+
+    return NULL;
+}
+
+/* test_concurrent_take - threads that take boxes at once must take every box exactly once */
+static void test_concurrent_take(box_factory_backend_t backend)
+{
+    static unsigned int inserted[SIDE_RANGE * SIDE_RANGE + 1][HEIGHT_RANGE + 1];
+    static unsigned int taken[TAKE_THREADS][SIDE_RANGE * SIDE_RANGE + 1][HEIGHT_RANGE + 1];
+    take_context_t contexts[TAKE_THREADS];
+    pthread_t threads[TAKE_THREADS];
+    box_shards_t *shards = NULL;
+    unsigned int total = 0;
+    unsigned int side = 0;
+    unsigned int height = 0;
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    printf("Taking %d boxes on %d threads (backend %d)...\n", TAKE_BOXES, TAKE_THREADS, backend);
+    shards = box_shards_create(backend, 8, SHARDS_SIDE_RANGE);
+    assert(shards);
+
+    for (i = 0; i < TAKE_BOXES; i++) {
+        side = rand() % (SIDE_RANGE + 1);
+        height = rand() % (HEIGHT_RANGE + 1);
+        assert(box_shards_insert(shards, side, height));
+        inserted[side * side][height]++;
+    }
+
+    for (i = 0; i < TAKE_THREADS; i++) {
+        contexts[i].shards = shards;
+        contexts[i].taken = taken[i];
+        assert(0 == pthread_create(&threads[i], NULL, take_all, &contexts[i]));
+    }
+    for (i = 0; i < TAKE_THREADS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    for (side = 0; side <= SIDE_RANGE * SIDE_RANGE; side++) {
+        for (height = 0; height <= HEIGHT_RANGE; height++) {
+            total = 0;
+            for (j = 0; j < TAKE_THREADS; j++) {
+                total += taken[j][side][height];
+                taken[j][side][height] = 0;
+            }
+            assert(total == inserted[side][height]);
+            inserted[side][height] = 0;
+        }
+    }
+    assert(!box_shards_check_box(shards, 0, 0));
+
+    box_shards_destroy(shards);
+}
+
+int main(void)
+{
+    unsigned int counts[] = {1, 4, 7};
+    unsigned int i = 0;
+
+    srand(18);
+
+    assert(NULL == box_shards_create(BOX_FACTORY_RB_TREE, 0, SHARDS_SIDE_RANGE));
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        compare_random(BOX_FACTORY_RB_TREE, counts[i]);
+    }
+    compare_random(BOX_FACTORY_BP_TREE, 4);
+
+    test_concurrent_take(BOX_FACTORY_RB_TREE);
+    test_concurrent_take(BOX_FACTORY_BP_TREE);
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "op_stats.h"
+#include "pool.h"
+#include "rb_tree_gen.h"
+#include "box_subtree.h"
+
+/* array_find - the index of the smallest inline value larger than/equal to value, or the size of
+   the subtree if there's none.
+ */
+static unsigned int array_find(const box_subtree_t *subtree, unsigned int value);
+
+/* create_tree - create a tree in pool out of count distinct ascending values with their counts,
+   where nodes has room for count nodes. Returns NULL on an allocation failure.
+ */
+static box_subtree_tree_t* create_tree(pool_t *pool, const unsigned int *values, const unsigned int *counts, size_t count, box_subtree_tree_node_t **nodes);
+
+/* promote - move the values of a full inline subtree to a tree in pool. Returns false on an
+   allocation failure, in which case the subtree is left unchanged.
+ */
+static bool promote(box_subtree_t *subtree, pool_t *pool);
+
+/* demote - move the values of a promoted subtree that fit inline back to the array, and free its
+   tree.
+ */
+static void demote(box_subtree_t *subtree);
+
+RB_TREE_FUNCTIONS(box_subtree_tree, unsigned int, RB_TREE_NO_AUGMENT)
+
+void box_subtree_init(box_subtree_t *subtree)
+{
+    subtree->size = 0;
+    subtree->is_tree = false;
+}
+
+bool box_subtree_build(box_subtree_t *subtree, pool_t *pool, const unsigned int *values, const unsigned int *counts, size_t count)
+{
+    box_subtree_tree_node_t **nodes = NULL;
+    box_subtree_tree_t *tree = NULL;
+
+    if (count <= BOX_SUBTREE_INLINE) {
+        memcpy(subtree->array.values, values, count * sizeof(unsigned int));
+        memcpy(subtree->array.counts, counts, count * sizeof(unsigned int));
+        subtree->size = count;
+        return true;
+    }
+
+    nodes = malloc(count * sizeof(box_subtree_tree_node_t *));
+    if (NULL == nodes) {
+        return false;
+    }
+    tree = create_tree(pool, values, counts, count, nodes);
+    free(nodes);
+    if (NULL == tree) {
+        return false;
+    }
+
+    subtree->tree = tree;
+    subtree->is_tree = true;
+    subtree->size = count;
+    return true;
+}
+
+bool box_subtree_insert(box_subtree_t *subtree, pool_t *pool, unsigned int value, unsigned int count, bool *exists)
+{
+    box_subtree_tree_node_t *node = NULL;
+    unsigned int index = 0;
+
+    *exists = false;
+
+    if (subtree->is_tree) {
+        node = box_subtree_tree_insert(subtree->tree, value, exists);
+        if (NULL == node) {
+            return false;
+        }
+        /* box_subtree_tree_insert has counted a single box */
+        node->count += count - 1;
+        subtree->size += *exists ? 0 : 1;
+        return true;
+    }
+
+    index = array_find(subtree, value);
+    if ((index < subtree->size) && (subtree->array.values[index] == value)) {
+        *exists = true;
+        subtree->array.counts[index] += count;
+        return true;
+    }
+
+    if (subtree->size == BOX_SUBTREE_INLINE) {
+        if (false == promote(subtree, pool)) {
+            return false;
+        }
+        return box_subtree_insert(subtree, pool, value, count, exists);
+    }
+
+    memmove(&(subtree->array.values[index + 1]), &(subtree->array.values[index]), (subtree->size - index) * sizeof(unsigned int));
+    memmove(&(subtree->array.counts[index + 1]), &(subtree->array.counts[index]), (subtree->size - index) * sizeof(unsigned int));
+    subtree->array.values[index] = value;
+    subtree->array.counts[index] = count;
+    subtree->size++;
+
+    return true;
+}
+
+unsigned int box_subtree_remove(box_subtree_t *subtree, unsigned int value, unsigned int count, bool *deleted)
+{
+    box_subtree_cursor_t cursor;
+
+    *deleted = false;
+
+    if (!box_subtree_search_smallest(subtree, value, &cursor) || (box_subtree_cursor_key(&cursor) != value)) {
+        return 0;
+    }
+
+    return box_subtree_cursor_remove(&cursor, count, deleted);
+}
+
+unsigned int box_subtree_cursor_remove(box_subtree_cursor_t *cursor, unsigned int count, bool *deleted)
+{
+    box_subtree_t *subtree = cursor->subtree;
+    unsigned int index = cursor->index;
+    unsigned int removed = 0;
+
+    *deleted = false;
+
+    if (subtree->is_tree) {
+        if (cursor->node->count > count) {
+            cursor->node->count -= count;
+            return count;
+        }
+
+        removed = cursor->node->count;
+        box_subtree_tree_delete_node(subtree->tree, cursor->node);
+        subtree->size--;
+        *deleted = true;
+        if (subtree->size <= BOX_SUBTREE_DEMOTE) {
+            demote(subtree);
+        }
+        return removed;
+    }
+
+    if (subtree->array.counts[index] > count) {
+        subtree->array.counts[index] -= count;
+        return count;
+    }
+
+    removed = subtree->array.counts[index];
+    subtree->size--;
+    memmove(&(subtree->array.values[index]), &(subtree->array.values[index + 1]), (subtree->size - index) * sizeof(unsigned int));
+    memmove(&(subtree->array.counts[index]), &(subtree->array.counts[index + 1]), (subtree->size - index) * sizeof(unsigned int));
+    *deleted = true;
+
+    return removed;
+}
+
+bool box_subtree_search_smallest(box_subtree_t *subtree, unsigned int value, box_subtree_cursor_t *cursor)
+{
+    cursor->subtree = subtree;
+
+    if (subtree->is_tree) {
+        cursor->node = box_subtree_tree_search_smallest(subtree->tree, value);
+        return NULL != cursor->node;
+    }
+
+    cursor->index = array_find(subtree, value);
+    return cursor->index < subtree->size;
+}
+
+bool box_subtree_cursor_next(box_subtree_cursor_t *cursor)
+{
+    if (cursor->subtree->is_tree) {
+        cursor->node = box_subtree_tree_successor(cursor->subtree->tree, cursor->node);
+        return NULL != cursor->node;
+    }
+
+    cursor->index++;
+    return cursor->index < cursor->subtree->size;
+}
+
+unsigned int box_subtree_cursor_key(box_subtree_cursor_t *cursor)
+{
+    return cursor->subtree->is_tree ? cursor->node->key : cursor->subtree->array.values[cursor->index];
+}
+
+unsigned int box_subtree_cursor_count(box_subtree_cursor_t *cursor)
+{
+    return cursor->subtree->is_tree ? cursor->node->count : cursor->subtree->array.counts[cursor->index];
+}
+
+void box_subtree_shape(box_subtree_t *subtree, rb_tree_shape_t *shape)
+{
+    if (!subtree->is_tree) {
+        memset(shape, 0, sizeof(*shape));
+        return;
+    }
+
+    box_subtree_tree_shape(subtree->tree, shape);
+}
+
+static unsigned int array_find(const box_subtree_t *subtree, unsigned int value)
+{
+    unsigned int index = 0;
+
+    /* There are only a few values, so a linear scan beats a binary search's mispredictions */
+    for (index = 0; index < subtree->size; index++) {
+        OP_STATS_COUNT(comparisons);
+        if (subtree->array.values[index] >= value) {
+            break;
+        }
+    }
+
+    return index;
+}
+
+static box_subtree_tree_t* create_tree(pool_t *pool, const unsigned int *values, const unsigned int *counts, size_t count, box_subtree_tree_node_t **nodes)
+{
+    box_subtree_tree_t *tree = NULL;
+    size_t i = 0;
+
+    tree = box_subtree_tree_create(pool);
+    if (NULL == tree) {
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        nodes[i] = box_subtree_tree_create_node(tree, values[i]);
+        if (NULL == nodes[i]) {
+            while (i > 0) {
+                pool_free(pool, nodes[--i], sizeof(box_subtree_tree_node_t));
+            }
+            box_subtree_tree_destroy(tree);
+            return NULL;
+        }
+        nodes[i]->count = counts[i];
+    }
+
+    box_subtree_tree_build(tree, nodes, count);
+    return tree;
+}
+
+static bool promote(box_subtree_t *subtree, pool_t *pool)
+{
+    box_subtree_tree_node_t *nodes[BOX_SUBTREE_INLINE];
+    box_subtree_tree_t *tree = NULL;
+
+    /* The tree pointer shares its memory with the array, so it's only set once the array is read */
+    tree = create_tree(pool, subtree->array.values, subtree->array.counts, subtree->size, nodes);
+    if (NULL == tree) {
+        return false;
+    }
+
+    subtree->tree = tree;
+    subtree->is_tree = true;
+    return true;
+}
+
+static void demote(box_subtree_t *subtree)
+{
+    box_subtree_tree_t *tree = subtree->tree;
+    box_subtree_tree_node_t *node = NULL;
+    unsigned int index = 0;
+
+    for (node = box_subtree_tree_search_smallest(tree, 0); NULL != node; node = box_subtree_tree_successor(tree, node)) {
+        subtree->array.values[index] = node->key;
+        subtree->array.counts[index] = node->count;
+        index++;
+    }
+
+    subtree->is_tree = false;
+    box_subtree_tree_destroy(tree);
+}
@@ -0,0 +1,112 @@
+/*
+  box_subtree.h - The subtree of a main tree node: the boxes' values in the other dimension, each
+  with its number of boxes.
+  Most main values have only a few distinct sub values, for which a red-black tree (whose header
+  alone, with its nil sentinel, is larger than all of them) is mostly overhead. So up to
+  BOX_SUBTREE_INLINE values are kept inline, as a sorted array of (value, count) in the subtree
+  itself, which is searched by a short scan without any pointer chasing or allocation. Inserting a
+  value beyond that promotes the subtree to a red-black tree in the given pool, and it is only
+  demoted back to the array once the tree is down to BOX_SUBTREE_DEMOTE values, so a subtree that
+  hovers around the limit doesn't keep moving its values back and forth.
+
+  Unlike an embedded tree, a subtree has no pointers into itself, so it may be moved freely.
+  Its values are visited in order with a cursor, like bp_tree's.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pool.h"
+#include "rb_tree_gen.h"
+
+#ifndef __BOX_SUBTREE_H__
+#define __BOX_SUBTREE_H__
+
+/* The values of a promoted subtree, with the number of boxes of each as the count */
+RB_TREE_TYPES(box_subtree_tree, unsigned int, )
+
+/* The inline array, not the tree pointer, sets the size of the union (32 bytes against 8), and every
+   main node embeds it even once its subtree is promoted. 4 values cover the few sub values that
+   most main values have, at 40 bytes per subtree; each doubling would add 32 bytes to every main
+   node (88 bytes with 4). */
+#define BOX_SUBTREE_INLINE (4)
+#define BOX_SUBTREE_DEMOTE (BOX_SUBTREE_INLINE / 2)
+
+typedef struct box_subtree_s {
+    unsigned int size;         /* Number of distinct values */
+    bool is_tree;              /* Whether the values are in tree rather than inline */
+    union {
+        struct {
+            unsigned int values[BOX_SUBTREE_INLINE]; /* The first size of them, ascending */
+            unsigned int counts[BOX_SUBTREE_INLINE];
+        } array;
+        box_subtree_tree_t *tree;
+    };
+} box_subtree_t;
+
+/* A position of a value in the subtree. A cursor is invalidated by any change to the subtree. */
+typedef struct box_subtree_cursor_s {
+    box_subtree_t *subtree;
+    unsigned int index;             /* The value's index in the array (inline subtrees) */
+    box_subtree_tree_node_t *node;  /* The value's node (promoted subtrees) */
+} box_subtree_cursor_t;
+
+/* box_subtree_init - initialize an empty (inline) subtree. */
+void box_subtree_init(box_subtree_t *subtree);
+
+/* box_subtree_build - fill an empty subtree with count values, which must be distinct and
+   ascending, with the number of boxes of each in counts. Beyond BOX_SUBTREE_INLINE values, the tree
+   is built in pool in O(count) instead of count insertions.
+   Returns false on an allocation failure, in which case the subtree is left empty.
+ */
+bool box_subtree_build(box_subtree_t *subtree, pool_t *pool, const unsigned int *values, const unsigned int *counts, size_t count);
+
+/* box_subtree_insert - add count (at least 1) boxes of value. If it already exists, its count is
+   increased and exists is set. A promotion allocates the tree and its nodes from pool.
+   Returns false on an allocation failure, in which case the subtree is left unchanged.
+ */
+bool box_subtree_insert(box_subtree_t *subtree, pool_t *pool, unsigned int value, unsigned int count, bool *exists);
+
+/* box_subtree_remove - remove up to count boxes of value, and delete it when none are left (in
+   which case deleted is set). An emptied subtree is always inline, and holds no memory.
+   Returns the number of boxes that were removed, 0 if the value doesn't exist.
+ */
+unsigned int box_subtree_remove(box_subtree_t *subtree, unsigned int value, unsigned int count, bool *deleted);
+
+/* box_subtree_search_smallest - search for the smallest value larger than/equal to value.
+   Returns true and sets cursor to it if it is found.
+ */
+bool box_subtree_search_smallest(box_subtree_t *subtree, unsigned int value, box_subtree_cursor_t *cursor);
+
+/* box_subtree_cursor_next - move the cursor to the next value. Returns false (and the cursor is no
+   longer on a value) if it was on the max value.
+ */
+bool box_subtree_cursor_next(box_subtree_cursor_t *cursor);
+
+/* box_subtree_cursor_key, box_subtree_cursor_count - the value that the cursor is on, and its
+   number of boxes. The cursor must be on a value.
+ */
+unsigned int box_subtree_cursor_key(box_subtree_cursor_t *cursor);
+unsigned int box_subtree_cursor_count(box_subtree_cursor_t *cursor);
+
+/* box_subtree_cursor_remove - remove up to count boxes of the value that the cursor is on, in place,
+   and delete it when none are left (in which case deleted is set), like box_subtree_remove but
+   without searching for it. The cursor is invalidated. Returns the number of boxes that were
+   removed.
+ */
+unsigned int box_subtree_cursor_remove(box_subtree_cursor_t *cursor, unsigned int count, bool *deleted);
+
+/* box_subtree_shape - measure the promoted tree of the subtree into shape, like rb_tree_shape. An
+   inline subtree has no tree, so its shape is all zeros.
+ */
+void box_subtree_shape(box_subtree_t *subtree, rb_tree_shape_t *shape);
+
+/* box_subtree_max - the max value of a non-empty subtree, in O(1). This is inline, as the main
+   trees' augmentation reads it on every rotation.
+ */
+static inline unsigned int box_subtree_max(const box_subtree_t *subtree)
+{
+    return subtree->is_tree ? subtree->tree->max->key : subtree->array.values[subtree->size - 1];
+}
+
+#endif /* __BOX_SUBTREE_H__ */
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include "pool.h"
+#include "box_subtree.h"
+
+#define VALUE_RANGE (40)
+#define OPERATIONS (60000)
+
+/* The expected contents of the subtree, by value */
+static unsigned int value_count[VALUE_RANGE];
+
+/* verify_subtree - the subtree must hold exactly the values of value_count, in its expected form */
+static void verify_subtree(box_subtree_t *subtree)
+{
+    box_subtree_cursor_t cursor;
+    unsigned int distinct = 0;
+    unsigned int max = 0;
+    unsigned int value = 0;
+    unsigned int expected = 0;
+    bool found = false;
+
+    for (value = 0; value < VALUE_RANGE; value++) {
+        if (value_count[value] > 0) {
+            distinct++;
+            max = value;
+        }
+    }
+    assert(subtree->size == distinct);
+    if (distinct > 0) {
+        assert(box_subtree_max(subtree) == max);
+    }
+
+    /* The subtree is promoted beyond BOX_SUBTREE_INLINE values, and demoted at BOX_SUBTREE_DEMOTE */
+    if (distinct > BOX_SUBTREE_INLINE) {
+        assert(subtree->is_tree);
+    } else if (distinct <= BOX_SUBTREE_DEMOTE) {
+        assert(!subtree->is_tree);
+    }
+    if (subtree->is_tree) {
+        assert(subtree->tree->count == distinct);
+    }
+
+    /* A scan from every value */
+    for (value = 0; value <= VALUE_RANGE; value++) {
+        expected = value;
+        for (found = box_subtree_search_smallest(subtree, value, &cursor); found; found = box_subtree_cursor_next(&cursor)) {
+            while (value_count[expected] == 0) {
+                expected++;
+            }
+            assert(box_subtree_cursor_key(&cursor) == expected);
+            assert(box_subtree_cursor_count(&cursor) == value_count[expected]);
+            expected++;
+        }
+        for (; expected < VALUE_RANGE; expected++) {
+            assert(value_count[expected] == 0);
+        }
+    }
+}
+
+int main(void)
+{
+    box_subtree_t subtree;
+    box_subtree_cursor_t cursor;
+    pool_t *pool = NULL;
+    rb_tree_shape_t shape;
+    unsigned int values[VALUE_RANGE];
+    unsigned int counts[VALUE_RANGE];
+    unsigned int value = 0;
+    unsigned int count = 0;
+    unsigned int removed = 0;
+    unsigned int size = 0;
+    unsigned int i = 0;
+    bool exists = false;
+    bool deleted = false;
+
+    srand(18);
+    pool = pool_create();
+    assert(pool);
+    box_subtree_init(&subtree);
+
+    printf("Searching an empty subtree...\n");
+    verify_subtree(&subtree);
+    assert(box_subtree_remove(&subtree, 1, 1, &deleted) == 0);
+    assert(!deleted);
+
+    printf("Inserting and removing random values...\n");
+    for (i = 0; i < OPERATIONS; i++) {
+        /* The range of the values drifts, so that the subtree keeps crossing the limit both ways */
+        value = rand() % ((i / 1000) % 4 * 4 + 3);
+        count = rand() % 3 + 1;
+
+        if (rand() % 2 == 0) {
+            assert(box_subtree_insert(&subtree, pool, value, count, &exists));
+            assert(exists == (value_count[value] > 0));
+            value_count[value] += count;
+        } else if (rand() % 2 == 0) {
+            removed = (value_count[value] < count) ? value_count[value] : count;
+            assert(box_subtree_remove(&subtree, value, count, &deleted) == removed);
+            value_count[value] -= removed;
+            assert(deleted == ((removed > 0) && (value_count[value] == 0)));
+        } else if (value_count[value] > 0) {
+            /* The same removal, in place through a cursor on the value */
+            removed = (value_count[value] < count) ? value_count[value] : count;
+            assert(box_subtree_search_smallest(&subtree, value, &cursor) && (box_subtree_cursor_key(&cursor) == value));
+            assert(box_subtree_cursor_remove(&cursor, count, &deleted) == removed);
+            value_count[value] -= removed;
+            assert(deleted == (value_count[value] == 0));
+        }
+
+        if (i % 100 == 0) {
+            verify_subtree(&subtree);
+        }
+    }
+    verify_subtree(&subtree);
+
+    printf("Emptying subtree...\n");
+    for (value = 0; value < VALUE_RANGE; value++) {
+        if (value_count[value] > 0) {
+            assert(box_subtree_remove(&subtree, value, value_count[value], &deleted) == value_count[value]);
+            assert(deleted);
+            value_count[value] = 0;
+        }
+    }
+    verify_subtree(&subtree);
+    assert(pool->allocated == 0);
+
+    printf("Building subtrees of every size...\n");
+    for (size = 0; size <= VALUE_RANGE / 2; size++) {
+        for (i = 0; i < size; i++) {
+            values[i] = 2 * i + 1;
+            counts[i] = i + 1;
+            value_count[values[i]] = counts[i];
+        }
+        box_subtree_init(&subtree);
+        assert(box_subtree_build(&subtree, pool, values, counts, size));
+        assert(subtree.is_tree == (size > BOX_SUBTREE_INLINE));
+        verify_subtree(&subtree);
+
+        box_subtree_shape(&subtree, &shape);
+        assert(shape.nodes == (subtree.is_tree ? size : 0));
+
+        /* Inserting a new value to a full array promotes it */
+        assert(box_subtree_insert(&subtree, pool, 0, 1, &exists));
+        assert(!exists);
+        value_count[0] = 1;
+        verify_subtree(&subtree);
+
+        for (i = 0; i < VALUE_RANGE; i++) {
+            if (value_count[i] > 0) {
+                assert(box_subtree_remove(&subtree, i, value_count[i], &deleted) == value_count[i]);
+                value_count[i] = 0;
+            }
+        }
+        verify_subtree(&subtree);
+        assert(pool->allocated == 0);
+    }
+
+    pool_destroy(pool);
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "box_factory.h"
+#include "box_wal.h"
+
+/* The log starts with a header, followed by the records */
+#define BOX_WAL_MAGIC ("BOXWAL")
+#define BOX_WAL_VERSION (1)
+
+/* Records are read (and applied as batches) this many at a time on replay */
+#define BOX_WAL_REPLAY_RECORDS (4096)
+
+/* FNV-1a, over the 3 fields of a record */
+#define BOX_WAL_CHECKSUM_BASIS (2166136261u)
+#define BOX_WAL_CHECKSUM_PRIME (16777619u)
+
+typedef struct box_wal_header_s {
+    char magic[8];
+    unsigned int version;
+    unsigned int record_size;   /* sizeof(box_wal_record_t) */
+} box_wal_header_t;
+
+/* now_ns - the monotonic time in nanoseconds. */
+static unsigned long long now_ns(void);
+
+/* record_checksum - the checksum of a record's fields. */
+static unsigned int record_checksum(const box_wal_record_t *record);
+
+/* write_all - write size bytes of buffer to fd, through partial writes and interrupts.
+   Returns false on a write error.
+ */
+static bool write_all(int fd, const void *buffer, size_t size);
+
+/* read_all - read up to size bytes of fd to buffer, through partial reads and interrupts.
+   Returns the number of bytes read, which is less than size only at the end of the file, or -1 on
+   a read error.
+ */
+static ssize_t read_all(int fd, void *buffer, size_t size);
+
+/* replay - apply the records of the log of fd (positioned after its header) to factory, and cut the
+   log at the first torn record. Returns false on a read error, an allocation error, or a removal of
+   a box that isn't in the factory.
+ */
+static bool replay(int fd, box_factory_t *factory);
+
+/* apply - apply a chunk of records, whose insertions and removals were split to inserted and removed
+   (which are reordered), to factory. Returns false like replay.
+   The chunk is applied as its net change per box: a single batch of removals, followed by a single
+   batch of insertions. The log was valid in its own order, so the boxes that are net removed were
+   all in the factory before the chunk, and the result is the same.
+ */
+static bool apply(box_factory_t *factory, box_factory_box_t *inserted, size_t insert_count, box_factory_box_t *removed, size_t remove_count);
+
+/* compare_boxes - qsort's comparison of box_factory_box_t, by side and then by height. */
+static int compare_boxes(const void *a, const void *b);
+
+/* append - add a record to the group, and write the group if it's complete. Returns false if the
+   log has failed.
+ */
+static bool append(box_wal_t *wal, unsigned int operation, unsigned int side, unsigned int height);
+
+box_wal_t* box_wal_open(const char *path, box_factory_t *factory, unsigned int group_size, unsigned int group_window_ms)
+{
+    box_wal_t *wal = NULL;
+    box_wal_header_t header;
+    ssize_t size = 0;
+
+    wal = calloc(sizeof(box_wal_t), 1);
+    if (NULL == wal) {
+        return NULL;
+    }
+
+    wal->group_size = (group_size == 0) ? 1 : group_size;
+    wal->group_window = (unsigned long long) group_window_ms * 1000000ULL;
+    wal->group = calloc(sizeof(box_wal_record_t), wal->group_size);
+    wal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if ((NULL == wal->group) || (-1 == wal->fd)) {
+        goto error;
+    }
+
+    size = read_all(wal->fd, &header, sizeof(header));
+    if (size == -1) {
+        goto error;
+    }
+    if (size < (ssize_t) sizeof(header)) {
+        /* A new log, or one whose creation was cut short by a crash before it held any record */
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, BOX_WAL_MAGIC, sizeof(BOX_WAL_MAGIC));
+        header.version = BOX_WAL_VERSION;
+        header.record_size = sizeof(box_wal_record_t);
+        if ((0 != ftruncate(wal->fd, 0)) || (-1 == lseek(wal->fd, 0, SEEK_SET)) ||
+            !write_all(wal->fd, &header, sizeof(header)) || (0 != fdatasync(wal->fd))) {
+            goto error;
+        }
+        return wal;
+    }
+
+    if ((0 != memcmp(header.magic, BOX_WAL_MAGIC, sizeof(BOX_WAL_MAGIC))) ||
+        (header.version != BOX_WAL_VERSION) ||
+        (header.record_size != sizeof(box_wal_record_t))) {
+        goto error;
+    }
+
+    /* replay leaves the file positioned at its (new) end, where the next records go */
+    if (false == replay(wal->fd, factory)) {
+        goto error;
+    }
+
+    return wal;
+
+error:
+    if (-1 != wal->fd) {
+        close(wal->fd);
+    }
+    free(wal->group);
+    free(wal);
+
+    return NULL;
+}
+
+bool box_wal_close(box_wal_t *wal)
+{
+    bool result = box_wal_sync(wal);
+
+    if (0 != close(wal->fd)) {
+        result = false;
+    }
+    free(wal->group);
+    free(wal);
+
+    return result;
+}
+
+bool box_wal_insert(box_wal_t *wal, box_factory_t *factory, unsigned int side, unsigned int height)
+{
+    if (wal->failed || !box_factory_insert(factory, side, height)) {
+        return false;
+    }
+
+    return append(wal, BOX_WAL_INSERT, side, height);
+}
+
+bool box_wal_remove(box_wal_t *wal, box_factory_t *factory, unsigned int side, unsigned int height)
+{
+    if (wal->failed || !box_factory_remove(factory, side, height)) {
+        return false;
+    }
+
+    return append(wal, BOX_WAL_REMOVE, side, height);
+}
+
+bool box_wal_sync(box_wal_t *wal)
+{
+    if (wal->failed) {
+        return false;
+    }
+
+    if (wal->pending == 0) {
+        return true;
+    }
+
+    if (!write_all(wal->fd, wal->group, wal->pending * sizeof(box_wal_record_t)) || (0 != fdatasync(wal->fd))) {
+        /* The file may now hold part of the group, so nothing may be appended after it */
+        wal->failed = true;
+        return false;
+    }
+    wal->pending = 0;
+
+    return true;
+}
+
+static bool append(box_wal_t *wal, unsigned int operation, unsigned int side, unsigned int height)
+{
+    box_wal_record_t *record = &(wal->group[wal->pending]);
+
+    record->operation = operation;
+    record->side = side;
+    record->height = height;
+    record->checksum = record_checksum(record);
+
+    if (wal->pending++ == 0) {
+        wal->group_start = (wal->group_window > 0) ? now_ns() : 0;
+    }
+
+    if ((wal->pending == wal->group_size) ||
+        ((wal->group_window > 0) && (now_ns() - wal->group_start >= wal->group_window))) {
+        return box_wal_sync(wal);
+    }
+
+    return true;
+}
+
+static bool replay(int fd, box_factory_t *factory)
+{
+    box_wal_record_t *records = NULL;
+    box_factory_box_t *inserted = NULL;
+    box_factory_box_t *removed = NULL;
+    off_t valid_end = sizeof(box_wal_header_t);
+    ssize_t size = 0;
+    size_t count = 0;
+    size_t insert_count = 0;
+    size_t remove_count = 0;
+    size_t i = 0;
+    bool end = false;
+    bool result = false;
+
+    records = malloc(BOX_WAL_REPLAY_RECORDS * sizeof(box_wal_record_t));
+    inserted = malloc(BOX_WAL_REPLAY_RECORDS * sizeof(box_factory_box_t));
+    removed = malloc(BOX_WAL_REPLAY_RECORDS * sizeof(box_factory_box_t));
+    if ((NULL == records) || (NULL == inserted) || (NULL == removed)) {
+        goto cleanup;
+    }
+
+    while (!end) {
+        size = read_all(fd, records, BOX_WAL_REPLAY_RECORDS * sizeof(box_wal_record_t));
+        if (size == -1) {
+            goto cleanup;
+        }
+
+        /* A short read is the end of the log, where a partial record is a torn one */
+        count = size / sizeof(box_wal_record_t);
+        end = (count < BOX_WAL_REPLAY_RECORDS);
+
+        insert_count = 0;
+        remove_count = 0;
+        for (i = 0; i < count; i++) {
+            if (records[i].checksum != record_checksum(&records[i])) {
+                end = true;
+                break;
+            }
+
+            if (records[i].operation == BOX_WAL_INSERT) {
+                inserted[insert_count].side = records[i].side;
+                inserted[insert_count++].height = records[i].height;
+            } else if (records[i].operation == BOX_WAL_REMOVE) {
+                removed[remove_count].side = records[i].side;
+                removed[remove_count++].height = records[i].height;
+            } else {
+                end = true;
+                break;
+            }
+        }
+
+        if (false == apply(factory, inserted, insert_count, removed, remove_count)) {
+            goto cleanup;
+        }
+        valid_end += i * sizeof(box_wal_record_t);
+    }
+
+    /* Whatever follows the last valid record is dropped, so new records directly follow it */
+    if ((0 != ftruncate(fd, valid_end)) || (-1 == lseek(fd, valid_end, SEEK_SET))) {
+        goto cleanup;
+    }
+
+    result = true;
+
+cleanup:
+    free(records);
+    free(inserted);
+    free(removed);
+
+    return result;
+}
+
+static bool apply(box_factory_t *factory, box_factory_box_t *inserted, size_t insert_count, box_factory_box_t *removed, size_t remove_count)
+{
+    size_t insert_index = 0;
+    size_t remove_index = 0;
+    size_t insert_left = 0;
+    size_t remove_left = 0;
+    int order = 0;
+
+    qsort(inserted, insert_count, sizeof(box_factory_box_t), compare_boxes);
+    qsort(removed, remove_count, sizeof(box_factory_box_t), compare_boxes);
+
+    /* The instances of a box that were both inserted and removed cancel out, and only what's left
+       is kept (in place) at the beginning of each array */
+    while ((insert_index < insert_count) && (remove_index < remove_count)) {
+        order = compare_boxes(&inserted[insert_index], &removed[remove_index]);
+        if (order == 0) {
+            insert_index++;
+            remove_index++;
+        } else if (order < 0) {
+            inserted[insert_left++] = inserted[insert_index++];
+        } else {
+            removed[remove_left++] = removed[remove_index++];
+        }
+    }
+    while (insert_index < insert_count) {
+        inserted[insert_left++] = inserted[insert_index++];
+    }
+    while (remove_index < remove_count) {
+        removed[remove_left++] = removed[remove_index++];
+    }
+
+    /* Only successful removals are logged, so every net removal must succeed again */
+    return (box_factory_remove_batch(factory, removed, remove_left) == remove_left) &&
+           box_factory_insert_batch(factory, inserted, insert_left);
+}
+
+static int compare_boxes(const void *a, const void *b)
+{
+    const box_factory_box_t *box_a = a;
+    const box_factory_box_t *box_b = b;
+
+    if (box_a->side != box_b->side) {
+        return (box_a->side > box_b->side) - (box_a->side < box_b->side);
+    }
+
+    return (box_a->height > box_b->height) - (box_a->height < box_b->height);
+}
+
+static unsigned int record_checksum(const box_wal_record_t *record)
+{
+    unsigned int fields[3] = {record->operation, record->side, record->height};
+    const unsigned char *bytes = (const unsigned char *) fields;
+    unsigned int checksum = BOX_WAL_CHECKSUM_BASIS;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(fields); i++) {
+        checksum = (checksum ^ bytes[i]) * BOX_WAL_CHECKSUM_PRIME;
+    }
+
+    return checksum;
+}
+
+static bool write_all(int fd, const void *buffer, size_t size)
+{
+    const char *bytes = buffer;
+    ssize_t written = 0;
+
+    while (size > 0) {
+        written = write(fd, bytes, size);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+static ssize_t read_all(int fd, void *buffer, size_t size)
+{
+    char *bytes = buffer;
+    size_t total = 0;
+    ssize_t done = 0;
+
+    while (total < size) {
+        done = read(fd, bytes + total, size - total);
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (done == 0) {
+            break;
+        }
+        total += done;
+    }
+
+    return total;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
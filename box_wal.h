@@ -0,0 +1,84 @@
+/*
+  box_wal.h - A write-ahead log of box factory mutations.
+  Every insertion and removal that goes through the log is appended to it as a fixed size binary
+  record, so the factory's state can be rebuilt after a crash by replaying the log.
+
+  Records are collected in memory and written with a single write and fdatasync per group (group
+  commit), once the group has group_size records, or once its first record is group_window_ms old.
+  The log is durable up to the last completed group, which costs a sync per group rather than per
+  operation. The window is only checked when records are appended, so an idle writer should call
+  box_wal_sync to bound the loss.
+
+  Replay reads the log in chunks, and applies each chunk as its net change per box: the insertions
+  and removals of a box within the chunk cancel out, and the rest goes through a single
+  box_factory_remove_batch and a single box_factory_insert_batch, which pay one search per distinct
+  box instead of one per record.
+  A record that was torn by a crash fails its checksum, and the log is cut right before it.
+
+  A log and its factory are used by a single thread, like the factory itself.
+ */
+
+#include <stdbool.h>
+
+#include "box_factory.h"
+
+#ifndef __BOX_WAL_H__
+#define __BOX_WAL_H__
+
+typedef enum box_wal_operation_e {
+    BOX_WAL_INSERT = 1,
+    BOX_WAL_REMOVE,
+} box_wal_operation_t;
+
+/* A record of the log, as it is written to the file */
+typedef struct box_wal_record_s {
+    unsigned int operation;     /* box_wal_operation_t */
+    unsigned int side;
+    unsigned int height;
+    unsigned int checksum;      /* Of the other fields, so torn records are detected */
+} box_wal_record_t;
+
+typedef struct box_wal_s {
+    int fd;
+    box_wal_record_t *group;            /* The records that weren't written yet */
+    unsigned int pending;               /* Number of records in group */
+    unsigned int group_size;
+    unsigned long long group_window;    /* In nanoseconds, or 0 for no time limit */
+    unsigned long long group_start;     /* The time of the first pending record */
+    bool failed;                        /* A write or a sync has failed, so nothing is logged anymore */
+} box_wal_t;
+
+/* box_wal_open - open the log at path for appending, creating it if it doesn't exist.
+   The records of an existing log are first replayed into factory, which should hold the state that
+   the log was started on (e.g. an empty factory, or the factory that was opened from a file saved
+   right before the log was started). A torn record at the end of the log is cut off, and so is a
+   torn header (a log that is shorter than its header holds no records, and is started over).
+   group_size is the max number of records per group (0 is taken as 1), and group_window_ms is the
+   max age of a group before it's written (0 for no time limit).
+   Returns NULL if the log can't be opened or isn't a valid log, if its removals don't match
+   factory's boxes, or on an allocation error. The factory may hold part of the log's records then.
+ */
+box_wal_t* box_wal_open(const char *path, box_factory_t *factory, unsigned int group_size, unsigned int group_window_ms);
+
+/* box_wal_close - write and sync the pending records, and close the log.
+   Returns false if they couldn't be written (or if the log had already failed).
+ */
+bool box_wal_close(box_wal_t *wal);
+
+/* box_wal_insert - box_factory_insert, which is then logged.
+   Returns false on an allocation error, or if the log has failed (in which case the factory isn't
+   changed). If the group write fails, the box stays in the factory, but the log fails and false is
+   returned.
+ */
+bool box_wal_insert(box_wal_t *wal, box_factory_t *factory, unsigned int side, unsigned int height);
+
+/* box_wal_remove - box_factory_remove, which is then logged if the box was removed.
+   Returns false if the box wasn't found, or on the log errors of box_wal_insert (wal->failed tells
+   them apart).
+ */
+bool box_wal_remove(box_wal_t *wal, box_factory_t *factory, unsigned int side, unsigned int height);
+
+/* box_wal_sync - write and sync the pending records now. Returns false if the log has failed. */
+bool box_wal_sync(box_wal_t *wal);
+
+#endif /* __BOX_WAL_H__ */
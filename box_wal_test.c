@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "box_factory.h"
+#include "box_wal.h"
+
+#define SIDE_RANGE (30)
+#define HEIGHT_RANGE (30)
+
+/* More than the number of distinct boxes, so a dump holds all of them */
+#define MAX_FITS (SIDE_RANGE * HEIGHT_RANGE + 1)
+
+/* Enough records for replay to apply several chunks */
+#define REPLAY_OPERATIONS (20000)
+
+/* Every byte offset of a log of this many records is cut in turn */
+#define TORN_OPERATIONS (60)
+
+/* The size of the log's header, which the records follow */
+#define HEADER_SIZE (16)
+
+/* An operation of the log, as the test made it */
+typedef struct operation_s {
+    bool insert;
+    unsigned int side;
+    unsigned int height;
+} operation_t;
+
+static char directory[] = "/tmp/box_wal_test.XXXXXX";
+static char path[sizeof(directory) + 16];
+
+/* same_boxes - returns true if both factories hold the same boxes, with the same counts */
+static bool same_boxes(box_factory_t *factory, box_factory_t *expected)
+{
+    static box_factory_fit_t fits[MAX_FITS];
+    static box_factory_fit_t expected_fits[MAX_FITS];
+    size_t count = box_factory_get_boxes_k(factory, 0, 0, fits, MAX_FITS);
+
+    return (count == box_factory_get_boxes_k(expected, 0, 0, expected_fits, MAX_FITS)) &&
+           (0 == memcmp(fits, expected_fits, count * sizeof(fits[0])));
+}
+
+/* file_size - the size of the log */
+static off_t file_size(void)
+{
+    struct stat status;
+
+    assert(0 == stat(path, &status));
+    return status.st_size;
+}
+
+/* random_operations - make count random operations through the log, and directly on expected.
+   Removals are only made of boxes that exist, so they're all logged. The operations are kept in
+   operations, if it isn't NULL.
+ */
+static void random_operations(box_wal_t *wal, box_factory_t *factory, box_factory_t *expected, operation_t *operations, unsigned int count)
+{
+    operation_t operation;
+    unsigned int found_side_square = 0;
+    unsigned int found_height = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < count; i++) {
+        operation.side = rand() % SIDE_RANGE + 1;
+        operation.height = rand() % HEIGHT_RANGE + 1;
+        operation.insert = (rand() % 3 != 0) ||
+                           !box_factory_get_box(expected, operation.side, operation.height, &found_side_square, &found_height);
+        if (operation.insert) {
+            assert(box_wal_insert(wal, factory, operation.side, operation.height));
+            assert(box_factory_insert(expected, operation.side, operation.height));
+        } else {
+            /* Some box that fits, whose side is the square root of found_side_square */
+            for (operation.side = 1; operation.side * operation.side < found_side_square; operation.side++);
+            operation.height = found_height;
+            assert(box_wal_remove(wal, factory, operation.side, operation.height));
+            assert(box_factory_remove(expected, operation.side, operation.height));
+        }
+        if (NULL != operations) {
+            operations[i] = operation;
+        }
+    }
+}
+
+static void test_replay(void)
+{
+    box_factory_t *factory = NULL;
+    box_factory_t *expected = NULL;
+    box_factory_t *replayed = NULL;
+    box_wal_t *wal = NULL;
+
+    printf("Replaying %d operations...\n", REPLAY_OPERATIONS);
+    unlink(path);
+    factory = box_factory_create();
+    expected = box_factory_create();
+    assert(factory && expected);
+
+    wal = box_wal_open(path, factory, 64, 0);
+    assert(wal);
+    assert(file_size() == HEADER_SIZE);
+
+    /* Removals of missing boxes aren't logged */
+    assert(!box_wal_remove(wal, factory, 1, 1) && !wal->failed);
+    random_operations(wal, factory, expected, NULL, REPLAY_OPERATIONS);
+    assert(box_wal_close(wal));
+    assert(file_size() == HEADER_SIZE + (off_t) sizeof(box_wal_record_t) * REPLAY_OPERATIONS);
+
+    replayed = box_factory_create();
+    assert(replayed);
+    wal = box_wal_open(path, replayed, 64, 0);
+    assert(wal);
+    assert(same_boxes(replayed, expected));
+
+    /* The log goes on from where it was */
+    random_operations(wal, replayed, expected, NULL, 1000);
+    assert(box_wal_close(wal));
+    box_factory_destroy(replayed);
+    replayed = box_factory_create();
+    assert(replayed);
+    wal = box_wal_open(path, replayed, 64, 0);
+    assert(wal);
+    assert(same_boxes(replayed, expected));
+    assert(box_wal_close(wal));
+    box_factory_destroy(replayed);
+
+    /* A log whose removals don't match the factory's boxes, or that isn't a log, can't be opened */
+    box_factory_destroy(factory);
+    unlink(path);
+    factory = box_factory_create();
+    assert(factory && box_factory_insert(factory, 7, 7));
+    wal = box_wal_open(path, factory, 64, 0);
+    assert(wal && box_wal_remove(wal, factory, 7, 7));
+    assert(box_wal_close(wal));
+    assert(NULL == box_wal_open(path, factory, 64, 0));
+    assert(0 == truncate(path, 0));
+    assert(0 == truncate(path, HEADER_SIZE));
+    assert(NULL == box_wal_open(path, factory, 64, 0));
+
+    box_factory_destroy(factory);
+    box_factory_destroy(expected);
+}
+
+static void test_group_commit(void)
+{
+    struct timespec window = {0, 3000000};
+    box_factory_t *factory = NULL;
+    box_wal_t *wal = NULL;
+    unsigned int i = 0;
+
+    printf("Committing groups...\n");
+    unlink(path);
+    factory = box_factory_create();
+    assert(factory);
+
+    /* A group is only written once it's complete */
+    wal = box_wal_open(path, factory, 8, 0);
+    assert(wal);
+    for (i = 0; i < 7; i++) {
+        assert(box_wal_insert(wal, factory, 1, i + 1));
+    }
+    assert((wal->pending == 7) && (file_size() == HEADER_SIZE));
+    assert(box_wal_insert(wal, factory, 1, 8));
+    assert((wal->pending == 0) && (file_size() == HEADER_SIZE + 8 * (off_t) sizeof(box_wal_record_t)));
+
+    /* Or once it's synced */
+    assert(box_wal_remove(wal, factory, 1, 8));
+    assert(file_size() == HEADER_SIZE + 8 * (off_t) sizeof(box_wal_record_t));
+    assert(box_wal_sync(wal));
+    assert(box_wal_sync(wal));
+    assert((wal->pending == 0) && (file_size() == HEADER_SIZE + 9 * (off_t) sizeof(box_wal_record_t)));
+    assert(box_wal_close(wal));
+
+    /* Or once its window is over */
+    box_factory_destroy(factory);
+    factory = box_factory_create();
+    assert(factory);
+    wal = box_wal_open(path, factory, 1000, 1);
+    assert(wal);
+    assert(box_wal_insert(wal, factory, 2, 1));
+    nanosleep(&window, NULL);
+    assert(box_wal_insert(wal, factory, 2, 2));
+    assert((wal->pending == 0) && (file_size() == HEADER_SIZE + 11 * (off_t) sizeof(box_wal_record_t)));
+
+    /* A group size of 0 is taken as 1 */
+    assert(box_wal_close(wal));
+    box_factory_destroy(factory);
+    factory = box_factory_create();
+    assert(factory);
+    wal = box_wal_open(path, factory, 0, 0);
+    assert(wal);
+    assert(box_wal_insert(wal, factory, 2, 3));
+    assert((wal->pending == 0) && (file_size() == HEADER_SIZE + 12 * (off_t) sizeof(box_wal_record_t)));
+    assert(box_wal_close(wal));
+
+    box_factory_destroy(factory);
+}
+
+/* test_torn_log - a log cut at any byte offset, as by a crash, must open with the records that
+   were completely written, and keep on logging after them
+ */
+static void test_torn_log(void)
+{
+    operation_t operations[TORN_OPERATIONS];
+    box_factory_t *factory = NULL;
+    box_factory_t *expected = NULL;
+    box_wal_t *wal = NULL;
+    FILE *file = NULL;
+    char *log = NULL;
+    off_t size = 0;
+    off_t offset = 0;
+    off_t records = 0;
+    off_t i = 0;
+
+    printf("Opening a log that was cut at each of its bytes...\n");
+    unlink(path);
+    factory = box_factory_create();
+    expected = box_factory_create();
+    assert(factory && expected);
+    wal = box_wal_open(path, factory, 1, 0);
+    assert(wal);
+    random_operations(wal, factory, expected, operations, TORN_OPERATIONS);
+    assert(box_wal_close(wal));
+    box_factory_destroy(factory);
+    box_factory_destroy(expected);
+
+    size = file_size();
+    log = malloc(size);
+    assert(log);
+    file = fopen(path, "rb");
+    assert(file && (1 == fread(log, size, 1, file)));
+    fclose(file);
+
+    for (offset = 0; offset <= size; offset++) {
+        file = fopen(path, "wb");
+        assert(file && ((offset == 0) || (1 == fwrite(log, offset, 1, file))));
+        fclose(file);
+
+        records = (offset < HEADER_SIZE) ? 0 : (offset - HEADER_SIZE) / (off_t) sizeof(box_wal_record_t);
+        factory = box_factory_create();
+        expected = box_factory_create();
+        assert(factory && expected);
+        for (i = 0; i < records; i++) {
+            assert(operations[i].insert ? box_factory_insert(expected, operations[i].side, operations[i].height) :
+                                          box_factory_remove(expected, operations[i].side, operations[i].height));
+        }
+
+        wal = box_wal_open(path, factory, 1, 0);
+        assert(wal);
+        assert(same_boxes(factory, expected));
+        assert(file_size() == HEADER_SIZE + records * (off_t) sizeof(box_wal_record_t));
+
+        /* The next record directly follows the last complete one */
+        assert(box_wal_insert(wal, factory, 1, 1));
+        assert(box_factory_insert(expected, 1, 1));
+        assert(box_wal_close(wal));
+        box_factory_destroy(factory);
+        factory = box_factory_create();
+        assert(factory);
+        wal = box_wal_open(path, factory, 1, 0);
+        assert(wal);
+        assert(same_boxes(factory, expected));
+        assert(box_wal_close(wal));
+
+        box_factory_destroy(factory);
+        box_factory_destroy(expected);
+    }
+
+    /* A record that fails its checksum ends the log, like a torn one */
+    file = fopen(path, "wb");
+    assert(file && (1 == fwrite(log, size, 1, file)));
+    fclose(file);
+    records = TORN_OPERATIONS / 2;
+    file = fopen(path, "r+b");
+    assert(file && (0 == fseek(file, HEADER_SIZE + records * sizeof(box_wal_record_t) + 4, SEEK_SET)));
+    assert(EOF != fputc(0xff, file));
+    fclose(file);
+
+    factory = box_factory_create();
+    expected = box_factory_create();
+    assert(factory && expected);
+    for (i = 0; i < records; i++) {
+        assert(operations[i].insert ? box_factory_insert(expected, operations[i].side, operations[i].height) :
+                                      box_factory_remove(expected, operations[i].side, operations[i].height));
+    }
+    wal = box_wal_open(path, factory, 1, 0);
+    assert(wal);
+    assert(same_boxes(factory, expected));
+    assert(file_size() == HEADER_SIZE + records * (off_t) sizeof(box_wal_record_t));
+    assert(box_wal_close(wal));
+
+    box_factory_destroy(factory);
+    box_factory_destroy(expected);
+    free(log);
+}
+
+int main(void)
+{
+    srand(18);
+
+    assert(mkdtemp(directory));
+    sprintf(path, "%s/log", directory);
+
+    test_replay();
+    test_group_commit();
+    test_torn_log();
+
+    assert(0 == unlink(path));
+    assert(0 == rmdir(directory));
+
+    return 0;
+}
@@ -0,0 +1,661 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "op_stats.h"
+#include "pool.h"
+#include "bp_tree.h"
+
+/* A node (other than the root) is kept at least half full */
+#define LEAF_MIN_KEYS (BP_TREE_LEAF_KEYS / 2)
+#define INNER_MIN_KEYS (BP_TREE_INNER_KEYS / 2)
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+/* The path of a descent from the root to a leaf */
+typedef struct bp_tree_path_s {
+    bp_tree_inner_t *nodes[BP_TREE_MAX_HEIGHT]; /* The inner node at each level, from the root */
+    unsigned int slots[BP_TREE_MAX_HEIGHT];     /* The child that the descent took at each level */
+    bp_tree_leaf_t *leaf;
+    unsigned int index;                         /* The key's lower bound in the leaf */
+} bp_tree_path_t;
+
+/* find_path - descend from the root to the leaf of key, recording the path. The tree must not be
+   empty. Returns true if the key exists (at path->leaf->keys[path->index]).
+ */
+static bool find_path(bp_tree_t *tree, unsigned int key, bp_tree_path_t *path);
+
+/* leaf_lower_bound - the index of the first key in the leaf that is larger than or equal to key. */
+static unsigned int leaf_lower_bound(bp_tree_leaf_t *leaf, unsigned int key);
+
+/* inner_slot - the child of the inner node whose branch should hold key. */
+static unsigned int inner_slot(bp_tree_inner_t *inner, unsigned int key);
+
+/* node_max_aux - the max aux in a node (a leaf if is_leaf), 0 if it is empty. */
+static unsigned int node_max_aux(void *node, bool is_leaf);
+
+/* leaf_insert_at, leaf_remove_at - insert/remove an entry at the index of a leaf, shifting the
+   following entries. leaf_insert_at requires a leaf that isn't full.
+ */
+static void leaf_insert_at(bp_tree_leaf_t *leaf, unsigned int index, unsigned int key, unsigned int aux);
+static void leaf_remove_at(bp_tree_leaf_t *leaf, unsigned int index);
+
+/* leaf_move - move count entries from one leaf index to another (possibly in the same leaf). */
+static void leaf_move(bp_tree_leaf_t *to, unsigned int to_index, bp_tree_leaf_t *from, unsigned int from_index, unsigned int count);
+
+/* inner_insert_child - insert a separator and the child to its right into an inner node (which may
+   be full, as the arrays are passed by the caller), after slot.
+ */
+static void inner_insert_child(unsigned int *keys, void **children, unsigned int *aux_max, unsigned int count, unsigned int slot, unsigned int separator, void *child, unsigned int child_aux);
+
+/* inner_remove_child - remove the separator keys[slot] and the child to its right. */
+static void inner_remove_child(bp_tree_inner_t *inner, unsigned int slot);
+
+/* fix_underflow - rebalance the child in slot of parent, which has become less than half full, by
+   merging it with a sibling, or by borrowing an entry from it if they don't fit in one node.
+ */
+static void fix_underflow(bp_tree_t *tree, bp_tree_inner_t *parent, unsigned int slot, bool is_leaf);
+
+/* free_node - free a node and its entire branch. level is the node's distance from the leaves. */
+static void free_node(bp_tree_t *tree, void *node, unsigned int level);
+
+bp_tree_t* bp_tree_create(pool_t *pool)
+{
+    bp_tree_t *tree = pool_alloc(pool, sizeof(bp_tree_t));
+
+    if (NULL == tree) {
+        return NULL;
+    }
+
+    tree->root = NULL;
+    tree->height = 0;
+    tree->count = 0;
+    tree->first = NULL;
+    tree->last = NULL;
+    tree->pool = pool;
+
+    return tree;
+}
+
+void bp_tree_destroy(bp_tree_t *tree)
+{
+    if (NULL != tree->root) {
+        free_node(tree, tree->root, tree->height);
+    }
+
+    pool_free(tree->pool, tree, sizeof(bp_tree_t));
+}
+
+bool bp_tree_insert(bp_tree_t *tree, unsigned int key, unsigned int aux, bool *exists, bp_tree_cursor_t *position)
+{
+    bp_tree_path_t path;
+    bp_tree_leaf_t *leaf = NULL;
+    bp_tree_leaf_t *right = NULL;
+    bp_tree_inner_t *parent = NULL;
+    bp_tree_inner_t *sibling = NULL;
+    bp_tree_inner_t *spare_inners[BP_TREE_MAX_HEIGHT + 1];
+    unsigned int spare_count = 0;
+    unsigned int keys[BP_TREE_INNER_KEYS + 1];
+    unsigned int aux_max[BP_TREE_INNER_KEYS + 2];
+    void *children[BP_TREE_INNER_KEYS + 2];
+    void *new_child = NULL;
+    unsigned int separator = 0;
+    unsigned int half = 0;
+    unsigned int slot = 0;
+    int level = 0;
+    bp_tree_leaf_t *found_leaf = NULL;
+    unsigned int found_index = 0;
+
+    *exists = false;
+
+    if (NULL == tree->root) {
+        leaf = pool_alloc(tree->pool, sizeof(bp_tree_leaf_t));
+        if (NULL == leaf) {
+            return false;
+        }
+        leaf_insert_at(leaf, 0, key, aux);
+        tree->root = leaf;
+        tree->first = leaf;
+        tree->last = leaf;
+        tree->count = 1;
+        if (NULL != position) {
+            position->leaf = leaf;
+            position->index = 0;
+        }
+        return true;
+    }
+
+    if (find_path(tree, key, &path)) {
+        /* The key exists, only its count and aux change */
+        *exists = true;
+        path.leaf->counts[path.index]++;
+        path.leaf->aux[path.index] = MAX(path.leaf->aux[path.index], aux);
+        for (level = 0; level < (int) tree->height; level++) {
+            path.nodes[level]->aux_max[path.slots[level]] = MAX(path.nodes[level]->aux_max[path.slots[level]], aux);
+        }
+        if (NULL != position) {
+            position->leaf = path.leaf;
+            position->index = path.index;
+        }
+        return true;
+    }
+
+    leaf = path.leaf;
+    if (leaf->count == BP_TREE_LEAF_KEYS) {
+        /* The splits go up the path while the nodes are full, and may add a new root. All of the
+           nodes are allocated in advance, so that a failure leaves the tree unchanged. */
+        right = pool_alloc(tree->pool, sizeof(bp_tree_leaf_t));
+        if (NULL == right) {
+            return false;
+        }
+        level = (int) tree->height - 1;
+        while ((level >= 0) && (path.nodes[level]->count == BP_TREE_INNER_KEYS)) {
+            level--;
+        }
+        spare_count = (level < 0) ? tree->height + 1 : tree->height - 1 - level;
+        for (half = 0; half < spare_count; half++) {
+            spare_inners[half] = pool_alloc(tree->pool, sizeof(bp_tree_inner_t));
+            if (NULL == spare_inners[half]) {
+                while (half > 0) {
+                    pool_free(tree->pool, spare_inners[--half], sizeof(bp_tree_inner_t));
+                }
+                pool_free(tree->pool, right, sizeof(bp_tree_leaf_t));
+                return false;
+            }
+        }
+    }
+
+    tree->count++;
+
+    if (NULL == right) {
+        leaf_insert_at(leaf, path.index, key, aux);
+        for (level = 0; level < (int) tree->height; level++) {
+            path.nodes[level]->aux_max[path.slots[level]] = MAX(path.nodes[level]->aux_max[path.slots[level]], aux);
+        }
+        if (NULL != position) {
+            position->leaf = leaf;
+            position->index = path.index;
+        }
+        return true;
+    }
+
+    /* Split the leaf in half, and insert the key into the half it belongs to */
+    half = BP_TREE_LEAF_KEYS / 2;
+    leaf_move(right, 0, leaf, half, BP_TREE_LEAF_KEYS - half);
+    right->count = BP_TREE_LEAF_KEYS - half;
+    leaf->count = half;
+    if (path.index <= half) {
+        leaf_insert_at(leaf, path.index, key, aux);
+        found_leaf = leaf;
+        found_index = path.index;
+    } else {
+        leaf_insert_at(right, path.index - half, key, aux);
+        found_leaf = right;
+        found_index = path.index - half;
+    }
+    right->next = leaf->next;
+    leaf->next = right;
+    if (tree->last == leaf) {
+        tree->last = right;
+    }
+    new_child = right;
+    separator = right->keys[0];
+
+    /* Add the new child to the parents, splitting the full ones */
+    for (level = (int) tree->height - 1; level >= 0; level--) {
+        parent = path.nodes[level];
+        slot = path.slots[level];
+
+        if (NULL == new_child) {
+            parent->aux_max[slot] = MAX(parent->aux_max[slot], aux);
+            continue;
+        }
+
+        parent->aux_max[slot] = node_max_aux(parent->children[slot], level == (int) tree->height - 1);
+        if (parent->count < BP_TREE_INNER_KEYS) {
+            inner_insert_child(parent->keys, parent->children, parent->aux_max, parent->count, slot,
+                               separator, new_child, node_max_aux(new_child, level == (int) tree->height - 1));
+            parent->count++;
+            new_child = NULL;
+            continue;
+        }
+
+        /* The parent is full - lay out its entries with the new child, and split them between it
+           and a new sibling, around the middle separator, which goes up */
+        memcpy(keys, parent->keys, sizeof(parent->keys));
+        memcpy(children, parent->children, sizeof(parent->children));
+        memcpy(aux_max, parent->aux_max, sizeof(parent->aux_max));
+        inner_insert_child(keys, children, aux_max, BP_TREE_INNER_KEYS, slot,
+                           separator, new_child, node_max_aux(new_child, level == (int) tree->height - 1));
+
+        sibling = spare_inners[--spare_count];
+        half = BP_TREE_INNER_KEYS / 2;
+        parent->count = half;
+        memcpy(parent->keys, keys, half * sizeof(unsigned int));
+        memcpy(parent->children, children, (half + 1) * sizeof(void *));
+        memcpy(parent->aux_max, aux_max, (half + 1) * sizeof(unsigned int));
+        sibling->count = BP_TREE_INNER_KEYS - half;
+        memcpy(sibling->keys, keys + half + 1, sibling->count * sizeof(unsigned int));
+        memcpy(sibling->children, children + half + 1, (sibling->count + 1) * sizeof(void *));
+        memcpy(sibling->aux_max, aux_max + half + 1, (sibling->count + 1) * sizeof(unsigned int));
+
+        separator = keys[half];
+        new_child = sibling;
+    }
+
+    if (NULL != new_child) {
+        /* The root was split, so the tree grows by a level */
+        parent = spare_inners[--spare_count];
+        parent->count = 1;
+        parent->keys[0] = separator;
+        parent->children[0] = tree->root;
+        parent->children[1] = new_child;
+        parent->aux_max[0] = node_max_aux(tree->root, tree->height == 0);
+        parent->aux_max[1] = node_max_aux(new_child, tree->height == 0);
+        tree->root = parent;
+        tree->height++;
+    }
+
+    if (NULL != position) {
+        position->leaf = found_leaf;
+        position->index = found_index;
+    }
+
+    return true;
+}
+
+bool bp_tree_remove(bp_tree_t *tree, unsigned int key, bool *deleted)
+{
+    bp_tree_path_t path;
+    bp_tree_inner_t *parent = NULL;
+    bp_tree_inner_t *root = NULL;
+    unsigned int child_count = 0;
+    bool is_leaf = false;
+    int level = 0;
+
+    *deleted = false;
+
+    if ((NULL == tree->root) || !find_path(tree, key, &path)) {
+        return false;
+    }
+
+    path.leaf->counts[path.index]--;
+    if (path.leaf->counts[path.index] > 0) {
+        return true;
+    }
+
+    *deleted = true;
+    tree->count--;
+    leaf_remove_at(path.leaf, path.index);
+
+    /* Rebalance the path bottom-up. The removed aux might have been a branch max on the way. */
+    for (level = (int) tree->height - 1; level >= 0; level--) {
+        parent = path.nodes[level];
+        is_leaf = (level == (int) tree->height - 1);
+        child_count = is_leaf ? ((bp_tree_leaf_t *) parent->children[path.slots[level]])->count :
+                                ((bp_tree_inner_t *) parent->children[path.slots[level]])->count;
+
+        if (child_count < (is_leaf ? LEAF_MIN_KEYS : INNER_MIN_KEYS)) {
+            fix_underflow(tree, parent, path.slots[level], is_leaf);
+        } else {
+            parent->aux_max[path.slots[level]] = node_max_aux(parent->children[path.slots[level]], is_leaf);
+        }
+    }
+
+    if (tree->height == 0) {
+        if (path.leaf->count == 0) {
+            pool_free(tree->pool, path.leaf, sizeof(bp_tree_leaf_t));
+            tree->root = NULL;
+            tree->first = NULL;
+            tree->last = NULL;
+        }
+    } else {
+        root = tree->root;
+        if (root->count == 0) {
+            /* The root's last two children were merged, so the tree shrinks by a level */
+            tree->root = root->children[0];
+            tree->height--;
+            pool_free(tree->pool, root, sizeof(bp_tree_inner_t));
+        }
+    }
+
+    return true;
+}
+
+bool bp_tree_set_aux(bp_tree_t *tree, unsigned int key, unsigned int aux)
+{
+    bp_tree_path_t path;
+    int level = 0;
+
+    if ((NULL == tree->root) || !find_path(tree, key, &path)) {
+        return false;
+    }
+
+    path.leaf->aux[path.index] = aux;
+    for (level = (int) tree->height - 1; level >= 0; level--) {
+        path.nodes[level]->aux_max[path.slots[level]] = node_max_aux(path.nodes[level]->children[path.slots[level]],
+                                                                     level == (int) tree->height - 1);
+    }
+
+    return true;
+}
+
+bool bp_tree_has_dominating(bp_tree_t *tree, unsigned int key, unsigned int aux)
+{
+    void *node = tree->root;
+    bp_tree_inner_t *inner = NULL;
+    bp_tree_leaf_t *leaf = NULL;
+    unsigned int level = 0;
+    unsigned int slot = 0;
+    unsigned int i = 0;
+
+    if (NULL == node) {
+        return false;
+    }
+
+    /* All of the keys in the branches to the right of the key's slot are larger than key, so only
+       their max aux has to be checked. The rest of the candidates are in the key's slot. */
+    for (level = 0; level < tree->height; level++) {
+        inner = node;
+        slot = inner_slot(inner, key);
+        for (i = slot + 1; i <= inner->count; i++) {
+            if (inner->aux_max[i] >= aux) {
+                return true;
+            }
+        }
+        node = inner->children[slot];
+    }
+
+    leaf = node;
+    for (i = leaf_lower_bound(leaf, key); i < leaf->count; i++) {
+        if (leaf->aux[i] >= aux) {
+            return true;
+        }
+    }
+
+    /* The following leaves were covered by the inner nodes */
+    return false;
+}
+
+bool bp_tree_search(bp_tree_t *tree, unsigned int key, bp_tree_cursor_t *cursor)
+{
+    bp_tree_path_t path;
+
+    cursor->leaf = NULL;
+    if ((NULL == tree->root) || !find_path(tree, key, &path)) {
+        return false;
+    }
+
+    cursor->leaf = path.leaf;
+    cursor->index = path.index;
+    return true;
+}
+
+bool bp_tree_search_smallest(bp_tree_t *tree, unsigned int key, bp_tree_cursor_t *cursor)
+{
+    bp_tree_path_t path;
+
+    cursor->leaf = NULL;
+    if (NULL == tree->root) {
+        return false;
+    }
+
+    find_path(tree, key, &path);
+    cursor->leaf = path.leaf;
+    cursor->index = path.index;
+
+    /* The lower bound may be the first key of the next leaf */
+    if (cursor->index == cursor->leaf->count) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->index = 0;
+    }
+
+    return (NULL != cursor->leaf);
+}
+
+bool bp_tree_first(bp_tree_t *tree, bp_tree_cursor_t *cursor)
+{
+    cursor->leaf = tree->first;
+    cursor->index = 0;
+    return (NULL != cursor->leaf);
+}
+
+bool bp_tree_last(bp_tree_t *tree, bp_tree_cursor_t *cursor)
+{
+    cursor->leaf = tree->last;
+    cursor->index = (NULL == tree->last) ? 0 : tree->last->count - 1;
+    return (NULL != cursor->leaf);
+}
+
+bool bp_tree_cursor_next(bp_tree_cursor_t *cursor)
+{
+    if (NULL == cursor->leaf) {
+        return false;
+    }
+
+    cursor->index++;
+    if (cursor->index == cursor->leaf->count) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->index = 0;
+    }
+
+    return (NULL != cursor->leaf);
+}
+
+unsigned int bp_tree_cursor_key(bp_tree_cursor_t *cursor)
+{
+    return cursor->leaf->keys[cursor->index];
+}
+
+unsigned int bp_tree_cursor_count(bp_tree_cursor_t *cursor)
+{
+    return cursor->leaf->counts[cursor->index];
+}
+
+unsigned int bp_tree_cursor_aux(bp_tree_cursor_t *cursor)
+{
+    return cursor->leaf->aux[cursor->index];
+}
+
+void* bp_tree_cursor_value(bp_tree_cursor_t *cursor)
+{
+    return cursor->leaf->values[cursor->index];
+}
+
+void bp_tree_cursor_set_value(bp_tree_cursor_t *cursor, void *value)
+{
+    cursor->leaf->values[cursor->index] = value;
+}
+
+static bool find_path(bp_tree_t *tree, unsigned int key, bp_tree_path_t *path)
+{
+    void *node = tree->root;
+    unsigned int level = 0;
+
+    for (level = 0; level < tree->height; level++) {
+        path->nodes[level] = node;
+        path->slots[level] = inner_slot(node, key);
+        node = path->nodes[level]->children[path->slots[level]];
+    }
+
+    path->leaf = node;
+    path->index = leaf_lower_bound(path->leaf, key);
+
+    return (path->index < path->leaf->count) && (path->leaf->keys[path->index] == key);
+}
+
+static unsigned int leaf_lower_bound(bp_tree_leaf_t *leaf, unsigned int key)
+{
+    unsigned int i = 0;
+
+    /* A linear scan, as the keys are packed in a single cache line */
+    while ((i < leaf->count) && (leaf->keys[i] < key)) {
+        OP_STATS_COUNT(comparisons);
+        i++;
+    }
+
+    return i;
+}
+
+static unsigned int inner_slot(bp_tree_inner_t *inner, unsigned int key)
+{
+    unsigned int i = 0;
+
+    while ((i < inner->count) && (inner->keys[i] <= key)) {
+        OP_STATS_COUNT(comparisons);
+        i++;
+    }
+
+    return i;
+}
+
+static unsigned int node_max_aux(void *node, bool is_leaf)
+{
+    bp_tree_leaf_t *leaf = node;
+    bp_tree_inner_t *inner = node;
+    unsigned int max = 0;
+    unsigned int i = 0;
+
+    if (is_leaf) {
+        for (i = 0; i < leaf->count; i++) {
+            max = MAX(max, leaf->aux[i]);
+        }
+    } else {
+        for (i = 0; i <= inner->count; i++) {
+            max = MAX(max, inner->aux_max[i]);
+        }
+    }
+
+    return max;
+}
+
+static void leaf_insert_at(bp_tree_leaf_t *leaf, unsigned int index, unsigned int key, unsigned int aux)
+{
+    leaf_move(leaf, index + 1, leaf, index, leaf->count - index);
+    leaf->keys[index] = key;
+    leaf->counts[index] = 1;
+    leaf->aux[index] = aux;
+    leaf->values[index] = NULL;
+    leaf->count++;
+}
+
+static void leaf_remove_at(bp_tree_leaf_t *leaf, unsigned int index)
+{
+    leaf_move(leaf, index, leaf, index + 1, leaf->count - index - 1);
+    leaf->count--;
+}
+
+static void leaf_move(bp_tree_leaf_t *to, unsigned int to_index, bp_tree_leaf_t *from, unsigned int from_index, unsigned int count)
+{
+    memmove(to->keys + to_index, from->keys + from_index, count * sizeof(unsigned int));
+    memmove(to->counts + to_index, from->counts + from_index, count * sizeof(unsigned int));
+    memmove(to->aux + to_index, from->aux + from_index, count * sizeof(unsigned int));
+    memmove(to->values + to_index, from->values + from_index, count * sizeof(void *));
+}
+
+static void inner_insert_child(unsigned int *keys, void **children, unsigned int *aux_max, unsigned int count, unsigned int slot, unsigned int separator, void *child, unsigned int child_aux)
+{
+    memmove(keys + slot + 1, keys + slot, (count - slot) * sizeof(unsigned int));
+    memmove(children + slot + 2, children + slot + 1, (count - slot) * sizeof(void *));
+    memmove(aux_max + slot + 2, aux_max + slot + 1, (count - slot) * sizeof(unsigned int));
+    keys[slot] = separator;
+    children[slot + 1] = child;
+    aux_max[slot + 1] = child_aux;
+}
+
+static void inner_remove_child(bp_tree_inner_t *inner, unsigned int slot)
+{
+    memmove(inner->keys + slot, inner->keys + slot + 1, (inner->count - slot - 1) * sizeof(unsigned int));
+    memmove(inner->children + slot + 1, inner->children + slot + 2, (inner->count - slot - 1) * sizeof(void *));
+    memmove(inner->aux_max + slot + 1, inner->aux_max + slot + 2, (inner->count - slot - 1) * sizeof(unsigned int));
+    inner->count--;
+}
+
+static void fix_underflow(bp_tree_t *tree, bp_tree_inner_t *parent, unsigned int slot, bool is_leaf)
+{
+    /* The underflowing child is paired with its left sibling, or with its right one if it's first.
+       The separator between the pair is parent->keys[separator]. */
+    unsigned int separator = (slot > 0) ? slot - 1 : 0;
+    bp_tree_leaf_t *left_leaf = parent->children[separator];
+    bp_tree_leaf_t *right_leaf = parent->children[separator + 1];
+    bp_tree_inner_t *left = parent->children[separator];
+    bp_tree_inner_t *right = parent->children[separator + 1];
+
+    if (is_leaf) {
+        if (left_leaf->count + right_leaf->count <= BP_TREE_LEAF_KEYS) {
+            leaf_move(left_leaf, left_leaf->count, right_leaf, 0, right_leaf->count);
+            left_leaf->count += right_leaf->count;
+            left_leaf->next = right_leaf->next;
+            if (tree->last == right_leaf) {
+                tree->last = left_leaf;
+            }
+            pool_free(tree->pool, right_leaf, sizeof(bp_tree_leaf_t));
+            inner_remove_child(parent, separator);
+        } else if (right_leaf->count < LEAF_MIN_KEYS) {
+            leaf_move(right_leaf, 1, right_leaf, 0, right_leaf->count);
+            leaf_move(right_leaf, 0, left_leaf, left_leaf->count - 1, 1);
+            left_leaf->count--;
+            right_leaf->count++;
+            parent->keys[separator] = right_leaf->keys[0];
+        } else {
+            leaf_move(left_leaf, left_leaf->count, right_leaf, 0, 1);
+            leaf_move(right_leaf, 0, right_leaf, 1, right_leaf->count - 1);
+            left_leaf->count++;
+            right_leaf->count--;
+            parent->keys[separator] = right_leaf->keys[0];
+        }
+    } else {
+        if (left->count + right->count + 1 <= BP_TREE_INNER_KEYS) {
+            /* The separator comes down between the merged keys */
+            left->keys[left->count] = parent->keys[separator];
+            memcpy(left->keys + left->count + 1, right->keys, right->count * sizeof(unsigned int));
+            memcpy(left->children + left->count + 1, right->children, (right->count + 1) * sizeof(void *));
+            memcpy(left->aux_max + left->count + 1, right->aux_max, (right->count + 1) * sizeof(unsigned int));
+            left->count += right->count + 1;
+            pool_free(tree->pool, right, sizeof(bp_tree_inner_t));
+            inner_remove_child(parent, separator);
+        } else if (right->count < INNER_MIN_KEYS) {
+            /* Rotate the left sibling's last child through the separator */
+            memmove(right->keys + 1, right->keys, right->count * sizeof(unsigned int));
+            memmove(right->children + 1, right->children, (right->count + 1) * sizeof(void *));
+            memmove(right->aux_max + 1, right->aux_max, (right->count + 1) * sizeof(unsigned int));
+            right->keys[0] = parent->keys[separator];
+            right->children[0] = left->children[left->count];
+            right->aux_max[0] = left->aux_max[left->count];
+            right->count++;
+            parent->keys[separator] = left->keys[left->count - 1];
+            left->count--;
+        } else {
+            /* Rotate the right sibling's first child through the separator */
+            left->keys[left->count] = parent->keys[separator];
+            left->children[left->count + 1] = right->children[0];
+            left->aux_max[left->count + 1] = right->aux_max[0];
+            left->count++;
+            parent->keys[separator] = right->keys[0];
+            memmove(right->keys, right->keys + 1, (right->count - 1) * sizeof(unsigned int));
+            memmove(right->children, right->children + 1, right->count * sizeof(void *));
+            memmove(right->aux_max, right->aux_max + 1, right->count * sizeof(unsigned int));
+            right->count--;
+        }
+    }
+
+    parent->aux_max[separator] = node_max_aux(parent->children[separator], is_leaf);
+    if (separator + 1 <= parent->count) {
+        parent->aux_max[separator + 1] = node_max_aux(parent->children[separator + 1], is_leaf);
+    }
+}
+
+static void free_node(bp_tree_t *tree, void *node, unsigned int level)
+{
+    bp_tree_inner_t *inner = node;
+    unsigned int i = 0;
+
+    if (level == 0) {
+        pool_free(tree->pool, node, sizeof(bp_tree_leaf_t));
+        return;
+    }
+
+    for (i = 0; i <= inner->count; i++) {
+        free_node(tree, inner->children[i], level - 1);
+    }
+    pool_free(tree->pool, node, sizeof(bp_tree_inner_t));
+}
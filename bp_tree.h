@@ -0,0 +1,130 @@
+/*
+  bp_tree.h - A B+tree of unsigned int keys, with a reference count per key.
+  The keys are packed in arrays inside nodes of a few cache lines, so a search touches a node per
+  level (and each level's keys are in a single cache line), instead of a node per key comparison as
+  in rb_tree. All of the keys are in the leaves, which are linked in order for successor scans.
+
+  Every key also carries:
+    - aux - an unsigned int whose max over each branch is maintained in the inner nodes, so that
+            dominance queries (is there a key >= k with an aux >= a) take a single descent.
+    - value - a user pointer, which the tree doesn't interpret.
+
+  Leaves and inner nodes that drop below half full borrow from a sibling or are merged with it, so
+  the tree stays balanced under removals. The nodes are allocated from a pool (or with malloc for
+  a NULL pool), and fit in the pool's size classes.
+ */
+
+#include <stdbool.h>
+
+#include "pool.h"
+
+#ifndef __BP_TREE_H__
+#define __BP_TREE_H__
+
+/* The node sizes are chosen so that the header and keys of each node fill its first cache line (a
+   leaf's 16 byte header and 12 keys, or an inner node's 8 byte header and 14 keys, are 64 bytes),
+   and the entire node fits in POOL_MAX_SIZE. The nodes are aligned to POOL_CACHE_LINE, which makes
+   their sizes multiples of it (256 bytes each), so that the pool starts them on a cache line too.
+ */
+#define BP_TREE_LEAF_KEYS (12)
+#define BP_TREE_INNER_KEYS (14)
+
+/* More than enough for any tree that fits in memory, as inner nodes have at least 8 children */
+#define BP_TREE_MAX_HEIGHT (24)
+
+typedef struct bp_tree_leaf_s bp_tree_leaf_t;
+
+struct bp_tree_leaf_s {
+    unsigned int count;                     /* Number of keys in the leaf */
+    unsigned int reserved;
+    bp_tree_leaf_t *next;                   /* The next leaf in order, NULL for the last one */
+    unsigned int keys[BP_TREE_LEAF_KEYS];
+    unsigned int counts[BP_TREE_LEAF_KEYS]; /* Reference count of each key */
+    unsigned int aux[BP_TREE_LEAF_KEYS];
+    void *values[BP_TREE_LEAF_KEYS];
+} __attribute__((aligned(POOL_CACHE_LINE)));
+
+typedef struct bp_tree_inner_s {
+    unsigned int count;                          /* Number of keys, there are count + 1 children */
+    unsigned int reserved;
+    unsigned int keys[BP_TREE_INNER_KEYS];       /* keys[i] is the smallest key under children[i + 1] */
+    unsigned int aux_max[BP_TREE_INNER_KEYS + 1]; /* The max aux under each child */
+    void *children[BP_TREE_INNER_KEYS + 1];      /* Inner nodes, or leaves at the bottom level */
+} __attribute__((aligned(POOL_CACHE_LINE))) bp_tree_inner_t;
+
+typedef struct bp_tree_s {
+    void *root;                /* NULL if the tree is empty */
+    unsigned int height;       /* Number of inner levels above the leaves */
+    unsigned int count;        /* Number of distinct keys */
+    bp_tree_leaf_t *first;     /* The leaves of the min & max keys, NULL if the tree is empty */
+    bp_tree_leaf_t *last;
+    pool_t *pool;              /* The pool of the tree and its nodes, NULL for malloc */
+} bp_tree_t;
+
+/* A position of a key in the tree. A cursor is invalidated by any insertion or removal of a key. */
+typedef struct bp_tree_cursor_s {
+    bp_tree_leaf_t *leaf;      /* NULL if the cursor isn't on a key */
+    unsigned int index;
+} bp_tree_cursor_t;
+
+/* bp_tree_create - create an empty tree, whose memory is allocated from pool (NULL for malloc).
+   Returns NULL on an allocation failure.
+ */
+bp_tree_t* bp_tree_create(pool_t *pool);
+
+/* bp_tree_destroy - free the tree and all of its nodes. The values are not freed. */
+void bp_tree_destroy(bp_tree_t *tree);
+
+/* bp_tree_insert - insert a key. If it already exists, its reference count is increased and exists
+   is set. A new key's aux is set to aux, and an existing key's aux is raised to aux if it is
+   smaller. If position isn't NULL, it is set to the key's position (e.g. to set its value).
+   Returns false if an allocation fails (in which case the tree is unchanged), true otherwise.
+ */
+bool bp_tree_insert(bp_tree_t *tree, unsigned int key, unsigned int aux, bool *exists, bp_tree_cursor_t *position);
+
+/* bp_tree_remove - decrease the reference count of key, and remove it when it reaches zero, in
+   which case deleted is set.
+   Returns false if the key doesn't exist, true otherwise.
+ */
+bool bp_tree_remove(bp_tree_t *tree, unsigned int key, bool *deleted);
+
+/* bp_tree_set_aux - set the aux of an existing key (e.g. when it decreases). Returns false if the
+   key doesn't exist.
+ */
+bool bp_tree_set_aux(bp_tree_t *tree, unsigned int key, unsigned int aux);
+
+/* bp_tree_has_dominating - returns true if there's a key larger than or equal to key, whose aux
+   is larger than or equal to aux. A single descent, guided by the branch maxima of aux.
+ */
+bool bp_tree_has_dominating(bp_tree_t *tree, unsigned int key, unsigned int aux);
+
+/* bp_tree_search - an exact key search. Returns true and sets cursor to the key if it is found. */
+bool bp_tree_search(bp_tree_t *tree, unsigned int key, bp_tree_cursor_t *cursor);
+
+/* bp_tree_search_smallest - search for the smallest key that is larger than or equal to key.
+   Returns true and sets cursor to it if it is found.
+ */
+bool bp_tree_search_smallest(bp_tree_t *tree, unsigned int key, bp_tree_cursor_t *cursor);
+
+/* bp_tree_first, bp_tree_last - set cursor to the min/max key, in O(1). Returns false if the tree
+   is empty.
+ */
+bool bp_tree_first(bp_tree_t *tree, bp_tree_cursor_t *cursor);
+bool bp_tree_last(bp_tree_t *tree, bp_tree_cursor_t *cursor);
+
+/* bp_tree_cursor_next - move the cursor to the successor key, through the leaf links.
+   Returns false (and the cursor is no longer on a key) if it was on the max key.
+ */
+bool bp_tree_cursor_next(bp_tree_cursor_t *cursor);
+
+/* bp_tree_cursor_key, bp_tree_cursor_count, bp_tree_cursor_aux, bp_tree_cursor_value - the key
+   that the cursor is on, and its reference count, aux and value. The cursor must be on a key.
+   bp_tree_cursor_set_value - set the value of the key that the cursor is on.
+ */
+unsigned int bp_tree_cursor_key(bp_tree_cursor_t *cursor);
+unsigned int bp_tree_cursor_count(bp_tree_cursor_t *cursor);
+unsigned int bp_tree_cursor_aux(bp_tree_cursor_t *cursor);
+void* bp_tree_cursor_value(bp_tree_cursor_t *cursor);
+void bp_tree_cursor_set_value(bp_tree_cursor_t *cursor, void *value);
+
+#endif /* __BP_TREE_H__ */
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "bp_tree.h"
+
+#define KEY_RANGE (3000)
+#define AUX_RANGE (1000)
+#define OPERATIONS (60000)
+
+/* The expected contents of the tree, by key */
+static unsigned int key_count[KEY_RANGE];
+static unsigned int key_aux[KEY_RANGE];
+
+/* verify_node - recursively verifies the order, fill and aux maxima of a branch whose keys must be
+   in [low, high). Returns the branch's max aux, and appends its leaves to *leaves in order.
+ */
+static unsigned int verify_node(bp_tree_t *tree, void *node, unsigned int level, unsigned int low, unsigned int high, bp_tree_leaf_t ***leaves, unsigned int *count)
+{
+    bp_tree_leaf_t *leaf = node;
+    bp_tree_inner_t *inner = node;
+    unsigned int max = 0;
+    unsigned int child_max = 0;
+    unsigned int i = 0;
+
+    /* Every node starts on a cache line, where its header and keys are */
+    assert((uintptr_t) node % POOL_CACHE_LINE == 0);
+    assert(offsetof(bp_tree_leaf_t, counts) == POOL_CACHE_LINE);
+    assert(offsetof(bp_tree_inner_t, aux_max) == POOL_CACHE_LINE);
+
+    if (level == 0) {
+        assert((node == tree->root) || (leaf->count >= BP_TREE_LEAF_KEYS / 2));
+        assert((leaf->count > 0) && (leaf->count <= BP_TREE_LEAF_KEYS));
+        for (i = 0; i < leaf->count; i++) {
+            assert((leaf->keys[i] >= low) && (leaf->keys[i] < high));
+            assert((i == 0) || (leaf->keys[i - 1] < leaf->keys[i]));
+            assert(leaf->counts[i] == key_count[leaf->keys[i]]);
+            assert(leaf->aux[i] == key_aux[leaf->keys[i]]);
+            max = (leaf->aux[i] > max) ? leaf->aux[i] : max;
+        }
+        *((*leaves)++) = leaf;
+        *count += leaf->count;
+        return max;
+    }
+
+    assert((node == tree->root) || (inner->count >= BP_TREE_INNER_KEYS / 2));
+    assert((inner->count > 0) && (inner->count <= BP_TREE_INNER_KEYS));
+    for (i = 0; i <= inner->count; i++) {
+        child_max = verify_node(tree, inner->children[i], level - 1,
+                                (i == 0) ? low : inner->keys[i - 1],
+                                (i == inner->count) ? high : inner->keys[i],
+                                leaves, count);
+        assert(inner->aux_max[i] == child_max);
+        max = (child_max > max) ? child_max : max;
+    }
+
+    return max;
+}
+
+static void verify_tree(bp_tree_t *tree)
+{
+    static bp_tree_leaf_t *leaves[KEY_RANGE + 1];
+    bp_tree_leaf_t **next_leaf = leaves;
+    unsigned int count = 0;
+    unsigned int expected = 0;
+    unsigned int key = 0;
+    unsigned int i = 0;
+
+    for (key = 0; key < KEY_RANGE; key++) {
+        expected += (key_count[key] > 0) ? 1 : 0;
+    }
+    assert(tree->count == expected);
+
+    if (NULL == tree->root) {
+        assert((expected == 0) && (NULL == tree->first) && (NULL == tree->last));
+        return;
+    }
+
+    verify_node(tree, tree->root, tree->height, 0, KEY_RANGE, &next_leaf, &count);
+    assert(count == expected);
+
+    /* The leaf links must follow the tree order */
+    assert(tree->first == leaves[0]);
+    assert(tree->last == next_leaf[-1]);
+    for (i = 0; leaves + i + 1 < next_leaf; i++) {
+        assert(leaves[i]->next == leaves[i + 1]);
+    }
+    assert(NULL == tree->last->next);
+}
+
+static void verify_queries(bp_tree_t *tree)
+{
+    bp_tree_cursor_t cursor;
+    unsigned int key = 0;
+    unsigned int aux = 0;
+    unsigned int expected = 0;
+    bool dominating = false;
+
+    for (key = 0; key < KEY_RANGE; key += 37) {
+        /* Lower bound */
+        for (expected = key; (expected < KEY_RANGE) && (key_count[expected] == 0); expected++);
+        if (expected == KEY_RANGE) {
+            assert(!bp_tree_search_smallest(tree, key, &cursor));
+        } else {
+            assert(bp_tree_search_smallest(tree, key, &cursor));
+            assert(bp_tree_cursor_key(&cursor) == expected);
+        }
+
+        /* Dominance, by aux */
+        for (aux = 0; aux < AUX_RANGE; aux += 97) {
+            dominating = false;
+            for (expected = key; expected < KEY_RANGE; expected++) {
+                if ((key_count[expected] > 0) && (key_aux[expected] >= aux)) {
+                    dominating = true;
+                    break;
+                }
+            }
+            assert(bp_tree_has_dominating(tree, key, aux) == dominating);
+        }
+    }
+
+    /* A full scan through the cursor */
+    expected = 0;
+    for (bp_tree_first(tree, &cursor); NULL != cursor.leaf; bp_tree_cursor_next(&cursor)) {
+        while (key_count[expected] == 0) {
+            expected++;
+        }
+        assert(bp_tree_cursor_key(&cursor) == expected);
+        assert(bp_tree_cursor_count(&cursor) == key_count[expected]);
+        expected++;
+    }
+    if (tree->count > 0) {
+        assert(bp_tree_last(tree, &cursor) && (bp_tree_cursor_key(&cursor) == expected - 1));
+    }
+}
+
+int main(void)
+{
+    bp_tree_t *tree = NULL;
+    pool_t *pool = NULL;
+    bp_tree_cursor_t cursor;
+    unsigned int key = 0;
+    unsigned int aux = 0;
+    unsigned int i = 0;
+    bool exists = false;
+    bool deleted = false;
+
+    srand(18);
+    pool = pool_create();
+    assert(pool);
+    tree = bp_tree_create(pool);
+    assert(tree);
+
+    printf("Searching an empty tree...\n");
+    verify_tree(tree);
+    verify_queries(tree);
+    assert(!bp_tree_remove(tree, 1, &deleted));
+
+    printf("Inserting and removing random keys...\n");
+    for (i = 0; i < OPERATIONS; i++) {
+        key = rand() % KEY_RANGE;
+        aux = rand() % AUX_RANGE;
+
+        /* Insertions are favored in the first half, and removals in the second, so that the tree
+           both grows and shrinks by a few levels */
+        if (rand() % 100 < ((i < OPERATIONS / 2) ? 65 : 30)) {
+            assert(bp_tree_insert(tree, key, aux, &exists, &cursor));
+            assert(exists == (key_count[key] > 0));
+            assert((bp_tree_cursor_key(&cursor) == key) && (NULL == bp_tree_cursor_value(&cursor) || exists));
+            bp_tree_cursor_set_value(&cursor, &key_count[key]);
+            key_aux[key] = (exists && (key_aux[key] > aux)) ? key_aux[key] : aux;
+            key_count[key]++;
+        } else if (rand() % 4 == 0) {
+            assert(bp_tree_set_aux(tree, key, aux) == (key_count[key] > 0));
+            if (key_count[key] > 0) {
+                key_aux[key] = aux;
+            }
+        } else {
+            assert(bp_tree_remove(tree, key, &deleted) == (key_count[key] > 0));
+            if (key_count[key] > 0) {
+                key_count[key]--;
+                assert(deleted == (key_count[key] == 0));
+            }
+        }
+
+        if (i % 1000 == 0) {
+            verify_tree(tree);
+            verify_queries(tree);
+        }
+    }
+    verify_tree(tree);
+    verify_queries(tree);
+
+    printf("Verifying values...\n");
+    for (key = 0; key < KEY_RANGE; key++) {
+        assert(bp_tree_search(tree, key, &cursor) == (key_count[key] > 0));
+        if (key_count[key] > 0) {
+            assert(bp_tree_cursor_value(&cursor) == &key_count[key]);
+        }
+    }
+
+    printf("Emptying tree...\n");
+    for (key = 0; key < KEY_RANGE; key++) {
+        while (key_count[key] > 0) {
+            assert(bp_tree_remove(tree, key, &deleted));
+            key_count[key]--;
+        }
+        if (key % 100 == 0) {
+            verify_tree(tree);
+        }
+    }
+    verify_tree(tree);
+    assert((NULL == tree->root) && (tree->height == 0));
+
+    bp_tree_destroy(tree);
+    assert(pool->allocated == 0);
+    pool_destroy(pool);
+
+    /* Without a pool, the nodes are still aligned */
+    printf("Inserting keys without a pool...\n");
+    tree = bp_tree_create(NULL);
+    assert(tree);
+    for (key = 0; key < KEY_RANGE; key += 3) {
+        assert(bp_tree_insert(tree, key, 0, &exists, &cursor) && !exists);
+        key_count[key] = 1;
+        key_aux[key] = 0;
+    }
+    verify_tree(tree);
+    bp_tree_destroy(tree);
+
+    return 0;
+}
@@ -1,3 +1,3 @@
 #!/usr/bin/env bash
 
-gcc -g -Wall -Wunused -std=gnu99 main.c menu.c box_menu.c box_factory.c rb_tree.c -o ex18 -lm
+gcc -g -Wall -Wunused -std=gnu99 main.c menu.c box_menu.c box_batch.c box_factory.c box_flat.c box_subtree.c persistent_tree.c bp_tree.c parallel_sort.c range_tree.c rb_tree.c pool.c op_stats.c -o ex18 -lm -pthread
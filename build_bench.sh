@@ -0,0 +1,3 @@
+#!/usr/bin/env bash
+
+gcc -O2 -g -Wall -Wunused -std=gnu99 box_factory_bench.c box_factory.c box_flat.c box_subtree.c box_wal.c persistent_tree.c box_shards.c bp_tree.c parallel_sort.c range_tree.c rb_tree.c pool.c op_stats.c -o box_factory_bench -lm -pthread
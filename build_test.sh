@@ -1,3 +1,13 @@
 #!/usr/bin/env bash
 
-gcc -g -Wall -Wunused -std=gnu99 rb_tree_test.c rb_tree.c -o rb_tree_test -lm
+gcc -g -Wall -Wunused -std=gnu99 rb_tree_test.c rb_tree.c pool.c op_stats.c -o rb_tree_test -lm
+gcc -g -Wall -Wunused -std=gnu99 range_tree_test.c range_tree.c rb_tree.c pool.c op_stats.c -o range_tree_test -lm
+gcc -g -Wall -Wunused -std=gnu99 bp_tree_test.c bp_tree.c pool.c op_stats.c -o bp_tree_test -lm
+gcc -g -Wall -Wunused -std=gnu99 persistent_tree_test.c persistent_tree.c -o persistent_tree_test -lm
+gcc -g -Wall -Wunused -std=gnu99 op_stats_test.c op_stats.c -o op_stats_test -lm -pthread
+gcc -g -Wall -Wunused -std=gnu99 box_flat_test.c box_flat.c -o box_flat_test -lm -pthread
+gcc -g -Wall -Wunused -std=gnu99 box_subtree_test.c box_subtree.c pool.c op_stats.c -o box_subtree_test -lm
+gcc -g -Wall -Wunused -std=gnu99 box_batch_test.c box_batch.c box_factory.c box_flat.c box_subtree.c persistent_tree.c bp_tree.c parallel_sort.c range_tree.c rb_tree.c pool.c op_stats.c -o box_batch_test -lm -pthread
+gcc -g -Wall -Wunused -std=gnu99 box_factory_test.c box_factory.c box_flat.c box_subtree.c persistent_tree.c bp_tree.c parallel_sort.c range_tree.c rb_tree.c pool.c op_stats.c -o box_factory_test -lm -pthread
+gcc -g -Wall -Wunused -std=gnu99 box_shards_test.c box_shards.c box_factory.c box_flat.c box_subtree.c persistent_tree.c bp_tree.c parallel_sort.c range_tree.c rb_tree.c pool.c op_stats.c -o box_shards_test -lm -pthread
+gcc -g -Wall -Wunused -std=gnu99 box_wal_test.c box_wal.c box_factory.c box_flat.c box_subtree.c persistent_tree.c bp_tree.c parallel_sort.c range_tree.c rb_tree.c pool.c op_stats.c -o box_wal_test -lm -pthread
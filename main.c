@@ -1,11 +1,36 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "box_factory.h"
+#include "box_batch.h"
 #include "box_menu.h"
 #include "menu.h"
 
-int main(void)
+/* run_batch - the non-interactive mode: ex18 --batch [commands file] (stdin by default) */
+static int run_batch(box_factory_t *factory, const char *path)
+{
+    FILE *input = stdin;
+    bool result = false;
+
+    if ((NULL != path) && (0 != strcmp(path, "-"))) {
+        input = fopen(path, "r");
+        if (NULL == input) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    result = box_batch_run(factory, input, stdout);
+
+    if (stdin != input) {
+        fclose(input);
+    }
+
+    return result ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
 {
     box_factory_t *factory = box_factory_create();
     menu_item_t menu_items[] = {{box_menu_insert, "Insert a box", factory},
@@ -14,13 +39,20 @@ int main(void)
                                 {box_menu_check, "Check if a box in an appropriate box exists", factory},
                                 MENU_QUIT_ACTION,
     };
+    int result = 0;
 
     if (NULL == factory) {
         printf("Fatal error: unable to create factory object (out of memory)\n");
         return -1;
     }
 
-    menu_run(menu_items, sizeof(menu_items) / sizeof(menu_item_t));
+    if ((argc > 1) && (0 == strcmp(argv[1], "--batch"))) {
+        result = run_batch(factory, (argc > 2) ? argv[2] : NULL);
+    } else {
+        menu_run(menu_items, sizeof(menu_items) / sizeof(menu_item_t));
+    }
+
+    box_factory_destroy(factory);
 
-    return 0;
+    return result;
 }
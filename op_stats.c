@@ -0,0 +1,200 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "op_stats.h"
+
+__thread op_stats_counters_t op_stats_counters;
+
+#ifndef NO_OP_STATS
+
+/* now_ns - the monotonic time in nanoseconds. */
+static unsigned long long now_ns(void);
+
+/* record_stats - the statistics of record, which are allocated (by whichever thread gets there first)
+   if they aren't yet. Returns NULL on an allocation failure.
+ */
+static op_stats_t* record_stats(op_stats_record_t *record);
+
+/* add_counter - atomically add the events of a counter since start to total, unless there were none
+   (which is most counters of most operations). */
+static inline void add_counter(unsigned long long *total, unsigned long long now, unsigned long long start);
+
+void op_stats_begin(op_stats_record_t *record, op_stats_token_t *token)
+{
+    token->sampled = (__atomic_fetch_add(&(record->calls), 1, __ATOMIC_RELAXED) % OP_STATS_SAMPLE_INTERVAL == 0);
+    if (!token->sampled) {
+        return;
+    }
+
+    token->start = op_stats_counters;
+    token->start_time = now_ns();
+}
+
+void op_stats_end(op_stats_record_t *record, const op_stats_token_t *token)
+{
+    op_stats_t *stats = NULL;
+    unsigned long long latency = 0;
+    unsigned long long max = 0;
+
+    if (!token->sampled) {
+        return;
+    }
+
+    latency = now_ns() - token->start_time;
+    stats = record_stats(record);
+    if (NULL == stats) {
+        return;
+    }
+
+    __atomic_fetch_add(&(stats->samples), 1, __ATOMIC_RELAXED);
+    add_counter(&(stats->counters.comparisons), op_stats_counters.comparisons, token->start.comparisons);
+    add_counter(&(stats->counters.successor_steps), op_stats_counters.successor_steps, token->start.successor_steps);
+    add_counter(&(stats->counters.subtree_searches), op_stats_counters.subtree_searches, token->start.subtree_searches);
+    add_counter(&(stats->counters.rotations), op_stats_counters.rotations, token->start.rotations);
+    add_counter(&(stats->counters.allocations), op_stats_counters.allocations, token->start.allocations);
+
+    __atomic_fetch_add(&(stats->latency_total), latency, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(stats->latency_buckets[op_stats_bucket_index(latency)]), 1, __ATOMIC_RELAXED);
+
+    /* A new max is rare, so the max is only written when it is exceeded */
+    max = __atomic_load_n(&(stats->latency_max), __ATOMIC_RELAXED);
+    while ((latency > max) &&
+           !__atomic_compare_exchange_n(&(stats->latency_max), &max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static op_stats_t* record_stats(op_stats_record_t *record)
+{
+    op_stats_t *stats = __atomic_load_n(&(record->stats), __ATOMIC_ACQUIRE);
+    op_stats_t *allocated = NULL;
+
+    if (NULL != stats) {
+        return stats;
+    }
+
+    allocated = calloc(sizeof(op_stats_t), 1);
+    if (NULL == allocated) {
+        return NULL;
+    }
+
+    /* Another thread may have allocated them meanwhile, in which case its statistics are used */
+    if (!__atomic_compare_exchange_n(&(record->stats), &stats, allocated, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(allocated);
+        return stats;
+    }
+
+    return allocated;
+}
+
+static inline void add_counter(unsigned long long *total, unsigned long long now, unsigned long long start)
+{
+    if (now != start) {
+        __atomic_fetch_add(total, now - start, __ATOMIC_RELAXED);
+    }
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif /* NO_OP_STATS */
+
+void op_stats_read(op_stats_record_t *record, op_stats_t *copy, bool reset)
+{
+    op_stats_t *stats = __atomic_load_n(&(record->stats), __ATOMIC_ACQUIRE);
+    unsigned long long *fields = (unsigned long long *) stats;
+    unsigned long long *copy_fields = (unsigned long long *) copy;
+    unsigned long long value = 0;
+    size_t i = 0;
+
+    if (NULL != copy) {
+        memset(copy, 0, sizeof(op_stats_t));
+    }
+
+    if (NULL != stats) {
+        for (i = 0; i < sizeof(op_stats_t) / sizeof(unsigned long long); i++) {
+            value = reset ? __atomic_exchange_n(&fields[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&fields[i], __ATOMIC_RELAXED);
+            if (NULL != copy) {
+                copy_fields[i] = value;
+            }
+        }
+    }
+
+    /* The calls are counted by the record, whether or not its statistics are allocated */
+    value = reset ? __atomic_exchange_n(&(record->calls), 0, __ATOMIC_RELAXED) : __atomic_load_n(&(record->calls), __ATOMIC_RELAXED);
+    if (NULL != copy) {
+        copy->calls = value;
+    }
+}
+
+void op_stats_free(op_stats_record_t *record)
+{
+    free(record->stats);
+    record->stats = NULL;
+    record->calls = 0;
+}
+
+unsigned long long op_stats_percentile(const op_stats_t *stats, double percentile)
+{
+    unsigned long long total = 0;
+    unsigned long long target = 0;
+    unsigned long long seen = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < OP_STATS_BUCKETS; i++) {
+        total += stats->latency_buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    /* The rank of the percentile's call, counting from 1 */
+    target = (unsigned long long) (percentile / 100.0 * total + 0.5);
+    if (target < 1) {
+        target = 1;
+    } else if (target > total) {
+        target = total;
+    }
+
+    for (i = 0; i < OP_STATS_BUCKETS; i++) {
+        seen += stats->latency_buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+
+    /* The bucket's values are all reported as its highest, which the max may tighten */
+    return ((stats->latency_max > 0) && (op_stats_bucket_high(i) > stats->latency_max)) ? stats->latency_max : op_stats_bucket_high(i);
+}
+
+unsigned int op_stats_bucket_index(unsigned long long value)
+{
+    unsigned int shift = 0;
+
+    if (value < OP_STATS_SUB_BUCKETS) {
+        return (unsigned int) value;
+    }
+
+    /* value is in [2^e, 2^(e+1)) for e >= OP_STATS_SUB_BITS, which is split into OP_STATS_SUB_BUCKETS
+       buckets of 2^(e - OP_STATS_SUB_BITS) values each */
+    shift = 63 - __builtin_clzll(value) - OP_STATS_SUB_BITS;
+    return (shift + 1) * OP_STATS_SUB_BUCKETS + (unsigned int) (value >> shift) - OP_STATS_SUB_BUCKETS;
+}
+
+unsigned long long op_stats_bucket_high(unsigned int index)
+{
+    unsigned int shift = 0;
+
+    if (index < OP_STATS_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / OP_STATS_SUB_BUCKETS - 1;
+    return (((unsigned long long) (OP_STATS_SUB_BUCKETS + index % OP_STATS_SUB_BUCKETS)) << shift) + ((1ULL << shift) - 1);
+}
@@ -0,0 +1,139 @@
+/*
+  op_stats.h - Per operation statistics: event counters and HDR-style latency histograms.
+  The data structures count their internal events (key comparisons, successor steps, subtree
+  searches, rotations and allocations) with OP_STATS_COUNT, which is a single increment of a
+  thread-local counter. An operation brackets itself with op_stats_begin and op_stats_end, which add
+  the events of the calling thread in between, and the operation's latency, to the op_stats_record_t
+  of its type.
+
+  Reading the clock and adding the events costs more than a fast operation itself, so only every
+  OP_STATS_SAMPLE_INTERVAL-th call of each record is sampled that way (every call is still counted).
+  The countdown is the record's own count of calls, so the samples are spread evenly over the calls of
+  each operation type, however the types are interleaved, and the percentiles and the average events
+  per call are estimated without a bias. Building with -DOP_STATS_SAMPLE_INTERVAL=1 samples all of the
+  operations.
+
+  The latencies are kept in a log-linear histogram, like HdrHistogram: values below
+  OP_STATS_SUB_BUCKETS nanoseconds have a bucket each, and every power of 2 above is split into
+  OP_STATS_SUB_BUCKETS equal buckets, so a bucket is never wider than 1/32 of its values, over the
+  whole 64 bit range and in a fixed amount of memory. That is about 15KB per operation type, so a
+  record only allocates its statistics on its first call, and the types that are never called cost
+  nothing but the record itself.
+
+  A record is updated with relaxed atomic adds, so any number of threads may call operations on it at
+  once (and read it with op_stats_read), at the cost of the cache line traffic.
+
+  Building with -DNO_OP_STATS compiles all of it out: OP_STATS_COUNT is empty, and op_stats_begin
+  and op_stats_end do nothing.
+ */
+
+#include <stdbool.h>
+
+#ifndef __OP_STATS_H__
+#define __OP_STATS_H__
+
+#ifndef OP_STATS_SAMPLE_INTERVAL
+#define OP_STATS_SAMPLE_INTERVAL (16)
+#endif
+
+#define OP_STATS_SUB_BITS (5)
+#define OP_STATS_SUB_BUCKETS (1 << OP_STATS_SUB_BITS)
+#define OP_STATS_BUCKETS ((64 - OP_STATS_SUB_BITS + 1) * OP_STATS_SUB_BUCKETS)
+
+/* The events of the data structures, see OP_STATS_COUNT */
+typedef struct op_stats_counters_s {
+    unsigned long long comparisons;       /* Key comparisons of the red-black trees and B+trees */
+    unsigned long long successor_steps;   /* Links followed by the red-black trees' successor */
+    unsigned long long subtree_searches;  /* Searches of a nested tree (a main tree node's subtree,
+                                             or a range tree node's secondary tree) */
+    unsigned long long rotations;         /* Red-black tree rotations */
+    unsigned long long allocations;       /* pool_alloc calls */
+} op_stats_counters_t;
+
+/* The statistics of an operation type. All of the fields are unsigned long long, which op_stats_read
+   relies on. */
+typedef struct op_stats_s {
+    unsigned long long calls;             /* Kept by the record, see op_stats_record_t */
+    unsigned long long samples;           /* The sampled calls, which the rest of the fields are of */
+    op_stats_counters_t counters;         /* The total events of the samples */
+    unsigned long long latency_total;     /* In nanoseconds */
+    unsigned long long latency_max;
+    unsigned long long latency_buckets[OP_STATS_BUCKETS];
+} op_stats_t;
+
+/* The record of an operation type, which op_stats_begin and op_stats_end update. A zeroed record is
+   an empty one. */
+typedef struct op_stats_record_s {
+    unsigned long long calls;             /* Counted here, as the countdown of the samples */
+    op_stats_t *stats;                    /* Allocated by the first call (which is sampled), NULL until then */
+} op_stats_record_t;
+
+/* The state of an operation in progress, between op_stats_begin and op_stats_end */
+typedef struct op_stats_token_s {
+    op_stats_counters_t start;
+    unsigned long long start_time;
+    bool sampled;
+} op_stats_token_t;
+
+/* The events of the calling thread so far */
+extern __thread op_stats_counters_t op_stats_counters;
+
+#ifdef NO_OP_STATS
+
+#define OP_STATS_ENABLED (false)
+#define OP_STATS_COUNT(counter)
+
+static inline void op_stats_begin(op_stats_record_t *record, op_stats_token_t *token)
+{
+    (void) record;
+    (void) token;
+}
+
+static inline void op_stats_end(op_stats_record_t *record, const op_stats_token_t *token)
+{
+    (void) record;
+    (void) token;
+}
+
+#else
+
+#define OP_STATS_ENABLED (true)
+#define OP_STATS_COUNT(counter) (op_stats_counters.counter++)
+
+/* op_stats_begin - start a call of the operation type of record on the calling thread, and count
+   it. Whether it is sampled is decided here, by the record's count of calls.
+ */
+void op_stats_begin(op_stats_record_t *record, op_stats_token_t *token);
+
+/* op_stats_end - end the call of token, which was started on the calling thread, and add its sample
+   (if it is sampled) to record. If the record's statistics can't be allocated, the sample is dropped.
+ */
+void op_stats_end(op_stats_record_t *record, const op_stats_token_t *token);
+
+#endif /* NO_OP_STATS */
+
+/* op_stats_read - copy the statistics of record to copy (unless it's NULL), all zeros but calls if
+   they aren't allocated yet, and zero them if reset is set. Each field is read (and zeroed)
+   atomically, but not all of them at once, so operations that end meanwhile may be split between the
+   copy and the next read.
+ */
+void op_stats_read(op_stats_record_t *record, op_stats_t *copy, bool reset);
+
+/* op_stats_free - free the statistics of record, which is left empty. No operation may be in progress
+   on it.
+ */
+void op_stats_free(op_stats_record_t *record);
+
+/* op_stats_bucket_index - the histogram bucket of value. */
+unsigned int op_stats_bucket_index(unsigned long long value);
+
+/* op_stats_bucket_high - the highest value of the histogram bucket index. */
+unsigned long long op_stats_bucket_high(unsigned int index);
+
+/* op_stats_percentile - the latency (in nanoseconds) that percentile (0 to 100) percent of the
+   samples of stats didn't exceed, up to the precision of the histogram's buckets. Returns 0 if stats
+   has no samples.
+ */
+unsigned long long op_stats_percentile(const op_stats_t *stats, double percentile);
+
+#endif /* __OP_STATS_H__ */
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "op_stats.h"
+
+#define THREADS (4)
+#define THREAD_CALLS (10000)
+
+/* The calls of each type in test_sampling, a multiple of the interval */
+#define INTERLEAVED_CALLS (64 * OP_STATS_SAMPLE_INTERVAL)
+
+/* call - a whole call of the operation type of record, with events events */
+static void call(op_stats_record_t *record, unsigned int events)
+{
+    op_stats_token_t token;
+
+    op_stats_begin(record, &token);
+    op_stats_counters.comparisons += events;
+    op_stats_end(record, &token);
+}
+
+static void* call_many(void *record)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < THREAD_CALLS; i++) {
+        call(record, 1);
+    }
+
+    return NULL;
+}
+
+/* test_buckets - the buckets cover the whole 64 bit range in order, without gaps, and each is at
+   most 1/OP_STATS_SUB_BUCKETS of its values wide
+ */
+static void test_buckets(void)
+{
+    unsigned long long low = 0;
+    unsigned long long high = 0;
+    unsigned long long value = 0;
+    unsigned int index = 0;
+    unsigned int bit = 0;
+
+    printf("Verifying the histogram's buckets...\n");
+    for (index = 0; index < OP_STATS_BUCKETS; index++) {
+        high = op_stats_bucket_high(index);
+        assert(high >= low);
+        assert((index < OP_STATS_SUB_BUCKETS) ? (high == index) : ((high - low + 1) * OP_STATS_SUB_BUCKETS <= low));
+
+        /* Both ends of the bucket, and the values next to them, are in the right buckets */
+        assert((op_stats_bucket_index(low) == index) && (op_stats_bucket_index(high) == index));
+        if (low > 0) {
+            assert(op_stats_bucket_index(low - 1) == index - 1);
+        }
+        if (high < ULLONG_MAX) {
+            assert(op_stats_bucket_index(high + 1) == index + 1);
+        }
+        low = high + 1;
+    }
+    assert(high == ULLONG_MAX);
+
+    for (bit = 0; bit < 64; bit++) {
+        value = 1ULL << bit;
+        index = op_stats_bucket_index(value);
+        assert((index < OP_STATS_BUCKETS) && (op_stats_bucket_high(index) >= value));
+        assert((index == 0) || (op_stats_bucket_high(index - 1) < value));
+    }
+}
+
+/* test_percentile - the percentiles of known histograms */
+static void test_percentile(void)
+{
+    static op_stats_t stats;
+    unsigned int i = 0;
+
+    printf("Verifying percentiles...\n");
+    memset(&stats, 0, sizeof(stats));
+    assert(op_stats_percentile(&stats, 50) == 0);
+
+    /* A sample of each of 1 to 10 ns, which have a bucket each */
+    for (i = 1; i <= 10; i++) {
+        stats.latency_buckets[op_stats_bucket_index(i)]++;
+    }
+    stats.latency_max = 10;
+    assert(op_stats_percentile(&stats, 0) == 1);
+    assert(op_stats_percentile(&stats, 10) == 1);
+    assert(op_stats_percentile(&stats, 50) == 5);
+    assert(op_stats_percentile(&stats, 54) == 5);
+    assert(op_stats_percentile(&stats, 56) == 6);
+    assert(op_stats_percentile(&stats, 99) == 10);
+    assert(op_stats_percentile(&stats, 100) == 10);
+
+    /* A larger value is reported as the highest of its bucket, unless the max is below it */
+    stats.latency_buckets[op_stats_bucket_index(1000)] += 90;
+    stats.latency_max = 2000;
+    assert(op_stats_percentile(&stats, 10) == 10);
+    assert(op_stats_percentile(&stats, 50) == op_stats_bucket_high(op_stats_bucket_index(1000)));
+    stats.latency_max = 1000;
+    assert(op_stats_bucket_high(op_stats_bucket_index(1000)) > 1000);
+    assert(op_stats_percentile(&stats, 50) == 1000);
+}
+
+/* test_sampling - interleaved calls of two operation types are each sampled at the interval, and a
+   record's statistics are only allocated by its first call
+ */
+static void test_sampling(void)
+{
+    static op_stats_t copy;
+    op_stats_record_t first;
+    op_stats_record_t second;
+    pthread_t threads[THREADS];
+    unsigned int i = 0;
+
+    printf("Sampling interleaved calls...\n");
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    op_stats_read(&first, &copy, false);
+    assert((NULL == first.stats) && (copy.calls == 0) && (copy.samples == 0));
+
+    for (i = 0; i < INTERLEAVED_CALLS; i++) {
+        call(&first, 1);
+        call(&second, 2);
+    }
+    assert((NULL != first.stats) && (NULL != second.stats));
+
+    op_stats_read(&first, &copy, false);
+    assert((copy.calls == INTERLEAVED_CALLS) && (copy.samples == INTERLEAVED_CALLS / OP_STATS_SAMPLE_INTERVAL));
+    assert(copy.counters.comparisons == copy.samples);
+    assert(op_stats_percentile(&copy, 100) == copy.latency_max);
+    op_stats_read(&second, &copy, true);
+    assert((copy.calls == INTERLEAVED_CALLS) && (copy.samples == INTERLEAVED_CALLS / OP_STATS_SAMPLE_INTERVAL));
+    assert(copy.counters.comparisons == 2 * copy.samples);
+
+    /* A reset keeps the statistics, zeroed */
+    op_stats_read(&second, &copy, false);
+    assert((NULL != second.stats) && (copy.calls == 0) && (copy.samples == 0) && (op_stats_percentile(&copy, 50) == 0));
+
+    /* Threads that call at once are all counted, and sampled at the interval */
+    op_stats_free(&first);
+    assert(NULL == first.stats);
+    for (i = 0; i < THREADS; i++) {
+        assert(0 == pthread_create(&threads[i], NULL, call_many, &first));
+    }
+    for (i = 0; i < THREADS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+    op_stats_read(&first, &copy, false);
+    assert(copy.calls == THREADS * THREAD_CALLS);
+    assert(copy.samples == (THREADS * THREAD_CALLS + OP_STATS_SAMPLE_INTERVAL - 1) / OP_STATS_SAMPLE_INTERVAL);
+
+    op_stats_free(&first);
+    op_stats_free(&second);
+}
+
+int main(void)
+{
+    test_buckets();
+    test_percentile();
+    test_sampling();
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel_sort.h"
+
+/* The work of a single thread - either sorting a chunk, or merging two adjacent sorted runs
+   [low, middle) and [middle, high) of from into to.
+ */
+typedef struct sort_task_s {
+    unsigned long long *from;
+    unsigned long long *to;
+    size_t low;
+    size_t middle;
+    size_t high;
+    pthread_t thread;
+    bool started;
+} sort_task_t;
+
+/* compare_values - qsort comparison function of unsigned long long values. */
+static int compare_values(const void *a, const void *b);
+
+/* sort_chunk, merge_runs - thread functions for sort_task_t. */
+static void* sort_chunk(void *task);
+static void* merge_runs(void *task);
+
+/* run_tasks - run each of the tasks in its own thread (falling back to the calling thread), and
+   wait for all of them.
+ */
+static void run_tasks(sort_task_t *tasks, unsigned int count, void* (*function)(void *));
+
+unsigned int parallel_sort_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cpus < 1) ? 1 : (unsigned int) cpus;
+}
+
+bool parallel_sort(unsigned long long *values, size_t count, unsigned int threads)
+{
+    sort_task_t *tasks = NULL;
+    unsigned long long *buffer = NULL;
+    unsigned long long *from = values;
+    unsigned long long *to = NULL;
+    unsigned long long *swap = NULL;
+    unsigned int chunks = 0;
+    unsigned int merges = 0;
+    unsigned int i = 0;
+
+    if (threads == 0) {
+        threads = parallel_sort_threads();
+    }
+    if (threads > count / PARALLEL_SORT_MIN_CHUNK) {
+        threads = count / PARALLEL_SORT_MIN_CHUNK;
+    }
+    if (threads <= 1) {
+        qsort(values, count, sizeof(unsigned long long), compare_values);
+        return true;
+    }
+
+    tasks = calloc(sizeof(sort_task_t), threads);
+    buffer = malloc(count * sizeof(unsigned long long));
+    if ((NULL == tasks) || (NULL == buffer)) {
+        free(tasks);
+        free(buffer);
+        return false;
+    }
+
+    /* Sort the chunks. The boundaries of chunk i are kept in tasks[i].low and tasks[i].high. */
+    chunks = threads;
+    for (i = 0; i < chunks; i++) {
+        tasks[i].from = values;
+        tasks[i].low = count * i / chunks;
+        tasks[i].high = count * (i + 1) / chunks;
+    }
+    run_tasks(tasks, chunks, sort_chunk);
+
+    /* Merge adjacent pairs of runs between the two buffers, until a single run is left. An odd run
+       out is merged with an empty run, which just copies it. */
+    to = buffer;
+    while (chunks > 1) {
+        merges = (chunks + 1) / 2;
+        for (i = 0; i < merges; i++) {
+            tasks[i].from = from;
+            tasks[i].to = to;
+            tasks[i].low = tasks[2 * i].low;
+            tasks[i].middle = tasks[2 * i].high;
+            tasks[i].high = (2 * i + 1 < chunks) ? tasks[2 * i + 1].high : tasks[2 * i].high;
+        }
+        run_tasks(tasks, merges, merge_runs);
+
+        chunks = merges;
+        swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != values) {
+        memcpy(values, from, count * sizeof(unsigned long long));
+    }
+
+    free(tasks);
+    free(buffer);
+    return true;
+}
+
+size_t parallel_sort_unique(unsigned long long *values, size_t count, unsigned int *counts, unsigned int threads)
+{
+    size_t unique = 0;
+    size_t i = 0;
+
+    if ((count == 0) || !parallel_sort(values, count, threads)) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if ((unique > 0) && (values[unique - 1] == values[i])) {
+            if (NULL != counts) {
+                counts[unique - 1]++;
+            }
+            continue;
+        }
+
+        values[unique] = values[i];
+        if (NULL != counts) {
+            counts[unique] = 1;
+        }
+        unique++;
+    }
+
+    return unique;
+}
+
+static int compare_values(const void *a, const void *b)
+{
+    unsigned long long value_a = *(const unsigned long long *) a;
+    unsigned long long value_b = *(const unsigned long long *) b;
+
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+static void* sort_chunk(void *task)
+{
+    sort_task_t *chunk = task;
+
+    qsort(chunk->from + chunk->low, chunk->high - chunk->low, sizeof(unsigned long long), compare_values);
+    return NULL;
+}
+
+static void* merge_runs(void *task)
+{
+    sort_task_t *merge = task;
+    unsigned long long *from = merge->from;
+    unsigned long long *to = merge->to;
+    size_t left = merge->low;
+    size_t right = merge->middle;
+    size_t next = merge->low;
+
+    while ((left < merge->middle) && (right < merge->high)) {
+        to[next++] = (from[right] < from[left]) ? from[right++] : from[left++];
+    }
+    memcpy(to + next, from + left, (merge->middle - left) * sizeof(unsigned long long));
+    next += merge->middle - left;
+    memcpy(to + next, from + right, (merge->high - right) * sizeof(unsigned long long));
+
+    return NULL;
+}
+
+static void run_tasks(sort_task_t *tasks, unsigned int count, void* (*function)(void *))
+{
+    unsigned int i = 0;
+
+    /* The last task is always done by the calling thread, rather than waiting idle */
+    for (i = 0; i + 1 < count; i++) {
+        tasks[i].started = (0 == pthread_create(&tasks[i].thread, NULL, function, &tasks[i]));
+    }
+    function(&tasks[count - 1]);
+
+    for (i = 0; i + 1 < count; i++) {
+        if (tasks[i].started) {
+            pthread_join(tasks[i].thread, NULL);
+        } else {
+            function(&tasks[i]);
+        }
+    }
+}
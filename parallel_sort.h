@@ -0,0 +1,33 @@
+/*
+  parallel_sort.h - Sorting of large arrays of 64 bit values across threads.
+  The array is split into a chunk per thread, the chunks are sorted concurrently, and then merged in
+  rounds of pairs, where the merges of each round are concurrent too.
+  Composite keys (e.g. a box's two dimensions) are sorted by packing them into a single value.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef __PARALLEL_SORT_H__
+#define __PARALLEL_SORT_H__
+
+/* Arrays smaller than this are sorted by the calling thread */
+#define PARALLEL_SORT_MIN_CHUNK (1 << 14)
+
+/* parallel_sort_threads - the default number of threads, which is the number of online CPUs. */
+unsigned int parallel_sort_threads(void);
+
+/* parallel_sort - sort values in ascending order with up to threads threads (0 for the default).
+   If a thread can't be created, its work is done by the calling thread.
+   Returns false if the merge buffer can't be allocated, in which case values are left unsorted.
+ */
+bool parallel_sort(unsigned long long *values, size_t count, unsigned int threads);
+
+/* parallel_sort_unique - sort values, and then remove the duplicates. If counts isn't NULL, it
+   would hold the number of instances of each unique value (and must have room for count values).
+   Returns the number of unique values, which are at the beginning of values, or 0 on an allocation
+   failure (which can't be told apart from an empty array).
+ */
+size_t parallel_sort_unique(unsigned long long *values, size_t count, unsigned int *counts, unsigned int threads);
+
+#endif /* __PARALLEL_SORT_H__ */
@@ -0,0 +1,382 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "persistent_tree.h"
+
+/* The balance parameters of the weight-balanced tree, where the weight of a branch is its size + 1:
+   a branch may weigh up to DELTA times its sibling, and a double rotation is needed when the inner
+   grandchild weighs at least GAMMA times the outer one. (3, 2) is the only integral pair for which
+   a single rebalancing per level is known to restore the balance after an insertion or a removal.
+ */
+#define DELTA (3)
+#define GAMMA (2)
+
+#define SIZE(node) ((NULL == (node)) ? 0 : (node)->size)
+#define WEIGHT(node) (SIZE(node) + 1)
+
+/* All of the internal functions take over the references to the nodes that they are given (their
+   "owned" arguments), and return new references. On an allocation failure, they release whatever
+   they own and return false, so nothing leaks on the way back up.
+ */
+
+/* create_node - create a node with the key, count, aux & child of payload (which isn't changed),
+   over the owned branches left and right.
+ */
+static bool create_node(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result);
+
+/* balance - create_node, followed by a rotation if one of the branches has become too heavy (by a
+   single insertion or removal).
+ */
+static bool balance(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result);
+
+/* rotate_left, rotate_right - balance for an owned right/left branch that is too heavy. */
+static bool rotate_left(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result);
+static bool rotate_right(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result);
+
+/* set - the implementation of persistent_tree_set on the branch of node (which isn't owned).
+   payload holds the key's new count, aux & child.
+ */
+static bool set(persistent_tree_node_t *node, const persistent_tree_node_t *payload, persistent_tree_node_t **result);
+
+/* build - the implementation of persistent_tree_build, on the count payloads from payloads. */
+static bool build(const persistent_tree_node_t *payloads, size_t count, persistent_tree_node_t **result);
+
+/* glue - join the owned branches of a removed node. */
+static bool glue(persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result);
+
+/* remove_min, remove_max - a copy of the branch of node (which isn't owned) without its min/max key,
+   whose node is returned in removed (it stays valid for as long as node is).
+ */
+static bool remove_min(persistent_tree_node_t *node, persistent_tree_node_t **result, persistent_tree_node_t **removed);
+static bool remove_max(persistent_tree_node_t *node, persistent_tree_node_t **result, persistent_tree_node_t **removed);
+
+bool persistent_tree_set(persistent_tree_node_t *root, unsigned int key, unsigned int count, unsigned int aux, persistent_tree_node_t *child, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t payload = {.key = key, .count = count, .aux = aux, .child = child};
+
+    return set(root, &payload, result);
+}
+
+bool persistent_tree_build(const persistent_tree_node_t *payloads, size_t count, persistent_tree_node_t **result)
+{
+    return build(payloads, count, result);
+}
+
+persistent_tree_node_t* persistent_tree_acquire(persistent_tree_node_t *root)
+{
+    if (NULL != root) {
+        __atomic_add_fetch(&(root->refs), 1, __ATOMIC_RELAXED);
+    }
+
+    return root;
+}
+
+void persistent_tree_release(persistent_tree_node_t *root)
+{
+    persistent_tree_node_t *next = NULL;
+
+    /* The right branch is released by the loop rather than by recursion */
+    while ((NULL != root) && (0 == __atomic_sub_fetch(&(root->refs), 1, __ATOMIC_ACQ_REL))) {
+        persistent_tree_release(root->left);
+        persistent_tree_release(root->child);
+        next = root->right;
+        free(root);
+        root = next;
+    }
+}
+
+persistent_tree_node_t* persistent_tree_search(persistent_tree_node_t *root, unsigned int key)
+{
+    while ((NULL != root) && (key != root->key)) {
+        root = (key < root->key) ? root->left : root->right;
+    }
+
+    return root;
+}
+
+persistent_tree_node_t* persistent_tree_search_smallest(persistent_tree_node_t *root, unsigned int key)
+{
+    persistent_tree_node_t *smallest = NULL;
+
+    while (NULL != root) {
+        if (key == root->key) {
+            return root;
+        }
+
+        if (key < root->key) {
+            smallest = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+
+    return smallest;
+}
+
+persistent_tree_node_t* persistent_tree_find_max(persistent_tree_node_t *root)
+{
+    while ((NULL != root) && (NULL != root->right)) {
+        root = root->right;
+    }
+
+    return root;
+}
+
+bool persistent_tree_has_dominating(persistent_tree_node_t *root, unsigned int key, unsigned int aux)
+{
+    /* Whenever a node's key is large enough, the node itself and its entire right branch are
+       candidates. Otherwise, only the right branch might still contain one. */
+    while (NULL != root) {
+        if (root->key < key) {
+            root = root->right;
+            continue;
+        }
+
+        if ((root->aux >= aux) || ((NULL != root->right) && (root->right->branch_max >= aux))) {
+            return true;
+        }
+
+        root = root->left;
+    }
+
+    return false;
+}
+
+static bool set(persistent_tree_node_t *node, const persistent_tree_node_t *payload, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *branch = NULL;
+
+    if (NULL == node) {
+        if (payload->count == 0) {
+            /* Removing a key that doesn't exist */
+            *result = NULL;
+            return true;
+        }
+        return create_node(payload, NULL, NULL, result);
+    }
+
+    if (payload->key == node->key) {
+        if (payload->count == 0) {
+            return glue(persistent_tree_acquire(node->left), persistent_tree_acquire(node->right), result);
+        }
+        return create_node(payload, persistent_tree_acquire(node->left), persistent_tree_acquire(node->right), result);
+    }
+
+    if (payload->key < node->key) {
+        if (false == set(node->left, payload, &branch)) {
+            return false;
+        }
+        if (branch == node->left) {
+            /* Nothing has changed, so the branch is shared as is */
+            persistent_tree_release(branch);
+            *result = persistent_tree_acquire(node);
+            return true;
+        }
+        return balance(node, branch, persistent_tree_acquire(node->right), result);
+    }
+
+    if (false == set(node->right, payload, &branch)) {
+        return false;
+    }
+    if (branch == node->right) {
+        persistent_tree_release(branch);
+        *result = persistent_tree_acquire(node);
+        return true;
+    }
+    return balance(node, persistent_tree_acquire(node->left), branch, result);
+}
+
+static bool build(const persistent_tree_node_t *payloads, size_t count, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *left = NULL;
+    persistent_tree_node_t *right = NULL;
+    size_t middle = count / 2;
+
+    if (0 == count) {
+        *result = NULL;
+        return true;
+    }
+
+    /* The branches' sizes differ by at most 1, so the tree is balanced without any rotation */
+    if (false == build(payloads, middle, &left)) {
+        return false;
+    }
+    if (false == build(payloads + middle + 1, count - middle - 1, &right)) {
+        persistent_tree_release(left);
+        return false;
+    }
+
+    return create_node(&payloads[middle], left, right, result);
+}
+
+static bool glue(persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *removed = NULL;
+    persistent_tree_node_t *branch = NULL;
+    persistent_tree_node_t *heavier = NULL;
+    bool success = false;
+
+    if (NULL == left) {
+        *result = right;
+        return true;
+    }
+
+    if (NULL == right) {
+        *result = left;
+        return true;
+    }
+
+    /* The removed node is replaced by its neighbor from the heavier side, which keeps the balance */
+    heavier = (left->size > right->size) ? left : right;
+    if (heavier == left) {
+        if (false == remove_max(left, &branch, &removed)) {
+            persistent_tree_release(left);
+            persistent_tree_release(right);
+            return false;
+        }
+        success = balance(removed, branch, right, result);
+    } else {
+        if (false == remove_min(right, &branch, &removed)) {
+            persistent_tree_release(left);
+            persistent_tree_release(right);
+            return false;
+        }
+        success = balance(removed, left, branch, result);
+    }
+
+    /* The neighbor node is read through the old heavier branch, which is only released now */
+    persistent_tree_release(heavier);
+    return success;
+}
+
+static bool remove_min(persistent_tree_node_t *node, persistent_tree_node_t **result, persistent_tree_node_t **removed)
+{
+    persistent_tree_node_t *branch = NULL;
+
+    if (NULL == node->left) {
+        *removed = node;
+        *result = persistent_tree_acquire(node->right);
+        return true;
+    }
+
+    if (false == remove_min(node->left, &branch, removed)) {
+        return false;
+    }
+
+    return balance(node, branch, persistent_tree_acquire(node->right), result);
+}
+
+static bool remove_max(persistent_tree_node_t *node, persistent_tree_node_t **result, persistent_tree_node_t **removed)
+{
+    persistent_tree_node_t *branch = NULL;
+
+    if (NULL == node->right) {
+        *removed = node;
+        *result = persistent_tree_acquire(node->left);
+        return true;
+    }
+
+    if (false == remove_max(node->right, &branch, removed)) {
+        return false;
+    }
+
+    return balance(node, persistent_tree_acquire(node->left), branch, result);
+}
+
+static bool create_node(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *node = malloc(sizeof(persistent_tree_node_t));
+
+    if (NULL == node) {
+        persistent_tree_release(left);
+        persistent_tree_release(right);
+        return false;
+    }
+
+    node->key = payload->key;
+    node->count = payload->count;
+    node->aux = payload->aux;
+    node->child = persistent_tree_acquire(payload->child);
+    node->left = left;
+    node->right = right;
+    node->refs = 1;
+    node->size = SIZE(left) + SIZE(right) + 1;
+
+    node->branch_max = node->aux;
+    if ((NULL != left) && (left->branch_max > node->branch_max)) {
+        node->branch_max = left->branch_max;
+    }
+    if ((NULL != right) && (right->branch_max > node->branch_max)) {
+        node->branch_max = right->branch_max;
+    }
+
+    *result = node;
+    return true;
+}
+
+static bool balance(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result)
+{
+    if (WEIGHT(right) > DELTA * WEIGHT(left)) {
+        return rotate_left(payload, left, right, result);
+    }
+
+    if (WEIGHT(left) > DELTA * WEIGHT(right)) {
+        return rotate_right(payload, left, right, result);
+    }
+
+    return create_node(payload, left, right, result);
+}
+
+static bool rotate_left(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *inner = right->left;
+    persistent_tree_node_t *outer = right->right;
+    persistent_tree_node_t *new_left = NULL;
+    persistent_tree_node_t *new_right = NULL;
+    bool success = false;
+
+    /* The new nodes are created out of right's nodes and branches, so right is released last */
+    if (WEIGHT(inner) < GAMMA * WEIGHT(outer)) {
+        /* Single rotation: right becomes the root */
+        success = create_node(payload, left, persistent_tree_acquire(inner), &new_left) &&
+                  create_node(right, new_left, persistent_tree_acquire(outer), result);
+    } else {
+        /* Double rotation: inner becomes the root */
+        if (create_node(payload, left, persistent_tree_acquire(inner->left), &new_left)) {
+            if (create_node(right, persistent_tree_acquire(inner->right), persistent_tree_acquire(outer), &new_right)) {
+                success = create_node(inner, new_left, new_right, result);
+            } else {
+                persistent_tree_release(new_left);
+            }
+        }
+    }
+
+    persistent_tree_release(right);
+    return success;
+}
+
+static bool rotate_right(const persistent_tree_node_t *payload, persistent_tree_node_t *left, persistent_tree_node_t *right, persistent_tree_node_t **result)
+{
+    persistent_tree_node_t *inner = left->right;
+    persistent_tree_node_t *outer = left->left;
+    persistent_tree_node_t *new_left = NULL;
+    persistent_tree_node_t *new_right = NULL;
+    bool success = false;
+
+    if (WEIGHT(inner) < GAMMA * WEIGHT(outer)) {
+        success = create_node(payload, persistent_tree_acquire(inner), right, &new_right) &&
+                  create_node(left, persistent_tree_acquire(outer), new_right, result);
+    } else {
+        if (create_node(payload, persistent_tree_acquire(inner->right), right, &new_right)) {
+            if (create_node(left, persistent_tree_acquire(outer), persistent_tree_acquire(inner->left), &new_left)) {
+                success = create_node(inner, new_left, new_right, result);
+            } else {
+                persistent_tree_release(new_right);
+            }
+        }
+    }
+
+    persistent_tree_release(left);
+    return success;
+}
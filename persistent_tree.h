@@ -0,0 +1,88 @@
+/*
+  persistent_tree.h - A persistent (immutable) balanced tree of unsigned int keys.
+  An update never changes a node. Instead, it copies the path from the root to the key, and returns
+  the root of a new version, which shares all of the other nodes with the previous version. Every
+  version stays valid, and may be read by any number of threads without locks, for as long as a
+  reference to its root is held.
+
+  The nodes are reference counted (by their parents and by the users' references to roots), and a
+  node is freed once its last reference is released. The counts are atomic, so versions may be
+  released by any thread. The nodes are allocated with malloc rather than from a pool, as the pools
+  are not thread-safe.
+
+  The tree is weight-balanced (a node's branch is at most 3 times the size of its sibling's), which
+  keeps rebalancing to a couple of rotations per level of the copied path, without parent pointers
+  or colors that would have to be copied along.
+
+  Every key also carries:
+    - count - a reference count, which is kept by the user (a key with a count of 0 is removed).
+    - aux - an unsigned int whose max over each branch is maintained, for dominance queries.
+    - child - a nested tree (e.g. of a second dimension), which the node holds a reference to.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef __PERSISTENT_TREE_H__
+#define __PERSISTENT_TREE_H__
+
+typedef struct persistent_tree_node_s persistent_tree_node_t;
+
+struct persistent_tree_node_s {
+    unsigned int key;
+    unsigned int count;
+    unsigned int aux;
+    unsigned int branch_max;        /* The max aux of the node's branch */
+    unsigned int size;              /* Number of keys in the node's branch */
+    unsigned int refs;              /* Parents and user references of the node, updated atomically */
+    persistent_tree_node_t *left;
+    persistent_tree_node_t *right;
+    persistent_tree_node_t *child;  /* The root of the nested tree, or NULL */
+};
+
+/* A tree is a pointer to its root node, where NULL is the empty tree. */
+
+/* persistent_tree_set - create a new version of the tree of root, where key has the given count,
+   aux and child (of which the new version takes its own reference). If count is 0, the key is
+   removed instead. The version of root is left unchanged.
+   result is set to the root of the new version, with a reference that the caller must release.
+   Returns false on an allocation failure, in which case nothing has changed.
+ */
+bool persistent_tree_set(persistent_tree_node_t *root, unsigned int key, unsigned int count, unsigned int aux, persistent_tree_node_t *child, persistent_tree_node_t **result);
+
+/* persistent_tree_build - create a tree of the count keys of payloads, which must be ascending and
+   distinct (only their key, count, aux & child are read, and the tree takes its own references to the
+   children). The tree is built perfectly balanced in O(count), instead of count calls to
+   persistent_tree_set.
+   result is set to its root, with a reference that the caller must release.
+   Returns false on an allocation failure, in which case nothing was created.
+ */
+bool persistent_tree_build(const persistent_tree_node_t *payloads, size_t count, persistent_tree_node_t **result);
+
+/* persistent_tree_acquire - take another reference to the version of root (which may be NULL).
+   Returns root.
+ */
+persistent_tree_node_t* persistent_tree_acquire(persistent_tree_node_t *root);
+
+/* persistent_tree_release - release a reference to the version of root (which may be NULL), and free
+   all of its nodes that are no longer referenced by any version.
+ */
+void persistent_tree_release(persistent_tree_node_t *root);
+
+/* persistent_tree_search - an exact key search. Returns the node of key, or NULL if not found. */
+persistent_tree_node_t* persistent_tree_search(persistent_tree_node_t *root, unsigned int key);
+
+/* persistent_tree_search_smallest - returns the node of the smallest key that is larger than or
+   equal to key, or NULL if there's none.
+ */
+persistent_tree_node_t* persistent_tree_search_smallest(persistent_tree_node_t *root, unsigned int key);
+
+/* persistent_tree_find_max - returns the node of the max key, or NULL if the tree is empty. */
+persistent_tree_node_t* persistent_tree_find_max(persistent_tree_node_t *root);
+
+/* persistent_tree_has_dominating - returns true if there's a key larger than or equal to key, whose
+   aux is larger than or equal to aux. A single descent, guided by the branch maxima of aux.
+ */
+bool persistent_tree_has_dominating(persistent_tree_node_t *root, unsigned int key, unsigned int aux);
+
+#endif /* __PERSISTENT_TREE_H__ */
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "persistent_tree.h"
+
+#define KEY_RANGE (600)
+#define AUX_RANGE (1000)
+#define OPERATIONS (20000)
+
+/* Every KEPT_INTERVAL-th version is kept (along with its expected contents) until the end */
+#define KEPT_INTERVAL (500)
+#define KEPT_VERSIONS (OPERATIONS / KEPT_INTERVAL + 1)
+
+#define NODE_SET_SIZE (1 << 18)
+
+typedef struct expected_s {
+    unsigned int count[KEY_RANGE];
+    unsigned int aux[KEY_RANGE];
+} expected_t;
+
+static expected_t current;
+static expected_t kept_expected[KEPT_VERSIONS];
+static persistent_tree_node_t *kept[KEPT_VERSIONS];
+static unsigned int kept_count = 0;
+
+/* A nested tree, which some of the keys point to */
+static persistent_tree_node_t *nested = NULL;
+
+/* The distinct nodes of all of the live versions, for verify_refs */
+static persistent_tree_node_t *node_set[NODE_SET_SIZE];
+static unsigned int node_refs[NODE_SET_SIZE];
+
+/* node_slot - the slot of node in node_set, or the empty slot where it should be added. */
+static unsigned int node_slot(persistent_tree_node_t *node)
+{
+    unsigned int slot = (unsigned int) (((uintptr_t) node >> 4) * 2654435761u) % NODE_SET_SIZE;
+
+    while ((NULL != node_set[slot]) && (node_set[slot] != node)) {
+        slot = (slot + 1) % NODE_SET_SIZE;
+    }
+
+    return slot;
+}
+
+/* collect - adds node's branch to node_set, and counts the references of its nodes to their children */
+static void collect(persistent_tree_node_t *node)
+{
+    unsigned int slot = 0;
+
+    if (NULL == node) {
+        return;
+    }
+
+    slot = node_slot(node);
+    if (NULL != node_set[slot]) {
+        /* A shared node, that was already collected */
+        return;
+    }
+    node_set[slot] = node;
+
+    if (NULL != node->left) {
+        collect(node->left);
+        node_refs[node_slot(node->left)]++;
+    }
+    if (NULL != node->right) {
+        collect(node->right);
+        node_refs[node_slot(node->right)]++;
+    }
+    if (NULL != node->child) {
+        collect(node->child);
+        node_refs[node_slot(node->child)]++;
+    }
+}
+
+/* verify_refs - the reference count of every node must be the number of its parents among all of
+   the live nodes, plus the user references to it as a root.
+ */
+static void verify_refs(persistent_tree_node_t *root)
+{
+    unsigned int i = 0;
+
+    memset(node_set, 0, sizeof(node_set));
+    memset(node_refs, 0, sizeof(node_refs));
+
+    collect(root);
+    collect(nested);
+    for (i = 0; i < kept_count; i++) {
+        collect(kept[i]);
+    }
+
+    if (NULL != root) {
+        node_refs[node_slot(root)]++;
+    }
+    if (NULL != nested) {
+        node_refs[node_slot(nested)]++;
+    }
+    for (i = 0; i < kept_count; i++) {
+        if (NULL != kept[i]) {
+            node_refs[node_slot(kept[i])]++;
+        }
+    }
+
+    for (i = 0; i < NODE_SET_SIZE; i++) {
+        if (NULL != node_set[i]) {
+            assert(node_set[i]->refs == node_refs[i]);
+        }
+    }
+}
+
+/* verify_node - recursively verifies the order, balance, sizes and aux maxima of a branch whose keys
+   must be in [low, high), and its contents by expected. Returns the branch's size.
+ */
+static unsigned int verify_node(persistent_tree_node_t *node, unsigned int low, unsigned int high, expected_t *expected)
+{
+    unsigned int left_size = 0;
+    unsigned int right_size = 0;
+    unsigned int max = 0;
+
+    if (NULL == node) {
+        return 0;
+    }
+
+    assert((node->key >= low) && (node->key < high));
+    assert(node->count > 0);
+    assert(node->count == expected->count[node->key]);
+    assert(node->aux == expected->aux[node->key]);
+
+    left_size = verify_node(node->left, low, node->key, expected);
+    right_size = verify_node(node->right, node->key + 1, high, expected);
+    assert(node->size == left_size + right_size + 1);
+
+    /* Weight balance, where the weight is the size + 1 */
+    assert(left_size + 1 <= 3 * (right_size + 1));
+    assert(right_size + 1 <= 3 * (left_size + 1));
+
+    max = node->aux;
+    if ((NULL != node->left) && (node->left->branch_max > max)) {
+        max = node->left->branch_max;
+    }
+    if ((NULL != node->right) && (node->right->branch_max > max)) {
+        max = node->right->branch_max;
+    }
+    assert(node->branch_max == max);
+
+    return node->size;
+}
+
+static void verify_tree(persistent_tree_node_t *root, expected_t *expected)
+{
+    unsigned int key = 0;
+    unsigned int count = 0;
+
+    for (key = 0; key < KEY_RANGE; key++) {
+        count += (expected->count[key] > 0) ? 1 : 0;
+    }
+    assert(verify_node(root, 0, KEY_RANGE, expected) == count);
+}
+
+static void verify_queries(persistent_tree_node_t *root, expected_t *expected)
+{
+    persistent_tree_node_t *node = NULL;
+    unsigned int key = 0;
+    unsigned int aux = 0;
+    unsigned int other = 0;
+    bool dominating = false;
+
+    for (key = 0; key < KEY_RANGE; key += 7) {
+        node = persistent_tree_search(root, key);
+        assert((NULL != node) == (expected->count[key] > 0));
+
+        for (other = key; (other < KEY_RANGE) && (expected->count[other] == 0); other++);
+        node = persistent_tree_search_smallest(root, key);
+        assert((NULL == node) ? (other == KEY_RANGE) : (node->key == other));
+
+        for (aux = 0; aux < AUX_RANGE; aux += 111) {
+            dominating = false;
+            for (other = key; (other < KEY_RANGE) && !dominating; other++) {
+                dominating = (expected->count[other] > 0) && (expected->aux[other] >= aux);
+            }
+            assert(persistent_tree_has_dominating(root, key, aux) == dominating);
+        }
+    }
+
+    for (other = KEY_RANGE; (other > 0) && (expected->count[other - 1] == 0); other--);
+    node = persistent_tree_find_max(root);
+    assert((NULL == node) ? (other == 0) : (node->key == other - 1));
+}
+
+int main(void)
+{
+    static persistent_tree_node_t payloads[KEY_RANGE];
+    persistent_tree_node_t *root = NULL;
+    persistent_tree_node_t *next = NULL;
+    persistent_tree_node_t *child = NULL;
+    persistent_tree_node_t *built = NULL;
+    unsigned int key = 0;
+    unsigned int aux = 0;
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    srand(18);
+
+    printf("Creating a nested tree...\n");
+    for (key = 0; key < 10; key++) {
+        assert(persistent_tree_set(nested, key, 1, 0, NULL, &next));
+        persistent_tree_release(nested);
+        nested = next;
+    }
+    assert(nested->size == 10);
+
+    printf("Searching an empty tree...\n");
+    verify_tree(root, &current);
+    verify_queries(root, &current);
+    assert(persistent_tree_set(root, 1, 0, 0, NULL, &next));
+    assert(NULL == next);
+
+    printf("Updating random keys, keeping some of the versions...\n");
+    for (i = 0; i < OPERATIONS; i++) {
+        key = rand() % KEY_RANGE;
+        aux = rand() % AUX_RANGE;
+
+        /* Insertions are favored in the first half, and removals in the second */
+        count = (rand() % 100 < ((i < OPERATIONS / 2) ? 70 : 30)) ? current.count[key] + 1 : 0;
+        child = (rand() % 4 == 0) ? nested : NULL;
+
+        assert(persistent_tree_set(root, key, count, aux, child, &next));
+
+        /* The previous version must stay as it was */
+        if (i % KEPT_INTERVAL == 0) {
+            kept[kept_count] = root;
+            kept_expected[kept_count++] = current;
+        } else {
+            persistent_tree_release(root);
+        }
+        root = next;
+        current.count[key] = count;
+        current.aux[key] = (count > 0) ? aux : 0;
+
+        if (i % 1000 == 0) {
+            verify_tree(root, &current);
+            verify_queries(root, &current);
+            verify_refs(root);
+        }
+    }
+    verify_tree(root, &current);
+    verify_queries(root, &current);
+    verify_refs(root);
+
+    printf("Verifying the kept versions...\n");
+    for (i = 0; i < kept_count; i++) {
+        verify_tree(kept[i], &kept_expected[i]);
+        verify_queries(kept[i], &kept_expected[i]);
+    }
+
+    printf("Releasing the kept versions...\n");
+    while (kept_count > 0) {
+        persistent_tree_release(kept[--kept_count]);
+        verify_refs(root);
+    }
+    verify_tree(root, &current);
+
+    printf("Building a tree of the current keys...\n");
+    assert(persistent_tree_build(payloads, 0, &built));
+    assert(NULL == built);
+    count = 0;
+    for (key = 0; key < KEY_RANGE; key++) {
+        if (current.count[key] > 0) {
+            payloads[count].key = key;
+            payloads[count].count = current.count[key];
+            payloads[count].aux = current.aux[key];
+            payloads[count++].child = (key % 3 == 0) ? nested : NULL;
+        }
+    }
+    assert(persistent_tree_build(payloads, count, &built));
+    verify_tree(built, &current);
+    verify_queries(built, &current);
+    kept[kept_count++] = built;
+    verify_refs(root);
+    persistent_tree_release(kept[--kept_count]);
+    verify_refs(root);
+
+    printf("Emptying tree...\n");
+    for (key = 0; key < KEY_RANGE; key++) {
+        assert(persistent_tree_set(root, key, 0, 0, NULL, &next));
+        persistent_tree_release(root);
+        root = next;
+        current.count[key] = 0;
+        if (key % 50 == 0) {
+            verify_tree(root, &current);
+            verify_refs(root);
+        }
+    }
+    assert(NULL == root);
+
+    /* Only the user's reference to the nested tree is left */
+    verify_refs(root);
+    assert(nested->refs == 1);
+    persistent_tree_release(nested);
+
+    return 0;
+}
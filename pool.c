@@ -0,0 +1,258 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "op_stats.h"
+#include "pool.h"
+
+/* The chunk's data starts after its header, aligned */
+#define CHUNK_HEADER_SIZE (((sizeof(pool_chunk_t) + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT) * POOL_ALIGNMENT)
+#define CHUNK_DATA(chunk) ((char *) (chunk) + CHUNK_HEADER_SIZE)
+#define CHUNK_END(chunk) ((char *) (chunk) + POOL_CHUNK_SIZE)
+
+/* SIZE_CLASS - the index of the free list of objects of size bytes (size > 0) */
+#define SIZE_CLASS(size) (((size) - 1) / POOL_ALIGNMENT)
+
+/* IS_LINE_CLASS - whether the objects of a size class of rounded bytes are aligned to cache lines */
+#define IS_LINE_CLASS(rounded) ((rounded) % POOL_CACHE_LINE == 0)
+
+/* LINE_SKIP - the bytes to skip from next, for an object of rounded bytes to start where its size class
+   should (always 0 unless it is a line class) */
+#define LINE_SKIP(next, rounded) (IS_LINE_CLASS(rounded) ? (POOL_CACHE_LINE - (uintptr_t) (next) % POOL_CACHE_LINE) % POOL_CACHE_LINE : 0)
+
+/* A large object starts after its header, aligned */
+#define LARGE_HEADER_SIZE (((sizeof(pool_large_t) + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT) * POOL_ALIGNMENT)
+#define LARGE_OBJECT(large) ((char *) (large) + LARGE_HEADER_SIZE)
+#define LARGE_HEADER(object) ((pool_large_t *) ((char *) (object) - LARGE_HEADER_SIZE))
+
+/* pool_next_chunk - move on to the next chunk, allocating it if there's no chunk left to reuse.
+   Returns false on an allocation failure.
+ */
+static bool pool_next_chunk(pool_t *pool);
+
+/* pool_carve - carve an object of rounded bytes out of the current chunk, or the next one if it
+   doesn't fit, first skipping to a cache line if rounded is a line class. Returns NULL on an
+   allocation failure.
+ */
+static void* pool_carve(pool_t *pool, size_t rounded);
+
+/* pool_calloc_aligned - the calloc of a NULL pool for a line class. Returns NULL on an allocation
+   failure.
+ */
+static void* pool_calloc_aligned(size_t size);
+
+/* pool_alloc_large, pool_free_large - pool_alloc and pool_free of objects larger than
+   POOL_MAX_SIZE, which are linked to the pool's list of large objects.
+ */
+static void* pool_alloc_large(pool_t *pool, size_t size);
+static void pool_free_large(pool_t *pool, void *object, size_t size);
+
+/* pool_free_all_large - free all of the pool's large objects. */
+static void pool_free_all_large(pool_t *pool);
+
+pool_t* pool_create()
+{
+    return calloc(sizeof(pool_t), 1);
+}
+
+void pool_destroy(pool_t *pool)
+{
+    pool_chunk_t *chunk = pool->chunks;
+    pool_chunk_t *next = NULL;
+
+    while (NULL != chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pool_free_all_large(pool);
+
+    free(pool);
+}
+
+void pool_reset(pool_t *pool)
+{
+    memset(pool->free_lists, 0, sizeof(pool->free_lists));
+    pool_free_all_large(pool);
+    pool->allocated = 0;
+    pool->current = pool->chunks;
+
+    if (NULL != pool->current) {
+        pool->next = CHUNK_DATA(pool->current);
+        pool->end = CHUNK_END(pool->current);
+    }
+}
+
+void* pool_alloc(pool_t *pool, size_t size)
+{
+    void *object = NULL;
+    size_t rounded = 0;
+
+    OP_STATS_COUNT(allocations);
+    if (NULL == pool) {
+        return ((size > 0) && (size <= POOL_MAX_SIZE) && IS_LINE_CLASS((SIZE_CLASS(size) + 1) * POOL_ALIGNMENT)) ?
+               pool_calloc_aligned(size) : calloc(size, 1);
+    }
+
+    if (size > POOL_MAX_SIZE) {
+        return pool_alloc_large(pool, size);
+    }
+
+    if (size == 0) {
+        size = 1;
+    }
+    rounded = (SIZE_CLASS(size) + 1) * POOL_ALIGNMENT;
+
+    object = pool->free_lists[SIZE_CLASS(size)];
+    if (NULL != object) {
+        /* Freed objects hold the next object of the free list */
+        pool->free_lists[SIZE_CLASS(size)] = *(void **) object;
+    } else {
+        object = pool_carve(pool, rounded);
+        if (NULL == object) {
+            return NULL;
+        }
+    }
+
+    pool->allocated += rounded;
+    memset(object, 0, rounded);
+
+    return object;
+}
+
+void pool_free(pool_t *pool, void *object, size_t size)
+{
+    if (NULL == object) {
+        return;
+    }
+
+    if (NULL == pool) {
+        free(object);
+        return;
+    }
+
+    if (size > POOL_MAX_SIZE) {
+        pool_free_large(pool, object, size);
+        return;
+    }
+
+    if (size == 0) {
+        size = 1;
+    }
+
+    *(void **) object = pool->free_lists[SIZE_CLASS(size)];
+    pool->free_lists[SIZE_CLASS(size)] = object;
+    pool->allocated -= (SIZE_CLASS(size) + 1) * POOL_ALIGNMENT;
+}
+
+static bool pool_next_chunk(pool_t *pool)
+{
+    pool_chunk_t *chunk = NULL;
+
+    if ((NULL != pool->current) && (NULL != pool->current->next)) {
+        /* Reuse a chunk that was kept by pool_reset */
+        chunk = pool->current->next;
+    } else {
+        chunk = malloc(POOL_CHUNK_SIZE);
+        if (NULL == chunk) {
+            return false;
+        }
+        chunk->next = NULL;
+
+        if (NULL == pool->current) {
+            pool->chunks = chunk;
+        } else {
+            pool->current->next = chunk;
+        }
+    }
+
+    pool->current = chunk;
+    pool->next = CHUNK_DATA(chunk);
+    pool->end = CHUNK_END(chunk);
+
+    return true;
+}
+
+static void* pool_carve(pool_t *pool, size_t rounded)
+{
+    size_t skip = LINE_SKIP(pool->next, rounded);
+    void *object = NULL;
+
+    if (pool->end - pool->next < (ptrdiff_t) (skip + rounded)) {
+        if (!pool_next_chunk(pool)) {
+            return NULL;
+        }
+        skip = LINE_SKIP(pool->next, rounded);
+    }
+
+    /* The skipped bytes (a multiple of POOL_ALIGNMENT) become a free object of their size class */
+    if (skip > 0) {
+        *(void **) pool->next = pool->free_lists[SIZE_CLASS(skip)];
+        pool->free_lists[SIZE_CLASS(skip)] = pool->next;
+    }
+
+    object = pool->next + skip;
+    pool->next += skip + rounded;
+    return object;
+}
+
+static void* pool_calloc_aligned(size_t size)
+{
+    void *object = NULL;
+
+    if (0 != posix_memalign(&object, POOL_CACHE_LINE, size)) {
+        return NULL;
+    }
+
+    memset(object, 0, size);
+    return object;
+}
+
+static void* pool_alloc_large(pool_t *pool, size_t size)
+{
+    pool_large_t *large = calloc(LARGE_HEADER_SIZE + size, 1);
+
+    if (NULL == large) {
+        return NULL;
+    }
+
+    large->next = pool->large;
+    if (NULL != pool->large) {
+        pool->large->prev = large;
+    }
+    pool->large = large;
+    pool->allocated += size;
+
+    return LARGE_OBJECT(large);
+}
+
+static void pool_free_large(pool_t *pool, void *object, size_t size)
+{
+    pool_large_t *large = LARGE_HEADER(object);
+
+    if (NULL == large->prev) {
+        pool->large = large->next;
+    } else {
+        large->prev->next = large->next;
+    }
+    if (NULL != large->next) {
+        large->next->prev = large->prev;
+    }
+    pool->allocated -= size;
+
+    free(large);
+}
+
+static void pool_free_all_large(pool_t *pool)
+{
+    pool_large_t *large = pool->large;
+    pool_large_t *next = NULL;
+
+    while (NULL != large) {
+        next = large->next;
+        free(large);
+        large = next;
+    }
+    pool->large = NULL;
+}
@@ -0,0 +1,75 @@
+/*
+  pool.h - A pool allocator for small objects.
+  Memory is carved out of large chunks, and freed objects are kept in a free list per size class
+  (multiples of POOL_ALIGNMENT), so allocating and freeing an object never calls malloc/free once
+  the pool is warm. Objects larger than POOL_MAX_SIZE are allocated one by one with a header that
+  links them to the pool. All of the pool's objects are released together by pool_reset (which
+  keeps the chunks for reuse, but frees the large objects) or by pool_destroy.
+
+  The objects of the size classes that are multiples of POOL_CACHE_LINE start on a cache line, so
+  that structures that are laid out by cache lines (such as bp_tree's nodes) are never split across
+  an extra one. The bytes that are skipped to align such an object are put on the free list of their
+  own size, so they aren't lost.
+
+  The user must pass the object's size to pool_free, since the objects carry no headers.
+  A NULL pool falls back to calloc/free (aligned the same way), so structures may be used with or
+  without a pool.
+ */
+
+#include <stddef.h>
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#define POOL_ALIGNMENT (8)
+#define POOL_MAX_SIZE (256)
+#define POOL_SIZE_CLASSES (POOL_MAX_SIZE / POOL_ALIGNMENT)
+#define POOL_CHUNK_SIZE (64 * 1024)
+#define POOL_CACHE_LINE (64)
+
+typedef struct pool_chunk_s pool_chunk_t;
+
+struct pool_chunk_s {
+    pool_chunk_t *next;
+};
+
+/* The header of an object larger than POOL_MAX_SIZE, which the object follows */
+typedef struct pool_large_s pool_large_t;
+
+struct pool_large_s {
+    pool_large_t *prev;
+    pool_large_t *next;
+};
+
+typedef struct pool_s {
+    pool_chunk_t *chunks;     /* All of the pool's chunks */
+    pool_chunk_t *current;    /* The chunk that objects are currently carved out of */
+    char *next;               /* The next free byte in the current chunk */
+    char *end;                /* The end of the current chunk */
+    void *free_lists[POOL_SIZE_CLASSES];
+    pool_large_t *large;      /* All of the objects larger than POOL_MAX_SIZE */
+    size_t allocated;         /* Bytes currently allocated by the user */
+} pool_t;
+
+/* pool_create - create an empty pool. Returns NULL on an allocation failure. */
+pool_t* pool_create();
+
+/* pool_destroy - free the pool and all of its memory. */
+void pool_destroy(pool_t *pool);
+
+/* pool_reset - release all of the objects of the pool at once. The chunks are kept for reuse, and
+   the objects larger than POOL_MAX_SIZE are freed, which takes a free per object.
+ */
+void pool_reset(pool_t *pool);
+
+/* pool_alloc - allocate a zeroed object of size bytes, aligned to POOL_CACHE_LINE if its size class
+   is a multiple of it, and to POOL_ALIGNMENT otherwise. Returns NULL on an allocation failure.
+   Objects larger than POOL_MAX_SIZE are allocated with calloc, and are still released along with
+   the pool.
+ */
+void* pool_alloc(pool_t *pool, size_t size);
+
+/* pool_free - free an object of size bytes, which was allocated from the pool. */
+void pool_free(pool_t *pool, void *object, size_t size);
+
+#endif /* __POOL_H__ */
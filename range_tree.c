@@ -0,0 +1,789 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include "op_stats.h"
+#include "rb_tree.h"
+#include "range_tree.h"
+
+/* The scapegoat tree's balance factor is 2/3: a node's child may hold up to 2/3 of its branch.
+   The height of the tree is then at most log(size) / log(3/2).
+ */
+#define RANGE_TREE_LOG_INV_ALPHA (0.4054651081081644) /* log(3/2) */
+#define IS_UNBALANCED(child_size, size) (3 * (child_size) > 2 * (size))
+
+/* create_entry - creates a point entry. Returns NULL on an allocation failure. */
+static range_tree_entry_t* create_entry(pool_t *pool, unsigned int x, unsigned int y);
+
+/* create_node - creates a primary node with empty secondary trees.
+   Returns NULL on an allocation failure.
+ */
+static range_tree_node_t* create_node(pool_t *pool, unsigned int x);
+
+/* free_node - frees a primary node and its secondary trees, including all of their entries. */
+static void free_node(pool_t *pool, range_tree_node_t *node);
+
+/* free_branch - frees a node's entire branch, including the node itself. */
+static void free_branch(pool_t *pool, range_tree_node_t *node);
+
+/* free_secondary - frees a secondary tree, including all of its entries. */
+static void free_secondary(rb_tree_t *tree);
+
+/* find_node - search for the primary node of x. If it's not found, NULL is returned, and parent
+   would hold the node under which a node for x should be added (NULL if the tree is empty).
+ */
+static range_tree_node_t* find_node(range_tree_t *tree, unsigned int x, range_tree_node_t **parent);
+
+/* add_to_branches, remove_from_branches - add/remove a point to/from the branch trees of node and
+   all of its ancestors. add_to_branches leaves the trees unchanged on an allocation failure.
+ */
+static bool add_to_branches(range_tree_node_t *node, unsigned int x, unsigned int y);
+static void remove_from_branches(range_tree_node_t *node, range_tree_node_t *stop, unsigned int x, unsigned int y);
+
+/* insert_new_node - adds a node for a new x with the point (x, y) under parent, and rebalances
+   the tree if needed.
+ */
+static bool insert_new_node(range_tree_t *tree, range_tree_node_t *parent, unsigned int x, unsigned int y);
+
+/* build_branches - build the branch trees of a balanced tree of nodes[low..high), into branches
+   (by the same indices as nodes). Returns false on an allocation failure, in which case the
+   trees that have already been built must be freed by the caller.
+ */
+static bool build_branches(pool_t *pool, range_tree_node_t **nodes, rb_tree_t **branches, unsigned int low, unsigned int high);
+
+/* link_nodes - link nodes[low..high) as a perfectly balanced tree, returns its head. */
+static range_tree_node_t* link_nodes(range_tree_node_t **nodes, rb_tree_t **branches, unsigned int low, unsigned int high, range_tree_node_t *parent);
+
+/* rebuild - rebuild the branch of node as a perfectly balanced tree, including its branch trees.
+   If drop_empty is set, nodes without points are removed (only allowed for the head of the tree).
+   If an allocation fails, the tree is left unchanged (and merely stays unbalanced).
+ */
+static void rebuild(range_tree_t *tree, range_tree_node_t *node, bool drop_empty);
+
+/* search_branch - search for the entry of the minimal product with y larger than/equal to the
+   given y in a branch tree, using the augmented data. Returns NULL if there's no such entry.
+ */
+static range_tree_entry_t* search_branch(rb_tree_t *branch, unsigned int y);
+
+/* compare_entries_by_y - key comparison function for the points trees.
+   compare_entries - key comparison function for the branch trees (by y, and then by x).
+ */
+static int compare_entries_by_y(void *a, void *b);
+static int compare_entries(void *a, void *b);
+
+/* augment_best - augmentation function for the branch trees, maintains best of each entry. */
+static void augment_best(void *key, void *left_key, void *right_key);
+
+/* is_better - returns true if a is a better (smaller) result than b. NULL is never better. */
+static bool is_better(range_tree_entry_t *a, range_tree_entry_t *b);
+
+range_tree_t* range_tree_create(pool_t *pool)
+{
+    range_tree_t *tree = pool_alloc(pool, sizeof(range_tree_t));
+
+    if (NULL == tree) {
+        return NULL;
+    }
+
+    tree->pool = pool;
+
+    return tree;
+}
+
+void range_tree_destroy(range_tree_t *tree)
+{
+    free_branch(tree->pool, tree->head);
+    pool_free(tree->pool, tree, sizeof(range_tree_t));
+}
+
+bool range_tree_insert(range_tree_t *tree, unsigned int x, unsigned int y)
+{
+    range_tree_node_t *node = NULL;
+    range_tree_node_t *parent = NULL;
+    range_tree_entry_t *entry = NULL;
+    range_tree_entry_t probe = {.y = y, .x = x};
+    range_tree_entry_t *deleted = NULL;
+    rb_tree_node_t *point = NULL;
+    bool exists = false;
+
+    node = find_node(tree, x, &parent);
+    if (NULL == node) {
+        return insert_new_node(tree, parent, x, y);
+    }
+
+    /* The point already exists, so just increase its reference count, without searching for it
+       again through rb_tree_insert */
+    OP_STATS_COUNT(subtree_searches);
+    point = rb_tree_search_node(node->points, &probe);
+    if (NULL != point) {
+        point->count++;
+        return true;
+    }
+
+    entry = create_entry(tree->pool, x, y);
+    if (NULL == entry) {
+        return false;
+    }
+
+    if (false == rb_tree_insert(node->points, entry, &exists)) {
+        pool_free(tree->pool, entry, sizeof(range_tree_entry_t));
+        return false;
+    }
+
+    if (false == add_to_branches(node, x, y)) {
+        rb_tree_remove(node->points, entry, (void **) &deleted);
+        assert(deleted == entry);
+        pool_free(tree->pool, entry, sizeof(range_tree_entry_t));
+        return false;
+    }
+
+    if (node->points->count == 1) {
+        tree->empty_nodes--;
+    }
+
+    return true;
+}
+
+bool range_tree_remove(range_tree_t *tree, unsigned int x, unsigned int y)
+{
+    range_tree_node_t *node = NULL;
+    range_tree_node_t *parent = NULL;
+    range_tree_entry_t probe = {.y = y, .x = x};
+    range_tree_entry_t *deleted = NULL;
+
+    node = find_node(tree, x, &parent);
+    if (NULL == node) {
+        return false;
+    }
+
+    OP_STATS_COUNT(subtree_searches);
+    if (false == rb_tree_remove(node->points, &probe, (void **) &deleted)) {
+        return false;
+    }
+
+    if (NULL == deleted) {
+        /* There are more instances of the point */
+        return true;
+    }
+
+    pool_free(tree->pool, deleted, sizeof(range_tree_entry_t));
+    remove_from_branches(node, NULL, x, y);
+
+    if (node->points->count == 0) {
+        tree->empty_nodes++;
+
+        /* The tree is rebuilt once most of its nodes are empty, so the height stays logarithmic
+           in the number of the actual distinct x values. */
+        if (2 * tree->empty_nodes > tree->head->size) {
+            rebuild(tree, tree->head, true);
+        }
+    }
+
+    return true;
+}
+
+bool range_tree_build(range_tree_t *tree, const range_tree_point_t *points, size_t count)
+{
+    range_tree_node_t **nodes = NULL;
+    rb_tree_t **branches = NULL;
+    void **entries = NULL;
+    unsigned int *counts = NULL;
+    unsigned int node_count = 0;
+    size_t entry_count = 0;
+    size_t i = 0;
+    bool result = false;
+
+    assert(NULL == tree->head);
+
+    if (count == 0) {
+        return true;
+    }
+
+    nodes = calloc(sizeof(range_tree_node_t *), count);
+    branches = calloc(sizeof(rb_tree_t *), count);
+    entries = calloc(sizeof(void *), count);
+    counts = calloc(sizeof(unsigned int), count);
+    if ((NULL == nodes) || (NULL == branches) || (NULL == entries) || (NULL == counts)) {
+        goto cleanup;
+    }
+
+    /* A node per distinct x, whose points tree is built out of its (sorted) run of points */
+    for (i = 0; i < count; i++) {
+        if ((i == 0) || (points[i].x != points[i - 1].x)) {
+            nodes[node_count] = create_node(tree->pool, points[i].x);
+            if (NULL == nodes[node_count]) {
+                goto cleanup;
+            }
+            node_count++;
+            entry_count = 0;
+        }
+
+        entries[entry_count] = create_entry(tree->pool, points[i].x, points[i].y);
+        if (NULL == entries[entry_count]) {
+            goto cleanup;
+        }
+        counts[entry_count++] = points[i].count;
+
+        if ((i + 1 == count) || (points[i + 1].x != points[i].x)) {
+            if (false == rb_tree_build_sorted(nodes[node_count - 1]->points, entries, counts, entry_count)) {
+                goto cleanup;
+            }
+            entry_count = 0;
+        }
+    }
+
+    if (false == build_branches(tree->pool, nodes, branches, 0, node_count)) {
+        goto cleanup;
+    }
+
+    tree->head = link_nodes(nodes, branches, 0, node_count, NULL);
+    tree->empty_nodes = 0;
+    result = true;
+
+cleanup:
+    if (!result) {
+        /* Free whatever was built: the entries that aren't in a points tree yet, the nodes (with
+           their points) and the branches */
+        while (entry_count > 0) {
+            pool_free(tree->pool, entries[--entry_count], sizeof(range_tree_entry_t));
+        }
+        for (i = 0; (NULL != branches) && (i < node_count); i++) {
+            if (NULL != branches[i]) {
+                free_secondary(branches[i]);
+            }
+        }
+        for (i = 0; i < node_count; i++) {
+            free_node(tree->pool, nodes[i]);
+        }
+    }
+    free(nodes);
+    free(branches);
+    free(entries);
+    free(counts);
+    return result;
+}
+
+unsigned int range_tree_count(range_tree_t *tree)
+{
+    /* The root's branch tree holds all of the points */
+    return (NULL == tree->head) ? 0 : tree->head->branch->count;
+}
+
+bool range_tree_search_min(range_tree_t *tree, unsigned int x, unsigned int y, unsigned int *found_x, unsigned int *found_y)
+{
+    range_tree_node_t *node = tree->head;
+    rb_tree_node_t *smallest = NULL;
+    range_tree_entry_t *best = NULL;
+    range_tree_entry_t *candidate = NULL;
+    range_tree_entry_t probe = {.y = y, .x = x};
+
+    /* Whenever a node's x is large enough, its own points and its entire right branch dominate x,
+       so only their y has to be checked - which is done in the secondary trees. The rest of the
+       candidates are in the left branch.
+     */
+    while (NULL != node) {
+        if (node->x < x) {
+            node = node->right;
+            continue;
+        }
+
+        /* All of the node's points have the same x, so the smallest y is the smallest product */
+        OP_STATS_COUNT(subtree_searches);
+        smallest = rb_tree_search_smallest(node->points, &probe);
+        if (NULL != smallest) {
+            candidate = (range_tree_entry_t *) smallest->key;
+            if (is_better(candidate, best)) {
+                best = candidate;
+            }
+        }
+
+        if (NULL != node->right) {
+            OP_STATS_COUNT(subtree_searches);
+            candidate = search_branch(node->right->branch, y);
+            if (is_better(candidate, best)) {
+                best = candidate;
+            }
+        }
+
+        node = node->left;
+    }
+
+    if (NULL == best) {
+        return false;
+    }
+
+    *found_x = best->x;
+    *found_y = best->y;
+
+    return true;
+}
+
+static range_tree_entry_t* search_branch(rb_tree_t *branch, unsigned int y)
+{
+    rb_tree_node_t *node = branch->head;
+    range_tree_entry_t *entry = NULL;
+    range_tree_entry_t *right = NULL;
+    range_tree_entry_t *best = NULL;
+
+    /* Same as the primary search: an entry with a large enough y dominates, and so does its entire
+       right branch, whose best entry is already known.
+     */
+    while (!RB_TREE_IS_NIL(branch, node)) {
+        OP_STATS_COUNT(comparisons);
+        entry = (range_tree_entry_t *) node->key;
+
+        if (entry->y < y) {
+            node = node->right;
+            continue;
+        }
+
+        if (is_better(entry, best)) {
+            best = entry;
+        }
+
+        right = (range_tree_entry_t *) node->right->key;
+        if ((NULL != right) && is_better(right->best, best)) {
+            best = right->best;
+        }
+
+        node = node->left;
+    }
+
+    return best;
+}
+
+static range_tree_node_t* find_node(range_tree_t *tree, unsigned int x, range_tree_node_t **parent)
+{
+    range_tree_node_t *node = tree->head;
+
+    *parent = NULL;
+
+    while (NULL != node) {
+        if (x == node->x) {
+            return node;
+        }
+
+        *parent = node;
+        node = (x < node->x) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static bool insert_new_node(range_tree_t *tree, range_tree_node_t *parent, unsigned int x, unsigned int y)
+{
+    range_tree_node_t *node = NULL;
+    range_tree_node_t *ancestor = NULL;
+    range_tree_entry_t *entry = NULL;
+    bool exists = false;
+    unsigned int depth = 0;
+
+    node = create_node(tree->pool, x);
+    if (NULL == node) {
+        return false;
+    }
+
+    entry = create_entry(tree->pool, x, y);
+    if (NULL == entry) {
+        free_node(tree->pool, node);
+        return false;
+    }
+
+    if (false == rb_tree_insert(node->points, entry, &exists)) {
+        pool_free(tree->pool, entry, sizeof(range_tree_entry_t));
+        free_node(tree->pool, node);
+        return false;
+    }
+
+    node->parent = parent;
+    if (NULL == parent) {
+        tree->head = node;
+    } else if (x < parent->x) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+
+    if (false == add_to_branches(node, x, y)) {
+        if (NULL == parent) {
+            tree->head = NULL;
+        } else if (parent->left == node) {
+            parent->left = NULL;
+        } else {
+            parent->right = NULL;
+        }
+        free_node(tree->pool, node);
+        return false;
+    }
+
+    for (ancestor = parent; NULL != ancestor; ancestor = ancestor->parent) {
+        ancestor->size++;
+        depth++;
+    }
+
+    /* Scapegoat rebalancing: if the new node is too deep, some ancestor must be unbalanced. */
+    if ((double) depth > log((double) tree->head->size) / RANGE_TREE_LOG_INV_ALPHA) {
+        for (ancestor = node; NULL != ancestor->parent; ancestor = ancestor->parent) {
+            if (IS_UNBALANCED(ancestor->size, ancestor->parent->size)) {
+                rebuild(tree, ancestor->parent, false);
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool add_to_branches(range_tree_node_t *node, unsigned int x, unsigned int y)
+{
+    range_tree_node_t *current = NULL;
+    range_tree_entry_t *entry = NULL;
+    bool exists = false;
+
+    for (current = node; NULL != current; current = current->parent) {
+        OP_STATS_COUNT(subtree_searches);
+        entry = create_entry(current->branch->pool, x, y);
+        if (NULL == entry) {
+            break;
+        }
+
+        if (false == rb_tree_insert(current->branch, entry, &exists)) {
+            pool_free(current->branch->pool, entry, sizeof(range_tree_entry_t));
+            break;
+        }
+        assert(exists == false);
+    }
+
+    if (NULL != current) {
+        /* Roll back the branches that were already updated */
+        remove_from_branches(node, current, x, y);
+        return false;
+    }
+
+    return true;
+}
+
+static void remove_from_branches(range_tree_node_t *node, range_tree_node_t *stop, unsigned int x, unsigned int y)
+{
+    range_tree_node_t *current = NULL;
+    range_tree_entry_t probe = {.y = y, .x = x};
+    range_tree_entry_t *deleted = NULL;
+
+    for (current = node; stop != current; current = current->parent) {
+        OP_STATS_COUNT(subtree_searches);
+        rb_tree_remove(current->branch, &probe, (void **) &deleted);
+        assert(deleted);
+        pool_free(current->branch->pool, deleted, sizeof(range_tree_entry_t));
+    }
+}
+
+/* flatten - fill nodes with the nodes of the branch of node, in order. Returns the next index. */
+static unsigned int flatten(range_tree_node_t *node, range_tree_node_t **nodes, unsigned int index)
+{
+    if (NULL == node) {
+        return index;
+    }
+
+    index = flatten(node->left, nodes, index);
+    nodes[index++] = node;
+    return flatten(node->right, nodes, index);
+}
+
+static bool build_branches(pool_t *pool, range_tree_node_t **nodes, rb_tree_t **branches, unsigned int low, unsigned int high)
+{
+    unsigned int middle = low + (high - low) / 2;
+    rb_tree_t *branch = NULL;
+    rb_tree_t *sources[3];
+    rb_tree_cursor_t cursors[3];
+    unsigned int source_count = 0;
+    unsigned int source = 0;
+    unsigned int smallest = 0;
+    void **entries = NULL;
+    size_t count = 0;
+    size_t i = 0;
+
+    if (low >= high) {
+        return true;
+    }
+
+    /* The branches of the children are built first. The branch of the node is then the merge of
+       theirs with the node's own points, which are all sorted the same way, so it is built in
+       linear time rather than by an insertion per point.
+     */
+    if (!build_branches(pool, nodes, branches, low, middle) || !build_branches(pool, nodes, branches, middle + 1, high)) {
+        return false;
+    }
+
+    branch = rb_tree_create_in(pool, compare_entries, augment_best);
+    if (NULL == branch) {
+        return false;
+    }
+    branches[middle] = branch;
+
+    sources[source_count++] = nodes[middle]->points;
+    if (low < middle) {
+        sources[source_count++] = branches[low + (middle - low) / 2];
+    }
+    if (middle + 1 < high) {
+        sources[source_count++] = branches[middle + 1 + (high - middle - 1) / 2];
+    }
+    for (source = 0; source < source_count; source++) {
+        count += sources[source]->count;
+        rb_tree_cursor_init(&cursors[source], sources[source]);
+        rb_tree_cursor_first(&cursors[source]);
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    entries = malloc(count * sizeof(void *));
+    if (NULL == entries) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        smallest = source_count;
+        for (source = 0; source < source_count; source++) {
+            if (rb_tree_cursor_valid(&cursors[source]) &&
+                ((smallest == source_count) ||
+                 (compare_entries(rb_tree_cursor_key(&cursors[source]), rb_tree_cursor_key(&cursors[smallest])) < 0))) {
+                smallest = source;
+            }
+        }
+
+        entries[i] = create_entry(pool, ((range_tree_entry_t *) rb_tree_cursor_key(&cursors[smallest]))->x,
+                                  ((range_tree_entry_t *) rb_tree_cursor_key(&cursors[smallest]))->y);
+        if (NULL == entries[i]) {
+            break;
+        }
+        rb_tree_cursor_next(&cursors[smallest]);
+    }
+
+    if ((i < count) || !rb_tree_build_sorted(branch, entries, NULL, count)) {
+        while (i > 0) {
+            pool_free(pool, entries[--i], sizeof(range_tree_entry_t));
+        }
+        free(entries);
+        return false;
+    }
+
+    free(entries);
+    return true;
+}
+
+static range_tree_node_t* link_nodes(range_tree_node_t **nodes, rb_tree_t **branches, unsigned int low, unsigned int high, range_tree_node_t *parent)
+{
+    unsigned int middle = low + (high - low) / 2;
+    range_tree_node_t *node = NULL;
+
+    if (low >= high) {
+        return NULL;
+    }
+
+    node = nodes[middle];
+    node->parent = parent;
+    node->size = high - low;
+    free_secondary(node->branch);
+    node->branch = branches[middle];
+    node->left = link_nodes(nodes, branches, low, middle, node);
+    node->right = link_nodes(nodes, branches, middle + 1, high, node);
+
+    return node;
+}
+
+static void rebuild(range_tree_t *tree, range_tree_node_t *node, bool drop_empty)
+{
+    range_tree_node_t **nodes = NULL;
+    range_tree_node_t **dropped = NULL;
+    range_tree_node_t *parent = node->parent;
+    range_tree_node_t *head = NULL;
+    rb_tree_t **branches = NULL;
+    unsigned int size = node->size;
+    unsigned int kept = 0;
+    unsigned int dropped_count = 0;
+    unsigned int i = 0;
+
+    assert((false == drop_empty) || (NULL == parent));
+
+    nodes = calloc(sizeof(range_tree_node_t *), size);
+    dropped = calloc(sizeof(range_tree_node_t *), size);
+    branches = calloc(sizeof(rb_tree_t *), size);
+    if ((NULL == nodes) || (NULL == dropped) || (NULL == branches)) {
+        goto cleanup;
+    }
+
+    flatten(node, nodes, 0);
+    for (i = 0; i < size; i++) {
+        if (drop_empty && (nodes[i]->points->count == 0)) {
+            dropped[dropped_count++] = nodes[i];
+        } else {
+            nodes[kept++] = nodes[i];
+        }
+    }
+
+    if (false == build_branches(tree->pool, nodes, branches, 0, kept)) {
+        for (i = 0; i < kept; i++) {
+            if (NULL != branches[i]) {
+                free_secondary(branches[i]);
+            }
+        }
+        goto cleanup;
+    }
+
+    head = link_nodes(nodes, branches, 0, kept, parent);
+    if (NULL == parent) {
+        tree->head = head;
+    } else if (parent->left == node) {
+        parent->left = head;
+    } else {
+        parent->right = head;
+    }
+
+    for (i = 0; i < dropped_count; i++) {
+        free_node(tree->pool, dropped[i]);
+    }
+    tree->empty_nodes -= dropped_count;
+
+cleanup:
+    free(nodes);
+    free(dropped);
+    free(branches);
+}
+
+static range_tree_entry_t* create_entry(pool_t *pool, unsigned int x, unsigned int y)
+{
+    range_tree_entry_t *entry = pool_alloc(pool, sizeof(range_tree_entry_t));
+
+    if (NULL == entry) {
+        return NULL;
+    }
+
+    entry->x = x;
+    entry->y = y;
+    entry->product = (unsigned long long) x * y;
+    entry->best = entry;
+
+    return entry;
+}
+
+static range_tree_node_t* create_node(pool_t *pool, unsigned int x)
+{
+    range_tree_node_t *node = pool_alloc(pool, sizeof(range_tree_node_t));
+
+    if (NULL == node) {
+        return NULL;
+    }
+
+    node->x = x;
+    node->size = 1;
+
+    node->points = rb_tree_create_in(pool, compare_entries_by_y, NULL);
+    node->branch = rb_tree_create_in(pool, compare_entries, augment_best);
+    if ((NULL == node->points) || (NULL == node->branch)) {
+        pool_free(pool, node->points, sizeof(rb_tree_t));
+        pool_free(pool, node->branch, sizeof(rb_tree_t));
+        pool_free(pool, node, sizeof(range_tree_node_t));
+        return NULL;
+    }
+
+    return node;
+}
+
+static void free_node(pool_t *pool, range_tree_node_t *node)
+{
+    free_secondary(node->points);
+    free_secondary(node->branch);
+    pool_free(pool, node, sizeof(range_tree_node_t));
+}
+
+static void free_branch(pool_t *pool, range_tree_node_t *node)
+{
+    if (NULL == node) {
+        return;
+    }
+
+    free_branch(pool, node->left);
+    free_branch(pool, node->right);
+    free_node(pool, node);
+}
+
+static void free_secondary(rb_tree_t *tree)
+{
+    rb_tree_cursor_t entry;
+
+    /* Only the entries are freed during the walk, the nodes are freed by rb_tree_destroy */
+    rb_tree_cursor_init(&entry, tree);
+    for (rb_tree_cursor_first(&entry); rb_tree_cursor_valid(&entry); rb_tree_cursor_next(&entry)) {
+        pool_free(tree->pool, rb_tree_cursor_key(&entry), sizeof(range_tree_entry_t));
+    }
+    rb_tree_destroy(tree);
+}
+
+static int compare_entries_by_y(void *a, void *b)
+{
+    range_tree_entry_t *entry_a = a;
+    range_tree_entry_t *entry_b = b;
+
+    if (entry_a->y < entry_b->y) {
+        return -1;
+    }
+
+    if (entry_a->y > entry_b->y) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int compare_entries(void *a, void *b)
+{
+    range_tree_entry_t *entry_a = a;
+    range_tree_entry_t *entry_b = b;
+    int compare = compare_entries_by_y(a, b);
+
+    if (0 != compare) {
+        return compare;
+    }
+
+    if (entry_a->x < entry_b->x) {
+        return -1;
+    }
+
+    if (entry_a->x > entry_b->x) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void augment_best(void *key, void *left_key, void *right_key)
+{
+    range_tree_entry_t *entry = key;
+    range_tree_entry_t *left = left_key;
+    range_tree_entry_t *right = right_key;
+
+    entry->best = entry;
+
+    if ((NULL != left) && is_better(left->best, entry->best)) {
+        entry->best = left->best;
+    }
+
+    if ((NULL != right) && is_better(right->best, entry->best)) {
+        entry->best = right->best;
+    }
+}
+
+static bool is_better(range_tree_entry_t *a, range_tree_entry_t *b)
+{
+    if (NULL == a) {
+        return false;
+    }
+
+    if (NULL == b) {
+        return true;
+    }
+
+    return (a->product < b->product) || ((a->product == b->product) && (a->x < b->x));
+}
@@ -0,0 +1,95 @@
+/*
+  range_tree.h - A 2D range tree of (x, y) points, answering dominance queries by minimal x * y.
+  Given a query point (x, y), it finds the point with the minimal product among all the points
+  (px, py) with px >= x and py >= y, in O(log^2 n).
+
+  The primary tree is a scapegoat tree by x (a node per distinct x), so its height is logarithmic
+  without rotations. Every primary node holds two secondary red-black trees:
+    - points - the points with the node's x, by y, holding the reference count of each point.
+    - branch - all the points in the node's entire branch, by y, augmented with the entry of the
+               minimal product in each secondary branch.
+  Each point is therefore kept O(log n) times, which is the memory price of a range tree.
+  When a point's reference count is decreased to 0, it is removed from all of the branch trees.
+  Primary nodes without points are kept until they are the majority, and then the tree is rebuilt.
+ */
+
+#include <stdbool.h>
+
+#include "pool.h"
+#include "rb_tree.h"
+
+#ifndef __RANGE_TREE_H__
+#define __RANGE_TREE_H__
+
+/* A point entry in a secondary tree. */
+typedef struct range_tree_entry_s range_tree_entry_t;
+
+struct range_tree_entry_s {
+    unsigned int y;
+    unsigned int x;
+    unsigned long long product;
+    range_tree_entry_t *best; /* The entry with the minimal product in this entry's secondary branch */
+};
+
+typedef struct range_tree_node_s range_tree_node_t;
+
+struct range_tree_node_s {
+    unsigned int x;
+    unsigned int size;      /* Number of primary nodes in this node's branch (including itself) */
+    range_tree_node_t *parent;
+    range_tree_node_t *left;
+    range_tree_node_t *right;
+    rb_tree_t *points;      /* The points with this node's x (may be empty) */
+    rb_tree_t *branch;      /* All the points in this node's branch */
+};
+
+/* A point with its reference count, for range_tree_build */
+typedef struct range_tree_point_s {
+    unsigned int x;
+    unsigned int y;
+    unsigned int count;
+} range_tree_point_t;
+
+typedef struct range_tree_s {
+    range_tree_node_t *head;
+    unsigned int empty_nodes; /* Number of primary nodes without points */
+    pool_t *pool;             /* The pool of all of the tree's memory, NULL for malloc */
+} range_tree_t;
+
+/* range_tree_create - create an empty range tree, whose memory is allocated from pool (which may be
+   NULL for malloc). If an allocation error occurs, NULL is returned.
+ */
+range_tree_t* range_tree_create(pool_t *pool);
+
+/* range_tree_destroy - free the tree and all of its memory. */
+void range_tree_destroy(range_tree_t *tree);
+
+/* range_tree_insert - insert the point (x, y). If the point already exists, its reference count
+   is increased.
+   Returns false if an allocation fails (in which case the tree is left unchanged), true otherwise.
+ */
+bool range_tree_insert(range_tree_t *tree, unsigned int x, unsigned int y);
+
+/* range_tree_build - fill an empty tree with count points, which must be sorted by x and then by y,
+   without duplicates. The tree is built perfectly balanced in O(n log n), which is much faster than
+   inserting the points one by one.
+   Returns false if an allocation fails, in which case the tree is left empty.
+ */
+bool range_tree_build(range_tree_t *tree, const range_tree_point_t *points, size_t count);
+
+/* range_tree_remove - decrease the reference count of the point (x, y), and remove it when it
+   reaches 0.
+   Returns false if the point doesn't exist, true otherwise.
+ */
+bool range_tree_remove(range_tree_t *tree, unsigned int x, unsigned int y);
+
+/* range_tree_count - returns the number of distinct points in the tree. */
+unsigned int range_tree_count(range_tree_t *tree);
+
+/* range_tree_search_min - search for the point with the minimal x * y among the points that
+   dominate (x, y). Ties are broken by the smaller x.
+   Returns true and fills found_x and found_y if such a point exists, false otherwise.
+ */
+bool range_tree_search_min(range_tree_t *tree, unsigned int x, unsigned int y, unsigned int *found_x, unsigned int *found_y);
+
+#endif /* __RANGE_TREE_H__ */
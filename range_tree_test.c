@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include "pool.h"
+#include "range_tree.h"
+
+#define POINTS (2000)
+#define COORDINATE_RANGE (100)
+
+/* The points that are currently in the tree, with their reference counts */
+static unsigned int point_x[POINTS];
+static unsigned int point_y[POINTS];
+static unsigned int point_count[POINTS];
+
+/* brute_force_min - the expected result of range_tree_search_min */
+static bool brute_force_min(unsigned int x, unsigned int y, unsigned int *found_x, unsigned int *found_y)
+{
+    unsigned long long best = 0;
+    unsigned long long product = 0;
+    bool found = false;
+    unsigned int i = 0;
+
+    for (i = 0; i < POINTS; i++) {
+        if ((point_count[i] == 0) || (point_x[i] < x) || (point_y[i] < y)) {
+            continue;
+        }
+
+        product = (unsigned long long) point_x[i] * point_y[i];
+        if (!found || (product < best) || ((product == best) && (point_x[i] < *found_x))) {
+            best = product;
+            *found_x = point_x[i];
+            *found_y = point_y[i];
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+static void verify_queries(range_tree_t *tree)
+{
+    unsigned int x = 0;
+    unsigned int y = 0;
+    unsigned int found_x = 0;
+    unsigned int found_y = 0;
+    unsigned int expected_x = 0;
+    unsigned int expected_y = 0;
+    unsigned int distinct = 0;
+    unsigned int i = 0;
+    bool found = false;
+
+    for (i = 0; i < POINTS; i++) {
+        distinct += (point_count[i] > 0) ? 1 : 0;
+    }
+    assert(range_tree_count(tree) == distinct);
+
+    for (x = 0; x <= COORDINATE_RANGE; x += 7) {
+        for (y = 0; y <= COORDINATE_RANGE; y += 5) {
+            found = range_tree_search_min(tree, x, y, &found_x, &found_y);
+            assert(found == brute_force_min(x, y, &expected_x, &expected_y));
+            if (found) {
+                assert(found_x == expected_x);
+                assert(found_y == expected_y);
+            }
+        }
+    }
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    const range_tree_point_t *point_a = a;
+    const range_tree_point_t *point_b = b;
+
+    if (point_a->x != point_b->x) {
+        return (point_a->x < point_b->x) ? -1 : 1;
+    }
+    return (point_a->y > point_b->y) - (point_a->y < point_b->y);
+}
+
+/* verify_build - builds another tree out of the current points, which must answer the same */
+static void verify_build(pool_t *pool)
+{
+    static range_tree_point_t points[POINTS];
+    range_tree_t *built = NULL;
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < POINTS; i++) {
+        if (point_count[i] > 0) {
+            points[count].x = point_x[i];
+            points[count].y = point_y[i];
+            points[count++].count = point_count[i];
+        }
+    }
+    qsort(points, count, sizeof(range_tree_point_t), compare_points);
+
+    built = range_tree_create(pool);
+    assert(built);
+    assert(range_tree_build(built, points, count));
+    verify_queries(built);
+
+    /* The reference counts are kept */
+    for (i = 0; i < count; i++) {
+        while (points[i].count-- > 0) {
+            assert(range_tree_remove(built, points[i].x, points[i].y));
+        }
+        assert(!range_tree_remove(built, points[i].x, points[i].y));
+    }
+    assert(NULL == built->head);
+
+    range_tree_destroy(built);
+}
+
+int main(void)
+{
+    range_tree_t *tree = NULL;
+    pool_t *pool = NULL;
+    unsigned int i = 0;
+    unsigned int j = 0;
+
+    srand(18);
+    pool = pool_create();
+    assert(pool);
+    tree = range_tree_create(pool);
+    assert(tree);
+
+    printf("Searching an empty tree...\n");
+    verify_queries(tree);
+
+    printf("Inserting %d points (with duplicates)...\n", POINTS);
+    for (i = 0; i < POINTS; i++) {
+        point_x[i] = rand() % COORDINATE_RANGE + 1;
+        point_y[i] = rand() % COORDINATE_RANGE + 1;
+        /* Keep a single reference count per distinct point */
+        for (j = 0; j < i; j++) {
+            if ((point_x[j] == point_x[i]) && (point_y[j] == point_y[i])) {
+                break;
+            }
+        }
+        assert(range_tree_insert(tree, point_x[i], point_y[i]));
+        point_count[j]++;
+        if (j != i) {
+            point_x[i] = 0;
+            point_y[i] = 0;
+        }
+        if (i % 200 == 0) {
+            verify_queries(tree);
+        }
+    }
+    verify_queries(tree);
+
+    printf("Building a tree out of the points...\n");
+    verify_build(pool);
+
+    printf("Removing a non-existing point...\n");
+    assert(!range_tree_remove(tree, COORDINATE_RANGE + 1, 1));
+
+    printf("Removing points, one instance at a time...\n");
+    for (i = 0; i < POINTS; i++) {
+        if (point_count[i] == 0) {
+            continue;
+        }
+        assert(range_tree_remove(tree, point_x[i], point_y[i]));
+        point_count[i]--;
+        if (i % 100 == 0) {
+            verify_queries(tree);
+        }
+    }
+    verify_queries(tree);
+
+    printf("Emptying tree...\n");
+    for (i = 0; i < POINTS; i++) {
+        while (point_count[i] > 0) {
+            assert(range_tree_remove(tree, point_x[i], point_y[i]));
+            point_count[i]--;
+        }
+    }
+    assert(NULL == tree->head);
+    verify_queries(tree);
+
+    range_tree_destroy(tree);
+    pool_destroy(pool);
+
+    return 0;
+}
@@ -1,8 +1,9 @@
 #include <stdlib.h>
 
+#include "op_stats.h"
 #include "rb_tree.h"
 
-#define IS_NIL(tree, node) (&((tree)->nil) == (node))
+#define IS_NIL(tree, node) RB_TREE_IS_NIL(tree, node)
 
 /* The following static functions are internal to the module. Some of which are regular red-black tree
    operations, but we decided not to expose them to the user, as this is a specific red-black tree which
@@ -12,7 +13,7 @@
 /* rb_tree_search_smallest_node - Search for the node with the smallest key larger than/equal to key.
    If no such key is found (meaning that the tree is empty or that there are no smaller keys),
    NULL is returned. Otherwise, a pointer to the tree node is returned.
-   An internal function to be used by rb_tree_search_smallest.
+   An internal function to be used by rb_tree_search_smallest and rb_tree_cursor_seek.
  */
 static rb_tree_node_t* rb_tree_search_smallest_node(rb_tree_t *tree, rb_tree_node_t *node, void *key);
 
@@ -33,15 +34,36 @@ static void rb_tree_insert_fixup(rb_tree_t *tree, rb_tree_node_t *z);
 static void rb_tree_rotate_left(rb_tree_t *tree, rb_tree_node_t *x);
 static void rb_tree_rotate_right(rb_tree_t *tree, rb_tree_node_t *x);
 
-/* rb_tree_search_from - an exact key search in the tree, starting from the given node.
+/* rb_tree_search_from - an iterative exact key search in the tree, starting from the given node.
    The node containing an equal key is returned, or NULL if not found. */
 static rb_tree_node_t* rb_tree_search_from(rb_tree_t *tree, rb_tree_node_t *node, void *key);
 
+/* rb_tree_build_branch - link nodes[low..high) as a perfectly balanced branch under parent, and
+   return its head. depth is the depth of the branch's head. The nodes in red_depth (the only
+   level that may be incomplete) are red, so that every path has the same number of black nodes.
+ */
+static rb_tree_node_t* rb_tree_build_branch(rb_tree_t *tree, rb_tree_node_t **nodes, size_t low, size_t high, rb_tree_node_t *parent, unsigned int depth, unsigned int red_depth);
+
+/* rb_tree_augment_node - recompute the augmented data of a single node out of its children.
+   The nil sentinel's key is NULL, so a missing child is passed to the user as NULL.
+ */
+static void rb_tree_augment_node(rb_tree_t *tree, rb_tree_node_t *node);
+
 rb_tree_t *rb_tree_create(rb_tree_key_cmp_t key_cmp)
+{
+    return rb_tree_create_augmented(key_cmp, NULL);
+}
+
+rb_tree_t *rb_tree_create_augmented(rb_tree_key_cmp_t key_cmp, rb_tree_augment_t augment)
+{
+    return rb_tree_create_in(NULL, key_cmp, augment);
+}
+
+rb_tree_t *rb_tree_create_in(pool_t *pool, rb_tree_key_cmp_t key_cmp, rb_tree_augment_t augment)
 {
     rb_tree_t *rb_tree = NULL;
 
-    rb_tree = (rb_tree_t *) calloc(sizeof(rb_tree_t), 1);
+    rb_tree = (rb_tree_t *) pool_alloc(pool, sizeof(rb_tree_t));
 
     if (NULL == rb_tree) {
         return rb_tree;
@@ -56,7 +78,10 @@ rb_tree_t *rb_tree_create(rb_tree_key_cmp_t key_cmp)
 
     rb_tree->head = &(rb_tree->nil);
     rb_tree->key_cmp = key_cmp;
+    rb_tree->augment = augment;
+    rb_tree->pool = pool;
 
+    rb_tree->min = &(rb_tree->nil);
     rb_tree->max = &(rb_tree->nil);
     rb_tree->count = 0;
 
@@ -69,6 +94,8 @@ bool rb_tree_insert(rb_tree_t *tree, void *key, bool *exists)
     rb_tree_node_t *x = NULL;
     rb_tree_node_t *y = NULL;
     rb_tree_node_t *z = NULL;
+    bool is_min = true;
+    bool is_max = true;
 
     *exists = false;
 
@@ -81,7 +108,7 @@ bool rb_tree_insert(rb_tree_t *tree, void *key, bool *exists)
     }
 
     /* If the key doesn't exist, we need to allocate a new node for the key, and actually insert it */
-    z = (rb_tree_node_t *) calloc(sizeof(rb_tree_node_t), 1);
+    z = (rb_tree_node_t *) pool_alloc(tree->pool, sizeof(rb_tree_node_t));
     if (NULL == z) {
         return false;
     }
@@ -91,13 +118,17 @@ bool rb_tree_insert(rb_tree_t *tree, void *key, bool *exists)
     y = &(tree->nil);
     x = tree->head;
 
+    /* The new key is the tree's min/max only if the descent never turns right/left */
     while (!IS_NIL(tree, x)) {
         y = x;
+        OP_STATS_COUNT(comparisons);
         /* z->key < x->key */
         if (tree->key_cmp(z->key, x->key) < 0) {
             x = x->left;
+            is_max = false;
         } else {
             x = x->right;
+            is_min = false;
         }
     }
 
@@ -105,6 +136,7 @@ bool rb_tree_insert(rb_tree_t *tree, void *key, bool *exists)
     if (IS_NIL(tree, y)) {
         tree->head = z;
     } else {
+        OP_STATS_COUNT(comparisons);
         /* z->key < y->key */
         if (tree->key_cmp(z->key, y->key) < 0) {
             y->left = z;
@@ -115,11 +147,21 @@ bool rb_tree_insert(rb_tree_t *tree, void *key, bool *exists)
     z->left = &(tree->nil);
     z->right = &(tree->nil);
     z->color = RED;
+
+    /* The new key is a part of the subtree of all of its ancestors. The fixup's rotations keep the
+       augmented data up to date by themselves. */
+    rb_tree_augment_update(tree, z);
     rb_tree_insert_fixup(tree, z);
 
-    /* In this case, a unique key is add to the tree */
+    /* In this case, a unique key is add to the tree. The fixup only relinks nodes, so the min &
+       max nodes still hold the same keys. */
     tree->count++;
-    tree->max = rb_tree_find_max(tree);
+    if (is_min) {
+        tree->min = z;
+    }
+    if (is_max) {
+        tree->max = z;
+    }
 
     return true;
 }
@@ -143,11 +185,72 @@ bool rb_tree_remove(rb_tree_t *tree, void *key, void **deleted)
         rb_tree_delete(tree, node);
     }
 
-    tree->max = rb_tree_find_max(tree);
+    return true;
+}
+
+bool rb_tree_build_sorted(rb_tree_t *tree, void **keys, unsigned int *counts, size_t count)
+{
+    rb_tree_node_t **nodes = NULL;
+    unsigned int red_depth = 0;
+    size_t i = 0;
+
+    if (count == 0) {
+        return true;
+    }
+
+    nodes = malloc(count * sizeof(rb_tree_node_t *));
+    if (NULL == nodes) {
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        nodes[i] = (rb_tree_node_t *) pool_alloc(tree->pool, sizeof(rb_tree_node_t));
+        if (NULL == nodes[i]) {
+            while (i > 0) {
+                pool_free(tree->pool, nodes[--i], sizeof(rb_tree_node_t));
+            }
+            free(nodes);
+            return false;
+        }
+        nodes[i]->key = keys[i];
+        nodes[i]->count = (NULL == counts) ? 1 : counts[i];
+    }
+
+    /* The levels above floor(log2(count + 1)) are complete */
+    while (((size_t) 2 << red_depth) <= count + 1) {
+        red_depth++;
+    }
+
+    tree->head = rb_tree_build_branch(tree, nodes, 0, count, &(tree->nil), 0, red_depth);
+    tree->min = nodes[0];
+    tree->max = nodes[count - 1];
+    tree->count = count;
 
+    free(nodes);
     return true;
 }
 
+static rb_tree_node_t* rb_tree_build_branch(rb_tree_t *tree, rb_tree_node_t **nodes, size_t low, size_t high, rb_tree_node_t *parent, unsigned int depth, unsigned int red_depth)
+{
+    size_t middle = low + (high - low) / 2;
+    rb_tree_node_t *node = NULL;
+
+    if (low >= high) {
+        return &(tree->nil);
+    }
+
+    node = nodes[middle];
+    node->parent = parent;
+    node->color = (depth == red_depth) ? RED : BLACK;
+    node->left = rb_tree_build_branch(tree, nodes, low, middle, node, depth + 1, red_depth);
+    node->right = rb_tree_build_branch(tree, nodes, middle + 1, high, node, depth + 1, red_depth);
+
+    /* The children are complete, so the augmented data is computed bottom-up */
+    rb_tree_augment_node(tree, node);
+
+    return node;
+}
+
 rb_tree_node_t* rb_tree_search_smallest(rb_tree_t *tree, void *key)
 {
     rb_tree_node_t *node = rb_tree_search_smallest_node(tree, tree->head, key);
@@ -161,19 +264,83 @@ rb_tree_node_t* rb_tree_search_smallest(rb_tree_t *tree, void *key)
 
 void rb_tree_in_order(rb_tree_t *tree, rb_tree_node_t *node, void (*callback)(rb_tree_t *tree, rb_tree_node_t *node))
 {
+    rb_tree_node_t *last = node;
+    rb_tree_node_t *next = NULL;
+
     if (IS_NIL(tree, node)) {
         return;
     }
 
-    if (!IS_NIL(tree, node->left)) {
-        rb_tree_in_order(tree, node->left, callback);
+    /* Walk from the subtree's leftmost node to its rightmost one through successors, without
+       recursion. The successor is found before the callback, which may free the node's key. */
+    while (!IS_NIL(tree, last->right)) {
+        last = last->right;
+    }
+    while (!IS_NIL(tree, node->left)) {
+        node = node->left;
+    }
+
+    while (node != last) {
+        next = rb_tree_successor(tree, node);
+        callback(tree, node);
+        node = next;
+    }
+    callback(tree, last);
+}
+
+void rb_tree_destroy(rb_tree_t *tree)
+{
+    rb_tree_node_t *node = tree->head;
+    rb_tree_node_t *parent = NULL;
+
+    /* Free the nodes bottom-up, without recursion: descend to a leaf, free it and detach it from
+       its parent, then continue from the parent. */
+    while (!IS_NIL(tree, node)) {
+        if (!IS_NIL(tree, node->left)) {
+            node = node->left;
+        } else if (!IS_NIL(tree, node->right)) {
+            node = node->right;
+        } else {
+            parent = node->parent;
+            if (!IS_NIL(tree, parent)) {
+                if (parent->left == node) {
+                    parent->left = &(tree->nil);
+                } else {
+                    parent->right = &(tree->nil);
+                }
+            }
+            pool_free(tree->pool, node, sizeof(rb_tree_node_t));
+            node = parent;
+        }
+    }
+
+    pool_free(tree->pool, tree, sizeof(rb_tree_t));
+}
+
+rb_tree_node_t* rb_tree_search_node(rb_tree_t *tree, void *key)
+{
+    return rb_tree_search_from(tree, tree->head, key);
+}
+
+void rb_tree_augment_update(rb_tree_t *tree, rb_tree_node_t *node)
+{
+    if (NULL == tree->augment) {
+        return;
     }
 
-    callback(tree, node);
+    while (!IS_NIL(tree, node)) {
+        rb_tree_augment_node(tree, node);
+        node = node->parent;
+    }
+}
 
-    if (!IS_NIL(tree, node->right)) {
-        rb_tree_in_order(tree, node->right, callback);
+static void rb_tree_augment_node(rb_tree_t *tree, rb_tree_node_t *node)
+{
+    if ((NULL == tree->augment) || IS_NIL(tree, node)) {
+        return;
     }
+
+    tree->augment(node->key, node->left->key, node->right->key);
 }
 
 void* rb_tree_search(rb_tree_t *tree, void *key)
@@ -192,41 +359,26 @@ static rb_tree_node_t* rb_tree_search_smallest_node(rb_tree_t *tree, rb_tree_nod
     rb_tree_node_t *found = NULL;
     int compare = 0;
 
-    if (IS_NIL(tree, node)) {
-        return NULL;
-    }
-
-    compare = tree->key_cmp(key, node->key);
+    while (!IS_NIL(tree, node)) {
+        OP_STATS_COUNT(comparisons);
+        compare = tree->key_cmp(key, node->key);
 
-    /* key == node->key */
-    if (compare == 0) {
-        return node;
-    }
-
-    /* key < node->key */
-    if (compare < 0) {
-        if (IS_NIL(tree, node->left)) {
+        /* key == node->key */
+        if (compare == 0) {
             return node;
         }
-        found = rb_tree_search_smallest_node(tree, node->left, key);
 
-        /* If no smaller key than the current key was found, and the current key is greater than the
-           given key, return the current key.
-         */
-        if (NULL == found) {
-            return node;
+        if (compare < 0) {
+            /* key < node->key - the node is a candidate, but there may be a smaller one on its left */
+            found = node;
+            node = node->left;
         } else {
-            return found;
-        }
-    } else {
-        /* key > node->key */
-        if (IS_NIL(tree, node->right)) {
-            /* The searched key is too large, and there are no more nodes to search for,
-               so we have to return NULL */
-            return NULL;
+            /* key > node->key - the node and its entire left branch are too small */
+            node = node->right;
         }
-        return rb_tree_search_smallest_node(tree, node->right, key);
     }
+
+    return found;
 }
 
 static void rb_tree_delete(rb_tree_t *tree, rb_tree_node_t *z)
@@ -234,6 +386,15 @@ static void rb_tree_delete(rb_tree_t *tree, rb_tree_node_t *z)
     rb_tree_node_t *y = NULL;
     rb_tree_node_t *x = NULL;
 
+    /* The min (max) node has no left (right) child, so it is spliced out by itself, and the new
+       min (max) is its only child, which must be a red leaf, or else its parent. */
+    if (z == tree->min) {
+        tree->min = IS_NIL(tree, z->right) ? z->parent : z->right;
+    }
+    if (z == tree->max) {
+        tree->max = IS_NIL(tree, z->left) ? z->parent : z->left;
+    }
+
     if (IS_NIL(tree, z->left) || IS_NIL(tree, z->right)) {
         y = z;
     } else {
@@ -265,13 +426,22 @@ static void rb_tree_delete(rb_tree_t *tree, rb_tree_node_t *z)
         /* z->color = y->color; */
         z->key = y->key;
         z->count = y->count;
+
+        /* The successor's key has moved to z (it can't be the min, which is smaller than z) */
+        if (y == tree->max) {
+            tree->max = z;
+        }
     }
 
+    /* y was spliced out, so all of its former ancestors (including z, whose key has been replaced)
+       have to be recomputed. */
+    rb_tree_augment_update(tree, x->parent);
+
     if (y->color == BLACK) {
         rb_tree_delete_fixup(tree, x);
     }
 
-    free(y);
+    pool_free(tree->pool, y, sizeof(rb_tree_node_t));
 }
 
 static void rb_tree_delete_fixup(rb_tree_t *tree, rb_tree_node_t *x)
@@ -386,6 +556,7 @@ static void rb_tree_rotate_left(rb_tree_t *tree, rb_tree_node_t *x)
 {
     rb_tree_node_t *y = NULL;
 
+    OP_STATS_COUNT(rotations);
     y = x->right;
     x->right = y->left;
 
@@ -407,6 +578,10 @@ static void rb_tree_rotate_left(rb_tree_t *tree, rb_tree_node_t *x)
 
     y->left = x;
     x->parent = y;
+
+    /* x is now y's child, so it must be recomputed first */
+    rb_tree_augment_node(tree, x);
+    rb_tree_augment_node(tree, y);
 }
 
 /* rb_tree_rotate_right - a left rotate implementation as shown in the book  */
@@ -414,6 +589,7 @@ static void rb_tree_rotate_right(rb_tree_t *tree, rb_tree_node_t *x)
 {
     rb_tree_node_t *y = NULL;
 
+    OP_STATS_COUNT(rotations);
     y = x->left;
     x->left = y->right;
 
@@ -435,6 +611,10 @@ static void rb_tree_rotate_right(rb_tree_t *tree, rb_tree_node_t *x)
 
     y->right = x;
     x->parent = y;
+
+    /* x is now y's child, so it must be recomputed first */
+    rb_tree_augment_node(tree, x);
+    rb_tree_augment_node(tree, y);
 }
 
 rb_tree_node_t* rb_tree_find_max(rb_tree_t *tree)
@@ -451,13 +631,51 @@ rb_tree_node_t* rb_tree_find_max(rb_tree_t *tree)
     return node;
 }
 
+rb_tree_node_t* rb_tree_predecessor(rb_tree_t *tree, rb_tree_node_t *node)
+{
+    rb_tree_node_t *y = NULL;
+
+    y = node->left;
+    if (!IS_NIL(tree, y)) {
+        while (!IS_NIL(tree, y->right)) {
+            y = y->right;
+        }
+
+        return y;
+    } else {
+        y = node->parent;
+        while (node == y->left) {
+            node = y;
+            y = y->parent;
+        }
+
+        return IS_NIL(tree, y) ? NULL : y;
+    }
+}
+
+rb_tree_node_t* rb_tree_find_min(rb_tree_t *tree)
+{
+    rb_tree_node_t *node = tree->head;
+
+    if (IS_NIL(tree, node)){
+        return node;
+    }
+
+    while (!IS_NIL(tree, node->left)){
+        node = node->left;
+    }
+    return node;
+}
+
 rb_tree_node_t* rb_tree_successor(rb_tree_t *tree, rb_tree_node_t *node)
 {
     rb_tree_node_t *y = NULL;
 
+    OP_STATS_COUNT(successor_steps);
     y = node->right;
     if (!IS_NIL(tree, y)) {
         while (!IS_NIL(tree, y->left)) {
+            OP_STATS_COUNT(successor_steps);
             y = y->left;
         }
 
@@ -465,6 +683,7 @@ rb_tree_node_t* rb_tree_successor(rb_tree_t *tree, rb_tree_node_t *node)
     } else {
         y = node->parent;
         while (node == y->right) {
+            OP_STATS_COUNT(successor_steps);
             node = y;
             y = y->parent;
         }
@@ -477,20 +696,117 @@ static rb_tree_node_t* rb_tree_search_from(rb_tree_t *tree, rb_tree_node_t *node
 {
     int compare = 0;
 
-    if (IS_NIL(tree, node)) {
-        return NULL;
+    while (!IS_NIL(tree, node)) {
+        OP_STATS_COUNT(comparisons);
+        compare = tree->key_cmp(key, node->key);
+
+        if (0 == compare) {
+            return node;
+        }
+
+        /* If key isn't smaller, it must be greater than node's key */
+        node = (compare < 0) ? node->left : node->right;
     }
 
-    compare = tree->key_cmp(key, node->key);
+    return NULL;
+}
 
-    if (0 == compare) {
-        return node;
+void rb_tree_shape(rb_tree_t *tree, size_t key_size, rb_tree_shape_t *shape)
+{
+    rb_tree_node_t *node = tree->head;
+    rb_tree_node_t *previous = &(tree->nil);
+    rb_tree_node_t *next = NULL;
+    unsigned int depth = 1;
+
+    shape->nodes = 0;
+    shape->height = 0;
+    shape->black_height = 0;
+
+    /* Walk around the tree without a stack: a node is reached from its parent (counting it, and
+       continuing to its left child), then from its left child (continuing to its right child), and
+       then from its right child (returning to its parent). A missing child is skipped. */
+    while (!IS_NIL(tree, node)) {
+        if (previous == node->parent) {
+            shape->nodes++;
+            if (depth > shape->height) {
+                shape->height = depth;
+            }
+        }
+
+        if ((previous == node->parent) && !IS_NIL(tree, node->left)) {
+            next = node->left;
+        } else if ((previous != node->right) && !IS_NIL(tree, node->right)) {
+            next = node->right;
+        } else {
+            next = node->parent;
+        }
+
+        depth = (next == node->parent) ? depth - 1 : depth + 1;
+        previous = node;
+        node = next;
     }
 
-    if (compare < 0) {
-        return rb_tree_search_from(tree, node->left, key);
-    } else {
-        /* key must be greater than node's key */
-        return rb_tree_search_from(tree, node->right, key);
+    /* All of the paths have the same number of black nodes */
+    for (node = tree->head; !IS_NIL(tree, node); node = node->left) {
+        shape->black_height += (node->color == BLACK) ? 1 : 0;
     }
+
+    shape->node_bytes = shape->nodes * sizeof(rb_tree_node_t);
+    shape->key_bytes = shape->nodes * key_size;
+    shape->header_bytes = sizeof(rb_tree_t);
+}
+
+void rb_tree_cursor_init(rb_tree_cursor_t *cursor, rb_tree_t *tree)
+{
+    cursor->tree = tree;
+    cursor->node = NULL;
+}
+
+bool rb_tree_cursor_first(rb_tree_cursor_t *cursor)
+{
+    cursor->node = IS_NIL(cursor->tree, cursor->tree->min) ? NULL : cursor->tree->min;
+    return (NULL != cursor->node);
+}
+
+bool rb_tree_cursor_last(rb_tree_cursor_t *cursor)
+{
+    cursor->node = IS_NIL(cursor->tree, cursor->tree->max) ? NULL : cursor->tree->max;
+    return (NULL != cursor->node);
+}
+
+bool rb_tree_cursor_seek(rb_tree_cursor_t *cursor, void *key)
+{
+    cursor->node = rb_tree_search_smallest_node(cursor->tree, cursor->tree->head, key);
+    return (NULL != cursor->node);
+}
+
+bool rb_tree_cursor_next(rb_tree_cursor_t *cursor)
+{
+    if (NULL != cursor->node) {
+        cursor->node = rb_tree_successor(cursor->tree, cursor->node);
+    }
+    return (NULL != cursor->node);
+}
+
+bool rb_tree_cursor_prev(rb_tree_cursor_t *cursor)
+{
+    if (NULL != cursor->node) {
+        cursor->node = rb_tree_predecessor(cursor->tree, cursor->node);
+    }
+    return (NULL != cursor->node);
+}
+
+bool rb_tree_cursor_valid(rb_tree_cursor_t *cursor)
+{
+    return (NULL != cursor->node);
+}
+
+void* rb_tree_cursor_key(rb_tree_cursor_t *cursor)
+{
+    return (NULL == cursor->node) ? NULL : cursor->node->key;
+}
+
+unsigned int rb_tree_cursor_count(rb_tree_cursor_t *cursor)
+{
+    return (NULL == cursor->node) ? 0 : cursor->node->count;
 }
@@ -5,6 +5,9 @@
 */
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "pool.h"
 
 #ifndef __RB_TREE_H__
 #define __RB_TREE_H__
@@ -16,6 +19,13 @@
  */
 typedef int (* rb_tree_key_cmp_t)(void *a, void *b);
 
+/* Augmentation function - recomputes the augmented data that the user keeps inside key, out of the
+   key itself and the keys of its left and right children (NULL if the child does not exist).
+   The tree calls it bottom-up on every node whose subtree changes (insertion, deletion & rotations),
+   so that each key may hold information about its entire subtree (for example, the subtree max).
+ */
+typedef void (* rb_tree_augment_t)(void *key, void *left_key, void *right_key);
+
 typedef struct rb_tree_node_s rb_tree_node_t;
 
 typedef enum rb_tree_color_s {
@@ -34,12 +44,35 @@ struct rb_tree_node_s {
 
 typedef struct rb_tree_s {
     rb_tree_node_t *head;
-    rb_tree_node_t *max;
+    rb_tree_node_t *min;       /* The nodes of the min & max keys (nil if the tree is empty), */
+    rb_tree_node_t *max;       /* maintained in O(1) by insertions and deletions */
     unsigned int count;
     rb_tree_node_t nil;
     rb_tree_key_cmp_t key_cmp;
+    rb_tree_augment_t augment; /* NULL if the tree is not augmented */
+    pool_t *pool;              /* The pool of the tree and its nodes, NULL for malloc */
 } rb_tree_t;
 
+/* A position in the tree, see rb_tree_cursor_init. */
+typedef struct rb_tree_cursor_s {
+    rb_tree_t *tree;
+    rb_tree_node_t *node; /* NULL if the cursor isn't on a key */
+} rb_tree_cursor_t;
+
+/* The shape and memory footprint of a tree, see rb_tree_shape */
+typedef struct rb_tree_shape_s {
+    size_t nodes;              /* Number of nodes (distinct keys) */
+    unsigned int height;       /* Number of nodes on the longest path down from the head */
+    unsigned int black_height; /* Number of black nodes on every path down from the head */
+    size_t node_bytes;         /* The nodes */
+    size_t key_bytes;          /* The keys that the nodes point at (inline keys are in node_bytes) */
+    size_t header_bytes;       /* The tree structure, including its nil sentinel */
+} rb_tree_shape_t;
+
+/* RB_TREE_IS_NIL - check whether a node is the tree's sentinel, for users that descend the tree by
+   themselves (e.g. according to augmented data). */
+#define RB_TREE_IS_NIL(tree, node) (&((tree)->nil) == (node))
+
 /* rb_tree_create - Create an RB tree instance.
    Paramteres:
      - key_cmp - A function for comparison between the keys.
@@ -48,6 +81,22 @@ typedef struct rb_tree_s {
  */
 rb_tree_t *rb_tree_create(rb_tree_key_cmp_t key_cmp);
 
+/* rb_tree_create_augmented - Create an augmented RB tree instance.
+   Same as rb_tree_create, but augment is called to maintain the augmented data of the keys
+   (see rb_tree_augment_t).
+ */
+rb_tree_t *rb_tree_create_augmented(rb_tree_key_cmp_t key_cmp, rb_tree_augment_t augment);
+
+/* rb_tree_create_in - Create an RB tree instance, whose memory (including its nodes) is allocated
+   from pool. augment may be NULL for a tree that is not augmented.
+ */
+rb_tree_t *rb_tree_create_in(pool_t *pool, rb_tree_key_cmp_t key_cmp, rb_tree_augment_t augment);
+
+/* rb_tree_destroy - free the tree and all of its nodes. The keys are not freed; the user may free
+   them beforehand with rb_tree_in_order.
+ */
+void rb_tree_destroy(rb_tree_t *tree);
+
 /* rb_tre_insert - Inserts a key to the tree.
    If the key already exists, its reference count is increased, and exists would be true,
    so that one would know wether to free or not the key.
@@ -65,6 +114,13 @@ bool rb_tree_insert(rb_tree_t *tree, void *key, bool *exists);
  */
 bool rb_tree_remove(rb_tree_t *tree, void *key, void **deleted);
 
+/* rb_tree_build_sorted - fill an empty tree with count keys, which must be sorted in ascending order
+   and distinct. The tree is built perfectly balanced in O(count), instead of count insertions.
+   counts holds the reference count of each key, or is NULL for a count of 1 each.
+   Returns false if an allocation fails, in which case the tree is left empty.
+ */
+bool rb_tree_build_sorted(rb_tree_t *tree, void **keys, unsigned int *counts, size_t count);
+
 /* rb_tree_fetch_smallest - Search for the smallest key that is larger than or equal to the given key.
    If there's no key larger than or equal to the key, NULL is returned.
    If an allocation error occurs, NULL is returned.
@@ -72,18 +128,67 @@ bool rb_tree_remove(rb_tree_t *tree, void *key, void **deleted);
 rb_tree_node_t* rb_tree_search_smallest(rb_tree_t *tree, void *key);
 
 /* rb_tree_in_order - scan the tree in order and call callback for each node, starting from the given node.
-   In order to scan the entire tree, pass tree->head in node.
+   In order to scan the entire tree, pass tree->head in node. The scan isn't recursive, and the
+   callback may free the node's key (but must not change the tree).
  */
 void rb_tree_in_order(rb_tree_t *tree, rb_tree_node_t *node, void (*callback)(rb_tree_t *tree, rb_tree_node_t *node));
 
-/* rb_tree_find_max - returns the max node in the tree. */
+/* rb_tree_find_max, rb_tree_find_min - returns the max/min node in the tree (nil if it is empty),
+   by walking down the tree. tree->max and tree->min are the same, without the walk. */
 rb_tree_node_t* rb_tree_find_max(rb_tree_t *tree);
+rb_tree_node_t* rb_tree_find_min(rb_tree_t *tree);
 
 /* rb_tree_search - an exact key search in the tree. An equal key in the tree is returned
    or NULL if not found. */
 void* rb_tree_search(rb_tree_t *tree, void *key);
 
+/* rb_tree_search_node - an exact key search in the tree. The node holding an equal key is returned
+   or NULL if not found. */
+rb_tree_node_t* rb_tree_search_node(rb_tree_t *tree, void *key);
+
+/* rb_tree_augment_update - recompute the augmented data from node up to the head of the tree.
+   Should be called by the user whenever data that the augmentation depends on is changed inside
+   the key of node. Does nothing if the tree is not augmented.
+ */
+void rb_tree_augment_update(rb_tree_t *tree, rb_tree_node_t *node);
+
 /* rb_tree_successor - get the successor in the tree for node. Based on the book's implementation. */
 rb_tree_node_t* rb_tree_successor(rb_tree_t *tree, rb_tree_node_t *node);
 
+/* rb_tree_predecessor - get the predecessor in the tree for node, or NULL for the min node. */
+rb_tree_node_t* rb_tree_predecessor(rb_tree_t *tree, rb_tree_node_t *node);
+
+/* rb_tree_shape - measure the tree's shape and memory footprint into shape, where each key takes
+   key_size bytes. Walks the entire tree without recursion, in O(n).
+ */
+void rb_tree_shape(rb_tree_t *tree, size_t key_size, rb_tree_shape_t *shape);
+
+/* rb_tree_cursor_init - initialize a cursor over tree, which isn't on any key yet.
+   A cursor walks the keys in order, from node to node, instead of a callback scan by rb_tree_in_order.
+   It stays valid across insertions, but a removal of a key may move keys between nodes, so the
+   cursor must be positioned again after one.
+ */
+void rb_tree_cursor_init(rb_tree_cursor_t *cursor, rb_tree_t *tree);
+
+/* rb_tree_cursor_first, rb_tree_cursor_last - position the cursor on the min/max key, in O(1).
+   rb_tree_cursor_seek - position the cursor on the smallest key that is larger than or equal to key.
+   rb_tree_cursor_next, rb_tree_cursor_prev - move the cursor to the next/previous key.
+   All of them return true if the cursor is on a key, and false if there's no such key, in which case
+   the cursor is no longer on any key (and would stay so on next/prev).
+ */
+bool rb_tree_cursor_first(rb_tree_cursor_t *cursor);
+bool rb_tree_cursor_last(rb_tree_cursor_t *cursor);
+bool rb_tree_cursor_seek(rb_tree_cursor_t *cursor, void *key);
+bool rb_tree_cursor_next(rb_tree_cursor_t *cursor);
+bool rb_tree_cursor_prev(rb_tree_cursor_t *cursor);
+
+/* rb_tree_cursor_valid - returns true if the cursor is on a key. */
+bool rb_tree_cursor_valid(rb_tree_cursor_t *cursor);
+
+/* rb_tree_cursor_key, rb_tree_cursor_count - the key that the cursor is on and its reference count,
+   or NULL/0 if the cursor isn't on a key.
+ */
+void* rb_tree_cursor_key(rb_tree_cursor_t *cursor);
+unsigned int rb_tree_cursor_count(rb_tree_cursor_t *cursor);
+
 #endif /* __RB_TREE_H__ */
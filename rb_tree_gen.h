@@ -0,0 +1,644 @@
+/*
+  rb_tree_gen.h - A type-specialized Red-Black tree, generated by macros.
+  This is the same refcounted red-black tree as rb_tree.h, but the key is stored inline in the node
+  and compared with the < and == operators, so key_type must be a scalar type (such as unsigned int).
+  The comparisons are inlined instead of going through a key_cmp function pointer and a key pointer.
+
+  Usage:
+    RB_TREE_TYPES(name, key_type, node_fields) - defines name_t and name_node_t. node_fields are
+      extra members of each node (e.g. a value or augmented data), and may be empty.
+    RB_TREE_FUNCTIONS(name, key_type, augment) - defines the tree's functions as static inline.
+      augment(tree, node) must recompute the augmented data of node (which is never nil) out of its
+      children, or RB_TREE_NO_AUGMENT for a tree that is not augmented. It is called bottom-up on
+      every node whose subtree changes (insertion, deletion & rotations).
+
+  Functions (all prefixed by name_):
+    init, create, clear, destroy, is_nil, search, search_smallest, successor, find_max,
+    create_node, insert_node, insert, build, delete_node, remove, augment_update, shape.
+  Unlike rb_tree.h, nodes are never moved between keys: a node stays valid until its key is
+  deleted, so the user may hold on to the nodes it found.
+ */
+
+#include <stdbool.h>
+
+#include "op_stats.h"
+#include "pool.h"
+#include "rb_tree.h"
+
+#ifndef __RB_TREE_GEN_H__
+#define __RB_TREE_GEN_H__
+
+#define RB_TREE_NO_AUGMENT(tree, node)
+
+#define RB_TREE_TYPES(name, key_type, node_fields)                                              \
+typedef struct name##_node_s name##_node_t;                                                     \
+                                                                                                \
+struct name##_node_s {                                                                          \
+    key_type key;                                                                               \
+    unsigned int count;                                                                         \
+    name##_node_t *parent;                                                                      \
+    name##_node_t *left;                                                                        \
+    name##_node_t *right;                                                                       \
+    rb_tree_color_t color;                                                                      \
+    node_fields                                                                                 \
+};                                                                                              \
+                                                                                                \
+typedef struct name##_s {                                                                       \
+    name##_node_t *head;                                                                        \
+    name##_node_t *min;        /* The nodes of the min & max keys (nil if the tree is empty) */ \
+    name##_node_t *max;                                                                         \
+    unsigned int count;                                                                         \
+    name##_node_t nil;                                                                          \
+    pool_t *pool;              /* The pool of the tree and its nodes, NULL for malloc */        \
+} name##_t;
+
+#define RB_TREE_FUNCTIONS(name, key_type, augment)                                              \
+                                                                                                \
+static inline bool name##_is_nil(name##_t *tree, name##_node_t *node)                           \
+{                                                                                               \
+    return &(tree->nil) == node;                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_init - initialize an empty tree in place, whose nodes would be allocated from pool      \
+   (NULL for malloc). This allows embedding a tree in another structure, as long as it is not   \
+   moved while it has nodes. */                                                                 \
+static inline void name##_init(name##_t *tree, pool_t *pool)                                    \
+{                                                                                               \
+    tree->nil.color = BLACK;                                                                    \
+    tree->nil.parent = &(tree->nil);                                                            \
+    tree->nil.left = &(tree->nil);                                                              \
+    tree->nil.right = &(tree->nil);                                                             \
+    tree->head = &(tree->nil);                                                                  \
+    tree->min = &(tree->nil);                                                                   \
+    tree->max = &(tree->nil);                                                                   \
+    tree->count = 0;                                                                            \
+    tree->pool = pool;                                                                          \
+}                                                                                               \
+                                                                                                \
+/* name_create - create an empty tree in pool (NULL for malloc). Returns NULL on an allocation  \
+   failure. */                                                                                  \
+static inline name##_t* name##_create(pool_t *pool)                                             \
+{                                                                                               \
+    name##_t *tree = pool_alloc(pool, sizeof(name##_t));                                        \
+                                                                                                \
+    if (NULL == tree) {                                                                         \
+        return NULL;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    name##_init(tree, pool);                                                                    \
+    return tree;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_clear - free all of the nodes of the tree, bottom-up and without recursion, leaving it  \
+   empty. */                                                                                    \
+static inline void name##_clear(name##_t *tree)                                                 \
+{                                                                                               \
+    name##_node_t *node = tree->head;                                                           \
+    name##_node_t *parent = NULL;                                                               \
+                                                                                                \
+    while (!name##_is_nil(tree, node)) {                                                        \
+        if (!name##_is_nil(tree, node->left)) {                                                 \
+            node = node->left;                                                                  \
+        } else if (!name##_is_nil(tree, node->right)) {                                         \
+            node = node->right;                                                                 \
+        } else {                                                                                \
+            parent = node->parent;                                                              \
+            if (!name##_is_nil(tree, parent)) {                                                 \
+                if (parent->left == node) {                                                     \
+                    parent->left = &(tree->nil);                                                \
+                } else {                                                                        \
+                    parent->right = &(tree->nil);                                               \
+                }                                                                               \
+            }                                                                                   \
+            pool_free(tree->pool, node, sizeof(name##_node_t));                                 \
+            node = parent;                                                                      \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    name##_init(tree, tree->pool);                                                              \
+}                                                                                               \
+                                                                                                \
+/* name_destroy - free the tree and all of its nodes. */                                        \
+static inline void name##_destroy(name##_t *tree)                                               \
+{                                                                                               \
+    name##_clear(tree);                                                                         \
+    pool_free(tree->pool, tree, sizeof(name##_t));                                              \
+}                                                                                               \
+                                                                                                \
+/* name_search - an exact key search. Returns the node of the key, or NULL if not found. */     \
+static inline name##_node_t* name##_search(name##_t *tree, key_type key)                        \
+{                                                                                               \
+    name##_node_t *node = tree->head;                                                           \
+                                                                                                \
+    while (!name##_is_nil(tree, node)) {                                                        \
+        OP_STATS_COUNT(comparisons);                                                            \
+        if (key == node->key) {                                                                 \
+            return node;                                                                        \
+        }                                                                                       \
+        node = (key < node->key) ? node->left : node->right;                                    \
+    }                                                                                           \
+                                                                                                \
+    return NULL;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_search_smallest - search for the node with the smallest key larger than/equal to key.   \
+   Returns NULL if there's no such key. */                                                      \
+static inline name##_node_t* name##_search_smallest(name##_t *tree, key_type key)               \
+{                                                                                               \
+    name##_node_t *node = tree->head;                                                           \
+    name##_node_t *found = NULL;                                                                \
+                                                                                                \
+    while (!name##_is_nil(tree, node)) {                                                        \
+        OP_STATS_COUNT(comparisons);                                                            \
+        if (key == node->key) {                                                                 \
+            return node;                                                                        \
+        }                                                                                       \
+        if (key < node->key) {                                                                  \
+            /* This node is a candidate, but there might be a smaller one to its left */        \
+            found = node;                                                                       \
+            node = node->left;                                                                  \
+        } else {                                                                                \
+            node = node->right;                                                                 \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    return found;                                                                               \
+}                                                                                               \
+                                                                                                \
+/* name_successor - the node of the next key, or NULL if node holds the max key. */             \
+static inline name##_node_t* name##_successor(name##_t *tree, name##_node_t *node)              \
+{                                                                                               \
+    name##_node_t *y = node->right;                                                             \
+                                                                                                \
+    OP_STATS_COUNT(successor_steps);                                                            \
+    if (!name##_is_nil(tree, y)) {                                                              \
+        while (!name##_is_nil(tree, y->left)) {                                                 \
+            OP_STATS_COUNT(successor_steps);                                                    \
+            y = y->left;                                                                        \
+        }                                                                                       \
+        return y;                                                                               \
+    }                                                                                           \
+                                                                                                \
+    y = node->parent;                                                                           \
+    while (!name##_is_nil(tree, y) && (node == y->right)) {                                     \
+        OP_STATS_COUNT(successor_steps);                                                        \
+        node = y;                                                                               \
+        y = y->parent;                                                                          \
+    }                                                                                           \
+                                                                                                \
+    return name##_is_nil(tree, y) ? NULL : y;                                                   \
+}                                                                                               \
+                                                                                                \
+/* name_find_max - returns the max node in the tree (nil if the tree is empty), by walking down \
+   the tree. tree->max is the same, without the walk. */                                        \
+static inline name##_node_t* name##_find_max(name##_t *tree)                                    \
+{                                                                                               \
+    name##_node_t *node = tree->head;                                                           \
+                                                                                                \
+    if (name##_is_nil(tree, node)) {                                                            \
+        return node;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    while (!name##_is_nil(tree, node->right)) {                                                 \
+        node = node->right;                                                                     \
+    }                                                                                           \
+    return node;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_augment_update - recompute the augmented data from node up to the head of the tree.     \
+   Should be called whenever data that the augmentation depends on is changed inside node. */   \
+static inline void name##_augment_update(name##_t *tree, name##_node_t *node)                   \
+{                                                                                               \
+    while (!name##_is_nil(tree, node)) {                                                        \
+        augment(tree, node);                                                                    \
+        node = node->parent;                                                                    \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+static inline void name##_rotate_left(name##_t *tree, name##_node_t *x)                         \
+{                                                                                               \
+    name##_node_t *y = x->right;                                                                \
+                                                                                                \
+    OP_STATS_COUNT(rotations);                                                                  \
+    x->right = y->left;                                                                         \
+    if (!name##_is_nil(tree, y->left)) {                                                        \
+        y->left->parent = x;                                                                    \
+    }                                                                                           \
+                                                                                                \
+    y->parent = x->parent;                                                                      \
+    if (name##_is_nil(tree, x->parent)) {                                                       \
+        tree->head = y;                                                                         \
+    } else if (x == x->parent->left) {                                                          \
+        x->parent->left = y;                                                                    \
+    } else {                                                                                    \
+        x->parent->right = y;                                                                   \
+    }                                                                                           \
+                                                                                                \
+    y->left = x;                                                                                \
+    x->parent = y;                                                                              \
+                                                                                                \
+    /* x is now y's child, so it must be recomputed first */                                    \
+    augment(tree, x);                                                                           \
+    augment(tree, y);                                                                           \
+}                                                                                               \
+                                                                                                \
+static inline void name##_rotate_right(name##_t *tree, name##_node_t *x)                        \
+{                                                                                               \
+    name##_node_t *y = x->left;                                                                 \
+                                                                                                \
+    OP_STATS_COUNT(rotations);                                                                  \
+    x->left = y->right;                                                                         \
+    if (!name##_is_nil(tree, y->right)) {                                                       \
+        y->right->parent = x;                                                                   \
+    }                                                                                           \
+                                                                                                \
+    y->parent = x->parent;                                                                      \
+    if (name##_is_nil(tree, x->parent)) {                                                       \
+        tree->head = y;                                                                         \
+    } else if (x == x->parent->right) {                                                         \
+        x->parent->right = y;                                                                   \
+    } else {                                                                                    \
+        x->parent->left = y;                                                                    \
+    }                                                                                           \
+                                                                                                \
+    y->right = x;                                                                               \
+    x->parent = y;                                                                              \
+                                                                                                \
+    /* x is now y's child, so it must be recomputed first */                                    \
+    augment(tree, x);                                                                           \
+    augment(tree, y);                                                                           \
+}                                                                                               \
+                                                                                                \
+static inline void name##_insert_fixup(name##_t *tree, name##_node_t *z)                        \
+{                                                                                               \
+    name##_node_t *y = NULL;                                                                    \
+                                                                                                \
+    while (z->parent->color == RED) {                                                           \
+        if (z->parent == z->parent->parent->left) {                                             \
+            y = z->parent->parent->right;                                                       \
+            if (y->color == RED) {                                                              \
+                z->parent->color = BLACK;                                                       \
+                y->color = BLACK;                                                               \
+                z->parent->parent->color = RED;                                                 \
+                z = z->parent->parent;                                                          \
+            } else {                                                                            \
+                if (z == z->parent->right) {                                                    \
+                    z = z->parent;                                                              \
+                    name##_rotate_left(tree, z);                                                \
+                }                                                                               \
+                z->parent->color = BLACK;                                                       \
+                z->parent->parent->color = RED;                                                 \
+                name##_rotate_right(tree, z->parent->parent);                                   \
+            }                                                                                   \
+        } else {                                                                                \
+            y = z->parent->parent->left;                                                        \
+            if (y->color == RED) {                                                              \
+                z->parent->color = BLACK;                                                       \
+                y->color = BLACK;                                                               \
+                z->parent->parent->color = RED;                                                 \
+                z = z->parent->parent;                                                          \
+            } else {                                                                            \
+                if (z == z->parent->left) {                                                     \
+                    z = z->parent;                                                              \
+                    name##_rotate_right(tree, z);                                               \
+                }                                                                               \
+                z->parent->color = BLACK;                                                       \
+                z->parent->parent->color = RED;                                                 \
+                name##_rotate_left(tree, z->parent->parent);                                    \
+            }                                                                                   \
+        }                                                                                       \
+    }                                                                                           \
+    tree->head->color = BLACK;                                                                  \
+}                                                                                               \
+                                                                                                \
+/* name_create_node - allocate a node for key with a count of 1, without inserting it, so that  \
+   the user may initialize its fields first. Returns NULL on an allocation failure. */          \
+static inline name##_node_t* name##_create_node(name##_t *tree, key_type key)                   \
+{                                                                                               \
+    name##_node_t *node = pool_alloc(tree->pool, sizeof(name##_node_t));                        \
+                                                                                                \
+    if (NULL == node) {                                                                         \
+        return NULL;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    node->key = key;                                                                            \
+    node->count = 1;                                                                            \
+    return node;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_link_node - link a new node z as a child of parent (nil for an empty tree), on the side \
+   of its key, and rebalance the tree. */                                                       \
+static inline void name##_link_node(name##_t *tree, name##_node_t *z, name##_node_t *parent)    \
+{                                                                                               \
+    z->parent = parent;                                                                         \
+    if (name##_is_nil(tree, parent)) {                                                          \
+        tree->head = z;                                                                         \
+    } else if (z->key < parent->key) {                                                          \
+        parent->left = z;                                                                       \
+    } else {                                                                                    \
+        parent->right = z;                                                                      \
+    }                                                                                           \
+    z->left = &(tree->nil);                                                                     \
+    z->right = &(tree->nil);                                                                    \
+    z->color = RED;                                                                             \
+                                                                                                \
+    /* The new key is a part of the subtree of all of its ancestors. The fixup's rotations      \
+       keep the augmented data up to date by themselves. */                                     \
+    name##_augment_update(tree, z);                                                             \
+    name##_insert_fixup(tree, z);                                                               \
+                                                                                                \
+    tree->count++;                                                                              \
+    if (name##_is_nil(tree, tree->min) || (z->key < tree->min->key)) {                          \
+        tree->min = z;                                                                          \
+    }                                                                                           \
+    if (name##_is_nil(tree, tree->max) || (tree->max->key < z->key)) {                          \
+        tree->max = z;                                                                          \
+    }                                                                                           \
+}                                                                                               \
+                                                                                                \
+/* name_insert_node - insert a node created by name_create_node. Its key must not exist. */     \
+static inline void name##_insert_node(name##_t *tree, name##_node_t *z)                         \
+{                                                                                               \
+    name##_node_t *x = tree->head;                                                              \
+    name##_node_t *y = &(tree->nil);                                                            \
+                                                                                                \
+    while (!name##_is_nil(tree, x)) {                                                           \
+        OP_STATS_COUNT(comparisons);                                                            \
+        y = x;                                                                                  \
+        x = (z->key < x->key) ? x->left : x->right;                                             \
+    }                                                                                           \
+                                                                                                \
+    name##_link_node(tree, z, y);                                                               \
+}                                                                                               \
+                                                                                                \
+/* name_insert - insert a key. If it already exists, its count is increased and exists is set.  \
+   A single descent both searches for the key and finds where to link it, and a node is         \
+   allocated only for a new key. Returns the key's node, or NULL on an allocation failure. */   \
+static inline name##_node_t* name##_insert(name##_t *tree, key_type key, bool *exists)          \
+{                                                                                               \
+    name##_node_t *x = tree->head;                                                              \
+    name##_node_t *y = &(tree->nil);                                                            \
+    name##_node_t *z = NULL;                                                                    \
+                                                                                                \
+    *exists = false;                                                                            \
+    while (!name##_is_nil(tree, x)) {                                                           \
+        OP_STATS_COUNT(comparisons);                                                            \
+        if (key == x->key) {                                                                    \
+            *exists = true;                                                                     \
+            x->count += 1;                                                                      \
+            return x;                                                                           \
+        }                                                                                       \
+        y = x;                                                                                  \
+        x = (key < x->key) ? x->left : x->right;                                                \
+    }                                                                                           \
+                                                                                                \
+    z = name##_create_node(tree, key);                                                          \
+    if (NULL == z) {                                                                            \
+        return NULL;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    name##_link_node(tree, z, y);                                                               \
+    return z;                                                                                   \
+}                                                                                               \
+                                                                                                \
+static inline void name##_delete_fixup(name##_t *tree, name##_node_t *x)                        \
+{                                                                                               \
+    name##_node_t *w = NULL;                                                                    \
+                                                                                                \
+    while ((x->color == BLACK) && (x != tree->head)) {                                          \
+        if (x == x->parent->left) {                                                             \
+            w = x->parent->right;                                                               \
+            if (w->color == RED) {                                                              \
+                w->color = BLACK;                                                               \
+                x->parent->color = RED;                                                         \
+                name##_rotate_left(tree, x->parent);                                            \
+                w = x->parent->right;                                                           \
+            }                                                                                   \
+            if ((w->right->color == BLACK) && (w->left->color == BLACK)) {                      \
+                w->color = RED;                                                                 \
+                x = x->parent;                                                                  \
+            } else {                                                                            \
+                if (w->right->color == BLACK) {                                                 \
+                    w->left->color = BLACK;                                                     \
+                    w->color = RED;                                                             \
+                    name##_rotate_right(tree, w);                                               \
+                    w = x->parent->right;                                                       \
+                }                                                                               \
+                w->color = x->parent->color;                                                    \
+                x->parent->color = BLACK;                                                       \
+                w->right->color = BLACK;                                                        \
+                name##_rotate_left(tree, x->parent);                                            \
+                x = tree->head;                                                                 \
+            }                                                                                   \
+        } else {                                                                                \
+            w = x->parent->left;                                                                \
+            if (w->color == RED) {                                                              \
+                w->color = BLACK;                                                               \
+                x->parent->color = RED;                                                         \
+                name##_rotate_right(tree, x->parent);                                           \
+                w = x->parent->left;                                                            \
+            }                                                                                   \
+            if ((w->right->color == BLACK) && (w->left->color == BLACK)) {                      \
+                w->color = RED;                                                                 \
+                x = x->parent;                                                                  \
+            } else {                                                                            \
+                if (w->left->color == BLACK) {                                                  \
+                    w->right->color = BLACK;                                                    \
+                    w->color = RED;                                                             \
+                    name##_rotate_left(tree, w);                                                \
+                    w = x->parent->left;                                                        \
+                }                                                                               \
+                w->color = x->parent->color;                                                    \
+                x->parent->color = BLACK;                                                       \
+                w->left->color = BLACK;                                                         \
+                name##_rotate_right(tree, x->parent);                                           \
+                x = tree->head;                                                                 \
+            }                                                                                   \
+        }                                                                                       \
+    }                                                                                           \
+    x->color = BLACK;                                                                           \
+}                                                                                               \
+                                                                                                \
+/* name_transplant - replace the subtree of u with the subtree of v (which may be nil). */      \
+static inline void name##_transplant(name##_t *tree, name##_node_t *u, name##_node_t *v)        \
+{                                                                                               \
+    if (name##_is_nil(tree, u->parent)) {                                                       \
+        tree->head = v;                                                                         \
+    } else if (u == u->parent->left) {                                                          \
+        u->parent->left = v;                                                                    \
+    } else {                                                                                    \
+        u->parent->right = v;                                                                   \
+    }                                                                                           \
+    v->parent = u->parent;                                                                      \
+}                                                                                               \
+                                                                                                \
+/* name_delete_node - remove a node from the tree and free it, regardless of its count.         \
+   Unlike rb_tree.h, the successor node is moved into z's place, instead of moving keys, so     \
+   the other nodes stay valid. */                                                               \
+static inline void name##_delete_node(name##_t *tree, name##_node_t *z)                         \
+{                                                                                               \
+    name##_node_t *x = NULL;                                                                    \
+    name##_node_t *y = z;                                                                       \
+    name##_node_t *changed = NULL;                                                              \
+    rb_tree_color_t original_color = y->color;                                                  \
+                                                                                                \
+    /* The min (max) node has no left (right) child, so the new min (max) is its only child, or \
+       else its parent. Nodes are not moved, so the rest of the tree is unaffected. */          \
+    if (z == tree->min) {                                                                       \
+        tree->min = name##_is_nil(tree, z->right) ? z->parent : z->right;                       \
+    }                                                                                           \
+    if (z == tree->max) {                                                                       \
+        tree->max = name##_is_nil(tree, z->left) ? z->parent : z->left;                         \
+    }                                                                                           \
+                                                                                                \
+    if (name##_is_nil(tree, z->left)) {                                                         \
+        x = z->right;                                                                           \
+        changed = z->parent;                                                                    \
+        name##_transplant(tree, z, z->right);                                                   \
+    } else if (name##_is_nil(tree, z->right)) {                                                 \
+        x = z->left;                                                                            \
+        changed = z->parent;                                                                    \
+        name##_transplant(tree, z, z->left);                                                    \
+    } else {                                                                                    \
+        y = z->right;                                                                           \
+        while (!name##_is_nil(tree, y->left)) {                                                 \
+            y = y->left;                                                                        \
+        }                                                                                       \
+        original_color = y->color;                                                              \
+        x = y->right;                                                                           \
+        if (y->parent == z) {                                                                   \
+            x->parent = y;                                                                      \
+            changed = y;                                                                        \
+        } else {                                                                                \
+            changed = y->parent;                                                                \
+            name##_transplant(tree, y, y->right);                                               \
+            y->right = z->right;                                                                \
+            y->right->parent = y;                                                               \
+        }                                                                                       \
+        name##_transplant(tree, z, y);                                                          \
+        y->left = z->left;                                                                      \
+        y->left->parent = y;                                                                    \
+        y->color = z->color;                                                                    \
+    }                                                                                           \
+                                                                                                \
+    /* All of the ancestors of the lowest changed node have lost z */                           \
+    name##_augment_update(tree, changed);                                                       \
+                                                                                                \
+    if (original_color == BLACK) {                                                              \
+        name##_delete_fixup(tree, x);                                                           \
+    }                                                                                           \
+                                                                                                \
+    tree->count--;                                                                              \
+    pool_free(tree->pool, z, sizeof(name##_node_t));                                            \
+}                                                                                               \
+                                                                                                \
+/* name_build_branch - link nodes[low..high) as a perfectly balanced branch under parent, and   \
+   return its head. The nodes at red_depth (the only level that may be incomplete) are red. */  \
+static inline name##_node_t* name##_build_branch(name##_t *tree, name##_node_t **nodes,         \
+                                                 size_t low, size_t high, name##_node_t *parent,\
+                                                 unsigned int depth, unsigned int red_depth)    \
+{                                                                                               \
+    size_t middle = low + (high - low) / 2;                                                     \
+    name##_node_t *node = NULL;                                                                 \
+                                                                                                \
+    if (low >= high) {                                                                          \
+        return &(tree->nil);                                                                    \
+    }                                                                                           \
+                                                                                                \
+    node = nodes[middle];                                                                       \
+    node->parent = parent;                                                                      \
+    node->color = (depth == red_depth) ? RED : BLACK;                                           \
+    node->left = name##_build_branch(tree, nodes, low, middle, node, depth + 1, red_depth);     \
+    node->right = name##_build_branch(tree, nodes, middle + 1, high, node, depth + 1, red_depth);\
+    augment(tree, node);                                                                        \
+                                                                                                \
+    return node;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_build - link count nodes created by name_create_node, which must be sorted by distinct  \
+   ascending keys, into an empty tree. The tree is perfectly balanced, and built in O(count)    \
+   instead of count insertions. */                                                              \
+static inline void name##_build(name##_t *tree, name##_node_t **nodes, size_t count)            \
+{                                                                                               \
+    unsigned int red_depth = 0;                                                                 \
+                                                                                                \
+    if (count == 0) {                                                                           \
+        return;                                                                                 \
+    }                                                                                           \
+                                                                                                \
+    /* The levels above floor(log2(count + 1)) are complete */                                  \
+    while (((size_t) 2 << red_depth) <= count + 1) {                                            \
+        red_depth++;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    tree->head = name##_build_branch(tree, nodes, 0, count, &(tree->nil), 0, red_depth);        \
+    tree->min = nodes[0];                                                                       \
+    tree->max = nodes[count - 1];                                                               \
+    tree->count = count;                                                                        \
+}                                                                                               \
+                                                                                                \
+/* name_remove - decrease the count of key, and delete it when it reaches zero (in which case   \
+   deleted is set). Returns false if the key doesn't exist. */                                  \
+static inline bool name##_remove(name##_t *tree, key_type key, bool *deleted)                   \
+{                                                                                               \
+    name##_node_t *node = name##_search(tree, key);                                             \
+                                                                                                \
+    *deleted = false;                                                                           \
+    if (NULL == node) {                                                                         \
+        return false;                                                                           \
+    }                                                                                           \
+                                                                                                \
+    node->count -= 1;                                                                           \
+    if (node->count == 0) {                                                                     \
+        *deleted = true;                                                                        \
+        name##_delete_node(tree, node);                                                         \
+    }                                                                                           \
+                                                                                                \
+    return true;                                                                                \
+}                                                                                               \
+                                                                                                \
+/* name_shape - measure the tree's shape and memory footprint into shape, like rb_tree_shape.   \
+   The keys are inline, so they are part of node_bytes and key_bytes is 0. */                   \
+static inline void name##_shape(name##_t *tree, rb_tree_shape_t *shape)                         \
+{                                                                                               \
+    name##_node_t *node = tree->head;                                                           \
+    name##_node_t *previous = &(tree->nil);                                                     \
+    name##_node_t *next = NULL;                                                                 \
+    unsigned int depth = 1;                                                                     \
+                                                                                                \
+    shape->nodes = 0;                                                                           \
+    shape->height = 0;                                                                          \
+    shape->black_height = 0;                                                                    \
+                                                                                                \
+    /* Walk around the tree without a stack, see rb_tree_shape */                               \
+    while (!name##_is_nil(tree, node)) {                                                        \
+        if (previous == node->parent) {                                                         \
+            shape->nodes++;                                                                     \
+            if (depth > shape->height) {                                                        \
+                shape->height = depth;                                                          \
+            }                                                                                   \
+        }                                                                                       \
+                                                                                                \
+        if ((previous == node->parent) && !name##_is_nil(tree, node->left)) {                   \
+            next = node->left;                                                                  \
+        } else if ((previous != node->right) && !name##_is_nil(tree, node->right)) {            \
+            next = node->right;                                                                 \
+        } else {                                                                                \
+            next = node->parent;                                                                \
+        }                                                                                       \
+                                                                                                \
+        depth = (next == node->parent) ? depth - 1 : depth + 1;                                 \
+        previous = node;                                                                        \
+        node = next;                                                                            \
+    }                                                                                           \
+                                                                                                \
+    for (node = tree->head; !name##_is_nil(tree, node); node = node->left) {                    \
+        shape->black_height += (node->color == BLACK) ? 1 : 0;                                  \
+    }                                                                                           \
+                                                                                                \
+    shape->node_bytes = shape->nodes * sizeof(name##_node_t);                                   \
+    shape->key_bytes = 0;                                                                       \
+    shape->header_bytes = sizeof(name##_t);                                                     \
+}
+
+#endif /* __RB_TREE_GEN_H__ */
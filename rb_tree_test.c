@@ -1,8 +1,24 @@
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #include "rb_tree.h"
+#include "rb_tree_gen.h"
+
+/* A generated tree of int keys, augmented by the max key in each subtree */
+RB_TREE_TYPES(int_tree, int, int branch_max;)
+
+static inline void int_tree_augment(int_tree_t *tree, int_tree_node_t *node);
+RB_TREE_FUNCTIONS(int_tree, int, int_tree_augment)
+
+static inline void int_tree_augment(int_tree_t *tree, int_tree_node_t *node)
+{
+    node->branch_max = node->key;
+    if (!int_tree_is_nil(tree, node->right)) {
+        node->branch_max = node->right->branch_max;
+    }
+}
 
 static void print_key(rb_tree_t *tree, rb_tree_node_t *node)
 {
@@ -39,6 +55,400 @@ static int compare_int(void *a, void *b)
     return 1;
 }
 
+typedef struct aug_key_s {
+    int val;
+    int branch_max;
+} aug_key_t;
+
+static void augment_max(void *key, void *left_key, void *right_key)
+{
+    aug_key_t *k = key;
+    aug_key_t *left = left_key;
+    aug_key_t *right = right_key;
+
+    k->branch_max = k->val;
+    if ((NULL != left) && (left->branch_max > k->branch_max)) {
+        k->branch_max = left->branch_max;
+    }
+    if ((NULL != right) && (right->branch_max > k->branch_max)) {
+        k->branch_max = right->branch_max;
+    }
+}
+
+/* verify_augmentation - recursively verifies the branch_max of each node, returns the subtree's max */
+static int verify_augmentation(rb_tree_t *tree, rb_tree_node_t *node)
+{
+    int max = ((aug_key_t *) node->key)->val;
+    int child_max = 0;
+
+    if (!RB_TREE_IS_NIL(tree, node->left)) {
+        child_max = verify_augmentation(tree, node->left);
+        max = (child_max > max) ? child_max : max;
+    }
+    if (!RB_TREE_IS_NIL(tree, node->right)) {
+        child_max = verify_augmentation(tree, node->right);
+        max = (child_max > max) ? child_max : max;
+    }
+
+    assert(((aug_key_t *) node->key)->branch_max == max);
+    return max;
+}
+
+/* verify_min_max - verifies that the cached min & max nodes are the ones found by walking the tree */
+static void verify_min_max(rb_tree_t *tree)
+{
+    assert(tree->min == rb_tree_find_min(tree));
+    assert(tree->max == rb_tree_find_max(tree));
+}
+
+static void test_augmentation(void)
+{
+    rb_tree_t *tree = NULL;
+    aug_key_t keys[64];
+    aug_key_t *deleted = NULL;
+    bool result = false;
+    unsigned int i = 0;
+    const unsigned int key_count = sizeof(keys) / sizeof(aug_key_t);
+
+    printf("Verifying augmentation...\n");
+    /* compare_int can be used, since val is the first member of the key */
+    tree = rb_tree_create_augmented(&compare_int, augment_max);
+
+    for (i = 0; i < key_count; i++) {
+        /* A permutation of 0..63, so that rotations happen all over the tree */
+        keys[i].val = (i * 37) % key_count;
+        assert(rb_tree_insert(tree, &keys[i], &result) == true);
+        assert(result == false);
+        verify_augmentation(tree, tree->head);
+        verify_min_max(tree);
+    }
+
+    for (i = 0; i < key_count; i += 3) {
+        assert(rb_tree_remove(tree, &keys[i], (void **)&deleted));
+        assert(deleted == &keys[i]);
+        verify_augmentation(tree, tree->head);
+        verify_min_max(tree);
+    }
+
+    for (i = 0; i < key_count; i++) {
+        if (i % 3 != 0) {
+            assert(rb_tree_remove(tree, &keys[i], (void **)&deleted));
+            assert(deleted == &keys[i]);
+            if (tree->count > 0) {
+                verify_augmentation(tree, tree->head);
+            }
+            verify_min_max(tree);
+        }
+    }
+    assert(tree->count == 0);
+}
+
+static void test_cursor(void)
+{
+    rb_tree_t *tree = NULL;
+    rb_tree_cursor_t cursor;
+    int keys[100];
+    int temp = 0;
+    int expected = 0;
+    bool result = false;
+    unsigned int i = 0;
+    const unsigned int key_count = sizeof(keys) / sizeof(int);
+
+    printf("Verifying cursors...\n");
+    tree = rb_tree_create(&compare_int);
+    rb_tree_cursor_init(&cursor, tree);
+    assert(!rb_tree_cursor_first(&cursor) && !rb_tree_cursor_last(&cursor));
+    assert(!rb_tree_cursor_valid(&cursor) && (NULL == rb_tree_cursor_key(&cursor)));
+
+    /* The even numbers 0..198, in a scrambled order, with a duplicate of every 4th one */
+    for (i = 0; i < key_count; i++) {
+        keys[i] = ((i * 37) % key_count) * 2;
+        assert(rb_tree_insert(tree, &keys[i], &result) && !result);
+        if (keys[i] % 8 == 0) {
+            assert(rb_tree_insert(tree, &keys[i], &result) && result);
+        }
+    }
+
+    expected = 0;
+    for (rb_tree_cursor_first(&cursor); rb_tree_cursor_valid(&cursor); rb_tree_cursor_next(&cursor)) {
+        assert(*(int *) rb_tree_cursor_key(&cursor) == expected);
+        assert(rb_tree_cursor_count(&cursor) == ((expected % 8 == 0) ? 2 : 1));
+        expected += 2;
+    }
+    assert(expected == key_count * 2);
+    assert(!rb_tree_cursor_next(&cursor));
+
+    for (rb_tree_cursor_last(&cursor); rb_tree_cursor_valid(&cursor); rb_tree_cursor_prev(&cursor)) {
+        expected -= 2;
+        assert(*(int *) rb_tree_cursor_key(&cursor) == expected);
+    }
+    assert(expected == 0);
+
+    temp = 51;
+    assert(rb_tree_cursor_seek(&cursor, &temp) && (*(int *) rb_tree_cursor_key(&cursor) == 52));
+    assert(rb_tree_cursor_prev(&cursor) && (*(int *) rb_tree_cursor_key(&cursor) == 50));
+    temp = 198;
+    assert(rb_tree_cursor_seek(&cursor, &temp) && !rb_tree_cursor_next(&cursor));
+    temp = 199;
+    assert(!rb_tree_cursor_seek(&cursor, &temp) && (0 == rb_tree_cursor_count(&cursor)));
+
+    rb_tree_destroy(tree);
+}
+
+/* verify_int_tree - recursively verifies the order, colors and augmentation of a generated tree.
+   Returns the black height of the subtree.
+ */
+static int verify_int_tree(int_tree_t *tree, int_tree_node_t *node, unsigned int *count)
+{
+    int left_height = 0;
+    int right_height = 0;
+
+    if (int_tree_is_nil(tree, node)) {
+        return 1;
+    }
+
+    (*count)++;
+    if (!int_tree_is_nil(tree, node->left)) {
+        assert(node->left->key < node->key);
+        assert(node->left->parent == node);
+        assert((node->color == BLACK) || (node->left->color == BLACK));
+    }
+    if (!int_tree_is_nil(tree, node->right)) {
+        assert(node->right->key > node->key);
+        assert(node->right->parent == node);
+        assert((node->color == BLACK) || (node->right->color == BLACK));
+    }
+    assert(node->branch_max == (int_tree_is_nil(tree, node->right) ? node->key : node->right->branch_max));
+
+    left_height = verify_int_tree(tree, node->left, count);
+    right_height = verify_int_tree(tree, node->right, count);
+    assert(left_height == right_height);
+
+    return left_height + ((node->color == BLACK) ? 1 : 0);
+}
+
+static void verify_int_tree_all(int_tree_t *tree)
+{
+    unsigned int count = 0;
+
+    verify_int_tree(tree, tree->head, &count);
+    assert(count == tree->count);
+    assert(tree->head->color == BLACK);
+    assert(tree->max == int_tree_find_max(tree));
+    if (tree->count > 0) {
+        assert(tree->max->key == tree->head->branch_max);
+        assert(tree->min == int_tree_search_smallest(tree, INT_MIN));
+    } else {
+        assert(int_tree_is_nil(tree, tree->min));
+    }
+}
+
+/* verify_colors - recursively verifies the red-black properties of a tree, returns its black height */
+static int verify_colors(rb_tree_t *tree, rb_tree_node_t *node)
+{
+    int left_height = 0;
+
+    if (RB_TREE_IS_NIL(tree, node)) {
+        return 1;
+    }
+
+    if (node->color == RED) {
+        assert((node->left->color == BLACK) && (node->right->color == BLACK));
+    }
+    assert(RB_TREE_IS_NIL(tree, node->left) || (node->left->parent == node));
+    assert(RB_TREE_IS_NIL(tree, node->right) || (node->right->parent == node));
+
+    left_height = verify_colors(tree, node->left);
+    assert(left_height == verify_colors(tree, node->right));
+
+    return left_height + ((node->color == BLACK) ? 1 : 0);
+}
+
+/* tree_height, int_tree_height - recursively count the nodes on the longest path down from node */
+static unsigned int tree_height(rb_tree_t *tree, rb_tree_node_t *node)
+{
+    unsigned int left_height = 0;
+    unsigned int right_height = 0;
+
+    if (RB_TREE_IS_NIL(tree, node)) {
+        return 0;
+    }
+
+    left_height = tree_height(tree, node->left);
+    right_height = tree_height(tree, node->right);
+    return 1 + ((left_height > right_height) ? left_height : right_height);
+}
+
+static unsigned int int_tree_height(int_tree_t *tree, int_tree_node_t *node)
+{
+    unsigned int left_height = 0;
+    unsigned int right_height = 0;
+
+    if (int_tree_is_nil(tree, node)) {
+        return 0;
+    }
+
+    left_height = int_tree_height(tree, node->left);
+    right_height = int_tree_height(tree, node->right);
+    return 1 + ((left_height > right_height) ? left_height : right_height);
+}
+
+static void test_shape(void)
+{
+    rb_tree_t *tree = NULL;
+    int_tree_t *generated = NULL;
+    rb_tree_shape_t shape;
+    int keys[300];
+    int *deleted = NULL;
+    bool exists = false;
+    bool deleted_node = false;
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    printf("Verifying shapes...\n");
+    tree = rb_tree_create(&compare_int);
+    generated = int_tree_create(NULL);
+    assert(tree && generated);
+
+    rb_tree_shape(tree, sizeof(int), &shape);
+    assert((shape.nodes == 0) && (shape.height == 0) && (shape.black_height == 0) && (shape.node_bytes == 0));
+    assert(shape.header_bytes == sizeof(rb_tree_t));
+
+    for (i = 0; i < 300; i++) {
+        /* A permutation of 0..299, inserted twice each */
+        keys[i] = (i * 71) % 300;
+        assert(rb_tree_insert(tree, &keys[i], &exists) && !exists);
+        assert(rb_tree_insert(tree, &keys[i], &exists) && exists);
+        assert(NULL != int_tree_insert(generated, keys[i], &exists) && !exists);
+
+        rb_tree_shape(tree, sizeof(int), &shape);
+        assert((shape.nodes == i + 1) && (shape.height == tree_height(tree, tree->head)));
+        assert(shape.black_height == verify_colors(tree, tree->head) - 1);
+        assert((shape.node_bytes == (i + 1) * sizeof(rb_tree_node_t)) && (shape.key_bytes == (i + 1) * sizeof(int)));
+
+        int_tree_shape(generated, &shape);
+        assert((shape.nodes == i + 1) && (shape.height == int_tree_height(generated, generated->head)));
+        assert(shape.black_height == verify_int_tree(generated, generated->head, &count) - 1);
+        assert((shape.node_bytes == (i + 1) * sizeof(int_tree_node_t)) && (shape.key_bytes == 0));
+    }
+
+    for (i = 0; i < 300; i += 3) {
+        assert(rb_tree_remove(tree, &keys[i], (void **)&deleted) && (NULL == deleted));
+        assert(rb_tree_remove(tree, &keys[i], (void **)&deleted) && (deleted == &keys[i]));
+        assert(int_tree_remove(generated, keys[i], &deleted_node) && deleted_node);
+    }
+    rb_tree_shape(tree, sizeof(int), &shape);
+    assert((shape.nodes == 200) && (shape.height == tree_height(tree, tree->head)));
+    assert(shape.black_height == verify_colors(tree, tree->head) - 1);
+    int_tree_shape(generated, &shape);
+    assert((shape.nodes == 200) && (shape.height == int_tree_height(generated, generated->head)));
+
+    int_tree_destroy(generated);
+    rb_tree_destroy(tree);
+}
+
+static void test_build_sorted(void)
+{
+    rb_tree_t *tree = NULL;
+    int_tree_t *generated = NULL;
+    int_tree_node_t *nodes[70];
+    aug_key_t keys[70];
+    void *key_pointers[70];
+    aug_key_t *deleted = NULL;
+    bool exists = false;
+    unsigned int size = 0;
+    unsigned int i = 0;
+
+    printf("Verifying bulk builds...\n");
+    for (size = 0; size <= 70; size++) {
+        tree = rb_tree_create_augmented(&compare_int, augment_max);
+        for (i = 0; i < size; i++) {
+            keys[i].val = i * 3;
+            key_pointers[i] = &keys[i];
+        }
+        assert(rb_tree_build_sorted(tree, key_pointers, NULL, size));
+        assert(tree->count == size);
+        assert(tree->head->color == BLACK);
+        verify_colors(tree, tree->head);
+        verify_min_max(tree);
+        if (size > 0) {
+            verify_augmentation(tree, tree->head);
+        }
+
+        /* The built tree is a regular tree */
+        for (i = 0; i < size; i += 2) {
+            assert(rb_tree_remove(tree, &keys[i], (void **)&deleted) && (deleted == &keys[i]));
+            verify_colors(tree, tree->head);
+            verify_min_max(tree);
+        }
+        rb_tree_destroy(tree);
+
+        generated = int_tree_create(NULL);
+        for (i = 0; i < size; i++) {
+            nodes[i] = int_tree_create_node(generated, i * 3);
+            nodes[i]->count = i + 1;
+        }
+        int_tree_build(generated, nodes, size);
+        verify_int_tree_all(generated);
+        for (i = 0; i < size; i++) {
+            assert(int_tree_search(generated, i * 3)->count == i + 1);
+        }
+        assert(NULL != int_tree_insert(generated, 1, &exists) && !exists);
+        verify_int_tree_all(generated);
+        int_tree_destroy(generated);
+    }
+}
+
+static void test_generated_tree(void)
+{
+    int_tree_t *tree = NULL;
+    int_tree_node_t *node = NULL;
+    bool exists = false;
+    bool deleted = false;
+    int key = 0;
+    const int key_count = 200;
+
+    printf("Verifying the generated tree...\n");
+    tree = int_tree_create(NULL);
+    assert(tree);
+
+    for (key = 0; key < key_count; key++) {
+        /* A permutation of 0..199, inserted twice each */
+        node = int_tree_insert(tree, (key * 67) % key_count, &exists);
+        assert(node && !exists);
+        node = int_tree_insert(tree, (key * 67) % key_count, &exists);
+        assert(node && exists && (node->count == 2));
+        verify_int_tree_all(tree);
+    }
+
+    assert(int_tree_search_smallest(tree, -5)->key == 0);
+    assert(int_tree_search_smallest(tree, 17)->key == 17);
+    assert(NULL == int_tree_search_smallest(tree, key_count));
+    assert(int_tree_successor(tree, int_tree_search(tree, 17))->key == 18);
+
+    for (key = 0; key < key_count; key += 2) {
+        assert(int_tree_remove(tree, key, &deleted) && !deleted);
+        assert(int_tree_remove(tree, key, &deleted) && deleted);
+        assert(!int_tree_remove(tree, key, &deleted));
+        verify_int_tree_all(tree);
+    }
+
+    /* Nodes are not moved between keys, so a found node stays valid after other deletions */
+    node = int_tree_search(tree, 103);
+    for (key = 1; key < key_count; key += 4) {
+        int_tree_delete_node(tree, int_tree_search(tree, key));
+        verify_int_tree_all(tree);
+    }
+    assert((node->key == 103) && (node == int_tree_search(tree, 103)));
+    assert(int_tree_search_smallest(tree, 97)->key == 99);
+
+    int_tree_clear(tree);
+    assert((tree->count == 0) && int_tree_is_nil(tree, tree->head) && (NULL == int_tree_search(tree, 103)));
+    assert(NULL != int_tree_insert(tree, 103, &exists) && !exists && (tree->max->key == 103));
+
+    int_tree_destroy(tree);
+}
+
 int main(void)
 {
     rb_tree_t *tree = NULL;
@@ -125,6 +535,12 @@ int main(void)
     assert(deleted);
     printf("Verify that keys 2, 73 & 82 don't exist in the tree\n");
     print_tree(tree);
-    
+
+    test_augmentation();
+    test_cursor();
+    test_generated_tree();
+    test_build_sorted();
+    test_shape();
+
     return 0;
 }